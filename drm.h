@@ -633,6 +633,7 @@ struct drm_set_version {
 #define DRM_FENCE_FLAG_WAIT_LAZY           0x00000004
 #define DRM_FENCE_FLAG_WAIT_IGNORE_SIGNALS 0x00000008
 #define DRM_FENCE_FLAG_NO_USER             0x00000010
+#define DRM_FENCE_FLAG_WAIT_ANY            0x00000020
 
 /* Reserved for driver use */
 #define DRM_FENCE_MASK_DRIVER              0xFF000000
@@ -651,6 +652,61 @@ struct drm_fence_arg {
 	uint64_t expand_pad[2]; /*Future expansion */
 };
 
+/*
+ * Wait for several fence objects at once. With DRM_FENCE_FLAG_WAIT_ANY
+ * the wait returns as soon as one of the fences has signaled the
+ * requested types, otherwise when all of them have. On return,
+ * bit n of signaled is set if handle n has signaled.
+ */
+
+#define DRM_FENCE_WAIT_MULTI_MAX           64
+
+struct drm_fence_wait_multi_arg {
+	uint64_t handles;	/* User pointer to num_handles fence handles */
+	uint64_t signaled;
+	unsigned int num_handles;
+	unsigned int type;	/* 0 waits for each fence's full type */
+	unsigned int flags;
+	unsigned int timeout_ms;	/* 0 selects the driver's timeout */
+	unsigned int error;
+	unsigned int pad64;
+};
+
+/*
+ * Events read from the drm file descriptor. Each event starts with a
+ * struct drm_event header giving its type and total length.
+ */
+
+#define DRM_EVENT_FENCE                    0x01
+
+struct drm_event {
+	unsigned int type;
+	unsigned int length;
+};
+
+struct drm_fence_event {
+	struct drm_event base;
+	uint64_t user_data;
+	unsigned int handle;
+	unsigned int signaled;
+	unsigned int error;
+	unsigned int tv_sec;
+	unsigned int tv_usec;
+	unsigned int pad64;
+};
+
+/*
+ * Queue a DRM_EVENT_FENCE event on the file descriptor once the fence
+ * has signaled the requested types. A type of 0 selects the fence's
+ * full type.
+ */
+
+struct drm_fence_event_arg {
+	uint64_t user_data;
+	unsigned int handle;
+	unsigned int type;
+};
+
 /* Buffer permissions, referring to how the GPU uses the buffers.
  * these translate to fence types used for the buffers.
  * Typically a texture buffer is read, A destination buffer is write and
@@ -1112,6 +1168,8 @@ struct drm_mode_mode_cmd {
 #define DRM_IOCTL_BO_INFO               DRM_IOWR(0xd4, struct drm_bo_reference_info_arg)
 #define DRM_IOCTL_BO_WAIT_IDLE          DRM_IOWR(0xd5, struct drm_bo_map_wait_idle_arg)
 #define DRM_IOCTL_BO_VERSION          DRM_IOR(0xd6, struct drm_bo_version_arg)
+#define DRM_IOCTL_FENCE_WAIT_MULTI      DRM_IOWR(0xd7, struct drm_fence_wait_multi_arg)
+#define DRM_IOCTL_FENCE_EVENT           DRM_IOW(0xd8, struct drm_fence_event_arg)
 
 
 #define DRM_IOCTL_MODE_GETRESOURCES     DRM_IOWR(0xA0, struct drm_mode_card_res)
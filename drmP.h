@@ -444,6 +444,16 @@ struct drm_file {
 	void *driver_priv;
 
 	struct list_head fbs;
+
+	/*
+	 * Fence events, protected by the fence manager lock.
+	 */
+
+	struct list_head pending_events;
+	struct list_head event_list;
+	wait_queue_head_t event_wait;
+	int event_space;
+	int event_enabled;
 };
 
 /** Wait queue */
@@ -959,6 +969,8 @@ extern int drm_stub_open(struct inode *inode, struct file *filp);
 extern int drm_fasync(int fd, struct file *filp, int on);
 extern int drm_release(struct inode *inode, struct file *filp);
 unsigned int drm_poll(struct file *filp, struct poll_table_struct *wait);
+extern ssize_t drm_read(struct file *filp, char __user *buffer,
+			size_t count, loff_t *offset);
 
 				/* Mapping support (drm_vm.h) */
 extern int drm_mmap(struct file *filp, struct vm_area_struct *vma);
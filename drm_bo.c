@@ -552,10 +552,13 @@ void drm_bo_usage_deref_unlocked(struct drm_buffer_object **bo)
 }
 EXPORT_SYMBOL(drm_bo_usage_deref_unlocked);
 
-void drm_putback_buffer_objects(struct drm_device *dev)
+/*
+ * Put back the buffers on a private unfenced list, as built by drivers
+ * that validate several submissions concurrently.
+ */
+
+void drm_putback_buffer_list(struct drm_device *dev, struct list_head *list)
 {
-	struct drm_buffer_manager *bm = &dev->bm;
-	struct list_head *list = &bm->unfenced;
 	struct drm_buffer_object *entry, *next;
 
 	mutex_lock(&dev->struct_mutex);
@@ -582,6 +585,12 @@ void drm_putback_buffer_objects(struct drm_device *dev)
 	}
 	mutex_unlock(&dev->struct_mutex);
 }
+EXPORT_SYMBOL(drm_putback_buffer_list);
+
+void drm_putback_buffer_objects(struct drm_device *dev)
+{
+	drm_putback_buffer_list(dev, &dev->bm.unfenced);
+}
 EXPORT_SYMBOL(drm_putback_buffer_objects);
 
 
@@ -1548,15 +1557,31 @@ static int drm_buffer_object_validate(struct drm_buffer_object *bo,
 	return 0;
 }
 
-int drm_bo_do_validate(struct drm_buffer_object *bo,
-		       uint64_t flags, uint64_t mask, uint32_t hint,
-		       uint32_t fence_class,
-		       int no_wait,
-		       struct drm_bo_info_rep *rep)
+/*
+ * drm_bo_do_validate for submitters that keep their unfenced buffers on
+ * a list of their own. If backoff is set and the buffer is unfenced by
+ * someone else, fail with -EAGAIN instead of waiting, since that
+ * submission may be waiting for one of ours. A buffer left unfenced by
+ * the validation is moved to the unfenced list before bo->mutex is
+ * dropped.
+ */
+
+int drm_bo_do_validate_list(struct drm_buffer_object *bo,
+			    uint64_t flags, uint64_t mask, uint32_t hint,
+			    uint32_t fence_class,
+			    int no_wait, int backoff,
+			    struct list_head *unfenced,
+			    struct drm_bo_info_rep *rep)
 {
+	struct drm_device *dev = bo->dev;
 	int ret;
 
 	mutex_lock(&bo->mutex);
+	if (backoff && (bo->priv_flags & _DRM_BO_FLAG_UNFENCED)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
 	ret = drm_bo_wait_unfenced(bo, no_wait, 0);
 
 	if (ret)
@@ -1571,6 +1596,12 @@ int drm_bo_do_validate(struct drm_buffer_object *bo,
 					 fence_class,
 					 !(hint & DRM_BO_HINT_DONT_FENCE),
 					 no_wait);
+
+	if (!ret && unfenced && (bo->priv_flags & _DRM_BO_FLAG_UNFENCED)) {
+		mutex_lock(&dev->struct_mutex);
+		list_move_tail(&bo->lru, unfenced);
+		mutex_unlock(&dev->struct_mutex);
+	}
 out:
 	if (rep)
 		drm_bo_fill_rep_arg(bo, rep);
@@ -1578,6 +1609,17 @@ out:
 	mutex_unlock(&bo->mutex);
 	return ret;
 }
+EXPORT_SYMBOL(drm_bo_do_validate_list);
+
+int drm_bo_do_validate(struct drm_buffer_object *bo,
+		       uint64_t flags, uint64_t mask, uint32_t hint,
+		       uint32_t fence_class,
+		       int no_wait,
+		       struct drm_bo_info_rep *rep)
+{
+	return drm_bo_do_validate_list(bo, flags, mask, hint, fence_class,
+				       no_wait, 0, NULL, rep);
+}
 EXPORT_SYMBOL(drm_bo_do_validate);
 
 
@@ -30,6 +30,204 @@
 
 #include "drmP.h"
 
+#define DRM_FENCE_INDEX_MIN 64
+
+/*
+ * Types a fence is waiting for that have not signaled yet.
+ */
+
+static inline uint32_t drm_fence_outstanding(struct drm_fence_object *fence)
+{
+	return fence->waiting_types & ~fence->signaled_types;
+}
+
+/*
+ * Add or remove a fence's outstanding types from the class waiter
+ * counts, keeping the class waiting_types without walking the ring.
+ * Called with the fence manager lock held, for fences on the ring.
+ */
+
+static void drm_fence_count_waiters(struct drm_fence_class_manager *fc,
+				    uint32_t types, int add)
+{
+	uint32_t bit;
+
+	while (types) {
+		bit = __ffs(types);
+		types &= types - 1;
+		if (add) {
+			if (fc->waiters[bit]++ == 0)
+				fc->waiting_types |= (1 << bit);
+		} else if (--fc->waiters[bit] == 0)
+			fc->waiting_types &= ~(1 << bit);
+	}
+}
+
+/*
+ * Take a fence off the ring, leaving a hole in the index. The index
+ * head moves past holes so that it always points at a fence, or at
+ * the tail. Called with the fence manager lock held.
+ */
+
+static void drm_fence_ring_del(struct drm_fence_class_manager *fc,
+			       struct drm_fence_object *fence)
+{
+	uint32_t mask = fc->index_size - 1;
+
+	list_del_init(&fence->ring);
+	fc->index[fence->ring_pos & mask].fence = NULL;
+	fc->index_count--;
+	while (fc->index_head != fc->index_tail &&
+	       !fc->index[fc->index_head & mask].fence)
+		fc->index_head++;
+}
+
+/*
+ * Copy the fences of the index into a new array, dropping the holes.
+ * Positions restart from zero, so the type_done positions are reset
+ * to the head. Called with the fence manager lock held.
+ */
+
+static void drm_fence_index_move(struct drm_fence_class_manager *fc,
+				 struct drm_fence_index_slot *index,
+				 uint32_t size)
+{
+	struct drm_fence_index_slot *slot;
+	uint32_t pos;
+	uint32_t tail = 0;
+
+	for (pos = fc->index_head; pos != fc->index_tail; ++pos) {
+		slot = &fc->index[pos & (fc->index_size - 1)];
+		if (!slot->fence)
+			continue;
+		slot->fence->ring_pos = tail;
+		index[tail++] = *slot;
+	}
+
+	fc->index = index;
+	fc->index_size = size;
+	fc->index_head = 0;
+	fc->index_tail = tail;
+	memset(fc->type_done, 0, sizeof(fc->type_done));
+}
+
+/*
+ * Reserve a slot in the index for a fence about to be emitted, so that
+ * queueing it can't fail once the driver has emitted its sequence.
+ * A full index is replaced by one at least twice the number of fences
+ * and reservations it holds.
+ */
+
+static int drm_fence_index_reserve(struct drm_fence_manager *fm,
+				   struct drm_fence_class_manager *fc)
+{
+	struct drm_fence_index_slot *index = NULL;
+	struct drm_fence_index_slot *old_index;
+	uint32_t size = 0;
+	uint32_t old_size;
+	uint32_t needed;
+	unsigned long flags;
+
+	write_lock_irqsave(&fm->lock, flags);
+	while (fc->index_tail - fc->index_head + fc->index_reserved ==
+	       fc->index_size) {
+		needed = 2 * (fc->index_count + fc->index_reserved + 1);
+		if (size < needed) {
+			write_unlock_irqrestore(&fm->lock, flags);
+			if (index)
+				drm_free(index, size * sizeof(*index),
+					 DRM_MEM_FENCE);
+			for (size = DRM_FENCE_INDEX_MIN; size < needed;
+			     size <<= 1) ;
+			index = drm_calloc(size, sizeof(*index),
+					   DRM_MEM_FENCE);
+			if (!index)
+				return -ENOMEM;
+			write_lock_irqsave(&fm->lock, flags);
+			continue;
+		}
+
+		old_index = fc->index;
+		old_size = fc->index_size;
+		drm_fence_index_move(fc, index, size);
+		index = old_index;
+		size = old_size;
+	}
+	fc->index_reserved++;
+	write_unlock_irqrestore(&fm->lock, flags);
+
+	if (index)
+		drm_free(index, size * sizeof(*index), DRM_MEM_FENCE);
+	return 0;
+}
+
+/*
+ * The first index position that may hold a fence with type bit
+ * still to signal. Positions behind the head are stale.
+ */
+
+static inline uint32_t drm_fence_type_done(struct drm_fence_class_manager *fc,
+					   uint32_t bit)
+{
+	uint32_t done = fc->type_done[bit];
+
+	if ((int32_t) (done - fc->index_head) < 0 ||
+	    (int32_t) (fc->index_tail - done) < 0)
+		return fc->index_head;
+	return done;
+}
+
+/*
+ * Move the events whose types have signaled to their files' event
+ * lists and wake up readers. Called with the fence manager lock held.
+ */
+
+static void drm_fence_deliver_events(struct drm_fence_object *fence)
+{
+	struct drm_pending_fence_event *e, *next;
+	struct timeval now;
+	int stamped = 0;
+
+	list_for_each_entry_safe(e, next, &fence->events, head) {
+		if (!fence->error &&
+		    (e->type & fence->signaled_types) != e->type)
+			continue;
+
+		if (!stamped) {
+			do_gettimeofday(&now);
+			stamped = 1;
+		}
+
+		e->event.signaled = fence->signaled_types;
+		e->event.error = fence->error;
+		e->event.tv_sec = now.tv_sec;
+		e->event.tv_usec = now.tv_usec;
+		list_del(&e->file_head);
+		list_move_tail(&e->head, &e->file_priv->event_list);
+		wake_up_interruptible(&e->file_priv->event_wait);
+	}
+}
+
+/*
+ * Throw away the events still pending on a fence that is going away.
+ */
+
+static void drm_fence_drop_events(struct drm_device *dev,
+				  struct drm_fence_object *fence)
+{
+	struct drm_fence_manager *fm = &dev->fm;
+	struct drm_pending_fence_event *e, *next;
+	unsigned long flags;
+
+	write_lock_irqsave(&fm->lock, flags);
+	list_for_each_entry_safe(e, next, &fence->events, head) {
+		list_del(&e->head);
+		list_del(&e->file_head);
+		e->file_priv->event_space += sizeof(e->event);
+		drm_free(e, sizeof(*e), DRM_MEM_FENCE);
+	}
+	write_unlock_irqrestore(&fm->lock, flags);
+}
 
 /*
  * Convenience function to be called by fence::wait methods that
@@ -95,40 +293,76 @@ void drm_fence_handler(struct drm_device *dev, uint32_t fence_class,
 	struct drm_fence_manager *fm = &dev->fm;
 	struct drm_fence_class_manager *fc = &fm->fence_class[fence_class];
 	struct drm_fence_driver *driver = dev->driver->fence_driver;
-	struct list_head *head;
-	struct drm_fence_object *fence, *next;
-	int found = 0;
+	struct drm_fence_object *fence;
+	uint32_t mask = fc->index_size - 1;
+	uint32_t outstanding;
+	uint32_t pos, end, count, step;
+	uint32_t types, bit;
 
-	if (list_empty(&fc->ring))
+	if (fc->index_head == fc->index_tail)
 		return;
 
-	list_for_each_entry(fence, &fc->ring, ring) {
-		diff = (sequence - fence->sequence) & driver->sequence_mask;
-		if (diff > driver->wrap_diff) {
-			found = 1;
-			break;
-		}
+	/*
+	 * The index is in sequence order, so bisect for the first
+	 * position the sequence doesn't cover.
+	 */
+
+	end = fc->index_head;
+	count = fc->index_tail - end;
+	while (count) {
+		step = count / 2;
+		pos = end + step;
+		diff = (sequence - fc->index[pos & mask].sequence) &
+			driver->sequence_mask;
+		if (diff <= driver->wrap_diff) {
+			end = pos + 1;
+			count -= step + 1;
+		} else
+			count = step;
 	}
 
-	fc->waiting_types &= ~type;
-	head = (found) ? &fence->ring : &fc->ring;
+	if (end == fc->index_head)
+		return;
 
-	list_for_each_entry_safe_reverse(fence, next, head, ring) {
-		if (&fence->ring == &fc->ring)
-			break;
+	if (error) {
+		pos = end;
+		do {
+			fence = fc->index[--pos & mask].fence;
+		} while (!fence);
+
+		outstanding = drm_fence_outstanding(fence);
+		fence->error = error;
+		fence->signaled_types = fence->type;
+		drm_fence_count_waiters(fc, outstanding, 0);
+		drm_fence_ring_del(fc, fence);
+		if (!list_empty(&fence->events))
+			drm_fence_deliver_events(fence);
+		wake_up_all(&fc->fence_queue);
+		return;
+	}
 
-		if (error) {
-			fence->error = error;
-			fence->signaled_types = fence->type;
-			list_del_init(&fence->ring);
-			wake = 1;
-			break;
-		}
+	/*
+	 * Only fences from the oldest type_done position of the types
+	 * reported may still have one of them to signal.
+	 */
 
-		if (type & DRM_FENCE_TYPE_EXE)
-			type |= fence->native_types;
+	pos = end;
+	for (types = type; types; types &= types - 1) {
+		bit = drm_fence_type_done(fc, __ffs(types));
+		if ((int32_t) (bit - pos) < 0)
+			pos = bit;
+	}
 
-		relevant_type = type & fence->type;
+	for (; pos != end; ++pos) {
+		fence = fc->index[pos & mask].fence;
+		if (!fence)
+			continue;
+
+		outstanding = drm_fence_outstanding(fence);
+		relevant_type = type;
+		if (type & DRM_FENCE_TYPE_EXE)
+			relevant_type |= fence->native_types;
+		relevant_type &= fence->type;
 		new_type = (fence->signaled_types | relevant_type) ^
 			fence->signaled_types;
 
@@ -142,33 +376,26 @@ void drm_fence_handler(struct drm_device *dev, uint32_t fence_class,
 
 			if (new_type & fence->waiting_types)
 				wake = 1;
-		}
 
-		fc->waiting_types |= fence->waiting_types & ~fence->signaled_types;
+			drm_fence_count_waiters(fc, outstanding & new_type, 0);
+
+			if (!list_empty(&fence->events))
+				drm_fence_deliver_events(fence);
+		}
 
 		if (!(fence->type & ~fence->signaled_types)) {
 			DRM_DEBUG("Fence completely signaled 0x%08lx\n",
 				  fence->base.hash.key);
-			list_del_init(&fence->ring);
+			drm_fence_count_waiters(fc,
+						drm_fence_outstanding(fence), 0);
+			drm_fence_ring_del(fc, fence);
 		}
 	}
 
-	/*
-	 * Reinstate lost waiting types.
-	 */
-
-	if ((fc->waiting_types & type) != type) {
-		head = head->prev;
-		list_for_each_entry(fence, head, ring) {
-			if (&fence->ring == &fc->ring)
-				break;
-			diff = (fc->highest_waiting_sequence - fence->sequence) &
-				driver->sequence_mask;
-			if (diff > driver->wrap_diff)
-				break;
-			
-			fc->waiting_types |= fence->waiting_types & ~fence->signaled_types;
-		}
+	for (types = type; types; types &= types - 1) {
+		bit = __ffs(types);
+		if ((int32_t) (end - drm_fence_type_done(fc, bit)) > 0)
+			fc->type_done[bit] = end;
 	}
 
 	if (wake) 
@@ -176,13 +403,19 @@ void drm_fence_handler(struct drm_device *dev, uint32_t fence_class,
 }
 EXPORT_SYMBOL(drm_fence_handler);
 
-static void drm_fence_unring(struct drm_device *dev, struct list_head *ring)
+static void drm_fence_unring(struct drm_device *dev,
+			     struct drm_fence_object *fence)
 {
 	struct drm_fence_manager *fm = &dev->fm;
+	struct drm_fence_class_manager *fc;
 	unsigned long flags;
 
 	write_lock_irqsave(&fm->lock, flags);
-	list_del_init(ring);
+	if (!list_empty(&fence->ring)) {
+		fc = &fm->fence_class[fence->fence_class];
+		drm_fence_count_waiters(fc, drm_fence_outstanding(fence), 0);
+		drm_fence_ring_del(fc, fence);
+	}
 	write_unlock_irqrestore(&fm->lock, flags);
 }
 
@@ -195,7 +428,8 @@ void drm_fence_usage_deref_locked(struct drm_fence_object **fence)
 	DRM_ASSERT_LOCKED(&dev->struct_mutex);
 	*fence = NULL;
 	if (atomic_dec_and_test(&tmp_fence->usage)) {
-		drm_fence_unring(dev, &tmp_fence->ring);
+		drm_fence_unring(dev, tmp_fence);
+		drm_fence_drop_events(dev, tmp_fence);
 		DRM_DEBUG("Destroyed a fence object 0x%08lx\n",
 			  tmp_fence->base.hash.key);
 		atomic_dec(&fm->count);
@@ -215,7 +449,8 @@ void drm_fence_usage_deref_unlocked(struct drm_fence_object **fence)
 	if (atomic_dec_and_test(&tmp_fence->usage)) {
 		mutex_lock(&dev->struct_mutex);
 		if (atomic_read(&tmp_fence->usage) == 0) {
-			drm_fence_unring(dev, &tmp_fence->ring);
+			drm_fence_unring(dev, tmp_fence);
+			drm_fence_drop_events(dev, tmp_fence);
 			atomic_dec(&fm->count);
 			BUG_ON(!list_empty(&tmp_fence->base.list));
 			drm_ctl_free(tmp_fence, sizeof(*tmp_fence), DRM_MEM_FENCE);
@@ -286,6 +521,7 @@ int drm_fence_object_flush(struct drm_fence_object *fence,
 	struct drm_fence_driver *driver = dev->driver->fence_driver;
 	unsigned long irq_flags;
 	uint32_t saved_pending_flush;
+	uint32_t outstanding;
 	uint32_t diff;
 	int call_flush;
 
@@ -298,8 +534,11 @@ int drm_fence_object_flush(struct drm_fence_object *fence,
 /* 	} */
 
 	write_lock_irqsave(&fm->lock, irq_flags);
+	outstanding = drm_fence_outstanding(fence);
 	fence->waiting_types |= type;
-	fc->waiting_types |= fence->waiting_types;
+	if (!list_empty(&fence->ring))
+		drm_fence_count_waiters(fc, drm_fence_outstanding(fence) &
+					~outstanding, 1);
 	diff = (fence->sequence - fc->highest_waiting_sequence) & 
 		driver->sequence_mask;
 
@@ -343,6 +582,7 @@ void drm_fence_flush_old(struct drm_device *dev, uint32_t fence_class,
 	struct drm_fence_driver *driver = dev->driver->fence_driver;
 	int call_flush;
 
+	uint32_t outstanding;
 	uint32_t diff;
 
 	write_lock_irqsave(&fm->lock, irq_flags);
@@ -352,8 +592,12 @@ void drm_fence_flush_old(struct drm_device *dev, uint32_t fence_class,
 		if (diff <= driver->flush_diff)
 			break;
 	
+		outstanding = drm_fence_outstanding(fence);
 		fence->waiting_types = fence->type;
-		fc->waiting_types |= fence->type;
+		drm_fence_count_waiters(fc, drm_fence_outstanding(fence) &
+					~outstanding, 1);
+		drm_fence_count_waiters(fc, outstanding &
+					~drm_fence_outstanding(fence), 0);
 
 		if (driver->needed_flush)
 			fc->pending_flush |= driver->needed_flush(fence);
@@ -375,6 +619,20 @@ void drm_fence_flush_old(struct drm_device *dev, uint32_t fence_class,
 }
 EXPORT_SYMBOL(drm_fence_flush_old);
 
+/*
+ * How long a wait on a fence class may take before it times out.
+ */
+
+static unsigned long drm_fence_wait_timeout(struct drm_device *dev,
+					    uint32_t fence_class)
+{
+	struct drm_fence_driver *driver = dev->driver->fence_driver;
+
+	if (driver->wait_timeout)
+		return driver->wait_timeout(dev, fence_class);
+	return 3 * DRM_HZ;
+}
+
 int drm_fence_object_wait(struct drm_fence_object *fence,
 			  int lazy, int ignore_signals, uint32_t mask)
 {
@@ -383,7 +641,7 @@ int drm_fence_object_wait(struct drm_fence_object *fence,
 	struct drm_fence_manager *fm = &dev->fm;
 	struct drm_fence_class_manager *fc = &fm->fence_class[fence->fence_class];
 	int ret = 0;
-	unsigned long _end = 3 * DRM_HZ;
+	unsigned long _end = drm_fence_wait_timeout(dev, fence->fence_class);
 
 	if (mask & ~fence->type) {
 		DRM_ERROR("Wait trying to extend fence type"
@@ -402,12 +660,12 @@ int drm_fence_object_wait(struct drm_fence_object *fence,
 			ret = wait_event_interruptible_timeout
 				(fc->fence_queue, 
 				 drm_fence_object_signaled(fence, mask), 
-				 3 * DRM_HZ);
+				 _end);
 		else 
 			ret = wait_event_timeout
 				(fc->fence_queue, 
 				 drm_fence_object_signaled(fence, mask), 
-				 3 * DRM_HZ);
+				 _end);
 
 		if (unlikely(ret == -ERESTARTSYS))
 			return -EAGAIN;
@@ -431,19 +689,28 @@ int drm_fence_object_emit(struct drm_fence_object *fence, uint32_t fence_flags,
 	struct drm_device *dev = fence->dev;
 	struct drm_fence_manager *fm = &dev->fm;
 	struct drm_fence_driver *driver = dev->driver->fence_driver;
-	struct drm_fence_class_manager *fc = &fm->fence_class[fence->fence_class];
+	struct drm_fence_class_manager *fc = &fm->fence_class[fence_class];
+	struct drm_fence_index_slot *slot;
 	unsigned long flags;
 	uint32_t sequence;
 	uint32_t native_types;
 	int ret;
 
-	drm_fence_unring(dev, &fence->ring);
-	ret = driver->emit(dev, fence_class, fence_flags, &sequence,
-			   &native_types);
+	drm_fence_unring(dev, fence);
+	ret = drm_fence_index_reserve(fm, fc);
 	if (ret)
 		return ret;
 
+	ret = driver->emit(dev, fence_class, fence_flags, &sequence,
+			   &native_types);
+
 	write_lock_irqsave(&fm->lock, flags);
+	fc->index_reserved--;
+	if (ret) {
+		write_unlock_irqrestore(&fm->lock, flags);
+		return ret;
+	}
+
 	fence->fence_class = fence_class;
 	fence->type = type;
 	fence->waiting_types = 0;
@@ -453,6 +720,11 @@ int drm_fence_object_emit(struct drm_fence_object *fence, uint32_t fence_flags,
 	fence->native_types = native_types;
 	if (list_empty(&fc->ring))
 		fc->highest_waiting_sequence = sequence - 1;
+	slot = &fc->index[fc->index_tail & (fc->index_size - 1)];
+	slot->sequence = sequence;
+	slot->fence = fence;
+	fence->ring_pos = fc->index_tail++;
+	fc->index_count++;
 	list_add_tail(&fence->ring, &fc->ring);
 	fc->latest_queued_sequence = sequence;
 	write_unlock_irqrestore(&fm->lock, flags);
@@ -475,6 +747,7 @@ static int drm_fence_object_init(struct drm_device *dev, uint32_t fence_class,
 
 	write_lock_irqsave(&fm->lock, flags);
 	INIT_LIST_HEAD(&fence->ring);
+	INIT_LIST_HEAD(&fence->events);
 
 	/*
 	 *  Avoid hitting BUG() for kernel-only fence objects.
@@ -592,6 +865,25 @@ EXPORT_SYMBOL(drm_fence_fill_arg);
 
 void drm_fence_manager_takedown(struct drm_device *dev)
 {
+	struct drm_fence_manager *fm = &dev->fm;
+	struct drm_fence_class_manager *fc;
+	int i;
+
+	if (!fm->initialized)
+		return;
+
+	for (i = 0; i < fm->num_classes; ++i) {
+		fc = &fm->fence_class[i];
+		if (fc->index_count) {
+			DRM_ERROR("Fences still queued on class %d.\n", i);
+			continue;
+		}
+		if (fc->index)
+			drm_free(fc->index, fc->index_size * sizeof(*fc->index),
+				 DRM_MEM_FENCE);
+		fc->index = NULL;
+		fc->index_size = 0;
+	}
 }
 
 struct drm_fence_object *drm_lookup_fence_object(struct drm_file *priv,
@@ -765,6 +1057,242 @@ int drm_fence_wait_ioctl(struct drm_device *dev, void *data, struct drm_file *fi
 	return ret;
 }
 
+static inline uint32_t drm_fence_multi_mask(struct drm_fence_object *fence,
+					    uint32_t type)
+{
+	return (type) ? type & fence->type : fence->type;
+}
+
+/*
+ * Bit mask of the fences in the set that have signaled, recording
+ * the first error seen on a signaled fence.
+ */
+
+static uint64_t drm_fence_multi_signaled(struct drm_fence_object **fences,
+					 unsigned int num, uint32_t type,
+					 uint32_t *error)
+{
+	uint64_t signaled = 0;
+	unsigned int i;
+
+	for (i = 0; i < num; ++i) {
+		if (!drm_fence_object_signaled(fences[i],
+					       drm_fence_multi_mask(fences[i],
+								    type)))
+			continue;
+		signaled |= (1ULL << i);
+		if (!*error)
+			*error = fences[i]->error;
+	}
+
+	return signaled;
+}
+
+int drm_fence_wait_multi_ioctl(struct drm_device *dev, void *data,
+			       struct drm_file *file_priv)
+{
+	struct drm_fence_manager *fm = &dev->fm;
+	struct drm_fence_driver *driver = dev->driver->fence_driver;
+	struct drm_fence_wait_multi_arg *arg = data;
+	struct drm_fence_object **fences;
+	uint32_t *handles;
+	wait_queue_t entries[_DRM_FENCE_CLASSES];
+	uint32_t classes = 0;
+	uint32_t fence_class;
+	uint32_t mask;
+	uint32_t error = 0;
+	uint64_t all;
+	uint64_t signaled;
+	unsigned long timeout = 0;
+	unsigned long end;
+	unsigned int num = arg->num_handles;
+	unsigned int i;
+	int polling = 0;
+	int ret = 0;
+
+	if (!fm->initialized) {
+		DRM_ERROR("The DRM driver does not support fencing.\n");
+		return -EINVAL;
+	}
+
+	if (num == 0 || num > DRM_FENCE_WAIT_MULTI_MAX)
+		return -EINVAL;
+
+	handles = drm_calloc(num, sizeof(*handles), DRM_MEM_FENCE);
+	fences = drm_calloc(num, sizeof(*fences), DRM_MEM_FENCE);
+	if (!handles || !fences) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(handles, (void __user *)(unsigned long)arg->handles,
+			   num * sizeof(*handles))) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	for (i = 0; i < num; ++i) {
+		fences[i] = drm_lookup_fence_object(file_priv, handles[i]);
+		if (!fences[i]) {
+			ret = -EINVAL;
+			goto out_deref;
+		}
+	}
+
+	/*
+	 * Flush everything first so that the engines work on all the
+	 * fences while we sleep, then sleep once on the queues of the
+	 * fence classes involved. Unless user-space gives a timeout, use
+	 * the longest the driver allows for any of those classes.
+	 */
+
+	for (i = 0; i < num; ++i) {
+		mask = drm_fence_multi_mask(fences[i], arg->type);
+		fence_class = fences[i]->fence_class;
+		drm_fence_object_flush(fences[i], mask);
+		if (!driver->wait &&
+		    !(driver->has_irq &&
+		      driver->has_irq(dev, fence_class, mask)))
+			polling = 1;
+		if (classes & (1 << fence_class))
+			continue;
+		classes |= (1 << fence_class);
+		timeout = max(timeout, drm_fence_wait_timeout(dev, fence_class));
+		init_waitqueue_entry(&entries[fence_class], current);
+		add_wait_queue(&fm->fence_class[fence_class].fence_queue,
+			       &entries[fence_class]);
+	}
+
+	all = (num == 64) ? ~0ULL : (1ULL << num) - 1;
+	end = jiffies + ((arg->timeout_ms) ?
+			 msecs_to_jiffies(arg->timeout_ms) : timeout);
+
+	for (;;) {
+		__set_current_state(TASK_INTERRUPTIBLE);
+		signaled = drm_fence_multi_signaled(fences, num, arg->type,
+						    &error);
+		if ((arg->flags & DRM_FENCE_FLAG_WAIT_ANY) ?
+		    signaled != 0 : signaled == all)
+			break;
+		if (time_after_eq(jiffies, end)) {
+			ret = -EBUSY;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EAGAIN;
+			break;
+		}
+		schedule_timeout((polling) ? 1 : end - jiffies);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	for (fence_class = 0; fence_class < _DRM_FENCE_CLASSES; ++fence_class) {
+		if (classes & (1 << fence_class))
+			remove_wait_queue(&fm->fence_class[fence_class].
+					  fence_queue, &entries[fence_class]);
+	}
+
+	arg->signaled = signaled;
+	arg->error = error;
+
+out_deref:
+	for (i = 0; i < num; ++i) {
+		if (fences[i])
+			drm_fence_usage_deref_unlocked(&fences[i]);
+	}
+out_free:
+	if (fences)
+		drm_free(fences, num * sizeof(*fences), DRM_MEM_FENCE);
+	if (handles)
+		drm_free(handles, num * sizeof(*handles), DRM_MEM_FENCE);
+	return ret;
+}
+
+int drm_fence_event_ioctl(struct drm_device *dev, void *data,
+			  struct drm_file *file_priv)
+{
+	struct drm_fence_manager *fm = &dev->fm;
+	struct drm_fence_event_arg *arg = data;
+	struct drm_fence_object *fence;
+	struct drm_pending_fence_event *e;
+	unsigned long flags;
+	int ret = 0;
+
+	if (!fm->initialized) {
+		DRM_ERROR("The DRM driver does not support fencing.\n");
+		return -EINVAL;
+	}
+
+	fence = drm_lookup_fence_object(file_priv, arg->handle);
+	if (!fence)
+		return -EINVAL;
+
+	e = drm_calloc(1, sizeof(*e), DRM_MEM_FENCE);
+	if (!e) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	e->file_priv = file_priv;
+	e->type = (arg->type) ? arg->type & fence->type : fence->type;
+	e->event.base.type = DRM_EVENT_FENCE;
+	e->event.base.length = sizeof(e->event);
+	e->event.user_data = arg->user_data;
+	e->event.handle = arg->handle;
+
+	drm_fence_object_flush(fence, e->type);
+
+	write_lock_irqsave(&fm->lock, flags);
+	if (file_priv->event_space < sizeof(e->event)) {
+		write_unlock_irqrestore(&fm->lock, flags);
+		drm_free(e, sizeof(*e), DRM_MEM_FENCE);
+		ret = -ENOMEM;
+		goto out;
+	}
+	file_priv->event_space -= sizeof(e->event);
+	file_priv->event_enabled = 1;
+	list_add_tail(&e->file_head, &file_priv->pending_events);
+	list_add_tail(&e->head, &fence->events);
+
+	/*
+	 * The fence may already have signaled.
+	 */
+
+	drm_fence_deliver_events(fence);
+	write_unlock_irqrestore(&fm->lock, flags);
+out:
+	drm_fence_usage_deref_unlocked(&fence);
+	return ret;
+}
+
+/*
+ * Free the pending and unread events of a file that is being closed.
+ */
+
+void drm_fence_event_release(struct drm_file *file_priv)
+{
+	struct drm_fence_manager *fm = &file_priv->head->dev->fm;
+	struct drm_pending_fence_event *e, *next;
+	unsigned long flags;
+
+	if (!file_priv->event_enabled)
+		return;
+
+	write_lock_irqsave(&fm->lock, flags);
+	list_for_each_entry_safe(e, next, &file_priv->pending_events,
+				 file_head) {
+		list_del(&e->head);
+		list_del(&e->file_head);
+		drm_free(e, sizeof(*e), DRM_MEM_FENCE);
+	}
+	list_for_each_entry_safe(e, next, &file_priv->event_list, head) {
+		list_del(&e->head);
+		drm_free(e, sizeof(*e), DRM_MEM_FENCE);
+	}
+	write_unlock_irqrestore(&fm->lock, flags);
+}
+EXPORT_SYMBOL(drm_fence_event_release);
+
 
 int drm_fence_emit_ioctl(struct drm_device *dev, void *data, struct drm_file *file_priv)
 {
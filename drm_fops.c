@@ -264,6 +264,10 @@ static int drm_open_helper(struct inode *inode, struct file *filp,
 	INIT_LIST_HEAD(&priv->lhead);
 	INIT_LIST_HEAD(&priv->refd_objects);
 	INIT_LIST_HEAD(&priv->fbs);
+	INIT_LIST_HEAD(&priv->pending_events);
+	INIT_LIST_HEAD(&priv->event_list);
+	init_waitqueue_head(&priv->event_wait);
+	priv->event_space = 4096;
 
 	for (i = 0; i < _DRM_NO_REF_TYPES; ++i) {
 		ret = drm_ht_create(&priv->refd_object_hash[i],
@@ -475,6 +479,7 @@ int drm_release(struct inode *inode, struct file *filp)
 	mutex_lock(&dev->struct_mutex);
 	drm_fb_release(filp);
 	drm_object_release(filp);
+	drm_fence_event_release(file_priv);
 	if (file_priv->remove_auth_on_close == 1) {
 		struct drm_file *temp;
 
@@ -525,7 +530,87 @@ EXPORT_SYMBOL(drm_release);
  */
 unsigned int drm_poll(struct file *filp, struct poll_table_struct *wait)
 {
-	/* return (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM); */
-	return 0;
+	struct drm_file *file_priv = filp->private_data;
+	unsigned int mask = 0;
+
+	/*
+	 * Only files that have asked for fence events get the correct
+	 * response.
+	 */
+
+	if (!file_priv->event_enabled)
+		return 0;
+
+	poll_wait(filp, &file_priv->event_wait, wait);
+	if (!list_empty(&file_priv->event_list))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
 }
 EXPORT_SYMBOL(drm_poll);
+
+/*
+ * Read as many whole events as fit in the buffer, blocking until at
+ * least one is available unless the file is non-blocking.
+ */
+
+ssize_t drm_read(struct file *filp, char __user *buffer,
+		 size_t count, loff_t *offset)
+{
+	struct drm_file *file_priv = filp->private_data;
+	struct drm_fence_manager *fm = &file_priv->head->dev->fm;
+	struct drm_pending_fence_event *e;
+	unsigned long flags;
+	size_t total = 0;
+	int ret;
+
+	if (!file_priv->event_enabled)
+		return -EINVAL;
+
+	if (filp->f_flags & O_NONBLOCK) {
+		if (list_empty(&file_priv->event_list))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(file_priv->event_wait,
+					       !list_empty(&file_priv->
+							   event_list));
+		if (ret)
+			return ret;
+	}
+
+	for (;;) {
+		write_lock_irqsave(&fm->lock, flags);
+		if (list_empty(&file_priv->event_list)) {
+			write_unlock_irqrestore(&fm->lock, flags);
+			break;
+		}
+		e = list_entry(file_priv->event_list.next,
+			       struct drm_pending_fence_event, head);
+		if (e->event.base.length > count - total) {
+			write_unlock_irqrestore(&fm->lock, flags);
+			break;
+		}
+		list_del(&e->head);
+		file_priv->event_space += sizeof(e->event);
+		write_unlock_irqrestore(&fm->lock, flags);
+
+		if (copy_to_user(buffer + total, &e->event,
+				 e->event.base.length)) {
+			/*
+			 * Put the event back for the next read, and report
+			 * the events already copied, if any.
+			 */
+
+			write_lock_irqsave(&fm->lock, flags);
+			list_add(&e->head, &file_priv->event_list);
+			file_priv->event_space -= sizeof(e->event);
+			write_unlock_irqrestore(&fm->lock, flags);
+			return (total) ? total : -EFAULT;
+		}
+		total += e->event.base.length;
+		drm_free(e, sizeof(*e), DRM_MEM_FENCE);
+	}
+
+	return (total) ? total : -EINVAL;
+}
+EXPORT_SYMBOL(drm_read);
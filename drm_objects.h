@@ -153,10 +153,31 @@ struct drm_fence_object {
 	uint32_t sequence;
 	uint32_t waiting_types;
 	uint32_t error;
+	struct list_head events;
+	uint32_t ring_pos;
+};
+
+/*
+ * An event requested on a fence. It sits on the fence's event list
+ * and the file's pending list until the fence signals, and then on
+ * the file's event list until read.
+ */
+
+struct drm_pending_fence_event {
+	struct list_head head;
+	struct list_head file_head;
+	struct drm_file *file_priv;
+	uint32_t type;
+	struct drm_fence_event event;
 };
 
 #define _DRM_FENCE_CLASSES 8
 
+struct drm_fence_index_slot {
+	uint32_t sequence;
+	struct drm_fence_object *fence;
+};
+
 struct drm_fence_class_manager {
 	struct list_head ring;
 	uint32_t pending_flush;
@@ -164,6 +185,31 @@ struct drm_fence_class_manager {
 	wait_queue_head_t fence_queue;
 	uint32_t highest_waiting_sequence;
         uint32_t latest_queued_sequence;
+
+	/*
+	 * Number of fences on the ring waiting for each type bit
+	 * that has not signaled yet. waiting_types holds the bits
+	 * with a non-zero count.
+	 */
+
+	uint32_t waiters[32];
+
+	/*
+	 * The ring again, as an array in sequence order, so that the
+	 * handler can bisect for the newest fence a sequence covers.
+	 * Fences are at positions index_head up to index_tail, in slot
+	 * (position & (index_size - 1)). A fence leaving the ring leaves
+	 * a hole that keeps its sequence. Every fence before position
+	 * type_done[i] has signaled type bit i, or doesn't have it.
+	 */
+
+	struct drm_fence_index_slot *index;
+	uint32_t index_size;
+	uint32_t index_head;
+	uint32_t index_tail;
+	uint32_t index_count;
+	uint32_t index_reserved;
+	uint32_t type_done[32];
 };
 
 struct drm_fence_manager {
@@ -200,6 +246,10 @@ struct drm_fence_driver {
 	 *
 	 * wait(): Wait for the "mask" flags to signal on a given fence, performing
 	 * whatever's necessary to make this happen.
+	 *
+	 * wait_timeout() : How long in jiffies a wait on the fence class may
+	 * take before the fence is considered lost. Optional, 3 seconds if
+	 * not implemented.
 	 */
 
 	int (*has_irq) (struct drm_device *dev, uint32_t fence_class,
@@ -213,6 +263,8 @@ struct drm_fence_driver {
 	uint32_t (*needed_flush) (struct drm_fence_object *fence);
 	int (*wait) (struct drm_fence_object *fence, int lazy,
 		     int interruptible, uint32_t mask);
+	unsigned long (*wait_timeout) (struct drm_device *dev,
+				       uint32_t fence_class);
 };
 
 extern int drm_fence_wait_polling(struct drm_fence_object *fence, int lazy,
@@ -263,6 +315,11 @@ extern int drm_fence_flush_ioctl(struct drm_device *dev, void *data,
 				 struct drm_file *file_priv);
 extern int drm_fence_wait_ioctl(struct drm_device *dev, void *data,
 				struct drm_file *file_priv);
+extern int drm_fence_wait_multi_ioctl(struct drm_device *dev, void *data,
+				      struct drm_file *file_priv);
+extern int drm_fence_event_ioctl(struct drm_device *dev, void *data,
+				 struct drm_file *file_priv);
+extern void drm_fence_event_release(struct drm_file *file_priv);
 extern int drm_fence_emit_ioctl(struct drm_device *dev, void *data,
 				struct drm_file *file_priv);
 extern int drm_fence_buffers_ioctl(struct drm_device *dev, void *data,
@@ -575,6 +632,8 @@ extern int drm_mem_reg_is_pci(struct drm_device *dev, struct drm_bo_mem_reg *mem
 extern void drm_bo_usage_deref_locked(struct drm_buffer_object **bo);
 extern void drm_bo_usage_deref_unlocked(struct drm_buffer_object **bo);
 extern void drm_putback_buffer_objects(struct drm_device *dev);
+extern void drm_putback_buffer_list(struct drm_device *dev,
+				    struct list_head *list);
 extern int drm_fence_buffer_objects(struct drm_device *dev,
 				    struct list_head *list,
 				    uint32_t fence_flags,
@@ -610,6 +669,12 @@ extern int drm_bo_do_validate(struct drm_buffer_object *bo,
 			      uint32_t fence_class,
 			      int no_wait,
 			      struct drm_bo_info_rep *rep);
+extern int drm_bo_do_validate_list(struct drm_buffer_object *bo,
+				   uint64_t flags, uint64_t mask,
+				   uint32_t hint, uint32_t fence_class,
+				   int no_wait, int backoff,
+				   struct list_head *unfenced,
+				   struct drm_bo_info_rep *rep);
 extern void drm_bo_fill_rep_arg(struct drm_buffer_object *bo,
 				struct drm_bo_info_rep *rep);
 /*
@@ -0,0 +1,225 @@
+/**************************************************************************
+ * Copyright (c) 2007, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ **************************************************************************/
+/*
+ * Persistent per-file buffer sets. The buffer object lookups are done
+ * once at create time, and the references are held until the set is
+ * destroyed or the file is closed.
+ */
+
+#include "drmP.h"
+#include "psb_drv.h"
+#include "psb_drm.h"
+
+static void psb_bufset_free(struct psb_bufset *set)
+{
+	struct psb_bufset_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < set->num_entries; ++i) {
+		entry = &set->entries[i];
+		if (entry->bo)
+			drm_bo_usage_deref_unlocked(&entry->bo);
+	}
+	vfree(set->entries);
+	drm_free(set, sizeof(*set), DRM_MEM_DRIVER);
+}
+
+static struct psb_bufset *psb_bufset_find(struct psb_fpriv *fpriv,
+					  uint32_t handle)
+{
+	struct psb_bufset *set;
+
+	list_for_each_entry(set, &fpriv->bufsets, head) {
+		if (set->handle == handle)
+			return set;
+	}
+	return NULL;
+}
+
+static int psb_bufset_create(struct drm_file *file_priv,
+			     struct drm_psb_bufset_arg *arg)
+{
+	struct drm_device *dev = file_priv->head->dev;
+	struct psb_fpriv *fpriv = psb_fpriv(file_priv);
+	struct drm_psb_bufset_entry __user *user_entries;
+	struct drm_psb_bufset_entry user_entry;
+	struct psb_bufset_entry *entry;
+	struct psb_bufset *set;
+	unsigned int i;
+	int ret = 0;
+
+	if (arg->num_entries == 0 ||
+	    arg->num_entries > PSB_NUM_VALIDATE_BUFFERS)
+		return -EINVAL;
+
+	set = drm_calloc(1, sizeof(*set), DRM_MEM_DRIVER);
+	if (!set)
+		return -ENOMEM;
+	atomic_set(&set->usage, 1);
+
+	set->entries = vmalloc(arg->num_entries * sizeof(*set->entries));
+	if (!set->entries) {
+		drm_free(set, sizeof(*set), DRM_MEM_DRIVER);
+		return -ENOMEM;
+	}
+	memset(set->entries, 0, arg->num_entries * sizeof(*set->entries));
+
+	user_entries = (struct drm_psb_bufset_entry __user *)
+	    (unsigned long)arg->entries;
+
+	for (i = 0; i < arg->num_entries; ++i) {
+		entry = &set->entries[i];
+
+		if (copy_from_user(&user_entry, user_entries + i,
+				   sizeof(user_entry))) {
+			ret = -EFAULT;
+			goto out_err;
+		}
+
+		mutex_lock(&dev->struct_mutex);
+		entry->bo = drm_lookup_buffer_object(file_priv,
+						     user_entry.handle, 1);
+		mutex_unlock(&dev->struct_mutex);
+
+		if (!entry->bo) {
+			ret = -EINVAL;
+			goto out_err;
+		}
+		set->num_entries++;
+
+		/*
+		 * Only allow creator to change shared buffer mask,
+		 * as drm_bo_handle_validate does.
+		 */
+
+		if (entry->bo->base.owner != file_priv)
+			user_entry.mask &= ~(DRM_BO_FLAG_NO_EVICT |
+					     DRM_BO_FLAG_NO_MOVE);
+
+		entry->flags = user_entry.flags;
+		entry->mask = user_entry.mask;
+		entry->hint = user_entry.hint & ~DRM_BO_HINT_PRESUMED_OFFSET;
+
+		user_entry.offset = entry->bo->offset;
+		if (copy_to_user(&user_entries[i].offset, &user_entry.offset,
+				 sizeof(user_entry.offset))) {
+			ret = -EFAULT;
+			goto out_err;
+		}
+	}
+
+	mutex_lock(&fpriv->bufset_mutex);
+	do {
+		set->handle = ++fpriv->bufset_seq;
+	} while (set->handle == 0 || psb_bufset_find(fpriv, set->handle));
+	list_add_tail(&set->head, &fpriv->bufsets);
+	mutex_unlock(&fpriv->bufset_mutex);
+
+	arg->handle = set->handle;
+	return 0;
+
+      out_err:
+	psb_bufset_free(set);
+	return ret;
+}
+
+void psb_bufset_unref(struct psb_bufset **set)
+{
+	struct psb_bufset *tmp_set = *set;
+
+	*set = NULL;
+	if (atomic_dec_and_test(&tmp_set->usage))
+		psb_bufset_free(tmp_set);
+}
+
+static int psb_bufset_destroy(struct drm_file *file_priv,
+			      struct drm_psb_bufset_arg *arg)
+{
+	struct psb_fpriv *fpriv = psb_fpriv(file_priv);
+	struct psb_bufset *set;
+
+	mutex_lock(&fpriv->bufset_mutex);
+	set = psb_bufset_find(fpriv, arg->handle);
+	if (set)
+		list_del(&set->head);
+	mutex_unlock(&fpriv->bufset_mutex);
+
+	if (!set)
+		return -EINVAL;
+
+	psb_bufset_unref(&set);
+	return 0;
+}
+
+int psb_bufset_ioctl(struct drm_device *dev, void *data,
+		     struct drm_file *file_priv)
+{
+	struct drm_psb_bufset_arg *arg = data;
+
+	switch (arg->op) {
+	case PSB_BUFSET_CREATE:
+		return psb_bufset_create(file_priv, arg);
+	case PSB_BUFSET_DESTROY:
+		return psb_bufset_destroy(file_priv, arg);
+	default:
+		DRM_ERROR("Invalid buffer set operation %u.\n", arg->op);
+		return -EINVAL;
+	}
+}
+
+/*
+ * Look up a set for submission. The set is returned referenced, so
+ * that destroying it doesn't free it under the submission, and
+ * bufset_mutex is only held for the lookup. The entries don't change
+ * after creation, so submissions may share a set. Release with
+ * psb_bufset_unref().
+ */
+
+struct psb_bufset *psb_bufset_lookup(struct drm_file *file_priv,
+				     uint32_t handle)
+{
+	struct psb_fpriv *fpriv = psb_fpriv(file_priv);
+	struct psb_bufset *set;
+
+	mutex_lock(&fpriv->bufset_mutex);
+	set = psb_bufset_find(fpriv, handle);
+	if (set)
+		atomic_inc(&set->usage);
+	mutex_unlock(&fpriv->bufset_mutex);
+
+	if (!set)
+		DRM_ERROR("Invalid buffer set handle 0x%08x.\n", handle);
+	return set;
+}
+
+void psb_bufset_takedown(struct drm_file *file_priv)
+{
+	struct psb_fpriv *fpriv = psb_fpriv(file_priv);
+	struct psb_bufset *set, *next;
+
+	mutex_lock(&fpriv->bufset_mutex);
+	list_for_each_entry_safe(set, next, &fpriv->bufsets, head) {
+		list_del(&set->head);
+		psb_bufset_unref(&set);
+	}
+	mutex_unlock(&fpriv->bufset_mutex);
+}
@@ -187,6 +187,50 @@ struct drm_psb_reloc {
 #define PSB_TA_FLAG_FIRSTPASS    (1 << 0)
 #define PSB_TA_FLAG_LASTPASS     (1 << 1)
 
+/*
+ * Submission flags valid for all engines, carried in the upper half
+ * of drm_psb_cmdbuf_arg::ta_flags.
+ */
+
+#define PSB_CMDBUF_FLAG_VALIDATE_ARRAY (1 << 16)
+#define PSB_CMDBUF_FLAG_USER_RELOCS    (1 << 17)
+#define PSB_CMDBUF_FLAG_BUFFER_SET     (1 << 18)
+#define PSB_CMDBUF_FLAG_PRIORITY       (1 << 19)
+#define PSB_CMDBUF_FLAG_DEADLINE       (1 << 20)
+
+/*
+ * With PSB_CMDBUF_FLAG_PRIORITY or PSB_BATCH_FLAG_PRIORITY, a TA or
+ * rasterizer submission gets PSB_SCHED_PRIORITY_WEIGHT times the share
+ * of the engines of a normal one, and may have as many times as many
+ * tasks queued, while other clients compete for the scheduler. The
+ * flags are ignored unless the caller is the DRM master or has
+ * CAP_SYS_NICE.
+ */
+
+/*
+ * With PSB_CMDBUF_FLAG_USER_RELOCS or PSB_BATCH_FLAG_USER_RELOCS,
+ * relocations are read from user memory rather than from a buffer
+ * object. reloc_handle then holds the low and reloc_offset the high
+ * 32 bits of a pointer to num_relocs struct drm_psb_reloc.
+ */
+
+#define PSB_USER_RELOCS_LO(_ptr) ((uint32_t) (unsigned long) (_ptr))
+#define PSB_USER_RELOCS_HI(_ptr) \
+	((uint32_t) ((uint64_t) (unsigned long) (_ptr) >> 32))
+
+/*
+ * With PSB_CMDBUF_FLAG_DEADLINE, a rasterizer submission carries a
+ * deadline in CLOCK_MONOTONIC nanoseconds in the deadline member,
+ * typically the time of the vblank it should be presented at. Any
+ * value, including 0, is a valid deadline.
+ *
+ * Deadline tasks are rasterized earliest deadline first, ahead of any
+ * rasterizer work without a deadline, including work queued before
+ * them. A deadline task must therefore not depend on the result of
+ * earlier rasterizer work unless user-space has waited for it. Missed
+ * deadlines are counted in "/proc/dri/%minor%/psb_deadline".
+ */
+
 #define PSB_FEEDBACK_OP_VISTEST (1 << 0)
 
 /* to eliminate video playback tearing */
@@ -257,11 +301,146 @@ typedef struct drm_psb_cmdbuf_arg {
 	uint32_t feedback_breakpoints;
 	uint32_t feedback_size;
 
+	uint32_t pad64;
+	uint64_t deadline;	/* See PSB_CMDBUF_FLAG_DEADLINE */
+
 #ifdef PSB_DETEAR
 	video_info sVideoInfo;
 #endif
 } drm_psb_cmdbuf_arg_t;
 
+/*
+ * Array-mode validate list, selected with PSB_CMDBUF_FLAG_VALIDATE_ARRAY
+ * or PSB_BATCH_FLAG_VALIDATE_ARRAY. buffer_list then points to this
+ * header instead of to the first list entry, and buffers points to a
+ * contiguous array of num_buffers struct drm_bo_op_arg. The next member
+ * of the array entries is ignored.
+ */
+
+struct drm_psb_validate_array {
+	uint64_t buffers;
+	uint32_t num_buffers;
+	uint32_t pad64;
+};
+
+/*
+ * Batched command submission. All entries share the validate list and
+ * the relocations of the batch argument, so the per-entry buffer_list
+ * and reloc_* members are ignored. All entries must belong to the
+ * fence class given by engine (2D, or TA / rasterizer).
+ *
+ * By default a single fence covering the whole batch is returned
+ * through fence_arg. With PSB_BATCH_FLAG_FENCE_EACH, each entry's own
+ * fence_flags and fence_arg are honoured instead.
+ *
+ * If an error occurs after some entries have been handed to the
+ * hardware, the ioctl still succeeds. num_submitted and ret then tell
+ * user-space how far it got and why it stopped.
+ *
+ * A TA batch is charged one scheduler queue slot per entry. If the
+ * client's share of the scheduler doesn't cover the whole batch, only
+ * the first num_submitted entries are submitted, fenced as if they
+ * were the whole batch, and ret is -EAGAIN. User-space resubmits the
+ * remaining entries.
+ */
+
+#define PSB_BATCH_FLAG_FENCE_EACH     (1 << 0)
+#define PSB_BATCH_FLAG_VALIDATE_ARRAY (1 << 1)
+#define PSB_BATCH_FLAG_USER_RELOCS    (1 << 2)
+#define PSB_BATCH_FLAG_BUFFER_SET     (1 << 3)
+#define PSB_BATCH_FLAG_PRIORITY       (1 << 4)
+#define PSB_MAX_BATCH_CMDBUFS     64
+
+struct drm_psb_cmdbuf_batch_arg {
+	uint64_t buffer_list;	/* List of buffers to validate */
+	uint64_t cmdbufs;	/* Array of struct drm_psb_cmdbuf_arg */
+	uint64_t fence_arg;	/* Fence covering the whole batch */
+
+	uint32_t reloc_handle;	/* Reloc buffer object */
+	uint32_t reloc_offset;
+	uint32_t num_relocs;
+
+	uint32_t num_cmdbufs;
+	uint32_t engine;
+	uint32_t fence_flags;
+	uint32_t flags;
+
+	uint32_t num_submitted;	/* Out */
+	int32_t ret;		/* Out */
+	uint32_t pad64;
+};
+
+/*
+ * Persistent buffer sets. A set is created once from an array of
+ * struct drm_psb_bufset_entry and can then be submitted with
+ * PSB_CMDBUF_FLAG_BUFFER_SET or PSB_BATCH_FLAG_BUFFER_SET. buffer_list
+ * then points to a struct drm_psb_bufset_submit instead of a validate
+ * list.
+ *
+ * The kernel keeps the buffer object references and the placement
+ * request of each entry, so no per-buffer lookup or validate list copy
+ * is done at submission time. The offset member of the entry array is
+ * written at create time only.
+ *
+ * offsets, if not 0, points to num_entries offsets for the submission.
+ * On input they are the offsets the command streams were built with,
+ * and relocations against a buffer are skipped if it is still there.
+ * On successful return they hold the current offsets. If offsets is 0,
+ * all relocations are applied and nothing is written back.
+ */
+
+struct drm_psb_bufset_submit {
+	uint64_t offsets;
+	uint32_t handle;
+	uint32_t pad64;
+};
+
+struct drm_psb_bufset_entry {
+	uint64_t flags;
+	uint64_t mask;
+	uint32_t handle;
+	uint32_t hint;
+	uint64_t offset;	/* Out */
+};
+
+#define PSB_BUFSET_CREATE  0x00
+#define PSB_BUFSET_DESTROY 0x01
+
+struct drm_psb_bufset_arg {
+	uint64_t entries;	/* Array of struct drm_psb_bufset_entry */
+	uint32_t num_entries;
+	uint32_t op;
+	uint32_t handle;	/* Out for PSB_BUFSET_CREATE */
+	uint32_t pad64;
+};
+
+/*
+ * Scheduler trace records, read as a binary stream from
+ * "/proc/dri/%minor%/psb_trace". Writing "1" or "0" to the same file
+ * starts or stops tracing. id increases by one per event, so a gap
+ * means the reader fell more than a ring length behind. For
+ * PSB_TRACE_USER_IRQ, arg is the xhw reply type and sequence is 0.
+ */
+
+#define PSB_TRACE_QUEUE        0x00
+#define PSB_TRACE_TA_FIRE      0x01
+#define PSB_TRACE_TA_DONE      0x02
+#define PSB_TRACE_TA_OOM       0x03
+#define PSB_TRACE_RASTER_FIRE  0x04
+#define PSB_TRACE_RASTER_DONE  0x05
+#define PSB_TRACE_USER_IRQ     0x06
+#define PSB_TRACE_FREE         0x07
+#define PSB_TRACE_NUM_EVENTS   0x08
+
+struct drm_psb_trace_event {
+	uint64_t time_ns;	/* Monotonic */
+	uint32_t id;
+	uint32_t sequence;
+	uint32_t arg;
+	uint16_t type;
+	uint16_t engine;
+};
+
 struct drm_psb_xhw_init_arg {
 	uint32_t operation;
 	uint32_t buffer_handle;
@@ -335,6 +514,27 @@ struct drm_psb_xhw_arg {
 	} arg;
 };
 
+/*
+ * Request ring shared with the X server. It is set up with
+ * PSB_XHW_INIT_RING instead of PSB_XHW_INIT, the buffer object then
+ * holding this header followed by the slots. The kernel sets num_slots.
+ *
+ * The kernel writes requests to slot[head % num_slots] and then
+ * advances head. The X server handles slots in order, writes replies
+ * in place, and advances done past each handled slot. DRM_PSB_XHW then
+ * acts as a doorbell: it consumes the replies up to done, and returns
+ * as soon as head differs from done, so that all requests queued since
+ * the last call are handled in one go.
+ */
+
+struct drm_psb_xhw_ring {
+	uint32_t head;
+	uint32_t done;
+	uint32_t num_slots;
+	uint32_t pad;
+	struct drm_psb_xhw_arg slot[0];
+};
+
 #define DRM_PSB_CMDBUF          0x00
 #define DRM_PSB_XHW_INIT        0x01
 #define DRM_PSB_XHW             0x02
@@ -343,9 +543,12 @@ struct drm_psb_xhw_arg {
 #define DRM_PSB_KMS_OFF		0x04
 #define DRM_PSB_KMS_ON		0x05
 #define DRM_PSB_HW_INFO         0x06
+#define DRM_PSB_CMDBUF_BATCH    0x07
+#define DRM_PSB_BUFSET          0x08
 
 #define PSB_XHW_INIT            0x00
 #define PSB_XHW_TAKEDOWN        0x01
+#define PSB_XHW_INIT_RING       0x02
 
 #define PSB_XHW_FIRE_RASTER     0x00
 #define PSB_XHW_SCENE_INFO      0x01
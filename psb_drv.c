@@ -40,8 +40,11 @@ EXPORT_SYMBOL(drm_psb_debug);
 static int drm_psb_trap_pagefaults = 0;
 static int drm_psb_clock_gating = 0;
 static int drm_psb_ta_mem_size = 32 * 1024;
+static int drm_psb_ta_mem_max_size = 128 * 1024;
+static int drm_psb_scene_cache_size = 4 * 1024;
 int drm_psb_disable_vsync = 0;
 int drm_psb_detear = 0;
+int drm_psb_pipeline = 0;
 int drm_psb_no_fb = 0;
 int drm_psb_force_pipeb = 0;
 char* psb_init_mode;
@@ -63,6 +66,9 @@ MODULE_PARM_DESC(disable_vsync, "Disable vsync interrupts");
 MODULE_PARM_DESC(detear, "eliminate video playback tearing");
 MODULE_PARM_DESC(force_pipeb, "Forces PIPEB to become primary fb");
 MODULE_PARM_DESC(ta_mem_size, "TA memory size in kiB");
+MODULE_PARM_DESC(ta_mem_max_size, "Maximum adaptive TA memory size in kiB");
+MODULE_PARM_DESC(scene_cache_size, "Idle scene cache size in kiB");
+MODULE_PARM_DESC(pipeline, "Rasterize while the TA is busy");
 MODULE_PARM_DESC(mode, "initial mode name");
 MODULE_PARM_DESC(xres, "initial mode width");
 MODULE_PARM_DESC(yres, "initial mode height");
@@ -75,6 +81,9 @@ module_param_named(disable_vsync, drm_psb_disable_vsync, int, 0600);
 module_param_named(detear, drm_psb_detear, int, 0600);
 module_param_named(force_pipeb, drm_psb_force_pipeb, int, 0600);
 module_param_named(ta_mem_size, drm_psb_ta_mem_size, int, 0600);
+module_param_named(ta_mem_max_size, drm_psb_ta_mem_max_size, int, 0600);
+module_param_named(scene_cache_size, drm_psb_scene_cache_size, int, 0600);
+module_param_named(pipeline, drm_psb_pipeline, int, 0600);
 module_param_named(mode, psb_init_mode, charp, 0600);
 module_param_named(xres, psb_init_xres, int, 0600);
 module_param_named(yres, psb_init_yres, int, 0600);
@@ -96,6 +105,10 @@ static struct pci_device_id pciidlist[] = {
 
 #define DRM_PSB_KMS_OFF_IOCTL	DRM_IO(DRM_PSB_KMS_OFF)
 #define DRM_PSB_KMS_ON_IOCTL	DRM_IO(DRM_PSB_KMS_ON)
+#define DRM_PSB_CMDBUF_BATCH_IOCTL DRM_IOWR(DRM_PSB_CMDBUF_BATCH, \
+					    struct drm_psb_cmdbuf_batch_arg)
+#define DRM_PSB_BUFSET_IOCTL    DRM_IOWR(DRM_PSB_BUFSET, \
+					 struct drm_psb_bufset_arg)
 
 static struct drm_ioctl_desc psb_ioctls[] = {
 	DRM_IOCTL_DEF(DRM_PSB_CMDBUF_IOCTL, psb_cmdbuf_ioctl, DRM_AUTH),
@@ -108,6 +121,9 @@ static struct drm_ioctl_desc psb_ioctls[] = {
 		      DRM_ROOT_ONLY),
 	DRM_IOCTL_DEF(DRM_PSB_KMS_ON_IOCTL, psbfb_kms_on_ioctl, DRM_ROOT_ONLY),
 	DRM_IOCTL_DEF(DRM_PSB_HW_INFO_IOCTL, psb_hw_info_ioctl, DRM_AUTH),
+	DRM_IOCTL_DEF(DRM_PSB_CMDBUF_BATCH_IOCTL, psb_cmdbuf_batch_ioctl,
+		      DRM_AUTH),
+	DRM_IOCTL_DEF(DRM_PSB_BUFSET_IOCTL, psb_bufset_ioctl, DRM_AUTH),
 };
 static int psb_max_ioctl = DRM_ARRAY_SIZE(psb_ioctls);
 
@@ -150,15 +166,55 @@ static void psb_lastclose(struct drm_device *dev)
 		return;
 
 	mutex_lock(&dev->struct_mutex);
+	psb_scene_cache_flush_devlocked(dev);
 	if (dev_priv->ta_mem)
 		psb_ta_mem_unref_devlocked(&dev_priv->ta_mem);
 	mutex_unlock(&dev->struct_mutex);
-	mutex_lock(&dev_priv->cmdbuf_mutex);
-	if (dev_priv->buffers) {
-		vfree(dev_priv->buffers);
-		dev_priv->buffers = NULL;
+	psb_validate_ctx_takedown(dev_priv);
+}
+
+static int psb_driver_open(struct drm_device *dev, struct drm_file *file_priv)
+{
+	struct psb_fpriv *fpriv;
+
+	fpriv = drm_calloc(1, sizeof(*fpriv), DRM_MEM_FILES);
+	if (!fpriv)
+		return -ENOMEM;
+
+	fpriv->sched_client = psb_sched_client_alloc();
+	if (!fpriv->sched_client) {
+		drm_free(fpriv, sizeof(*fpriv), DRM_MEM_FILES);
+		return -ENOMEM;
+	}
+
+	mutex_init(&fpriv->bufset_mutex);
+	INIT_LIST_HEAD(&fpriv->bufsets);
+	file_priv->driver_priv = fpriv;
+	return 0;
+}
+
+/*
+ * Drop the buffer references held by the file's buffer sets before
+ * the DRM core releases the file's buffer objects.
+ */
+
+static void psb_driver_preclose(struct drm_device *dev,
+				struct drm_file *file_priv)
+{
+	if (file_priv->driver_priv)
+		psb_bufset_takedown(file_priv);
+}
+
+static void psb_driver_postclose(struct drm_device *dev,
+				 struct drm_file *file_priv)
+{
+	struct psb_fpriv *fpriv = psb_fpriv(file_priv);
+
+	if (fpriv) {
+		psb_sched_client_unref(&fpriv->sched_client);
+		drm_free(fpriv, sizeof(*fpriv), DRM_MEM_FILES);
+		file_priv->driver_priv = NULL;
 	}
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
 }
 
 static void psb_do_takedown(struct drm_device *dev)
@@ -167,6 +223,7 @@ static void psb_do_takedown(struct drm_device *dev)
 	    (struct drm_psb_private *)dev->dev_private;
 
 	mutex_lock(&dev->struct_mutex);
+	psb_scene_cache_flush_devlocked(dev);
 	if (dev->bm.initialized) {
 		if (dev_priv->have_mem_rastgeom) {
 			drm_bo_clean_mm(dev, DRM_PSB_MEM_RASTGEOM);
@@ -267,6 +324,15 @@ static int psb_do_init(struct drm_device *dev)
 
 	dev_priv->ta_mem_pages =
 	    PSB_ALIGN_TO(drm_psb_ta_mem_size * 1024, PAGE_SIZE) >> PAGE_SHIFT;
+	dev_priv->ta_mem_min_pages = dev_priv->ta_mem_pages;
+	dev_priv->ta_mem_max_pages =
+	    PSB_ALIGN_TO(drm_psb_ta_mem_max_size * 1024, PAGE_SIZE) >> PAGE_SHIFT;
+	if (dev_priv->ta_mem_max_pages >
+	    (PSB_MEM_MMU_START - PSB_MEM_RASTGEOM_START) >> PAGE_SHIFT)
+		dev_priv->ta_mem_max_pages =
+		    (PSB_MEM_MMU_START - PSB_MEM_RASTGEOM_START) >> PAGE_SHIFT;
+	if (dev_priv->ta_mem_max_pages < dev_priv->ta_mem_min_pages)
+		dev_priv->ta_mem_max_pages = dev_priv->ta_mem_min_pages;
 	dev_priv->comm_page = alloc_page(GFP_KERNEL);
 	if (!dev_priv->comm_page)
 		goto out_err;
@@ -398,6 +464,7 @@ static int psb_driver_unload(struct drm_device *dev)
 	unregister_cpu_notifier(&psb_nb);
 #endif
 
+	psb_proc_cleanup(dev);
 	intel_modeset_cleanup(dev);
 
 	if (dev_priv) {
@@ -441,6 +508,7 @@ static int psb_driver_unload(struct drm_device *dev)
 			__free_page(dev_priv->scratch_page);
 			dev_priv->scratch_page = NULL;
 		}
+		psb_2d_ring_takedown(dev_priv);
 		psb_takedown_use_base(dev_priv);
 		if (dev_priv->vdc_reg) {
 			iounmap(dev_priv->vdc_reg);
@@ -529,6 +597,7 @@ static int psb_driver_load(struct drm_device *dev, unsigned long chipset)
 	unsigned long resource_start;
 	struct psb_gtt *pg;
 	int ret = -ENOMEM;
+	int i;
 
 	DRM_INFO("psb - %s\n", PSB_PACKAGE_VERSION);
 	dev_priv = drm_calloc(1, sizeof(*dev_priv), DRM_MEM_DRIVER);
@@ -536,10 +605,18 @@ static int psb_driver_load(struct drm_device *dev, unsigned long chipset)
 		return -ENOMEM;
 
 	mutex_init(&dev_priv->temp_mem);
-	mutex_init(&dev_priv->cmdbuf_mutex);
+	for (i = 0; i < PSB_NUM_ENGINES; ++i)
+		mutex_init(&dev_priv->cmdbuf_mutex[i]);
+	spin_lock_init(&dev_priv->validate_ctx_lock);
+	INIT_LIST_HEAD(&dev_priv->validate_ctx_pool);
+	psb_scene_cache_init(&dev_priv->scene_cache,
+			     (drm_psb_scene_cache_size * 1024) >> PAGE_SHIFT);
 	mutex_init(&dev_priv->reset_mutex);
 	psb_init_disallowed();
 
+	INIT_LIST_HEAD(&dev_priv->ta_mem_load_buf.head);
+	atomic_set(&dev_priv->ta_mem_load_buf.done, 1);
+
 	atomic_set(&dev_priv->msvdx_mmu_invaldc, 0);
 
 #ifdef FIX_TG_16
@@ -556,6 +633,8 @@ static int psb_driver_load(struct drm_device *dev, unsigned long chipset)
 
 	DRM_INIT_WAITQUEUE(&dev_priv->rel_mapped_queue);
 	DRM_INIT_WAITQUEUE(&dev_priv->event_2d_queue);
+	if (psb_2d_ring_init(dev_priv))
+		goto out_err;
 
 	dev->dev_private = (void *)dev_priv;
 	dev_priv->chipset = chipset;
@@ -805,6 +884,15 @@ static int psb_resume(struct pci_dev *pdev)
 #endif
 
 	INIT_LIST_HEAD(&dev_priv->resume_buf.head);
+
+	/*
+	 * The parameter memory is loaded again below. Drop a load still
+	 * queued from before suspend rather than reinitializing its
+	 * buffer under the request queue, so its reply can't write the
+	 * cookie that load reads.
+	 */
+
+	psb_ta_mem_load_cancel(dev_priv);
 	dev_priv->msvdx_needs_reset = 1;
 
 	PSB_WVDC32(pg->pge_ctl | _PSB_PGETBL_ENABLED, PSB_PGETBL_CTL);
@@ -897,9 +985,14 @@ static int psb_resume(struct pci_dev *pdev)
 	return 0;
 }
 
-/* always available as we are SIGIO'd */
+/* always available as we are SIGIO'd, unless fence events are used */
 static unsigned int psb_poll(struct file *filp, struct poll_table_struct *wait)
 {
+	struct drm_file *file_priv = (struct drm_file *)filp->private_data;
+
+	if (file_priv->event_enabled)
+		return drm_poll(filp, wait);
+
 	return (POLLIN | POLLRDNORM);
 }
 
@@ -978,6 +1071,9 @@ static struct drm_driver driver = {
 	.fb_remove = psbfb_remove,
 	.firstopen = NULL,
 	.lastclose = psb_lastclose,
+	.open = psb_driver_open,
+	.preclose = psb_driver_preclose,
+	.postclose = psb_driver_postclose,
 	.fops = {
 		 .owner = THIS_MODULE,
 		 .open = drm_open,
@@ -985,6 +1081,7 @@ static struct drm_driver driver = {
 		 .ioctl = drm_ioctl,
 		 .mmap = drm_mmap,
 		 .poll = psb_poll,
+		 .read = drm_read,
 		 .fasync = drm_fasync,
 		 },
 	.pci_driver = {
@@ -1007,19 +1104,44 @@ static struct drm_driver driver = {
 
 static int probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 {
-	return drm_get_dev(pdev, ent, &driver);
+	int ret;
+
+	ret = drm_get_dev(pdev, ent, &driver);
+	if (ret)
+		return ret;
+
+	/*
+	 * The device proc directory doesn't exist until drm_get_dev
+	 * has registered the head, so add our entries here rather than
+	 * in psb_driver_load.
+	 */
+
+	if (!drm_fb_loaded)
+		psb_proc_init(pci_get_drvdata(pdev));
+	return 0;
 }
 
 static int __init psb_init(void)
 {
+	int ret;
+
 	driver.num_ioctls = psb_max_ioctl;
 
-	return drm_init(&driver, pciidlist);
+	ret = psb_task_cache_init();
+	if (ret)
+		return ret;
+
+	ret = drm_init(&driver, pciidlist);
+	if (ret)
+		psb_task_cache_takedown();
+
+	return ret;
 }
 
 static void __exit psb_exit(void)
 {
 	drm_exit(&driver);
+	psb_task_cache_takedown();
 }
 
 module_init(psb_init);
@@ -28,6 +28,7 @@
 #include "psb_drm.h"
 #include "psb_reg.h"
 #include "psb_schedule.h"
+#include "psb_scene.h"
 #include "intel_drv.h"
 
 #ifdef PSB_DETEAR
@@ -94,6 +95,17 @@ enum {
 #define PSB_TT_PRIV0_LIMIT       (256*1024*1024)
 #define PSB_TT_PRIV0_PLIMIT      (PSB_TT_PRIV0_LIMIT >> PAGE_SHIFT)
 #define PSB_NUM_VALIDATE_BUFFERS 1024
+#define PSB_VALIDATE_CHUNK       32
+#define PSB_XHW_RING_MAX_SLOTS   64
+#define PSB_XHW_HIST_BUCKETS     20
+#define PSB_RELOC_SORT_MAX       4096
+#define PSB_RELOC_CHUNK          64
+#define PSB_2D_SPIN_USECS        20
+#define PSB_2D_RING_SIZE         4096
+#define PSB_2D_RING_MASK         (PSB_2D_RING_SIZE - 1)
+#define PSB_2D_RING_RESERVE      2
+#define PSB_2D_BURST             0x60
+#define PSB_2D_TIMEOUT           (3*DRM_HZ)
 #define PSB_MEM_KERNEL_START     0x10000000
 #define PSB_MEM_PDS_START        0x20000000
 #define PSB_MEM_MMU_START        0x40000000
@@ -221,6 +233,15 @@ enum {
 #define PSB_NUM_VBLANKS 2
 #define PSB_WATCHDOG_DELAY (DRM_HZ / 10)
 
+/*
+ * Kernel-internal fence flag, never accepted from user-space.
+ * Set on all but the last entry of a batched submission. The entry's
+ * buffers and use registers are left unfenced and are fenced together
+ * with the last entry of the batch.
+ */
+
+#define PSB_FENCE_FLAG_DEFERRED 0x80000000
+
 /*
  * User options.
  */
@@ -253,8 +274,103 @@ struct psb_use_base {
 	unsigned int dm;
 };
 
+/*
+ * Kernel 2D command ring, drained into the 2D slave port.
+ * See psb_sgx.c.
+ */
+
+struct psb_2d_ring {
+	uint32_t *buf;
+	uint32_t head;
+	uint32_t tail;
+	spinlock_t lock;
+	int irq_on;
+};
+
+/*
+ * Register offsets of recently checked TA and rasterizer streams.
+ * See psb_check_regs() in psb_sgx.c.
+ */
+
+#define PSB_REG_CACHE_SLOTS 8
+#define PSB_REG_CACHE_REGS  32
+
+struct psb_reg_cache_entry {
+	uint32_t num_regs;
+	uint32_t regs[PSB_REG_CACHE_REGS];
+};
+
+struct psb_reg_cache {
+	struct psb_reg_cache_entry entries[PSB_REG_CACHE_SLOTS];
+};
+
 struct psb_buflist_item;
 
+/*
+ * Validation state of a single submission. Contexts are pooled in
+ * dev_priv->validate_ctx_pool, so the large arrays are only allocated
+ * when more submissions than ever before run concurrently.
+ *
+ * Buffers validated for the submission are moved from the device-wide
+ * unfenced list to the context's own, so that concurrent submissions
+ * fence and put back only their own buffers.
+ */
+
+struct psb_validate_ctx {
+	struct list_head head;
+	struct list_head unfenced;
+	struct psb_buflist_item *buffers;
+	struct drm_bo_op_arg *validate_args;
+	uint64_t *reloc_keys;
+	uint64_t __user *set_offsets;
+	unsigned sched_reserved;
+	int sched_priority;
+	int sched_ordered;
+};
+
+/*
+ * Persistent buffer set, see struct drm_psb_bufset_arg. The file's
+ * list holds one reference, and each submission using the set another.
+ */
+
+struct psb_bufset_entry {
+	struct drm_buffer_object *bo;
+	uint64_t flags;
+	uint64_t mask;
+	uint32_t hint;
+};
+
+struct psb_bufset {
+	struct list_head head;
+	atomic_t usage;
+	uint32_t handle;
+	unsigned int num_entries;
+	struct psb_bufset_entry *entries;
+};
+
+/*
+ * Per-file driver private, hung off drm_file::driver_priv.
+ */
+
+struct psb_fpriv {
+	struct mutex bufset_mutex;
+	struct list_head bufsets;
+	uint32_t bufset_seq;
+	struct psb_sched_client *sched_client;
+};
+
+#define psb_fpriv(_file_priv) \
+	((struct psb_fpriv *)(_file_priv)->driver_priv)
+
+/*
+ * Engine class for submission locking. Rasterizer submissions use
+ * the TA lock.
+ */
+
+#define psb_engine_class(_engine) \
+	((((_engine) == PSB_ENGINE_RASTERIZER) || \
+	  ((_engine) == PSB_ENGINE_HPRAST)) ? PSB_ENGINE_TA : (_engine))
+
 struct psb_msvdx_cmd_queue {
 	struct list_head head;
 	void *cmd;
@@ -314,6 +430,7 @@ struct drm_psb_private {
 	int irq_enabled;
 	unsigned int irqen_count_2d;
 	wait_queue_head_t event_2d_queue;
+	struct psb_2d_ring ring_2d;
 
 #ifdef FIX_TG_16
 	wait_queue_head_t queue_2d;
@@ -362,6 +479,31 @@ struct drm_psb_private {
 	unsigned int rel_mapped_pages;
 	wait_queue_head_t rel_mapped_queue;
 
+	/*
+	 * Relocation statistics, reported through psb_proc.c.
+	 */
+
+	atomic_t reloc_count;
+	atomic_t reloc_kmaps;
+	atomic_t reloc_kmaps_saved;
+	atomic_t reloc_sorted;
+
+	/*
+	 * 2D ring space wait statistics. Protected by the 2D lock.
+	 */
+
+	uint32_t twod_spin_waits;
+	uint32_t twod_sleep_waits;
+	uint32_t twod_timeouts;
+	uint64_t twod_spin_usecs;
+	uint64_t twod_sleep_usecs;
+
+	/*
+	 * Proc entries.
+	 */
+
+	int proc_initialized;
+
 	/*
 	 * SAREA
 	 */
@@ -456,17 +598,65 @@ struct drm_psb_private {
 	int xhw_submit_ok;
 	int xhw_on;
 
+	/*
+	 * Xhw request ring, if the X server set one up. The head and
+	 * the buffers awaiting replies are kept here, since the ring
+	 * itself is writable by the X server. Protected by the xhw_lock.
+	 */
+
+	struct drm_psb_xhw_ring *xhw_ring;
+	uint32_t xhw_ring_mask;
+	uint32_t xhw_ring_head;
+	uint32_t xhw_ring_reaped;
+	struct psb_xhw_buf *xhw_ring_bufs[PSB_XHW_RING_MAX_SLOTS];
+
+	/*
+	 * Xhw round trip statistics. Bucket n of the histogram counts
+	 * replies that took from 2^(n-1) up to 2^n - 1 microseconds.
+	 * The time callers slept in synchronous calls is protected by
+	 * the xhw_lock.
+	 */
+
+	atomic_t xhw_hist[PSB_XHW_HIST_BUCKETS];
+	uint32_t xhw_sync_calls;
+	uint64_t xhw_sync_ns;
+
 	/*
 	 * Scheduling.
 	 */
 
 	struct mutex reset_mutex;
-	struct mutex cmdbuf_mutex;
+
+	/*
+	 * Submission locks, indexed by psb_engine_class().
+	 * See psb_engine_lock() for the lock ordering.
+	 */
+
+	struct mutex cmdbuf_mutex[PSB_NUM_ENGINES];
+	struct psb_reg_cache reg_cache;
 	struct psb_scheduler scheduler;
-        struct psb_buflist_item *buffers;
+	spinlock_t validate_ctx_lock;
+	struct list_head validate_ctx_pool;
 	uint32_t ta_mem_pages;
 	struct psb_ta_mem *ta_mem;
 	int force_ta_mem_load;
+	struct psb_xhw_buf ta_mem_load_buf;
+
+	/*
+	 * Parameter memory sizing, see psb_ta_mem_adapt().
+	 */
+
+	uint32_t ta_mem_min_pages;
+	uint32_t ta_mem_max_pages;
+	uint32_t ta_mem_target_pages;
+	atomic_t ta_mem_ooms;
+	uint32_t ta_mem_window_base;
+	uint32_t ta_mem_window_scenes;
+	uint32_t ta_mem_quiet_windows;
+	uint32_t ta_mem_peak_ooms;
+	uint32_t ta_mem_grows;
+	uint32_t ta_mem_shrinks;
+	struct psb_scene_cache scene_cache;
 
 	/*
 	 * Watchdog
@@ -545,6 +735,14 @@ extern int psb_blit_sequence(struct drm_psb_private *dev_priv,
 			     uint32_t sequence);
 extern void psb_init_2d(struct drm_psb_private *dev_priv);
 extern int psb_idle_2d(struct drm_device *dev);
+extern int psb_2d_ring_init(struct drm_psb_private *dev_priv);
+extern void psb_2d_ring_takedown(struct drm_psb_private *dev_priv);
+extern uint32_t psb_2d_ring_space(struct drm_psb_private *dev_priv);
+extern int psb_2d_ring_empty(struct drm_psb_private *dev_priv);
+extern void psb_2d_ring_write(struct drm_psb_private *dev_priv,
+			      const uint32_t *cmds, unsigned count);
+extern void psb_2d_ring_drain(struct drm_psb_private *dev_priv);
+extern void psb_2d_ring_reset(struct drm_psb_private *dev_priv);
 extern int psb_idle_3d(struct drm_device *dev);
 extern int psb_emit_2d_copy_blit(struct drm_device *dev,
 				 uint32_t src_offset,
@@ -552,6 +750,8 @@ extern int psb_emit_2d_copy_blit(struct drm_device *dev,
 				 int direction);
 extern int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 			    struct drm_file *file_priv);
+extern int psb_cmdbuf_batch_ioctl(struct drm_device *dev, void *data,
+				  struct drm_file *file_priv);
 extern int psb_reg_submit(struct drm_psb_private *dev_priv, uint32_t * regs,
 			  unsigned int cmds);
 extern int psb_submit_copy_cmdbuf(struct drm_device *dev,
@@ -559,8 +759,10 @@ extern int psb_submit_copy_cmdbuf(struct drm_device *dev,
 				  unsigned long cmd_offset,
 				  unsigned long cmd_size, int engine,
 				  uint32_t * copy_buffer);
+extern void psb_validate_ctx_takedown(struct drm_psb_private *dev_priv);
 extern void psb_fence_or_sync(struct drm_file *priv,
 			      int engine,
+			      struct psb_validate_ctx *ctx,
 			      struct drm_psb_cmdbuf_arg *arg,
 			      struct drm_fence_arg *fence_arg,
 			      struct drm_fence_object **fence_p);
@@ -668,6 +870,32 @@ extern int psb_grab_use_base(struct drm_psb_private *dev_priv,
 extern int psb_init_use_base(struct drm_psb_private *dev_priv,
 			     unsigned int reg_start, unsigned int reg_num);
 
+/*
+ * psb_bufset.c
+ */
+
+extern int psb_bufset_ioctl(struct drm_device *dev, void *data,
+			    struct drm_file *file_priv);
+extern struct psb_bufset *psb_bufset_lookup(struct drm_file *file_priv,
+					    uint32_t handle);
+extern void psb_bufset_unref(struct psb_bufset **set);
+extern void psb_bufset_takedown(struct drm_file *file_priv);
+
+/*
+ * psb_proc.c
+ */
+
+extern void psb_proc_init(struct drm_device *dev);
+extern void psb_proc_cleanup(struct drm_device *dev);
+
+/*
+ * psb_trace.c
+ */
+
+extern const struct file_operations psb_trace_fops;
+extern int psb_trace_info(char *buf, char **start, off_t offset,
+			  int request, int *eof, void *data);
+
 /*
  * psb_xhw.c
  */
@@ -727,6 +955,15 @@ extern int psb_xhw_ta_mem_load(struct drm_psb_private *dev_priv,
 			       uint32_t flags,
 			       uint32_t param_offset,
 			       uint32_t pt_offset, uint32_t * hw_cookie);
+extern int psb_xhw_ta_mem_load_async(struct drm_psb_private *dev_priv,
+				     struct psb_xhw_buf *buf,
+				     uint32_t flags,
+				     uint32_t param_offset,
+				     uint32_t pt_offset, uint32_t * hw_cookie,
+				     void (*complete) (struct drm_psb_private *,
+						       struct psb_xhw_buf *));
+extern int psb_xhw_wait(struct drm_psb_private *dev_priv,
+			struct psb_xhw_buf *buf, unsigned long timeout);
 extern void psb_xhw_clean_buf(struct drm_psb_private *dev_priv,
 			      struct psb_xhw_buf *buf);
 
@@ -786,6 +1023,7 @@ extern int drm_psb_debug;
 extern int drm_psb_no_fb;
 extern int drm_psb_disable_vsync;
 extern int drm_psb_detear;
+extern int drm_psb_pipeline;
 
 #define PSB_DEBUG_FW(_fmt, _arg...) \
 	PSB_DEBUG(PSB_D_FW, _fmt, ##_arg)
@@ -485,7 +485,8 @@ static int psbfb_set_par(struct fb_info *info)
 	return 0;
 }
 
-extern int psb_2d_submit(struct drm_psb_private *, uint32_t *, uint32_t);;
+extern int psb_2d_submit(struct drm_psb_private *, uint32_t *, uint32_t,
+			 int);
 
 static int psb_accel_2d_fillrect(struct drm_psb_private *dev_priv,
 				 uint32_t dst_offset, uint32_t dst_stride,
@@ -523,7 +524,7 @@ static int psb_accel_2d_fillrect(struct drm_psb_private *dev_priv,
 	*buf++ = PSB_2D_FLUSH_BH;
 
 	psb_2d_lock(dev_priv);
-	ret = psb_2d_submit(dev_priv, buffer, buf - buffer);
+	ret = psb_2d_submit(dev_priv, buffer, buf - buffer, 0);
 	psb_2d_unlock(dev_priv);
 
 	return ret;
@@ -671,7 +672,7 @@ static int psb_accel_2d_copy(struct drm_psb_private *dev_priv,
 	*buf++ = PSB_2D_FLUSH_BH;
 
 	psb_2d_lock(dev_priv);
-	ret = psb_2d_submit(dev_priv, buffer, buf - buffer);
+	ret = psb_2d_submit(dev_priv, buffer, buf - buffer, 0);
 	psb_2d_unlock(dev_priv);
 	return ret;
 }
@@ -35,6 +35,7 @@ static void psb_poll_ta(struct drm_device *dev, uint32_t waiting_types)
 	uint32_t flags = 0;
 	uint32_t sequence = 0;
 	uint32_t remaining = 0xFFFFFFFF;
+	uint32_t completed;
 	uint32_t diff;
 
 	struct psb_scheduler *scheduler;
@@ -48,17 +49,26 @@ static void psb_poll_ta(struct drm_device *dev, uint32_t waiting_types)
 	scheduler = &dev_priv->scheduler;
 	seq = scheduler->seq;
 
+	/*
+	 * The scheduler latches completed sequences without taking the
+	 * fence manager lock. Each one is read once, and compared with
+	 * the last one reported rather than cleared, so a sequence
+	 * latched while we poll is never lost.
+	 */
+
 	while (likely(waiting_types & remaining)) {
 		if (!(waiting_types & cur_flag))
 			goto skip;
-		if (seq->reported)
+		completed = seq->sequence;
+		barrier();
+		if (completed == seq->reported)
 			goto skip;
 		if (flags == 0)
-			sequence = seq->sequence;
-		else if (sequence != seq->sequence) {
+			sequence = completed;
+		else if (sequence != completed) {
 			drm_fence_handler(dev, PSB_ENGINE_TA,
 					  sequence, flags, 0);
-			sequence = seq->sequence;
+			sequence = completed;
 			flags = 0;
 		}
 		flags |= cur_flag;
@@ -72,7 +82,7 @@ static void psb_poll_ta(struct drm_device *dev, uint32_t waiting_types)
 		diff = (fc->latest_queued_sequence - sequence) &
 		    driver->sequence_mask;
 		if (diff < driver->wrap_diff)
-			seq->reported = 1;
+			seq->reported = sequence;
 
 	      skip:
 		cur_flag <<= 1;
@@ -224,6 +234,7 @@ void psb_fence_handler(struct drm_device *dev, uint32_t fence_class)
 {
 	struct drm_fence_manager *fm = &dev->fm;
 	struct drm_fence_class_manager *fc = &fm->fence_class[fence_class];
+	unsigned long irq_flags;
 
 #ifdef FIX_TG_16
 	if (fence_class == 0) {
@@ -231,15 +242,22 @@ void psb_fence_handler(struct drm_device *dev, uint32_t fence_class)
 		    (struct drm_psb_private *)dev->dev_private;
 
 		if ((atomic_read(&dev_priv->ta_wait_2d_irq) == 1) &&
+		    psb_2d_ring_empty(dev_priv) &&
 		    (PSB_RSGX32(PSB_CR_2D_SOCIF) == _PSB_C2_SOCIF_EMPTY) &&
 		    ((PSB_RSGX32(PSB_CR_2D_BLIT_STATUS) &
 		      _PSB_C2B_STATUS_BUSY) == 0))
 			psb_resume_ta_2d_idle(dev_priv);
 	}
 #endif
-	write_lock(&fm->lock);
+	write_lock_irqsave(&fm->lock, irq_flags);
 	psb_fence_poll(dev, fence_class, fc->waiting_types);
-	write_unlock(&fm->lock);
+	write_unlock_irqrestore(&fm->lock, irq_flags);
+}
+
+static unsigned long psb_fence_wait_timeout(struct drm_device *dev,
+					    uint32_t fence_class)
+{
+	return DRM_HZ * ((fence_class == PSB_ENGINE_TA) ? 30 : 3);
 }
 
 static int psb_fence_wait(struct drm_fence_object *fence,
@@ -249,8 +267,8 @@ static int psb_fence_wait(struct drm_fence_object *fence,
 	struct drm_fence_class_manager *fc =
 	    &dev->fm.fence_class[fence->fence_class];
 	int ret = 0;
-	unsigned long timeout = DRM_HZ *
-	    ((fence->fence_class == PSB_ENGINE_TA) ? 30 : 3);
+	unsigned long timeout = psb_fence_wait_timeout(dev,
+						       fence->fence_class);
 
 	drm_fence_object_flush(fence, mask);
 	if (interruptible)
@@ -281,5 +299,6 @@ struct drm_fence_driver psb_fence_driver = {
 	.flush = NULL,
 	.poll = psb_fence_poll,
 	.needed_flush = NULL,
-	.wait = psb_fence_wait
+	.wait = psb_fence_wait,
+	.wait_timeout = psb_fence_wait_timeout
 };
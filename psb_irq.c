@@ -112,6 +112,7 @@ static void psb_sgx_interrupt(struct drm_device *dev, uint32_t sgx_stat,
 	    (struct drm_psb_private *)dev->dev_private;
 
 	if (sgx_stat & _PSB_CE_TWOD_COMPLETE) {
+		psb_2d_ring_drain(dev_priv);
 		DRM_WAKEUP(&dev_priv->event_2d_queue);
 		psb_fence_handler(dev, 0);
 	}
@@ -199,7 +200,10 @@ irqreturn_t psb_irq_handler(DRM_IRQ_ARGS)
 #ifdef PSB_DETEAR
 		if(psb_blit_info.cmd_ready) {
 			psb_blit_info.cmd_ready = 0;
+			/* don't split a 2D ring burst */
+			spin_lock(&dev_priv->ring_2d.lock);
 			psb_blit_2d_reg_write(dev_priv, psb_blit_info.cmdbuf);
+			spin_unlock(&dev_priv->ring_2d.lock);
 			/* to resume the blocked psb_cmdbuf_2d() */
 			set_bit(0, &psb_blit_info.vdc_bit);
 		}
@@ -335,6 +339,8 @@ void psb_irq_uninstall(struct drm_device *dev)
 	dev_priv->irq_enabled = 0;
 	spin_unlock_irqrestore(&dev_priv->irqmask_lock, irqflags);
 
+	tasklet_kill(&dev_priv->scheduler.tasklet);
+
 }
 
 void psb_2D_irq_off(struct drm_psb_private *dev_priv)
@@ -0,0 +1,391 @@
+/**************************************************************************
+ * Copyright (c) 2007, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ **************************************************************************/
+/*
+ * Driver statistics in "/proc/dri/%minor%/", next to the DRM core entries.
+ */
+
+#include "drmP.h"
+#include "psb_drv.h"
+#include <asm/div64.h>
+
+static int psb_reloc_info(char *buf, char **start, off_t offset,
+			  int request, int *eof, void *data);
+static int psb_2d_info(char *buf, char **start, off_t offset,
+		       int request, int *eof, void *data);
+static int psb_deadline_info(char *buf, char **start, off_t offset,
+			     int request, int *eof, void *data);
+static int psb_scene_info(char *buf, char **start, off_t offset,
+			  int request, int *eof, void *data);
+static int psb_ta_mem_info(char *buf, char **start, off_t offset,
+			   int request, int *eof, void *data);
+static int psb_pipeline_info(char *buf, char **start, off_t offset,
+			     int request, int *eof, void *data);
+static int psb_xhw_info(char *buf, char **start, off_t offset,
+			int request, int *eof, void *data);
+
+/*
+ * Entries with file operations are used for binary or writable files.
+ */
+
+static struct psb_proc_list {
+	const char *name;
+	int (*f) (char *, char **, off_t, int, int *, void *);
+	const struct file_operations *fops;
+} psb_proc_list[] = {
+	{"psb_reloc", psb_reloc_info, NULL},
+	{"psb_2d", psb_2d_info, NULL},
+	{"psb_deadline", psb_deadline_info, NULL},
+	{"psb_scene", psb_scene_info, NULL},
+	{"psb_ta_mem", psb_ta_mem_info, NULL},
+	{"psb_pipeline", psb_pipeline_info, NULL},
+	{"psb_xhw", psb_xhw_info, NULL},
+	{"psb_trace", NULL, &psb_trace_fops},
+	{"psb_trace_stats", psb_trace_info, NULL},
+};
+
+#define PSB_PROC_ENTRIES ARRAY_SIZE(psb_proc_list)
+
+/*
+ * Called after the DRM core has created the device proc directory.
+ * Failure to create an entry is not fatal; statistics are optional.
+ */
+
+void psb_proc_init(struct drm_device *dev)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct proc_dir_entry *root = dev->primary.dev_root;
+	struct proc_dir_entry *ent;
+	int i;
+
+	if (!dev_priv || !root)
+		return;
+
+	for (i = 0; i < PSB_PROC_ENTRIES; i++) {
+		ent = create_proc_entry(psb_proc_list[i].name,
+					(psb_proc_list[i].fops) ?
+					S_IFREG | S_IRUSR | S_IWUSR :
+					S_IFREG | S_IRUGO, root);
+		if (!ent) {
+			DRM_ERROR("Cannot create /proc/dri/%d/%s\n",
+				  dev->primary.minor, psb_proc_list[i].name);
+			while (i--)
+				remove_proc_entry(psb_proc_list[i].name, root);
+			return;
+		}
+		if (psb_proc_list[i].fops)
+			ent->proc_fops = psb_proc_list[i].fops;
+		else
+			ent->read_proc = psb_proc_list[i].f;
+		ent->data = dev;
+	}
+	dev_priv->proc_initialized = 1;
+}
+
+void psb_proc_cleanup(struct drm_device *dev)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	int i;
+
+	if (!dev_priv || !dev_priv->proc_initialized)
+		return;
+
+	for (i = 0; i < PSB_PROC_ENTRIES; i++)
+		remove_proc_entry(psb_proc_list[i].name,
+				  dev->primary.dev_root);
+	dev_priv->proc_initialized = 0;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_reloc" is read.
+ */
+
+static int psb_reloc_info(char *buf, char **start, off_t offset,
+			  int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	DRM_PROC_PRINT("relocations applied:     %u\n",
+		       atomic_read(&dev_priv->reloc_count));
+	DRM_PROC_PRINT("destination page kmaps:  %u\n",
+		       atomic_read(&dev_priv->reloc_kmaps));
+	DRM_PROC_PRINT("kmaps saved by sorting:  %u\n",
+		       atomic_read(&dev_priv->reloc_kmaps_saved));
+	DRM_PROC_PRINT("sorted submissions:      %u\n",
+		       atomic_read(&dev_priv->reloc_sorted));
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_2d" is read.
+ */
+
+static int psb_2d_info(char *buf, char **start, off_t offset,
+		       int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	DRM_PROC_PRINT("ring space spin waits:   %u\n",
+		       dev_priv->twod_spin_waits);
+	DRM_PROC_PRINT("spin time (us):          %llu\n",
+		       (unsigned long long)dev_priv->twod_spin_usecs);
+	DRM_PROC_PRINT("ring space sleep waits:  %u\n",
+		       dev_priv->twod_sleep_waits);
+	DRM_PROC_PRINT("sleep time (us):         %llu\n",
+		       (unsigned long long)dev_priv->twod_sleep_usecs);
+	DRM_PROC_PRINT("ring space timeouts:     %u\n",
+		       dev_priv->twod_timeouts);
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_deadline" is read.
+ */
+
+static int psb_deadline_info(char *buf, char **start, off_t offset,
+			     int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	uint64_t max_late;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	max_late = scheduler->deadline_max_late_ns;
+	do_div(max_late, 1000);
+
+	DRM_PROC_PRINT("deadlines met:           %u\n",
+		       scheduler->deadline_met);
+	DRM_PROC_PRINT("deadlines missed:        %u\n",
+		       scheduler->deadline_missed);
+	DRM_PROC_PRINT("worst lateness (us):     %llu\n",
+		       (unsigned long long)max_late);
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_scene" is read.
+ */
+
+static int psb_scene_info(char *buf, char **start, off_t offset,
+			  int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scene_cache *cache = &dev_priv->scene_cache;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	DRM_PROC_PRINT("cached scene pages:      %u of %u\n",
+		       cache->pages, cache->max_pages);
+	DRM_PROC_PRINT("scene cache hits:        %u\n", cache->hits);
+	DRM_PROC_PRINT("scene cache misses:      %u\n", cache->misses);
+	DRM_PROC_PRINT("scene cache evictions:   %u\n", cache->evictions);
+	DRM_PROC_PRINT("scene info hits:         %u\n", cache->info_hits);
+	DRM_PROC_PRINT("scene info misses:       %u\n", cache->info_misses);
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_ta_mem" is read.
+ */
+
+static int psb_ta_mem_info(char *buf, char **start, off_t offset,
+			   int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	DRM_PROC_PRINT("parameter memory (kiB):  %lu\n",
+		       (unsigned long)dev_priv->ta_mem_pages *
+		       (PAGE_SIZE / 1024));
+	DRM_PROC_PRINT("limits (kiB):            %lu - %lu\n",
+		       (unsigned long)dev_priv->ta_mem_min_pages *
+		       (PAGE_SIZE / 1024),
+		       (unsigned long)dev_priv->ta_mem_max_pages *
+		       (PAGE_SIZE / 1024));
+	DRM_PROC_PRINT("out of memory events:    %u\n",
+		       atomic_read(&dev_priv->ta_mem_ooms));
+	DRM_PROC_PRINT("peak events per window:  %u\n",
+		       dev_priv->ta_mem_peak_ooms);
+	DRM_PROC_PRINT("grown:                   %u\n",
+		       dev_priv->ta_mem_grows);
+	DRM_PROC_PRINT("shrunk:                  %u\n",
+		       dev_priv->ta_mem_shrinks);
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_pipeline" is read.
+ */
+
+static int psb_pipeline_info(char *buf, char **start, off_t offset,
+			     int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	uint64_t overlap;
+	int len = 0;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	overlap = scheduler->overlap_ns;
+	do_div(overlap, 1000);
+
+	DRM_PROC_PRINT("pipelining:              %s\n",
+		       (drm_psb_pipeline) ? "on" : "off");
+	DRM_PROC_PRINT("overlap (us):            %llu\n",
+		       (unsigned long long)overlap);
+	DRM_PROC_PRINT("pipelined rasters:       %u\n",
+		       scheduler->pipelined_rasters);
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
+
+/*
+ * Called when "/proc/dri/.../psb_xhw" is read. Bucket n counts X server
+ * round trips that took from 2^(n-1) up to 2^n - 1 microseconds, the
+ * last bucket anything longer.
+ */
+
+static int psb_xhw_info(char *buf, char **start, off_t offset,
+			int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	unsigned long irq_flags;
+	uint64_t sync_us;
+	uint32_t sync_calls;
+	int len = 0;
+	int i;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+	sync_calls = dev_priv->xhw_sync_calls;
+	sync_us = dev_priv->xhw_sync_ns;
+	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+	do_div(sync_us, 1000);
+
+	DRM_PROC_PRINT("synchronous calls:       %u\n", sync_calls);
+	DRM_PROC_PRINT("time waited (us):        %llu\n",
+		       (unsigned long long)sync_us);
+
+	DRM_PROC_PRINT("\nround trips (log2 us):\n");
+	for (i = 0; i < PSB_XHW_HIST_BUCKETS; ++i)
+		DRM_PROC_PRINT("%s%u", (i) ? " " : "",
+			       atomic_read(&dev_priv->xhw_hist[i]));
+	DRM_PROC_PRINT("\n");
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
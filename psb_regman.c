@@ -137,7 +137,7 @@ int psb_init_use_base(struct drm_psb_private *dev_priv,
 	int i;
 	int ret = 0;
 
-	mutex_lock(&dev_priv->cmdbuf_mutex);
+	mutex_lock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
 
 	drm_regs_init(&dev_priv->use_manager,
 		      &psb_use_reg_reusable, &psb_use_reg_destroy);
@@ -161,7 +161,7 @@ int psb_init_use_base(struct drm_psb_private *dev_priv,
 		drm_regs_add(&dev_priv->use_manager, &use_reg->reg);
 	}
       out:
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
+	mutex_unlock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
 
 	return ret;
 
@@ -169,7 +169,7 @@ int psb_init_use_base(struct drm_psb_private *dev_priv,
 
 void psb_takedown_use_base(struct drm_psb_private *dev_priv)
 {
-	mutex_lock(&dev_priv->cmdbuf_mutex);
+	mutex_lock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
 	drm_regs_free(&dev_priv->use_manager);
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
+	mutex_unlock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
 }
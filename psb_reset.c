@@ -61,6 +61,9 @@ void psb_reset(struct drm_psb_private *dev_priv, int reset_2d)
 	PSB_WSGX32(PSB_RSGX32(PSB_CR_BIF_CTRL) & ~_PSB_CB_CTRL_CLEAR_FAULT,
 		   PSB_CR_BIF_CTRL);
 	(void)PSB_RSGX32(PSB_CR_BIF_CTRL);
+
+	if (reset_2d)
+		psb_2d_ring_reset(dev_priv);
 }
 
 void psb_print_pagefault(struct drm_psb_private *dev_priv)
@@ -159,7 +162,8 @@ static void psb_watchdog_func(unsigned long data)
 	psb_seq_lockup_idle(dev_priv, PSB_ENGINE_2D, &lockup_2d, &idle_2d);
 #else
 	lockup_2d = FALSE;
-	idle_2d = TRUE;
+	psb_2d_ring_drain(dev_priv);
+	idle_2d = psb_2d_ring_empty(dev_priv);
 #endif
 	if (lockup || msvdx_lockup || lockup_2d) {
 		spin_lock_irqsave(&dev_priv->watchdog_lock, irq_flags);
@@ -311,6 +315,13 @@ static void psb_reset_wq(struct work_struct *work)
 	psb_scheduler_reset(dev_priv, -EBUSY);
 	psb_scheduler_ta_mem_check(dev_priv);
 
+	/*
+	 * The reply to a pending asynchronous load copies into
+	 * ta_mem->hw_cookie, which the loads below read.
+	 */
+
+	(void)psb_ta_mem_load_wait(dev_priv);
+
 	while (dev_priv->ta_mem &&
 	       !dev_priv->force_ta_mem_load && ++reset_count < 10) {
 
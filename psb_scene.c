@@ -81,6 +81,212 @@ static void psb_destroy_scene_devlocked(struct psb_scene *scene)
 	drm_free(scene, sizeof(*scene), DRM_MEM_DRIVER);
 }
 
+/*
+ * Scenes whose last reference goes away are kept on a device-wide
+ * LRU list, so that a pool changing size, or a new pool, can pick up
+ * an idle scene of the right dimensions instead of asking the X server
+ * for the scene info and allocating new scene memory.
+ */
+
+void psb_scene_cache_init(struct psb_scene_cache *cache, uint32_t max_pages)
+{
+	memset(cache, 0, sizeof(*cache));
+	INIT_LIST_HEAD(&cache->lru);
+	cache->max_pages = max_pages;
+}
+
+static void psb_scene_cache_put_devlocked(struct psb_scene *scene)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)scene->dev->dev_private;
+	struct psb_scene_cache *cache = &dev_priv->scene_cache;
+	struct psb_scene *evict;
+
+	/*
+	 * A scene that was never rasterized still holds hw state.
+	 */
+
+	if ((scene->flags & PSB_SCENE_FLAG_DIRTY) ||
+	    scene->hw_data->num_pages > cache->max_pages) {
+		psb_destroy_scene_devlocked(scene);
+		return;
+	}
+
+	list_add_tail(&scene->cache_head, &cache->lru);
+	cache->pages += scene->hw_data->num_pages;
+
+	while (cache->pages > cache->max_pages) {
+		evict = list_entry(cache->lru.next, struct psb_scene,
+				   cache_head);
+		list_del(&evict->cache_head);
+		cache->pages -= evict->hw_data->num_pages;
+		cache->evictions++;
+		psb_destroy_scene_devlocked(evict);
+	}
+}
+
+static struct psb_scene *psb_scene_cache_get_devlocked(struct drm_device *dev,
+						       uint32_t w, uint32_t h)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scene_cache *cache = &dev_priv->scene_cache;
+	struct psb_scene *scene;
+
+	list_for_each_entry_reverse(scene, &cache->lru, cache_head) {
+		if (scene->w != w || scene->h != h)
+			continue;
+
+		list_del_init(&scene->cache_head);
+		cache->pages -= scene->hw_data->num_pages;
+		cache->hits++;
+
+		/*
+		 * Unless the clear worker got to it, the scene memory is
+		 * cleared at validation, once the last rendering using
+		 * it is idle.
+		 */
+
+		scene->flags &= PSB_SCENE_FLAG_CLEARED;
+		scene->hw_scene = NULL;
+		atomic_set(&scene->ref_count, 1);
+		return scene;
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+void psb_scene_cache_flush_devlocked(struct drm_device *dev)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scene_cache *cache = &dev_priv->scene_cache;
+	struct psb_scene *scene, *next;
+
+	DRM_ASSERT_LOCKED(&dev->struct_mutex);
+	list_for_each_entry_safe(scene, next, &cache->lru, cache_head) {
+		list_del(&scene->cache_head);
+		psb_destroy_scene_devlocked(scene);
+	}
+	cache->pages = 0;
+	memset(cache->info, 0, sizeof(cache->info));
+}
+
+/*
+ * The scene info reply only depends on the scene dimensions, so the
+ * last few replies are kept to avoid the X server round trip.
+ */
+
+static int psb_scene_info_lookup_devlocked(struct psb_scene_cache *cache,
+					   struct psb_scene *scene,
+					   uint32_t * bo_size)
+{
+	struct psb_scene_info *info;
+	int i;
+
+	for (i = 0; i < PSB_SCENE_INFO_CACHE_SIZE; ++i) {
+		info = &cache->info[i];
+		if (!info->stamp || info->w != scene->w || info->h != scene->h)
+			continue;
+
+		memcpy(scene->hw_cookie, info->hw_cookie,
+		       sizeof(scene->hw_cookie));
+		*bo_size = info->bo_size;
+		scene->clear_p_start = info->clear_p_start;
+		scene->clear_num_pages = info->clear_num_pages;
+		info->stamp = ++cache->info_stamp;
+		cache->info_hits++;
+		return 0;
+	}
+
+	cache->info_misses++;
+	return -ENOENT;
+}
+
+static void psb_scene_info_insert_devlocked(struct psb_scene_cache *cache,
+					    struct psb_scene *scene,
+					    uint32_t bo_size)
+{
+	struct psb_scene_info *info = &cache->info[0];
+	int i;
+
+	for (i = 1; i < PSB_SCENE_INFO_CACHE_SIZE; ++i) {
+		if (!info->stamp)
+			break;
+		if (!cache->info[i].stamp ||
+		    (int32_t) (cache->info[i].stamp - info->stamp) < 0)
+			info = &cache->info[i];
+	}
+
+	info->w = scene->w;
+	info->h = scene->h;
+	memcpy(info->hw_cookie, scene->hw_cookie, sizeof(info->hw_cookie));
+	info->bo_size = bo_size;
+	info->clear_p_start = scene->clear_p_start;
+	info->clear_num_pages = scene->clear_num_pages;
+	info->stamp = ++cache->info_stamp;
+}
+
+/*
+ * Call with the scheduler spinlock held, when rasterization of a scene
+ * has completed. Unless another submission is already using the scene,
+ * hand it to the clear worker, so that the next validation finds it
+ * cleared. The references are those of the pool and the completed task.
+ */
+
+void psb_scene_queue_clear(struct psb_scheduler *scheduler,
+			   struct psb_scene *scene)
+{
+	if (scene->clear_state != PSB_SCENE_CLEAR_IDLE ||
+	    (scene->flags & PSB_SCENE_FLAG_CLEARED) ||
+	    atomic_read(&scene->ref_count) > 2)
+		return;
+
+	scene->clear_state = PSB_SCENE_CLEAR_QUEUED;
+	list_add_tail(&scene->clear_head, &scheduler->scene_clear_queue);
+	(void)psb_scene_ref(scene);
+	schedule_work(&scheduler->scene_clear_wq);
+}
+
+void psb_scene_clear_wq(struct work_struct *work)
+{
+	struct psb_scheduler *scheduler =
+	    container_of(work, struct psb_scheduler, scene_clear_wq);
+	struct drm_device *dev = scheduler->dev;
+	struct psb_scene *scene;
+	int ret;
+
+	spin_lock_bh(&scheduler->lock);
+	while (!list_empty(&scheduler->scene_clear_queue)) {
+		scene = list_entry(scheduler->scene_clear_queue.next,
+				   struct psb_scene, clear_head);
+		list_del_init(&scene->clear_head);
+		scene->clear_state = PSB_SCENE_CLEAR_BUSY;
+		spin_unlock_bh(&scheduler->lock);
+
+		mutex_lock(&scene->hw_data->mutex);
+		ret = drm_bo_wait(scene->hw_data, 0, 0, 0);
+		mutex_unlock(&scene->hw_data->mutex);
+		if (!ret)
+			ret = psb_clear_scene(scene);
+
+		spin_lock_bh(&scheduler->lock);
+		if (!ret)
+			scene->flags |= PSB_SCENE_FLAG_CLEARED;
+		scene->clear_state = PSB_SCENE_CLEAR_IDLE;
+		spin_unlock_bh(&scheduler->lock);
+		wake_up(&scheduler->scene_clear_wait);
+
+		mutex_lock(&dev->struct_mutex);
+		psb_scene_unref_devlocked(&scene);
+		mutex_unlock(&dev->struct_mutex);
+
+		spin_lock_bh(&scheduler->lock);
+	}
+	spin_unlock_bh(&scheduler->lock);
+}
+
 void psb_scene_unref_devlocked(struct psb_scene **scene)
 {
 	struct psb_scene *tmp_scene = *scene;
@@ -89,7 +295,7 @@ void psb_scene_unref_devlocked(struct psb_scene **scene)
 	*scene = NULL;
 	if (atomic_dec_and_test(&tmp_scene->ref_count)) {
 		psb_scheduler_remove_scene_refs(tmp_scene);
-		psb_destroy_scene_devlocked(tmp_scene);
+		psb_scene_cache_put_devlocked(tmp_scene);
 	}
 }
 
@@ -105,6 +311,7 @@ static struct psb_scene *psb_alloc_scene(struct drm_device *dev,
 {
 	struct drm_psb_private *dev_priv =
 	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_scene_cache *cache = &dev_priv->scene_cache;
 	int ret = -EINVAL;
 	struct psb_scene *scene;
 	uint32_t bo_size;
@@ -112,6 +319,12 @@ static struct psb_scene *psb_alloc_scene(struct drm_device *dev,
 
 	PSB_DEBUG_RENDER("Alloc scene w %u h %u\n", w, h);
 
+	mutex_lock(&dev->struct_mutex);
+	scene = psb_scene_cache_get_devlocked(dev, w, h);
+	mutex_unlock(&dev->struct_mutex);
+	if (scene)
+		return scene;
+
 	scene = drm_calloc(1, sizeof(*scene), DRM_MEM_DRIVER);
 
 	if (!scene) {
@@ -124,14 +337,26 @@ static struct psb_scene *psb_alloc_scene(struct drm_device *dev,
 	scene->h = h;
 	scene->hw_scene = NULL;
 	atomic_set(&scene->ref_count, 1);
+	INIT_LIST_HEAD(&scene->cache_head);
+	INIT_LIST_HEAD(&scene->clear_head);
 
-	INIT_LIST_HEAD(&buf.head);
-	ret = psb_xhw_scene_info(dev_priv, &buf, scene->w, scene->h,
-				 scene->hw_cookie, &bo_size,
-				 &scene->clear_p_start,
-				 &scene->clear_num_pages);
-	if (ret)
-		goto out_err;
+	mutex_lock(&dev->struct_mutex);
+	ret = psb_scene_info_lookup_devlocked(cache, scene, &bo_size);
+	mutex_unlock(&dev->struct_mutex);
+
+	if (ret) {
+		INIT_LIST_HEAD(&buf.head);
+		ret = psb_xhw_scene_info(dev_priv, &buf, scene->w, scene->h,
+					 scene->hw_cookie, &bo_size,
+					 &scene->clear_p_start,
+					 &scene->clear_num_pages);
+		if (ret)
+			goto out_err;
+
+		mutex_lock(&dev->struct_mutex);
+		psb_scene_info_insert_devlocked(cache, scene, bo_size);
+		mutex_unlock(&dev->struct_mutex);
+	}
 
 	ret = drm_buffer_object_create(dev, bo_size, drm_bo_type_kernel,
 				       DRM_PSB_FLAG_MEM_MMU |
@@ -144,37 +369,185 @@ static struct psb_scene *psb_alloc_scene(struct drm_device *dev,
 	if (ret)
 		goto out_err;
 
+	scene->flags = PSB_SCENE_FLAG_CLEARED;
 	return scene;
       out_err:
 	drm_free(scene, sizeof(*scene), DRM_MEM_DRIVER);
 	return NULL;
 }
 
+/*
+ * Adaptive parameter memory sizing. OOMs are counted over windows of
+ * PSB_TA_MEM_WINDOW final scene passes. The memory is doubled as soon
+ * as a window sees PSB_TA_MEM_GROW_OOMS of them, and halved after
+ * PSB_TA_MEM_SHRINK_WINDOWS windows without one, within the limits
+ * set by the module parameters. Xpsb doesn't tell how much of the
+ * memory a scene used, so OOM-free windows are taken as low usage.
+ *
+ * A new size is applied only when the scheduler is idle and no scene
+ * is dirty, since a scene between multi-pass passes still has binned
+ * data in the memory. The caller holds the TA submission lock, so
+ * nothing can be queued meanwhile.
+ * Dropping the current memory makes psb_validate_scene_pool()
+ * allocate and load memory of the new size.
+ */
+
+static void psb_ta_mem_adapt(struct drm_psb_private *dev_priv, int final_pass)
+{
+	struct drm_device *dev = dev_priv->scheduler.dev;
+	uint32_t pages = dev_priv->ta_mem_pages;
+	uint32_t ooms;
+	int new_window = 0;
+
+	if (final_pass)
+		dev_priv->ta_mem_window_scenes++;
+
+	ooms = atomic_read(&dev_priv->ta_mem_ooms) -
+	    dev_priv->ta_mem_window_base;
+	if (ooms > dev_priv->ta_mem_peak_ooms)
+		dev_priv->ta_mem_peak_ooms = ooms;
+
+	if (ooms >= PSB_TA_MEM_GROW_OOMS) {
+		if (pages < dev_priv->ta_mem_max_pages)
+			dev_priv->ta_mem_target_pages =
+			    min(pages * 2, dev_priv->ta_mem_max_pages);
+		dev_priv->ta_mem_quiet_windows = 0;
+		new_window = 1;
+	} else if (dev_priv->ta_mem_window_scenes >= PSB_TA_MEM_WINDOW) {
+		if (ooms != 0)
+			dev_priv->ta_mem_quiet_windows = 0;
+		else if (++dev_priv->ta_mem_quiet_windows >=
+			 PSB_TA_MEM_SHRINK_WINDOWS) {
+			if (pages > dev_priv->ta_mem_min_pages)
+				dev_priv->ta_mem_target_pages =
+				    max(pages / 2, dev_priv->ta_mem_min_pages);
+			dev_priv->ta_mem_quiet_windows = 0;
+		}
+		new_window = 1;
+	}
+
+	if (new_window) {
+		dev_priv->ta_mem_window_base = atomic_read(&dev_priv->ta_mem_ooms);
+		dev_priv->ta_mem_window_scenes = 0;
+	}
+
+	if (likely(!dev_priv->ta_mem_target_pages))
+		return;
+	if (!dev_priv->ta_mem || !psb_scheduler_ta_mem_unused(dev_priv))
+		return;
+
+	DRM_INFO("Resizing parameter memory from %u to %u kiB.\n",
+		 (unsigned int)(pages * (PAGE_SIZE / 1024)),
+		 (unsigned int)(dev_priv->ta_mem_target_pages *
+				(PAGE_SIZE / 1024)));
+
+	if (dev_priv->ta_mem_target_pages > pages)
+		dev_priv->ta_mem_grows++;
+	else
+		dev_priv->ta_mem_shrinks++;
+
+	mutex_lock(&dev->struct_mutex);
+	psb_ta_mem_unref_devlocked(&dev_priv->ta_mem);
+	mutex_unlock(&dev->struct_mutex);
+	dev_priv->ta_mem_pages = dev_priv->ta_mem_target_pages;
+	dev_priv->ta_mem_target_pages = 0;
+}
+
+/*
+ * Reply to an asynchronous parameter memory load. Called with the
+ * xhw_lock held. The load is retried on the next validation if it
+ * failed.
+ */
+
+static void psb_ta_mem_load_done(struct drm_psb_private *dev_priv,
+				 struct psb_xhw_buf *buf)
+{
+	if (buf->arg.ret) {
+		DRM_ERROR("Failed loading parameter memory.\n");
+		dev_priv->force_ta_mem_load = 1;
+		return;
+	}
+
+	if (dev_priv->ta_mem)
+		memcpy(dev_priv->ta_mem->hw_cookie, buf->arg.cookie,
+		       sizeof(buf->arg.cookie));
+}
+
+/*
+ * Wait for an earlier asynchronous load, so that the parameter memory,
+ * its cookie and the load buffer may be changed. By the time of the
+ * next submission the X server has normally answered. A load that
+ * isn't answered in time is dropped.
+ */
+
+int psb_ta_mem_load_wait(struct drm_psb_private *dev_priv)
+{
+	struct psb_xhw_buf *buf = &dev_priv->ta_mem_load_buf;
+
+	if (likely(atomic_read(&buf->done)))
+		return 0;
+
+	return psb_xhw_wait(dev_priv, buf, 3 * DRM_HZ);
+}
+
+/*
+ * Drop an asynchronous load that is still queued, taking it off the
+ * request queue and ring. Used on resume, which loads the parameter
+ * memory again itself.
+ */
+
+void psb_ta_mem_load_cancel(struct drm_psb_private *dev_priv)
+{
+	struct psb_xhw_buf *buf = &dev_priv->ta_mem_load_buf;
+
+	if (!atomic_read(&buf->done))
+		psb_xhw_clean_buf(dev_priv, buf);
+}
+
 int psb_validate_scene_pool(struct psb_scene_pool *pool, uint64_t flags,
 			    uint64_t mask,
 			    uint32_t hint,
 			    uint32_t w,
 			    uint32_t h,
-			    int final_pass, struct psb_scene **scene_p)
+			    int final_pass,
+			    struct psb_validate_ctx *ctx,
+			    struct psb_scene **scene_p)
 {
 	struct drm_device *dev = pool->dev;
 	struct drm_psb_private *dev_priv =
 	    (struct drm_psb_private *)dev->dev_private;
 	struct psb_scene *scene = pool->scenes[pool->cur_scene];
+	struct psb_scene *worker_ref = NULL;
+	int clear;
 	int ret;
-	unsigned long irq_flags;
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
 	uint32_t bin_pt_offset;
 	uint32_t bin_param_offset;
 
 	PSB_DEBUG_RENDER("Validate scene pool. Scene %u\n", pool->cur_scene);
 
+	ret = psb_ta_mem_load_wait(dev_priv);
+	if (ret)
+		return ret;
+
+	psb_ta_mem_adapt(dev_priv, final_pass);
+
 	if (unlikely(!dev_priv->ta_mem)) {
 		dev_priv->ta_mem =
 		    psb_alloc_ta_mem(dev, dev_priv->ta_mem_pages);
+		if (!dev_priv->ta_mem &&
+		    dev_priv->ta_mem_pages != dev_priv->ta_mem_min_pages) {
+			DRM_ERROR("Failed resizing parameter memory.\n");
+			dev_priv->ta_mem_pages = dev_priv->ta_mem_min_pages;
+			dev_priv->ta_mem =
+			    psb_alloc_ta_mem(dev, dev_priv->ta_mem_pages);
+		}
 		if (!dev_priv->ta_mem)
 			return -ENOMEM;
 
+		dev_priv->ta_mem_pages =
+		    dev_priv->ta_mem->ta_memory->num_pages;
+
 		bin_pt_offset = ~0;
 		bin_param_offset = ~0;
 	} else {
@@ -185,13 +558,13 @@ int psb_validate_scene_pool(struct psb_scene_pool *pool, uint64_t flags,
 	pool->w = w;
 	pool->h = h;
 	if (scene && (scene->w != pool->w || scene->h != pool->h)) {
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
+		spin_lock_bh(&scheduler->lock);
 		if (scene->flags & PSB_SCENE_FLAG_DIRTY) {
-			spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+			spin_unlock_bh(&scheduler->lock);
 			DRM_ERROR("Trying to resize a dirty scene.\n");
 			return -EINVAL;
 		}
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+		spin_unlock_bh(&scheduler->lock);
 		mutex_lock(&dev->struct_mutex);
 		psb_scene_unref_devlocked(&pool->scenes[pool->cur_scene]);
 		mutex_unlock(&dev->struct_mutex);
@@ -204,44 +577,78 @@ int psb_validate_scene_pool(struct psb_scene_pool *pool, uint64_t flags,
 
 		if (!scene)
 			return -ENOMEM;
-
-		scene->flags = PSB_SCENE_FLAG_CLEARED;
 	}
 
 	/*
 	 * FIXME: We need atomic bit manipulation here for the
 	 * scheduler. For now use the spinlock.
+	 *
+	 * Normally the clear worker has already cleared the scene.
+	 * If it is still busy with it, wait. If it hasn't started,
+	 * take the scene back and clear it here. The scene is marked
+	 * busy while we clear it, so that a rasterization completing
+	 * meanwhile doesn't queue it for the worker as well.
 	 */
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
-	if (!(scene->flags & PSB_SCENE_FLAG_CLEARED)) {
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	while (scene->clear_state == PSB_SCENE_CLEAR_BUSY) {
+		spin_unlock_bh(&scheduler->lock);
+		wait_event(scheduler->scene_clear_wait,
+			   scene->clear_state != PSB_SCENE_CLEAR_BUSY);
+		spin_lock_bh(&scheduler->lock);
+	}
+	if (scene->clear_state == PSB_SCENE_CLEAR_QUEUED) {
+		list_del_init(&scene->clear_head);
+		scene->clear_state = PSB_SCENE_CLEAR_IDLE;
+		worker_ref = scene;
+	}
+	clear = !(scene->flags & PSB_SCENE_FLAG_CLEARED);
+	if (clear)
+		scene->clear_state = PSB_SCENE_CLEAR_BUSY;
+	spin_unlock_bh(&scheduler->lock);
+
+	/*
+	 * Drop the worker's reference. The pool still holds one.
+	 */
+
+	if (worker_ref) {
+		mutex_lock(&dev->struct_mutex);
+		psb_scene_unref_devlocked(&worker_ref);
+		mutex_unlock(&dev->struct_mutex);
+	}
+
+	if (clear) {
 		PSB_DEBUG_RENDER("Waiting to clear scene memory.\n");
 		mutex_lock(&scene->hw_data->mutex);
 		ret = drm_bo_wait(scene->hw_data, 0, 0, 0);
 		mutex_unlock(&scene->hw_data->mutex);
-		if (ret)
-			return ret;
+		if (!ret)
+			ret = psb_clear_scene(scene);
 
-		ret = psb_clear_scene(scene);
+		spin_lock_bh(&scheduler->lock);
+		if (!ret)
+			scene->flags |= PSB_SCENE_FLAG_CLEARED;
+		scene->clear_state = PSB_SCENE_CLEAR_IDLE;
+		spin_unlock_bh(&scheduler->lock);
+		wake_up(&scheduler->scene_clear_wait);
 
 		if (ret)
 			return ret;
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
-		scene->flags |= PSB_SCENE_FLAG_CLEARED;
 	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
 
-	ret = drm_bo_do_validate(scene->hw_data, flags, mask, hint,
-				 PSB_ENGINE_TA, 0, NULL);
+	ret = drm_bo_do_validate_list(scene->hw_data, flags, mask, hint,
+				      PSB_ENGINE_TA, 0, 0, &ctx->unfenced,
+				      NULL);
 	if (ret)
 		return ret;
-	ret = drm_bo_do_validate(dev_priv->ta_mem->hw_data, 0, 0, 0,
-				 PSB_ENGINE_TA, 0, NULL);
+	ret = drm_bo_do_validate_list(dev_priv->ta_mem->hw_data, 0, 0, 0,
+				      PSB_ENGINE_TA, 0, 0, &ctx->unfenced,
+				      NULL);
 	if (ret)
 		return ret;
-	ret = drm_bo_do_validate(dev_priv->ta_mem->ta_memory, 0, 0, 0,
-				 PSB_ENGINE_TA, 0, NULL);
+	ret = drm_bo_do_validate_list(dev_priv->ta_mem->ta_memory, 0, 0, 0,
+				      PSB_ENGINE_TA, 0, 0, &ctx->unfenced,
+				      NULL);
 	if (ret)
 		return ret;
 
@@ -251,37 +658,49 @@ int psb_validate_scene_pool(struct psb_scene_pool *pool, uint64_t flags,
 		     dev_priv->ta_mem->hw_data->offset ||
 		     dev_priv->force_ta_mem_load)) {
 
-		struct psb_xhw_buf buf;
-
-		INIT_LIST_HEAD(&buf.head);
-		ret = psb_xhw_ta_mem_load(dev_priv, &buf,
-					  PSB_TA_MEM_FLAG_TA |
-					  PSB_TA_MEM_FLAG_RASTER |
-					  PSB_TA_MEM_FLAG_HOSTA |
-					  PSB_TA_MEM_FLAG_HOSTD |
-					  PSB_TA_MEM_FLAG_INIT,
-					  dev_priv->ta_mem->ta_memory->offset,
-					  dev_priv->ta_mem->hw_data->offset,
-					  dev_priv->ta_mem->hw_cookie);
-		if (ret)
-			return ret;
+		/*
+		 * Don't wait for the reply. The load is queued ahead of
+		 * this submission's fire requests.
+		 */
 
 		dev_priv->force_ta_mem_load = 0;
+		ret = psb_xhw_ta_mem_load_async(dev_priv,
+						&dev_priv->ta_mem_load_buf,
+						PSB_TA_MEM_FLAG_TA |
+						PSB_TA_MEM_FLAG_RASTER |
+						PSB_TA_MEM_FLAG_HOSTA |
+						PSB_TA_MEM_FLAG_HOSTD |
+						PSB_TA_MEM_FLAG_INIT,
+						dev_priv->ta_mem->ta_memory->
+						offset,
+						dev_priv->ta_mem->hw_data->offset,
+						dev_priv->ta_mem->hw_cookie,
+						psb_ta_mem_load_done);
+		if (ret) {
+			dev_priv->force_ta_mem_load = 1;
+			return ret;
+		}
 	}
 
+	/*
+	 * Take the submission's reference before the scene is marked
+	 * uncleared, so psb_scene_queue_clear() sees it in use.
+	 */
+
+	*scene_p = psb_scene_ref(scene);
+
 	if (final_pass) {
 
 		/*
 		 * Clear the scene on next use. Advance the scene counter.
 		 */
 
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
+		spin_lock_bh(&scheduler->lock);
 		scene->flags &= ~PSB_SCENE_FLAG_CLEARED;
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+		spin_unlock_bh(&scheduler->lock);
 		pool->cur_scene = (pool->cur_scene + 1) % pool->num_scenes;
 	}
 
-	*scene_p = psb_scene_ref(scene);
 	return 0;
 }
 
@@ -434,6 +853,7 @@ struct psb_ta_mem *psb_alloc_ta_mem(struct drm_device *dev, uint32_t pages)
 	int ret = -EINVAL;
 	struct psb_ta_mem *ta_mem;
 	uint32_t bo_size;
+	uint32_t suggested;
 	struct psb_xhw_buf buf;
 
 	INIT_LIST_HEAD(&buf.head);
@@ -447,6 +867,19 @@ struct psb_ta_mem *psb_alloc_ta_mem(struct drm_device *dev, uint32_t pages)
 
 	ret = psb_xhw_ta_mem_info(dev_priv, &buf, pages,
 				  ta_mem->hw_cookie, &bo_size);
+	if (ret == -ENOMEM) {
+		suggested = PSB_ALIGN_TO(bo_size, PAGE_SIZE) >> PAGE_SHIFT;
+		if (suggested > pages &&
+		    suggested <= dev_priv->ta_mem_max_pages) {
+			DRM_INFO("Using the %u kiB of parameter memory "
+				 "suggested by Xpsb.\n",
+				 (unsigned int)(bo_size / 1024));
+			pages = suggested;
+			INIT_LIST_HEAD(&buf.head);
+			ret = psb_xhw_ta_mem_info(dev_priv, &buf, pages,
+						  ta_mem->hw_cookie, &bo_size);
+		}
+	}
 	if (ret == -ENOMEM) {
 		DRM_ERROR("Parameter memory size is too small.\n");
 		DRM_INFO("Attempted to use %u kiB of parameter memory.\n",
@@ -29,6 +29,15 @@
 #define PSB_USER_OBJECT_SCENE_POOL    drm_driver_type0
 #define PSB_USER_OBJECT_TA_MEM       drm_driver_type1
 #define PSB_MAX_NUM_SCENES            8
+#define PSB_SCENE_INFO_CACHE_SIZE     8
+
+#define PSB_SCENE_CLEAR_IDLE          0
+#define PSB_SCENE_CLEAR_QUEUED        1
+#define PSB_SCENE_CLEAR_BUSY          2
+
+#define PSB_TA_MEM_WINDOW             256
+#define PSB_TA_MEM_GROW_OOMS          4
+#define PSB_TA_MEM_SHRINK_WINDOWS     8
 
 struct psb_hw_scene;
 struct psb_hw_ta_mem;
@@ -47,6 +56,9 @@ struct psb_scene_pool {
 struct psb_scene {
 	struct drm_device *dev;
 	atomic_t ref_count;
+	struct list_head cache_head;
+	struct list_head clear_head;
+	int clear_state;
 	uint32_t hw_cookie[PSB_SCENE_HW_COOKIE_SIZE];
 	uint32_t bo_size;
 	uint32_t w;
@@ -59,6 +71,38 @@ struct psb_scene {
 	uint32_t clear_num_pages;
 };
 
+/*
+ * A cached xhw scene info reply. stamp is zero for unused entries.
+ */
+
+struct psb_scene_info {
+	uint32_t w;
+	uint32_t h;
+	uint32_t hw_cookie[PSB_SCENE_HW_COOKIE_SIZE];
+	uint32_t bo_size;
+	uint32_t clear_p_start;
+	uint32_t clear_num_pages;
+	uint32_t stamp;
+};
+
+/*
+ * Device-wide cache of idle scenes, least recently used first, and of
+ * scene info replies. Protected by dev->struct_mutex.
+ */
+
+struct psb_scene_cache {
+	struct list_head lru;
+	uint32_t pages;
+	uint32_t max_pages;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	struct psb_scene_info info[PSB_SCENE_INFO_CACHE_SIZE];
+	uint32_t info_stamp;
+	uint32_t info_hits;
+	uint32_t info_misses;
+};
+
 struct psb_scene_entry {
 	struct list_head head;
 	struct psb_scene *scene;
@@ -93,8 +137,15 @@ extern struct psb_scene_pool *psb_scene_pool_lookup_devlocked(struct drm_file
 extern int psb_validate_scene_pool(struct psb_scene_pool *pool, uint64_t flags,
 				   uint64_t mask, uint32_t hint, uint32_t w,
 				   uint32_t h, int final_pass,
+				   struct psb_validate_ctx *ctx,
 				   struct psb_scene **scene_p);
 extern void psb_scene_unref_devlocked(struct psb_scene **scene);
+extern void psb_scene_cache_init(struct psb_scene_cache *cache,
+				 uint32_t max_pages);
+extern void psb_scene_cache_flush_devlocked(struct drm_device *dev);
+extern void psb_scene_queue_clear(struct psb_scheduler *scheduler,
+				  struct psb_scene *scene);
+extern void psb_scene_clear_wq(struct work_struct *work);
 extern struct psb_scene *psb_scene_ref(struct psb_scene *src);
 extern int drm_psb_scene_unref_ioctl(struct drm_device *dev,
 				     void *data, struct drm_file *file_priv);
@@ -108,5 +159,7 @@ extern struct psb_ta_mem *psb_alloc_ta_mem(struct drm_device *dev,
 extern void psb_ta_mem_ref_devlocked(struct psb_ta_mem **dst,
 				     struct psb_ta_mem *src);
 extern void psb_ta_mem_unref_devlocked(struct psb_ta_mem **ta_mem);
+extern int psb_ta_mem_load_wait(struct drm_psb_private *dev_priv);
+extern void psb_ta_mem_load_cancel(struct drm_psb_private *dev_priv);
 
 #endif
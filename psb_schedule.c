@@ -28,6 +28,7 @@
 #include "psb_drv.h"
 #include "psb_reg.h"
 #include "psb_scene.h"
+#include <linux/ktime.h>
 
 #define PSB_ALLOWED_RASTER_RUNTIME (DRM_HZ * 20)
 #define PSB_RASTER_TIMEOUT (DRM_HZ / 2)
@@ -88,6 +89,8 @@ static void psb_dispatch_ta(struct drm_psb_private *dev_priv,
 static void psb_dispatch_raster(struct drm_psb_private *dev_priv,
 				struct psb_scheduler *scheduler,
 				uint32_t reply_flag);
+static void psb_scheduler_latch(struct psb_scheduler *scheduler,
+				uint32_t events);
 
 #ifdef FIX_TG_16
 
@@ -97,16 +100,34 @@ static int psb_check_2d_idle(struct drm_psb_private *dev_priv);
 
 #endif
 
+/*
+ * The scheduler lock is taken with bottom halves off. Drop it, and
+ * signal the TA fences reported while it was held.
+ */
+
+static void psb_scheduler_unlock(struct psb_scheduler *scheduler)
+{
+	uint32_t report = scheduler->report_fences;
+	uint32_t fence_class;
+
+	scheduler->report_fences = 0;
+	spin_unlock_bh(&scheduler->lock);
+
+	for (fence_class = 0; report != 0; ++fence_class, report >>= 1) {
+		if (report & 1)
+			psb_fence_handler(scheduler->dev, fence_class);
+	}
+}
+
 void psb_scheduler_lockup(struct drm_psb_private *dev_priv,
 			  int *lockup, int *idle)
 {
-	unsigned long irq_flags;
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
 
 	*lockup = 0;
 	*idle = 1;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 
 	if (scheduler->current_task[PSB_SCENE_ENGINE_TA] != NULL &&
 	    time_after_eq(jiffies, scheduler->ta_end_jiffies)) {
@@ -120,7 +141,30 @@ void psb_scheduler_lockup(struct drm_psb_private *dev_priv,
 	if (!*lockup)
 		*idle = scheduler->idle;
 
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
+}
+
+/*
+ * Call with the scheduler spinlock held, after either engine's current
+ * task changed. Accumulates the time both engines were busy.
+ */
+
+static void psb_account_overlap(struct psb_scheduler *scheduler)
+{
+	int busy = (scheduler->current_task[PSB_SCENE_ENGINE_RASTER] != NULL) &&
+	    (scheduler->current_task[PSB_SCENE_ENGINE_TA] != NULL);
+
+	if (busy == (scheduler->overlap_start_ns != 0))
+		return;
+
+	if (busy) {
+		scheduler->overlap_start_ns = ktime_to_ns(ktime_get());
+		return;
+	}
+
+	scheduler->overlap_ns +=
+	    ktime_to_ns(ktime_get()) - scheduler->overlap_start_ns;
+	scheduler->overlap_start_ns = 0;
 }
 
 static inline void psb_set_idle(struct psb_scheduler *scheduler)
@@ -215,9 +259,345 @@ static inline void psb_report_fence(struct psb_scheduler *scheduler,
 	struct psb_scheduler_seq *seq = &scheduler->seq[type];
 
 	seq->sequence = sequence;
-	seq->reported = 0;
 	if (call_handler)
-		psb_fence_handler(scheduler->dev, class);
+		scheduler->report_fences |= (1 << class);
+}
+
+/*
+ * TA done and rasterizer done are signaled by sequence, but deadline
+ * tasks may complete before older tasks. Each task therefore sits on
+ * the ta_pending and raster_pending lists, in sequence order, until it
+ * has completed that stage or left the scheduler. The newest sequence
+ * completed for a type is recorded, and reported only up to the oldest
+ * task still pending, which is at the head of the list.
+ *
+ * New tasks get the newest sequence and are added at the tail. Only a
+ * task going back to the TA for another pass is inserted in the
+ * middle, and it is normally the oldest one.
+ */
+
+static void psb_queue_pending(struct psb_scheduler *scheduler,
+			      struct psb_task *task)
+{
+	if (!task->has_deadline)
+		list_add_tail(&task->ta_pending_head, &scheduler->ta_pending);
+	list_add_tail(&task->raster_pending_head, &scheduler->raster_pending);
+}
+
+static void psb_requeue_ta_pending(struct psb_scheduler *scheduler,
+				   struct psb_task *task)
+{
+	struct psb_task *pos;
+
+	list_for_each_entry(pos, &scheduler->ta_pending, ta_pending_head) {
+		if ((int32_t) (task->sequence - pos->sequence) < 0)
+			break;
+	}
+	list_add_tail(&task->ta_pending_head, &pos->ta_pending_head);
+}
+
+static inline struct list_head *psb_pending_head(struct psb_task *task,
+						 uint32_t type)
+{
+	return (type == _PSB_FENCE_TA_DONE_SHIFT) ?
+	    &task->ta_pending_head : &task->raster_pending_head;
+}
+
+static inline struct psb_task *psb_oldest_pending(struct psb_scheduler
+						  *scheduler, uint32_t type)
+{
+	struct list_head *list = (type == _PSB_FENCE_TA_DONE_SHIFT) ?
+	    &scheduler->ta_pending : &scheduler->raster_pending;
+
+	if (list_empty(list))
+		return NULL;
+	if (type == _PSB_FENCE_TA_DONE_SHIFT)
+		return list_entry(list->next, struct psb_task, ta_pending_head);
+	return list_entry(list->next, struct psb_task, raster_pending_head);
+}
+
+/*
+ * Report done as having completed the stage given by type. Called with
+ * done == NULL after a pending task has left the scheduler some other
+ * way.
+ */
+
+static void psb_report_fence_ordered(struct psb_scheduler *scheduler,
+				     struct psb_task *done, uint32_t type)
+{
+	struct psb_scheduler_seq *seq = &scheduler->seq[type];
+	struct psb_task *task;
+	uint32_t sequence;
+
+	if (done) {
+		list_del_init(psb_pending_head(done, type));
+		if ((int32_t) (done->sequence - seq->completed) > 0)
+			seq->completed = done->sequence;
+	}
+
+	sequence = seq->completed;
+	task = psb_oldest_pending(scheduler, type);
+	if (task && (int32_t) (task->sequence - sequence) <= 0)
+		sequence = task->sequence - 1;
+
+	if ((int32_t) (sequence - seq->sequence) > 0)
+		psb_report_fence(scheduler, PSB_ENGINE_TA, sequence, type, 1);
+}
+
+static void psb_fence_unblock(struct psb_scheduler *scheduler,
+			      struct psb_task *task, uint32_t type)
+{
+	list_del_init(psb_pending_head(task, type));
+	psb_report_fence_ordered(scheduler, NULL, type);
+}
+
+/*
+ * Insert a deadline task in the hp raster queue, earliest deadline
+ * first.
+ */
+
+static void psb_insert_deadline(struct psb_scheduler *scheduler,
+				struct psb_task *task)
+{
+	struct psb_task *pos;
+
+	list_for_each_entry(pos, &scheduler->hp_raster_queue, head) {
+		if ((int64_t) (task->deadline - pos->deadline) < 0)
+			break;
+	}
+	list_add_tail(&task->head, &pos->head);
+}
+
+/*
+ * Queue a deadline task. It skips the ta queue, since it has no TA
+ * work.
+ */
+
+static void psb_queue_deadline(struct psb_scheduler *scheduler,
+			       struct psb_task *task)
+{
+	psb_insert_deadline(scheduler, task);
+	psb_report_fence_ordered(scheduler, task, _PSB_FENCE_TA_DONE_SHIFT);
+}
+
+/*
+ * Submitters put their tasks on the submit queue under the submit lock
+ * only, in sequence order, and leave it to the tasklet to queue and
+ * fire them. Called with the scheduler lock held before looking at the
+ * scheduler queues.
+ */
+
+static void psb_scheduler_take_submitted(struct psb_scheduler *scheduler)
+{
+	struct psb_task *task, *next;
+	LIST_HEAD(submitted);
+
+	spin_lock(&scheduler->submit_lock);
+	list_splice_init(&scheduler->submit_queue, &submitted);
+	spin_unlock(&scheduler->submit_lock);
+
+	list_for_each_entry_safe(task, next, &submitted, head) {
+		list_del_init(&task->head);
+		psb_queue_pending(scheduler, task);
+		if (task->has_deadline)
+			psb_queue_deadline(scheduler, task);
+		else
+			list_add_tail(&task->head, &scheduler->ta_queue);
+	}
+}
+
+static uint32_t psb_scheduler_submit(struct psb_scheduler *scheduler,
+				     struct psb_task *task)
+{
+	uint32_t sequence;
+
+	spin_lock_bh(&scheduler->submit_lock);
+	sequence = psb_fence_advance_sequence(scheduler->dev, PSB_ENGINE_TA);
+	task->sequence = sequence;
+	list_add_tail(&task->head, &scheduler->submit_queue);
+	psb_trace(scheduler, PSB_TRACE_QUEUE, task, 0);
+	spin_unlock_bh(&scheduler->submit_lock);
+
+	psb_scheduler_latch(scheduler, PSB_SCHED_EVENT_SUBMIT);
+	return sequence;
+}
+
+static void psb_check_deadline(struct psb_scheduler *scheduler,
+			       struct psb_task *task)
+{
+	uint64_t now = ktime_to_ns(ktime_get());
+
+	if ((int64_t) (now - task->deadline) <= 0) {
+		scheduler->deadline_met++;
+		return;
+	}
+
+	scheduler->deadline_missed++;
+	if (now - task->deadline > scheduler->deadline_max_late_ns)
+		scheduler->deadline_max_late_ns = now - task->deadline;
+	PSB_DEBUG_RENDER("Raster task %u missed its deadline.\n",
+			 task->sequence);
+}
+
+/*
+ * Dirty scenes hold binned data in the parameter memory until they are
+ * rasterized. They are counted, so that the memory isn't resized under
+ * them. Called with the scheduler lock held.
+ */
+
+static void psb_scene_set_dirty(struct psb_scheduler *scheduler,
+				struct psb_scene *scene, uint32_t flags)
+{
+	if (!(scene->flags & PSB_SCENE_FLAG_DIRTY))
+		scheduler->dirty_scenes++;
+	scene->flags |= PSB_SCENE_FLAG_DIRTY | flags;
+}
+
+static void psb_scene_clear_dirty(struct psb_scheduler *scheduler,
+				  struct psb_scene *scene)
+{
+	if (scene->flags & PSB_SCENE_FLAG_DIRTY)
+		scheduler->dirty_scenes--;
+	scene->flags &= ~(PSB_SCENE_FLAG_DIRTY | PSB_SCENE_FLAG_COMPLETE);
+}
+
+/*
+ * Per-client pick order.
+ *
+ * The TA and the rasterizer pick from their queues in stride order.
+ * Each client carries a pass per engine, the virtual finish time of
+ * its last task there, and each task fired advances its client's pass
+ * by PSB_SCHED_STRIDE, or by PSB_SCHED_PRIORITY_WEIGHT times less for
+ * priority tasks. The task with the earliest finish time is picked,
+ * where a client that has fallen behind the engine's virtual time, the
+ * start time of the last task fired, is brought up to it so that it
+ * can't save up a burst while idle. Ties go to the task queued first.
+ *
+ * Only the first task of each client is a candidate, so a client's own
+ * tasks are still fired in the order they were queued, and fences,
+ * which are signaled by sequence, are reported in order by
+ * psb_report_fence_ordered(). Tasks without a client are treated as one
+ * client. A task using a busy buffer shared with other clients may
+ * depend on their tasks queued ahead of it, so it is marked ordered at
+ * submission and isn't picked until it reaches the head of the queue.
+ * Tasks put back at the head of a queue to resume after an out of
+ * memory condition or a lockup are picked first.
+ *
+ * Called with the scheduler lock held.
+ */
+
+static uint32_t psb_sched_start(struct psb_scheduler *scheduler,
+				struct psb_task *task, int engine)
+{
+	uint32_t vtime = scheduler->vtime[engine];
+
+	if (task->client && (int32_t) (task->client->pass[engine] - vtime) > 0)
+		return task->client->pass[engine];
+
+	return vtime;
+}
+
+static uint32_t psb_sched_finish(struct psb_scheduler *scheduler,
+				 struct psb_task *task, int engine)
+{
+	uint32_t stride = PSB_SCHED_STRIDE;
+
+	if (task->priority)
+		stride /= PSB_SCHED_PRIORITY_WEIGHT;
+
+	return psb_sched_start(scheduler, task, engine) + stride;
+}
+
+/*
+ * Advance the virtual time and the client's pass when firing a task.
+ */
+
+static void psb_sched_charge(struct psb_scheduler *scheduler,
+			     struct psb_task *task, int engine)
+{
+	uint32_t finish = psb_sched_finish(scheduler, task, engine);
+
+	scheduler->vtime[engine] = psb_sched_start(scheduler, task, engine);
+	if (task->client)
+		task->client->pass[engine] = finish;
+	task->resume = 0;
+}
+
+/*
+ * Whether another task of the same client was already seen in the
+ * current scan. Marks the client as seen.
+ */
+
+static int psb_sched_seen(struct psb_scheduler *scheduler,
+			  struct psb_task *task, int *seen_no_client)
+{
+	struct psb_sched_client *client = task->client;
+	int seen;
+
+	if (!client) {
+		seen = *seen_no_client;
+		*seen_no_client = 1;
+		return seen;
+	}
+
+	seen = (client->scan == scheduler->scan);
+	client->scan = scheduler->scan;
+	return seen;
+}
+
+/*
+ * Pick the next task of a TA or raster queue. For the TA queue,
+ * rasterization-only tasks that are first of their client are moved to
+ * the raster queue on the way, and *pushed is set if any were.
+ */
+
+static struct psb_task *psb_sched_pick(struct psb_scheduler *scheduler,
+				       struct list_head *queue, int engine,
+				       int *pushed)
+{
+	struct psb_task *task, *next;
+	struct psb_task *best = NULL;
+	uint32_t best_finish = 0;
+	uint32_t finish;
+	int seen_no_client = 0;
+	int ahead = 0;
+
+	if (list_empty(queue))
+		return NULL;
+
+	task = list_entry(queue->next, struct psb_task, head);
+	if (task->resume)
+		return task;
+
+	scheduler->scan++;
+	list_for_each_entry_safe(task, next, queue, head) {
+		if (pushed && task->task_type == psb_raster_task &&
+		    !(task->ordered && ahead) &&
+		    !(task->client ? task->client->scan == scheduler->scan :
+		      seen_no_client)) {
+			list_del_init(&task->head);
+			list_add_tail(&task->head, &scheduler->raster_queue);
+			psb_report_fence_ordered(scheduler, task,
+						 _PSB_FENCE_TA_DONE_SHIFT);
+			*pushed = 1;
+			continue;
+		}
+
+		if (psb_sched_seen(scheduler, task, &seen_no_client) ||
+		    (task->ordered && ahead)) {
+			ahead = 1;
+			continue;
+		}
+		ahead = 1;
+
+		finish = psb_sched_finish(scheduler, task, engine);
+		if (!best || (int32_t) (finish - best_finish) < 0) {
+			best = task;
+			best_finish = finish;
+		}
+	}
+
+	return best;
 }
 
 static void psb_schedule_raster(struct drm_psb_private *dev_priv,
@@ -226,8 +606,7 @@ static void psb_schedule_raster(struct drm_psb_private *dev_priv,
 static void psb_schedule_ta(struct drm_psb_private *dev_priv,
 			    struct psb_scheduler *scheduler)
 {
-	struct psb_task *task = NULL;
-	struct list_head *list, *next;
+	struct psb_task *task;
 	int pushed_raster_task = 0;
 
 	PSB_DEBUG_RENDER("schedule ta\n");
@@ -244,21 +623,11 @@ static void psb_schedule_ta(struct drm_psb_private *dev_priv,
 	/*
 	 * Skip the ta stage for rasterization-only
 	 * tasks. They arrive here to make sure we're rasterizing
-	 * tasks in the correct order.
+	 * each client's tasks in the correct order.
 	 */
 
-	list_for_each_safe(list, next, &scheduler->ta_queue) {
-		task = list_entry(list, struct psb_task, head);
-		if (task->task_type != psb_raster_task)
-			break;
-
-		list_del_init(list);
-		list_add_tail(list, &scheduler->raster_queue);
-		psb_report_fence(scheduler, task->engine, task->sequence,
-				 _PSB_FENCE_TA_DONE_SHIFT, 1);
-		task = NULL;
-		pushed_raster_task = 1;
-	}
+	task = psb_sched_pick(scheduler, &scheduler->ta_queue,
+			      PSB_SCENE_ENGINE_TA, &pushed_raster_task);
 
 	if (pushed_raster_task)
 		psb_schedule_raster(dev_priv, scheduler);
@@ -301,12 +670,15 @@ static void psb_schedule_ta(struct drm_psb_private *dev_priv,
 #endif
 
 	list_del_init(&task->head);
+	psb_sched_charge(scheduler, task, PSB_SCENE_ENGINE_TA);
 	if (task->flags & PSB_FIRE_FLAG_XHW_OOM)
 		scheduler->ta_state = 1;
 
 	scheduler->current_task[PSB_SCENE_ENGINE_TA] = task;
+	psb_account_overlap(scheduler);
 	scheduler->idle = 0;
 	scheduler->ta_end_jiffies = jiffies + PSB_TA_TIMEOUT;
+	psb_trace(scheduler, PSB_TRACE_TA_FIRE, task, 0);
 
 	task->reply_flags = (task->flags & PSB_FIRE_FLAG_XHW_OOM) ?
 	    0x00000000 : PSB_RF_FIRE_TA;
@@ -329,15 +701,16 @@ static int psb_fire_raster(struct psb_scheduler *scheduler,
 }
 
 /*
- * Take the first rasterization task from the hp raster queue or from the
- * raster queue and fire the rasterizer.
+ * Take the first rasterization task from the hp raster queue, or the
+ * next one from the raster queue in client pick order, and fire the
+ * rasterizer.
  */
 
 static void psb_schedule_raster(struct drm_psb_private *dev_priv,
 				struct psb_scheduler *scheduler)
 {
 	struct psb_task *task;
-	struct list_head *list;
+	struct psb_task *ta_task;
 
 	if (scheduler->idle_count != 0)
 		return;
@@ -346,24 +719,39 @@ static void psb_schedule_raster(struct drm_psb_private *dev_priv,
 		PSB_DEBUG_RENDER("Raster busy.\n");
 		return;
 	}
-/* #ifdef PSB_BLOCK_OVERLAP */
-#if 1
-	if (scheduler->current_task[PSB_SCENE_ENGINE_TA] != NULL) {
+
+	ta_task = scheduler->current_task[PSB_SCENE_ENGINE_TA];
+	if (ta_task != NULL && !drm_psb_pipeline) {
 		PSB_DEBUG_RENDER("TA busy.\n");
 		return;
 	}
-#endif
 
 	if (!list_empty(&scheduler->hp_raster_queue))
-		list = scheduler->hp_raster_queue.next;
-	else if (!list_empty(&scheduler->raster_queue))
-		list = scheduler->raster_queue.next;
-	else {
+		task = list_entry(scheduler->hp_raster_queue.next,
+				  struct psb_task, head);
+	else
+		task = psb_sched_pick(scheduler, &scheduler->raster_queue,
+				      PSB_SCENE_ENGINE_RASTER, NULL);
+
+	if (!task) {
 		PSB_DEBUG_RENDER("Nothing in list\n");
 		return;
 	}
 
-	task = list_entry(list, struct psb_task, head);
+	/*
+	 * When pipelining, rasterize from the other hw scene context
+	 * while the TA is binning, but not while the TA is out of
+	 * memory and xpsb is juggling the scene contexts.
+	 */
+
+	if (ta_task != NULL) {
+		if (scheduler->ta_state || ta_task->aborting ||
+		    (task->scene && task->scene == ta_task->scene)) {
+			PSB_DEBUG_RENDER("TA busy.\n");
+			return;
+		}
+		scheduler->pipelined_rasters++;
+	}
 
 	/*
 	 * Sometimes changing ZLS format requires an ISP reset.
@@ -374,11 +762,14 @@ static void psb_schedule_raster(struct drm_psb_private *dev_priv,
 		PSB_WSGX32(_PSB_CS_RESET_ISP_RESET, PSB_CR_SOFT_RESET);
 
 	scheduler->current_task[PSB_SCENE_ENGINE_RASTER] = task;
+	psb_account_overlap(scheduler);
 
-	list_del_init(list);
+	list_del_init(&task->head);
+	psb_sched_charge(scheduler, task, PSB_SCENE_ENGINE_RASTER);
 	scheduler->idle = 0;
 	scheduler->raster_end_jiffies = jiffies + PSB_RASTER_TIMEOUT;
 	scheduler->total_raster_jiffies = 0;
+	psb_trace(scheduler, PSB_TRACE_RASTER_FIRE, task, 0);
 
 	if (task->scene)
 		PSB_WSGX32(0, PSB_CR_SOFT_RESET);
@@ -401,16 +792,15 @@ static void psb_schedule_raster(struct drm_psb_private *dev_priv,
 int psb_extend_raster_timeout(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 	int ret;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 	scheduler->total_raster_jiffies +=
 	    jiffies - scheduler->raster_end_jiffies + PSB_RASTER_TIMEOUT;
 	scheduler->raster_end_jiffies = jiffies + PSB_RASTER_TIMEOUT;
 	ret = (scheduler->total_raster_jiffies > PSB_ALLOWED_RASTER_RUNTIME) ?
 	    -EBUSY : 0;
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 	return ret;
 }
 
@@ -425,36 +815,41 @@ static void psb_ta_done(struct drm_psb_private *dev_priv,
 	struct psb_scene *scene = task->scene;
 
 	PSB_DEBUG_RENDER("TA done %u\n", task->sequence);
+	psb_trace(scheduler, PSB_TRACE_TA_DONE, task, 0);
 
 	switch (task->ta_complete_action) {
 	case PSB_RASTER_BLOCK:
 		scheduler->ta_state = 1;
-		scene->flags |=
-		    (PSB_SCENE_FLAG_DIRTY | PSB_SCENE_FLAG_COMPLETE);
+		psb_scene_set_dirty(scheduler, scene, PSB_SCENE_FLAG_COMPLETE);
 		list_add_tail(&task->head, &scheduler->raster_queue);
 		break;
 	case PSB_RASTER:
-		scene->flags |=
-		    (PSB_SCENE_FLAG_DIRTY | PSB_SCENE_FLAG_COMPLETE);
+		psb_scene_set_dirty(scheduler, scene, PSB_SCENE_FLAG_COMPLETE);
 		list_add_tail(&task->head, &scheduler->raster_queue);
 		break;
 	case PSB_RETURN:
 		scheduler->ta_state = 0;
-		scene->flags |= PSB_SCENE_FLAG_DIRTY;
+		psb_scene_set_dirty(scheduler, scene, 0);
 		list_add_tail(&scene->hw_scene->head, &scheduler->hw_scenes);
 
 		break;
 	}
 
 	scheduler->current_task[PSB_SCENE_ENGINE_TA] = NULL;
+	psb_account_overlap(scheduler);
 
 #ifdef FIX_TG_16
 	psb_2d_atomic_unlock(dev_priv);
 #endif
 
 	if (task->ta_complete_action != PSB_RASTER_BLOCK)
-		psb_report_fence(scheduler, task->engine, task->sequence,
-				 _PSB_FENCE_TA_DONE_SHIFT, 1);
+		psb_report_fence_ordered(scheduler, task,
+					 _PSB_FENCE_TA_DONE_SHIFT);
+	else
+		psb_fence_unblock(scheduler, task, _PSB_FENCE_TA_DONE_SHIFT);
+	if (task->ta_complete_action == PSB_RETURN)
+		psb_fence_unblock(scheduler, task,
+				  _PSB_FENCE_RASTER_DONE_SHIFT);
 
 	psb_schedule_raster(dev_priv, scheduler);
 	psb_schedule_ta(dev_priv, scheduler);
@@ -464,7 +859,7 @@ static void psb_ta_done(struct drm_psb_private *dev_priv,
 		return;
 
 	list_add_tail(&task->head, &scheduler->task_done_queue);
-	schedule_delayed_work(&scheduler->wq, 1);
+	schedule_delayed_work(&scheduler->wq, 0);
 }
 
 /*
@@ -480,8 +875,10 @@ static void psb_raster_done(struct drm_psb_private *dev_priv,
 	uint32_t complete_action = task->raster_complete_action;
 
 	PSB_DEBUG_RENDER("Raster done %u\n", task->sequence);
+	psb_trace(scheduler, PSB_TRACE_RASTER_DONE, task, 0);
 
 	scheduler->current_task[PSB_SCENE_ENGINE_RASTER] = NULL;
+	psb_account_overlap(scheduler);
 
 	if (complete_action != PSB_RASTER)
 		psb_schedule_raster(dev_priv, scheduler);
@@ -501,24 +898,27 @@ static void psb_raster_done(struct drm_psb_private *dev_priv,
 		}
 		switch (complete_action) {
 		case PSB_RETURN:
-			scene->flags &=
-			    ~(PSB_SCENE_FLAG_DIRTY | PSB_SCENE_FLAG_COMPLETE);
+			psb_scene_clear_dirty(scheduler, scene);
 			list_add_tail(&scene->hw_scene->head,
 				      &scheduler->hw_scenes);
 			psb_report_fence(scheduler, task->engine,
 					 task->sequence,
 					 _PSB_FENCE_SCENE_DONE_SHIFT, 1);
+			psb_scene_queue_clear(scheduler, scene);
 			if (task->flags & PSB_FIRE_FLAG_XHW_OOM) {
 				scheduler->ta_state = 0;
 			}
 			break;
 		case PSB_RASTER:
 			list_add(&task->head, &scheduler->raster_queue);
+			task->resume = 1;
 			task->raster_complete_action = PSB_RETURN;
 			psb_schedule_raster(dev_priv, scheduler);
 			break;
 		case PSB_TA:
 			list_add(&task->head, &scheduler->ta_queue);
+			task->resume = 1;
+			psb_requeue_ta_pending(scheduler, task);
 			scheduler->ta_state = 0;
 			task->raster_complete_action = PSB_RETURN;
 			task->ta_complete_action = PSB_RASTER;
@@ -530,14 +930,15 @@ static void psb_raster_done(struct drm_psb_private *dev_priv,
 	psb_set_idle(scheduler);
 
 	if (complete_action == PSB_RETURN) {
+		if (task->has_deadline)
+			psb_check_deadline(scheduler, task);
 		if (task->scene == NULL) {
-			psb_report_fence(scheduler, task->engine,
-					 task->sequence,
-					 _PSB_FENCE_RASTER_DONE_SHIFT, 1);
+			psb_report_fence_ordered(scheduler, task,
+						 _PSB_FENCE_RASTER_DONE_SHIFT);
 		}
 		if (!task->feedback.page) {
 			list_add_tail(&task->head, &scheduler->task_done_queue);
-			schedule_delayed_work(&scheduler->wq, 1);
+			schedule_delayed_work(&scheduler->wq, 0);
 		}
 	}
 
@@ -546,48 +947,67 @@ static void psb_raster_done(struct drm_psb_private *dev_priv,
 void psb_scheduler_pause(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 	scheduler->idle_count++;
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 }
 
 void psb_scheduler_restart(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 	if (--scheduler->idle_count == 0) {
 		psb_schedule_ta(dev_priv, scheduler);
 		psb_schedule_raster(dev_priv, scheduler);
 	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 }
 
 int psb_scheduler_idle(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 	int ret;
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 	ret = scheduler->idle_count != 0 && scheduler->idle;
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 	return ret;
 }
 
 int psb_scheduler_finished(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 	int ret;
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	psb_scheduler_take_submitted(scheduler);
 	ret = (scheduler->idle &&
 	       list_empty(&scheduler->raster_queue) &&
 	       list_empty(&scheduler->ta_queue) &&
 	       list_empty(&scheduler->hp_raster_queue));
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
+	return ret;
+}
+
+/*
+ * Nothing queued, and no scene has binned data left in the parameter
+ * memory. The scheduler is also idle between the passes of a
+ * multi-pass scene, but the scene stays dirty until rasterized.
+ */
+
+int psb_scheduler_ta_mem_unused(struct drm_psb_private *dev_priv)
+{
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	int ret;
+
+	spin_lock_bh(&scheduler->lock);
+	psb_scheduler_take_submitted(scheduler);
+	ret = (scheduler->idle &&
+	       scheduler->dirty_scenes == 0 &&
+	       list_empty(&scheduler->raster_queue) &&
+	       list_empty(&scheduler->ta_queue) &&
+	       list_empty(&scheduler->hp_raster_queue));
+	psb_scheduler_unlock(scheduler);
 	return ret;
 }
 
@@ -602,6 +1022,8 @@ static void psb_ta_oom(struct drm_psb_private *dev_priv,
 	if (task->aborting)
 		return;
 	task->aborting = 1;
+	psb_trace(scheduler, PSB_TRACE_TA_OOM, task, 0);
+	atomic_inc(&dev_priv->ta_mem_ooms);
 
 	DRM_INFO("Info: TA out of parameter memory.\n");
 
@@ -685,7 +1107,7 @@ static void psb_vistest_reply(struct drm_psb_private *dev_priv,
 
 	if (list_empty(&task->head)) {
 		list_add_tail(&task->head, &scheduler->task_done_queue);
-		schedule_delayed_work(&scheduler->wq, 1);
+		schedule_delayed_work(&scheduler->wq, 0);
 	} else
 		psb_schedule_ta(dev_priv, scheduler);
 }
@@ -732,52 +1154,59 @@ static int psb_user_interrupt(struct drm_psb_private *dev_priv,
 	/*
 	 * Xhw cannot write directly to the comm page, so
 	 * do it here. Firmware would have written directly.
+	 * With a request ring, there may be several replies to
+	 * handle, in order.
 	 */
 
-	ret = psb_xhw_handler(dev_priv);
-	if (unlikely(ret))
-		return ret;
+	do {
+		ret = psb_xhw_handler(dev_priv);
+		if (unlikely(ret < 0))
+			return ret;
+
+		spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+		type = dev_priv->comm[PSB_COMM_USER_IRQ];
+		dev_priv->comm[PSB_COMM_USER_IRQ] = 0;
+		if (dev_priv->comm[PSB_COMM_USER_IRQ_LOST]) {
+			dev_priv->comm[PSB_COMM_USER_IRQ_LOST] = 0;
+			DRM_ERROR("Lost Poulsbo hardware event.\n");
+		}
+		spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 
-	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
-	type = dev_priv->comm[PSB_COMM_USER_IRQ];
-	dev_priv->comm[PSB_COMM_USER_IRQ] = 0;
-	if (dev_priv->comm[PSB_COMM_USER_IRQ_LOST]) {
-		dev_priv->comm[PSB_COMM_USER_IRQ_LOST] = 0;
-		DRM_ERROR("Lost Poulsbo hardware event.\n");
-	}
-	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+		if (type == 0)
+			continue;
 
-	if (type == 0)
-		return 0;
+		psb_trace(scheduler, PSB_TRACE_USER_IRQ, NULL, type);
+
+		switch (type) {
+		case PSB_UIRQ_VISTEST:
+			psb_vistest_reply(dev_priv, scheduler);
+			break;
+		case PSB_UIRQ_OOM_REPLY:
+			psb_ta_oom_reply(dev_priv, scheduler);
+			break;
+		case PSB_UIRQ_FIRE_TA_REPLY:
+			psb_ta_fire_reply(dev_priv, scheduler);
+			break;
+		case PSB_UIRQ_FIRE_RASTER_REPLY:
+			psb_raster_fire_reply(dev_priv, scheduler);
+			break;
+		default:
+			DRM_ERROR("Unknown Poulsbo hardware event. %d\n",
+				  type);
+		}
+	} while (ret > 0);
 
-	switch (type) {
-	case PSB_UIRQ_VISTEST:
-		psb_vistest_reply(dev_priv, scheduler);
-		break;
-	case PSB_UIRQ_OOM_REPLY:
-		psb_ta_oom_reply(dev_priv, scheduler);
-		break;
-	case PSB_UIRQ_FIRE_TA_REPLY:
-		psb_ta_fire_reply(dev_priv, scheduler);
-		break;
-	case PSB_UIRQ_FIRE_RASTER_REPLY:
-		psb_raster_fire_reply(dev_priv, scheduler);
-		break;
-	default:
-		DRM_ERROR("Unknown Poulsbo hardware event. %d\n", type);
-	}
 	return 0;
 }
 
 int psb_forced_user_interrupt(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 	int ret;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
 	ret = psb_user_interrupt(dev_priv, scheduler);
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 	return ret;
 }
 
@@ -789,6 +1218,14 @@ static void psb_dispatch_ta(struct drm_psb_private *dev_priv,
 	uint32_t flags;
 	uint32_t mask;
 
+	/*
+	 * The task may have been dropped by a lockup reset after the
+	 * event was latched.
+	 */
+
+	if (unlikely(!task))
+		return;
+
 	task->reply_flags |= reply_flag;
 	flags = task->reply_flags;
 	mask = PSB_RF_FIRE_TA;
@@ -824,6 +1261,9 @@ static void psb_dispatch_raster(struct drm_psb_private *dev_priv,
 	uint32_t flags;
 	uint32_t mask;
 
+	if (unlikely(!task))
+		return;
+
 	task->reply_flags |= reply_flag;
 	flags = task->reply_flags;
 	mask = PSB_RF_FIRE_RASTER;
@@ -841,8 +1281,8 @@ static void psb_dispatch_raster(struct drm_psb_private *dev_priv,
 
 	if (task->raster_complete_action == PSB_RETURN &&
 	    (reply_flag & PSB_RF_RASTER_DONE) && task->scene != NULL) {
-		psb_report_fence(scheduler, task->engine, task->sequence,
-				 _PSB_FENCE_RASTER_DONE_SHIFT, 1);
+		psb_report_fence_ordered(scheduler, task,
+					 _PSB_FENCE_RASTER_DONE_SHIFT);
 	}
 
 	mask = PSB_RF_RASTER_DONE | PSB_RF_DEALLOC;
@@ -852,12 +1292,82 @@ static void psb_dispatch_raster(struct drm_psb_private *dev_priv,
 	}
 }
 
+/*
+ * Latch scheduler events for the tasklet. May be called from any
+ * context, and doesn't take the scheduler lock.
+ */
+
+static void psb_scheduler_latch(struct psb_scheduler *scheduler,
+				uint32_t events)
+{
+	int old;
+
+	do {
+		old = atomic_read(&scheduler->events);
+		if ((old | events) == old)
+			break;
+	} while (atomic_cmpxchg(&scheduler->events, old, old | events) != old);
+
+	tasklet_schedule(&scheduler->tasklet);
+}
+
+/*
+ * Drop latched events that haven't been handled yet.
+ */
+
+static void psb_scheduler_unlatch(struct psb_scheduler *scheduler,
+				  uint32_t events)
+{
+	int old;
+
+	do {
+		old = atomic_read(&scheduler->events);
+		if ((old & ~events) == old)
+			break;
+	} while (atomic_cmpxchg(&scheduler->events, old, old & ~events) !=
+		 old);
+}
+
+/*
+ * Interrupt handler part. Only latches the event status; the
+ * completion handling and firing of new tasks, which involve xhw
+ * replies, fence signaling and register writes, run in the tasklet.
+ */
+
 void psb_scheduler_handler(struct drm_psb_private *dev_priv, uint32_t status)
 {
-	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	status &= PSB_SCHED_EVENTS & ~PSB_SCHED_EVENT_2D_IDLE;
+	if (status)
+		psb_scheduler_latch(&dev_priv->scheduler, status);
+}
+
+#ifdef FIX_TG_16
+static void psb_ta_2d_idle(struct drm_psb_private *dev_priv,
+			   struct psb_scheduler *scheduler);
+#endif
+
+/*
+ * The events are handled in the order the interrupt handler used to
+ * handle them. An event can't be latched twice before it is handled,
+ * since the engine it comes from isn't restarted until then. Submitted
+ * tasks are queued first, so that they are seen by the picks, and the
+ * engines are kicked for them last.
+ */
+
+static void psb_scheduler_tasklet(unsigned long data)
+{
+	struct psb_scheduler *scheduler = (struct psb_scheduler *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)scheduler->dev->dev_private;
+	uint32_t status = atomic_xchg(&scheduler->events, 0);
+
+	if (!status)
+		return;
 
-	spin_lock(&scheduler->lock);
+	spin_lock_bh(&scheduler->lock);
 
+	if (status & PSB_SCHED_EVENT_SUBMIT)
+		psb_scheduler_take_submitted(scheduler);
 	if (status & _PSB_CE_PIXELBE_END_RENDER) {
 		psb_dispatch_raster(dev_priv, scheduler, PSB_RF_RASTER_DONE);
 	}
@@ -881,27 +1391,258 @@ void psb_scheduler_handler(struct drm_psb_private *dev_priv, uint32_t status)
 	if (status & _PSB_CE_SW_EVENT) {
 		psb_user_interrupt(dev_priv, scheduler);
 	}
-	spin_unlock(&scheduler->lock);
+#ifdef FIX_TG_16
+	if (status & PSB_SCHED_EVENT_2D_IDLE) {
+		psb_ta_2d_idle(dev_priv, scheduler);
+	}
+#endif
+	if (status & PSB_SCHED_EVENT_SUBMIT) {
+		psb_schedule_ta(dev_priv, scheduler);
+		psb_schedule_raster(dev_priv, scheduler);
+	}
+	psb_scheduler_unlock(scheduler);
+}
+
+/*
+ * Tasks are allocated from a dedicated slab cache. They are large,
+ * mostly because of the inline command arrays, and are allocated and
+ * freed at frame rate.
+ */
+
+static struct kmem_cache *psb_task_cache;
+
+int psb_task_cache_init(void)
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23))
+	psb_task_cache = kmem_cache_create("psb_task", sizeof(struct psb_task),
+					   0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+#else
+	psb_task_cache = kmem_cache_create("psb_task", sizeof(struct psb_task),
+					   0, SLAB_HWCACHE_ALIGN, NULL);
+#endif
+	return (psb_task_cache) ? 0 : -ENOMEM;
+}
+
+void psb_task_cache_takedown(void)
+{
+	if (psb_task_cache) {
+		kmem_cache_destroy(psb_task_cache);
+		psb_task_cache = NULL;
+	}
+}
+
+static struct psb_task *psb_task_alloc(void)
+{
+	struct psb_task *task;
+
+	task = kmem_cache_zalloc(psb_task_cache, GFP_KERNEL);
+	if (!task)
+		return NULL;
+
+	atomic_set(&task->buf.done, 1);
+	INIT_LIST_HEAD(&task->head);
+	INIT_LIST_HEAD(&task->ta_pending_head);
+	INIT_LIST_HEAD(&task->raster_pending_head);
+	INIT_LIST_HEAD(&task->buf.head);
+	return task;
+}
+
+static void psb_task_free(struct psb_task *task)
+{
+	kmem_cache_free(psb_task_cache, task);
+}
+
+/*
+ * Scheduler admission control.
+ *
+ * The engines pick between clients' queued tasks themselves, see
+ * psb_sched_pick(). Admission bounds how much each client may have
+ * queued, which keeps the queues short and the time a client waits
+ * for a pick bounded: while other clients have tasks queued, a client
+ * may only have PSB_SCHED_CLIENT_QUOTA of its own queued, or
+ * PSB_SCHED_PRIORITY_WEIGHT times that for priority submissions, and
+ * waits for its own tasks to retire before queueing more. A client
+ * running alone may queue up to PSB_SCHED_CLIENT_MAX tasks.
+ *
+ * Queue slots are reserved by psb_scheduler_admit() under the submit
+ * lock, so concurrent submitters of one client can't overshoot its
+ * share, and a batch is charged for every task it queues. Reserved
+ * slots are handed to tasks through the validate context, and slots
+ * left unused by a failed submission are returned with
+ * psb_scheduler_unreserve().
+ */
+
+struct psb_sched_client *psb_sched_client_alloc(void)
+{
+	struct psb_sched_client *client;
+
+	client = drm_calloc(1, sizeof(*client), DRM_MEM_DRIVER);
+	if (!client)
+		return NULL;
+
+	atomic_set(&client->ref_count, 1);
+	atomic_set(&client->queued, 0);
+	return client;
+}
+
+void psb_sched_client_unref(struct psb_sched_client **client)
+{
+	struct psb_sched_client *tmp = *client;
+
+	*client = NULL;
+	if (tmp && atomic_dec_and_test(&tmp->ref_count))
+		drm_free(tmp, sizeof(*tmp), DRM_MEM_DRIVER);
+}
+
+/*
+ * Number of queue slots the client may still take. Called with the
+ * submit lock held. Slots are only given back without the lock,
+ * so the result can only be pessimistic.
+ */
+
+static int psb_scheduler_may_admit(struct psb_scheduler *scheduler,
+				   struct psb_sched_client *client,
+				   int quota)
+{
+	int own = atomic_read(&client->queued);
+	int others = atomic_read(&scheduler->queued) - own;
+	int limit = (others <= 0) ? PSB_SCHED_CLIENT_MAX : quota;
+
+	return (own < limit) ? limit - own : 0;
+}
+
+/*
+ * Reserve between one and num queue slots for the client, waiting
+ * until at least one is available. Returns the number of slots
+ * reserved, or a negative error code.
+ */
+
+int psb_scheduler_admit(struct drm_psb_private *dev_priv,
+			struct psb_sched_client *client, int priority,
+			unsigned num)
+{
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	int quota = PSB_SCHED_CLIENT_QUOTA;
+	int avail;
+	int ret = 0;
+	DEFINE_WAIT(wait);
+
+	if (!client || num == 0)
+		return num;
+
+	if (priority)
+		quota *= PSB_SCHED_PRIORITY_WEIGHT;
+
+	for (;;) {
+		prepare_to_wait(&scheduler->admit_queue, &wait,
+				TASK_INTERRUPTIBLE);
+
+		spin_lock_bh(&scheduler->submit_lock);
+		avail = psb_scheduler_may_admit(scheduler, client, quota);
+		if (avail > 0) {
+			ret = ((unsigned)avail < num) ? avail : num;
+			atomic_add(ret, &client->queued);
+			atomic_add(ret, &scheduler->queued);
+		}
+		spin_unlock_bh(&scheduler->submit_lock);
+
+		if (ret)
+			break;
+		if (signal_pending(current)) {
+			ret = -EAGAIN;
+			break;
+		}
+		schedule();
+	}
+	finish_wait(&scheduler->admit_queue, &wait);
+
+	return ret;
+}
+
+void psb_scheduler_unreserve(struct drm_psb_private *dev_priv,
+			     struct psb_sched_client *client, unsigned num)
+{
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+
+	if (!client || num == 0)
+		return;
+
+	atomic_sub(num, &client->queued);
+	atomic_sub(num, &scheduler->queued);
+	wake_up(&scheduler->admit_queue);
+}
+
+/*
+ * Charge a task to the client, using one of the slots reserved for
+ * the submission.
+ */
+
+static void psb_scheduler_queued(struct psb_scheduler *scheduler,
+				 struct psb_task *task,
+				 struct psb_sched_client *client,
+				 struct psb_validate_ctx *ctx)
+{
+	if (!client)
+		return;
+
+	atomic_inc(&client->ref_count);
+	task->client = client;
+	task->priority = ctx->sched_priority;
+	task->ordered = ctx->sched_ordered;
+	if (likely(ctx->sched_reserved != 0)) {
+		ctx->sched_reserved--;
+	} else {
+		atomic_inc(&client->queued);
+		atomic_inc(&scheduler->queued);
+	}
+}
+
+static void psb_scheduler_retired(struct psb_scheduler *scheduler,
+				  struct psb_task *task)
+{
+	if (!task->client)
+		return;
+
+	atomic_dec(&task->client->queued);
+	atomic_dec(&scheduler->queued);
+	psb_sched_client_unref(&task->client);
+	wake_up(&scheduler->admit_queue);
 }
 
+/*
+ * Reclaim completed tasks. The work is queued by the completion paths
+ * that put tasks on the done queue, and by the xhw code when it
+ * completes the buffer of a task on the reclaim queue, so it never has
+ * to poll.
+ */
+
 static void psb_free_task_wq(struct work_struct *work)
 {
 	struct psb_scheduler *scheduler =
 	    container_of(work, struct psb_scheduler, wq.work);
 
 	struct drm_device *dev = scheduler->dev;
-	struct list_head *list, *next;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_task *task, *next;
 	unsigned long irq_flags;
-	struct psb_task *task;
+	struct list_head done;
+	int free;
 
-	if (!mutex_trylock(&scheduler->task_wq_mutex))
-		return;
+	INIT_LIST_HEAD(&done);
+	mutex_lock(&scheduler->task_wq_mutex);
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
-	list_for_each_safe(list, next, &scheduler->task_done_queue) {
-		task = list_entry(list, struct psb_task, head);
-		list_del_init(list);
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	list_splice_init(&scheduler->task_done_queue, &done);
+	psb_scheduler_unlock(scheduler);
+
+	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+	list_splice_init(&scheduler->task_reclaim_queue, &done);
+	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+
+	list_for_each_entry_safe(task, next, &done, head) {
+		list_del_init(&task->head);
+		psb_scheduler_retired(scheduler, task);
 
 		PSB_DEBUG_RENDER("Checking Task %d: Scene 0x%08lx, "
 				 "Feedback bo 0x%08lx, done %d\n",
@@ -921,20 +1662,19 @@ static void psb_free_task_wq(struct work_struct *work)
 			mutex_unlock(&dev->struct_mutex);
 		}
 
-		if (atomic_read(&task->buf.done)) {
+		spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+		free = atomic_read(&task->buf.done);
+		if (!free)
+			list_add_tail(&task->head,
+				      &scheduler->task_reclaim_queue);
+		spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+
+		if (free) {
 			PSB_DEBUG_RENDER("Deleting task %d\n", task->sequence);
-			drm_free(task, sizeof(*task), DRM_MEM_DRIVER);
-			task = NULL;
+			psb_trace(scheduler, PSB_TRACE_FREE, task, 0);
+			psb_task_free(task);
 		}
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
-		if (task != NULL)
-			list_add(list, &scheduler->task_done_queue);
 	}
-	if (!list_empty(&scheduler->task_done_queue)) {
-		PSB_DEBUG_RENDER("Rescheduling wq\n");
-		schedule_delayed_work(&scheduler->wq, 1);
-	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
 
 	mutex_unlock(&scheduler->task_wq_mutex);
 }
@@ -948,12 +1688,12 @@ static void psb_free_task_wq(struct work_struct *work)
 void psb_scheduler_ta_mem_check(struct drm_psb_private *dev_priv)
 {
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
 	struct psb_task *task;
 	struct psb_task *next_task;
 
 	dev_priv->force_ta_mem_load = 1;
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	psb_scheduler_take_submitted(scheduler);
 	list_for_each_entry_safe(task, next_task, &scheduler->ta_queue, head) {
 		if (task->scene) {
 			dev_priv->force_ta_mem_load = 0;
@@ -967,7 +1707,7 @@ void psb_scheduler_ta_mem_check(struct drm_psb_private *dev_priv)
 			break;
 		}
 	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 }
 
 void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
@@ -977,11 +1717,10 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 	unsigned long cur_jiffies;
 	struct psb_task *task;
 	struct psb_task *next_task;
-	unsigned long irq_flags;
 
 	psb_scheduler_pause(dev_priv);
 	if (!psb_scheduler_idle(dev_priv)) {
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
+		spin_lock_bh(&scheduler->lock);
 
 		cur_jiffies = jiffies;
 		wait_jiffies = cur_jiffies;
@@ -993,7 +1732,7 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 			wait_jiffies = scheduler->raster_end_jiffies;
 
 		wait_jiffies -= cur_jiffies;
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+		psb_scheduler_unlock(scheduler);
 
 		(void)wait_event_timeout(scheduler->idle_queue,
 					 psb_scheduler_idle(dev_priv),
@@ -1001,7 +1740,7 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 	}
 
 	if (!psb_scheduler_idle(dev_priv)) {
-		spin_lock_irqsave(&scheduler->lock, irq_flags);
+		spin_lock_bh(&scheduler->lock);
 		task = scheduler->current_task[PSB_SCENE_ENGINE_RASTER];
 		if (task) {
 			DRM_ERROR("Detected Poulsbo rasterizer lockup.\n");
@@ -1013,11 +1752,15 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 						error_condition);
 
 				list_del(&task->head);
+				list_del_init(&task->raster_pending_head);
 				psb_xhw_clean_buf(dev_priv, &task->buf);
 				list_add_tail(&task->head,
 					      &scheduler->task_done_queue);
+			} else if (task->has_deadline) {
+				psb_insert_deadline(scheduler, task);
 			} else {
 				list_add(&task->head, &scheduler->raster_queue);
+				task->resume = 1;
 			}
 		}
 		scheduler->current_task[PSB_SCENE_ENGINE_RASTER] = NULL;
@@ -1031,20 +1774,33 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 		}
 		scheduler->current_task[PSB_SCENE_ENGINE_TA] = NULL;
 		scheduler->ta_state = 0;
+		psb_account_overlap(scheduler);
+
+		/*
+		 * Engine events latched for the tasks dropped above are
+		 * stale. Xhw replies, submissions and 2D idle events are
+		 * still handled.
+		 */
+
+		psb_scheduler_unlatch(scheduler, PSB_SCHED_EVENTS &
+				      ~(_PSB_CE_SW_EVENT |
+					PSB_SCHED_EVENT_SUBMIT |
+					PSB_SCHED_EVENT_2D_IDLE));
 
 #ifdef FIX_TG_16
 		atomic_set(&dev_priv->ta_wait_2d, 0);
 		atomic_set(&dev_priv->ta_wait_2d_irq, 0);
 		wake_up(&dev_priv->queue_2d);
 #endif
-		spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+		psb_scheduler_unlock(scheduler);
 	}
 
 	/*
-	 * Empty raster queue.
+	 * Empty raster queues.
 	 */
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	list_splice_init(&scheduler->hp_raster_queue, &scheduler->raster_queue);
 	list_for_each_entry_safe(task, next_task, &scheduler->raster_queue,
 				 head) {
 		struct psb_scene *scene = task->scene;
@@ -1057,6 +1813,7 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 				_PSB_FENCE_TYPE_SCENE_DONE |
 				_PSB_FENCE_TYPE_FEEDBACK, error_condition);
 		if (scene) {
+			psb_scene_clear_dirty(scheduler, scene);
 			scene->flags = 0;
 			if (scene->hw_scene) {
 				list_add_tail(&scene->hw_scene->head,
@@ -1067,14 +1824,25 @@ void psb_scheduler_reset(struct drm_psb_private *dev_priv, int error_condition)
 
 		psb_xhw_clean_buf(dev_priv, &task->buf);
 		list_del(&task->head);
+		list_del_init(&task->ta_pending_head);
+		list_del_init(&task->raster_pending_head);
 		list_add_tail(&task->head, &scheduler->task_done_queue);
 	}
 
-	schedule_delayed_work(&scheduler->wq, 1);
+	/*
+	 * Completed sequences may have been held back by the tasks
+	 * removed above.
+	 */
+
+	psb_report_fence_ordered(scheduler, NULL, _PSB_FENCE_TA_DONE_SHIFT);
+	psb_report_fence_ordered(scheduler, NULL,
+				 _PSB_FENCE_RASTER_DONE_SHIFT);
+
+	schedule_delayed_work(&scheduler->wq, 0);
 	scheduler->idle = 1;
 	wake_up(&scheduler->idle_queue);
 
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 	psb_scheduler_restart(dev_priv);
 
 }
@@ -1087,16 +1855,30 @@ int psb_scheduler_init(struct drm_device *dev, struct psb_scheduler *scheduler)
 	memset(scheduler, 0, sizeof(*scheduler));
 	scheduler->dev = dev;
 	mutex_init(&scheduler->task_wq_mutex);
+	mutex_init(&scheduler->trace.mutex);
 	scheduler->lock = SPIN_LOCK_UNLOCKED;
+	scheduler->submit_lock = SPIN_LOCK_UNLOCKED;
 	scheduler->idle = 1;
 
+	INIT_LIST_HEAD(&scheduler->submit_queue);
 	INIT_LIST_HEAD(&scheduler->ta_queue);
 	INIT_LIST_HEAD(&scheduler->raster_queue);
 	INIT_LIST_HEAD(&scheduler->hp_raster_queue);
 	INIT_LIST_HEAD(&scheduler->hw_scenes);
 	INIT_LIST_HEAD(&scheduler->task_done_queue);
+	INIT_LIST_HEAD(&scheduler->ta_pending);
+	INIT_LIST_HEAD(&scheduler->raster_pending);
+	INIT_LIST_HEAD(&scheduler->task_reclaim_queue);
+	INIT_LIST_HEAD(&scheduler->scene_clear_queue);
+	INIT_WORK(&scheduler->scene_clear_wq, &psb_scene_clear_wq);
+	init_waitqueue_head(&scheduler->scene_clear_wait);
+	atomic_set(&scheduler->queued, 0);
+	init_waitqueue_head(&scheduler->admit_queue);
 	INIT_DELAYED_WORK(&scheduler->wq, &psb_free_task_wq);
 	init_waitqueue_head(&scheduler->idle_queue);
+	atomic_set(&scheduler->events, 0);
+	tasklet_init(&scheduler->tasklet, psb_scheduler_tasklet,
+		     (unsigned long)scheduler);
 
 	for (i = 0; i < PSB_NUM_HW_SCENES; ++i) {
 		hw_scene = &scheduler->hs[i];
@@ -1104,10 +1886,6 @@ int psb_scheduler_init(struct drm_device *dev, struct psb_scheduler *scheduler)
 		list_add_tail(&hw_scene->head, &scheduler->hw_scenes);
 	}
 
-	for (i = 0; i < _PSB_ENGINE_TA_FENCE_TYPES; ++i) {
-		scheduler->seq[i].reported = 0;
-	}
-
 	return 0;
 }
 
@@ -1122,10 +1900,11 @@ void psb_scheduler_remove_scene_refs(struct psb_scene *scene)
 	    (struct drm_psb_private *)scene->dev->dev_private;
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
 	struct psb_hw_scene *hw_scene;
-	unsigned long irq_flags;
 	unsigned int i;
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+	spin_lock_bh(&scheduler->lock);
+	if (scene->flags & PSB_SCENE_FLAG_DIRTY)
+		scheduler->dirty_scenes--;
 	for (i = 0; i < PSB_NUM_HW_SCENES; ++i) {
 		hw_scene = &scheduler->hs[i];
 		if (hw_scene->last_scene == scene) {
@@ -1133,12 +1912,40 @@ void psb_scheduler_remove_scene_refs(struct psb_scene *scene)
 			hw_scene->last_scene = NULL;
 		}
 	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+	psb_scheduler_unlock(scheduler);
 }
 
 void psb_scheduler_takedown(struct psb_scheduler *scheduler)
 {
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)scheduler->dev->dev_private;
+	struct psb_task *task, *next;
+	unsigned long irq_flags;
+	struct list_head reclaim;
+
+	tasklet_kill(&scheduler->tasklet);
 	flush_scheduled_work();
+
+	/*
+	 * The xhw queue is emptied at lastclose, so nothing should be
+	 * left here. Don't leak into the task cache if something is.
+	 */
+
+	INIT_LIST_HEAD(&reclaim);
+	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+	list_splice_init(&scheduler->task_reclaim_queue, &reclaim);
+	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+
+	list_for_each_entry_safe(task, next, &reclaim, head) {
+		DRM_ERROR("Task %d xhw buffer never completed.\n",
+			  task->sequence);
+		psb_xhw_clean_buf(dev_priv, &task->buf);
+		list_del(&task->head);
+		psb_scheduler_retired(scheduler, task);
+		psb_task_free(task);
+	}
+
+	psb_trace_takedown(scheduler);
 }
 
 static int psb_setup_task_devlocked(struct drm_device *dev,
@@ -1167,14 +1974,11 @@ static int psb_setup_task_devlocked(struct drm_device *dev,
 		return -EINVAL;
 	}
 
-	task = drm_calloc(1, sizeof(*task), DRM_MEM_DRIVER);
+	task = psb_task_alloc();
 	if (!task)
 		return -ENOMEM;
 
-	atomic_set(&task->buf.done, 1);
 	task->engine = engine;
-	INIT_LIST_HEAD(&task->head);
-	INIT_LIST_HEAD(&task->buf.head);
 	if (ta_cmd_buffer && arg->ta_size != 0) {
 		task->ta_cmd_size = arg->ta_size;
 		ret = psb_submit_copy_cmdbuf(dev, ta_cmd_buffer,
@@ -1222,7 +2026,7 @@ static int psb_setup_task_devlocked(struct drm_device *dev,
 	*task_p = task;
 	return 0;
       out_err:
-	drm_free(task, sizeof(*task), DRM_MEM_DRIVER);
+	psb_task_free(task);
 	*task_p = NULL;
 	return ret;
 }
@@ -1234,6 +2038,7 @@ int psb_cmdbuf_ta(struct drm_file *priv,
 		  struct drm_buffer_object *oom_buffer,
 		  struct psb_scene *scene,
 		  struct psb_feedback_info *feedback,
+		  struct psb_validate_ctx *ctx,
 		  struct drm_fence_arg *fence_arg)
 {
 	struct drm_device *dev = priv->head->dev;
@@ -1242,6 +2047,7 @@ int psb_cmdbuf_ta(struct drm_file *priv,
 	struct psb_task *task = NULL;
 	int ret;
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	uint32_t sequence;
 
 	PSB_DEBUG_RENDER("Cmdbuf ta\n");
 
@@ -1260,29 +2066,24 @@ int psb_cmdbuf_ta(struct drm_file *priv,
 		goto out_err;
 
 	task->feedback = *feedback;
+	psb_scheduler_queued(scheduler, task, psb_fpriv(priv)->sched_client,
+			     ctx);
 
 	/*
 	 * Hand the task over to the scheduler.
 	 */
 
-	spin_lock_irq(&scheduler->lock);
-	task->sequence = psb_fence_advance_sequence(dev, PSB_ENGINE_TA);
-
 	task->ta_complete_action = PSB_RASTER;
 	task->raster_complete_action = PSB_RETURN;
 
-	list_add_tail(&task->head, &scheduler->ta_queue);
-	PSB_DEBUG_RENDER("queued ta %u\n", task->sequence);
+	sequence = psb_scheduler_submit(scheduler, task);
+	PSB_DEBUG_RENDER("queued ta %u\n", sequence);
 
-	psb_schedule_ta(dev_priv, scheduler);
-	spin_unlock_irq(&scheduler->lock);
-
-	psb_fence_or_sync(priv, PSB_ENGINE_TA, arg, fence_arg, &fence);
-	drm_regs_fence(&dev_priv->use_manager, fence);
+	psb_fence_or_sync(priv, PSB_ENGINE_TA, ctx, arg, fence_arg, &fence);
+	if (!(arg->fence_flags & PSB_FENCE_FLAG_DEFERRED))
+		drm_regs_fence(&dev_priv->use_manager, fence);
 	if (fence) {
-		spin_lock_irq(&scheduler->lock);
-		psb_report_fence(scheduler, PSB_ENGINE_TA, task->sequence, 0, 1);
-		spin_unlock_irq(&scheduler->lock);
+		psb_scheduler_fence_queued(dev_priv, sequence);
 		fence_arg->signaled |= DRM_FENCE_TYPE_EXE;
 	}
 
@@ -1309,6 +2110,7 @@ int psb_cmdbuf_ta(struct drm_file *priv,
 int psb_cmdbuf_raster(struct drm_file *priv,
 		      struct drm_psb_cmdbuf_arg *arg,
 		      struct drm_buffer_object *cmd_buffer,
+		      struct psb_validate_ctx *ctx,
 		      struct drm_fence_arg *fence_arg)
 {
 	struct drm_device *dev = priv->head->dev;
@@ -1317,8 +2119,7 @@ int psb_cmdbuf_raster(struct drm_file *priv,
 	struct psb_task *task = NULL;
 	int ret;
 	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-
-	uint32_t sequence_temp;
+	uint32_t sequence;
 
 	PSB_DEBUG_RENDER("Cmdbuf Raster\n");
 
@@ -1335,27 +2136,29 @@ int psb_cmdbuf_raster(struct drm_file *priv,
 	if (ret)
 		goto out_err;
 
+	psb_scheduler_queued(scheduler, task, psb_fpriv(priv)->sched_client,
+			     ctx);
+
 	/*
 	 * Hand the task over to the scheduler.
 	 */
 
-	spin_lock_irq(&scheduler->lock);
-	task->sequence = psb_fence_advance_sequence(dev, PSB_ENGINE_TA);
-	sequence_temp = task->sequence; // backup for the change
 	task->ta_complete_action = PSB_RASTER;
 	task->raster_complete_action = PSB_RETURN;
 
-	list_add_tail(&task->head, &scheduler->ta_queue);
-	PSB_DEBUG_RENDER("queued raster %u\n", task->sequence);
-	psb_schedule_ta(dev_priv, scheduler);
-	spin_unlock_irq(&scheduler->lock);
+	if (arg->ta_flags & PSB_CMDBUF_FLAG_DEADLINE) {
+		task->has_deadline = 1;
+		task->deadline = arg->deadline;
+	}
+
+	sequence = psb_scheduler_submit(scheduler, task);
+	PSB_DEBUG_RENDER("queued raster %u\n", sequence);
 
-	psb_fence_or_sync(priv, PSB_ENGINE_TA, arg, fence_arg, &fence);
-	drm_regs_fence(&dev_priv->use_manager, fence);
+	psb_fence_or_sync(priv, PSB_ENGINE_TA, ctx, arg, fence_arg, &fence);
+	if (!(arg->fence_flags & PSB_FENCE_FLAG_DEFERRED))
+		drm_regs_fence(&dev_priv->use_manager, fence);
 	if (fence) {
-		spin_lock_irq(&scheduler->lock);
-		psb_report_fence(scheduler, PSB_ENGINE_TA, sequence_temp, 0, 1);
-		spin_unlock_irq(&scheduler->lock);
+		psb_scheduler_fence_queued(dev_priv, sequence);
 		fence_arg->signaled |= DRM_FENCE_TYPE_EXE;
 	}
       out_err:
@@ -1374,12 +2177,37 @@ int psb_cmdbuf_raster(struct drm_file *priv,
 	return ret;
 }
 
+/*
+ * Signal the EXE type of a TA class fence once it is emitted, after its
+ * tasks were submitted. EXE sequences are only latched by submitters,
+ * under the submit lock.
+ */
+
+void psb_scheduler_fence_queued(struct drm_psb_private *dev_priv,
+				uint32_t sequence)
+{
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+	struct psb_scheduler_seq *seq = &scheduler->seq[0];
+
+	spin_lock_bh(&scheduler->submit_lock);
+	if ((int32_t) (sequence - seq->sequence) > 0)
+		seq->sequence = sequence;
+	spin_unlock_bh(&scheduler->submit_lock);
+
+	psb_fence_handler(scheduler->dev, PSB_ENGINE_TA);
+}
+
 #ifdef FIX_TG_16
 
 static int psb_check_2d_idle(struct drm_psb_private *dev_priv)
 {
+	static const uint32_t idle_cmds[] = { PSB_2D_FENCE_BH,
+		PSB_2D_FLUSH_BH
+	};
+
 	if (psb_2d_trylock(dev_priv)) {
-		if ((PSB_RSGX32(PSB_CR_2D_SOCIF) == _PSB_C2_SOCIF_EMPTY) &&
+		if (psb_2d_ring_empty(dev_priv) &&
+		    (PSB_RSGX32(PSB_CR_2D_SOCIF) == _PSB_C2_SOCIF_EMPTY) &&
 		    !((PSB_RSGX32(PSB_CR_2D_BLIT_STATUS) &
 		       _PSB_C2B_STATUS_BUSY))) {
 			return 0;
@@ -1387,9 +2215,16 @@ static int psb_check_2d_idle(struct drm_psb_private *dev_priv)
 		if (atomic_cmpxchg(&dev_priv->ta_wait_2d_irq, 0, 1) == 0)
 			psb_2D_irq_on(dev_priv);
 
-		PSB_WSGX32(PSB_2D_FENCE_BH, PSB_SGX_2D_SLAVE_PORT);
-		PSB_WSGX32(PSB_2D_FLUSH_BH, PSB_SGX_2D_SLAVE_PORT);
-		(void)PSB_RSGX32(PSB_SGX_2D_SLAVE_PORT);
+		/*
+		 * Queue behind whatever is in the 2D ring. If the
+		 * reserve is already taken, an earlier idle fence is
+		 * still queued and will raise the interrupt for us.
+		 */
+
+		if (psb_2d_ring_space(dev_priv) >= ARRAY_SIZE(idle_cmds))
+			psb_2d_ring_write(dev_priv, idle_cmds,
+					  ARRAY_SIZE(idle_cmds));
+		psb_2d_ring_drain(dev_priv);
 
 		psb_2d_atomic_unlock(dev_priv);
 	}
@@ -1409,20 +2244,33 @@ static void psb_atomic_resume_ta_2d_idle(struct drm_psb_private *dev_priv)
 	}
 }
 
+/*
+ * Called from the 2D fence handler, possibly in interrupt context.
+ * Resuming the TA is left to the scheduler tasklet.
+ */
+
 void psb_resume_ta_2d_idle(struct drm_psb_private *dev_priv)
 {
-	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
+	psb_scheduler_latch(&dev_priv->scheduler, PSB_SCHED_EVENT_2D_IDLE);
+}
 
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
+/*
+ * Call with the scheduler spinlock held. Handles both the 2D idle
+ * interrupt and the 2D lock being released, see psb_2d_unlock().
+ */
+
+static void psb_ta_2d_idle(struct drm_psb_private *dev_priv,
+			   struct psb_scheduler *scheduler)
+{
 	if (atomic_cmpxchg(&dev_priv->ta_wait_2d_irq, 1, 0) == 1) {
 		atomic_set(&dev_priv->ta_wait_2d, 0);
 		psb_2D_irq_off(dev_priv);
 		psb_schedule_ta(dev_priv, scheduler);
 		if (atomic_read(&dev_priv->waiters_2d) != 0)
 			wake_up(&dev_priv->queue_2d);
+	} else if (atomic_read(&dev_priv->ta_wait_2d) != 0) {
+		psb_atomic_resume_ta_2d_idle(dev_priv);
 	}
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
 }
 
 /*
@@ -1442,16 +2290,17 @@ static void psb_2d_atomic_unlock(struct drm_psb_private *dev_priv)
 		wake_up(&dev_priv->queue_2d);
 }
 
+/*
+ * May be called in interrupt context, where the scheduler lock can't
+ * be taken, so resuming a waiting TA is left to the tasklet.
+ */
+
 void psb_2d_unlock(struct drm_psb_private *dev_priv)
 {
-	struct psb_scheduler *scheduler = &dev_priv->scheduler;
-	unsigned long irq_flags;
-
-	spin_lock_irqsave(&scheduler->lock, irq_flags);
 	psb_2d_atomic_unlock(dev_priv);
 	if (atomic_read(&dev_priv->ta_wait_2d) != 0)
-		psb_atomic_resume_ta_2d_idle(dev_priv);
-	spin_unlock_irqrestore(&scheduler->lock, irq_flags);
+		psb_scheduler_latch(&dev_priv->scheduler,
+				    PSB_SCHED_EVENT_2D_IDLE);
 }
 
 void psb_2d_lock(struct drm_psb_private *dev_priv)
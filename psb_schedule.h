@@ -27,6 +27,7 @@
 #define _PSB_SCHEDULE_H_
 
 #include "drmP.h"
+#include <linux/interrupt.h>
 
 enum psb_task_type {
 	psb_ta_midscene_task,
@@ -39,12 +40,22 @@ enum psb_task_type {
 #define PSB_MAX_RASTER_CMDS 60
 #define PSB_MAX_OOM_CMDS 6
 
+struct drm_psb_private;
+
+/*
+ * If complete is set, it's called when the buffer is done, with the
+ * xhw_lock held and possibly from interrupt context. It must not
+ * queue xhw buffers itself.
+ */
+
 struct psb_xhw_buf {
 	struct list_head head;
 	int copy_back;
 	atomic_t done;
 	struct drm_psb_xhw_arg arg;
-
+	void (*complete) (struct drm_psb_private *dev_priv,
+			  struct psb_xhw_buf *buf);
+	uint64_t issue_ns;
 };
 
 struct psb_feedback_info {
@@ -73,6 +84,16 @@ struct psb_task {
 	uint32_t flags;
 	uint32_t reply_flags;
 	uint32_t aborting;
+	struct psb_sched_client *client;
+	int priority;
+	int ordered;
+	int resume;
+	struct list_head ta_pending_head;
+	struct list_head raster_pending_head;
+	int has_deadline;
+	uint64_t deadline;
+	uint64_t trace_time;
+	uint32_t trace_stage;
 	struct psb_xhw_buf buf;
 
 #ifdef PSB_DETEAR
@@ -97,11 +118,86 @@ struct psb_hw_scene {
 };
 
 struct psb_scene;
-struct drm_psb_private;
+struct psb_validate_ctx;
+
+/*
+ * Per-client scheduling state, referenced by the client's file and
+ * by each of its tasks until the task is retired.
+ */
+
+struct psb_sched_client {
+	atomic_t ref_count;
+	atomic_t queued;
+
+	/*
+	 * Pick order state, see psb_sched_pick(). Protected by the
+	 * scheduler lock.
+	 */
+
+	uint32_t pass[PSB_SCENE_NUM_ENGINES];
+	uint32_t scan;
+};
+
+#define PSB_SCHED_CLIENT_QUOTA      4
+#define PSB_SCHED_CLIENT_MAX        16
+#define PSB_SCHED_PRIORITY_WEIGHT   4
+#define PSB_SCHED_STRIDE            1024
+
+/*
+ * Sequences completed per TA fence type. sequence is latched by the
+ * scheduler, and reported is the last one psb_fence_poll() reported,
+ * under the fence manager lock.
+ */
 
 struct psb_scheduler_seq {
 	uint32_t sequence;
-	int reported;
+	uint32_t completed;
+	uint32_t reported;
+};
+
+/*
+ * Scheduler event trace. Events are written lock-free into a ring of
+ * PSB_TRACE_SIZE entries, and the time each task spends between two
+ * events is binned into a log2 microsecond histogram per stage, the
+ * stage being named by the event that started it. Event counts and the
+ * deepest queue seen give throughput figures for the traced interval.
+ */
+
+/*
+ * Scheduler events latched by the interrupt handler: the SGX event
+ * status bits, a software event raised when the 2D engine goes idle
+ * while the TA is waiting for it, and one raised by submitters when
+ * they put tasks on the submit queue.
+ */
+
+#define PSB_SCHED_EVENT_SUBMIT   (1 << 29)
+#define PSB_SCHED_EVENT_2D_IDLE  (1 << 30)
+
+#define PSB_SCHED_EVENTS (_PSB_CE_PIXELBE_END_RENDER |	\
+			  _PSB_CE_DPM_3D_MEM_FREE |	\
+			  _PSB_CE_TA_FINISHED |	\
+			  _PSB_CE_TA_TERMINATE |	\
+			  _PSB_CE_DPM_REACHED_MEM_THRESH |	\
+			  _PSB_CE_DPM_OUT_OF_MEMORY_GBL |	\
+			  _PSB_CE_DPM_OUT_OF_MEMORY_MT |	\
+			  _PSB_CE_DPM_TA_MEM_FREE |	\
+			  _PSB_CE_SW_EVENT |	\
+			  PSB_SCHED_EVENT_SUBMIT |	\
+			  PSB_SCHED_EVENT_2D_IDLE)
+
+#define PSB_TRACE_SIZE     4096
+#define PSB_TRACE_MASK     (PSB_TRACE_SIZE - 1)
+#define PSB_TRACE_BUCKETS  20
+
+struct psb_trace {
+	int enabled;
+	atomic_t head;
+	uint64_t start_ns;
+	struct drm_psb_trace_event *ring;
+	struct mutex mutex;
+	atomic_t hist[PSB_TRACE_NUM_EVENTS][PSB_TRACE_BUCKETS];
+	atomic_t count[PSB_TRACE_NUM_EVENTS];
+	int max_queued;
 };
 
 struct psb_scheduler {
@@ -110,11 +206,71 @@ struct psb_scheduler {
 	struct psb_hw_scene hs[PSB_NUM_HW_SCENES];
 	struct mutex task_wq_mutex;
 	spinlock_t lock;
+
+	/*
+	 * Events latched in interrupt context and handled by the
+	 * tasklet. The lock is never taken in interrupt context, so it
+	 * is taken with bottom halves off only. TA fences reported
+	 * under it are signaled after it is dropped, for the fence
+	 * classes in report_fences.
+	 */
+
+	atomic_t events;
+	struct tasklet_struct tasklet;
+	uint32_t report_fences;
+
+	/*
+	 * Submitted tasks, waiting for the tasklet to queue them. The
+	 * submit lock also serializes admission and the EXE sequence,
+	 * so submitters don't take the scheduler lock. It nests inside
+	 * the scheduler lock.
+	 */
+
+	spinlock_t submit_lock;
+	struct list_head submit_queue;
 	struct list_head hw_scenes;
 	struct list_head ta_queue;
 	struct list_head raster_queue;
 	struct list_head hp_raster_queue;
 	struct list_head task_done_queue;
+
+	/*
+	 * Tasks that haven't yet completed the TA or the rasterizer,
+	 * in sequence order, see psb_report_fence_ordered().
+	 */
+
+	struct list_head ta_pending;
+	struct list_head raster_pending;
+
+	/*
+	 * Completed tasks whose xhw buffer is still in flight.
+	 * Protected by dev_priv->xhw_lock.
+	 */
+
+	struct list_head task_reclaim_queue;
+
+	/*
+	 * Scenes waiting to be cleared after rasterization,
+	 * see psb_scene_queue_clear().
+	 */
+
+	struct list_head scene_clear_queue;
+	struct work_struct scene_clear_wq;
+	wait_queue_head_t scene_clear_wait;
+
+	/*
+	 * Admission control, see psb_scheduler_admit().
+	 */
+
+	atomic_t queued;
+	wait_queue_head_t admit_queue;
+
+	/*
+	 * Pick order, see psb_sched_pick().
+	 */
+
+	uint32_t vtime[PSB_SCENE_NUM_ENGINES];
+	uint32_t scan;
 	struct psb_task *current_task[PSB_SCENE_NUM_ENGINES];
 	struct psb_task *feedback_task;
 	int ta_state;
@@ -123,11 +279,29 @@ struct psb_scheduler {
 	struct delayed_work wq;
 	struct psb_scene_pool *pool;
 	uint32_t idle_count;
+	uint32_t dirty_scenes;
 	int idle;
 	wait_queue_head_t idle_queue;
 	unsigned long ta_end_jiffies;
 	unsigned long raster_end_jiffies;
 	unsigned long total_raster_jiffies;
+
+	/*
+	 * Deadline statistics, protected by the scheduler lock.
+	 */
+
+	uint32_t deadline_met;
+	uint32_t deadline_missed;
+	uint64_t deadline_max_late_ns;
+
+	/*
+	 * TA / raster overlap statistics, protected by the scheduler lock.
+	 */
+
+	uint64_t overlap_start_ns;
+	uint64_t overlap_ns;
+	uint32_t pipelined_rasters;
+	struct psb_trace trace;
 };
 
 #define PSB_RF_FIRE_TA       (1 << 0)
@@ -146,6 +320,16 @@ extern uint32_t psb_scene_handle(struct psb_scene *scene);
 extern int psb_scheduler_init(struct drm_device *dev,
 			      struct psb_scheduler *scheduler);
 extern void psb_scheduler_takedown(struct psb_scheduler *scheduler);
+extern int psb_task_cache_init(void);
+extern struct psb_sched_client *psb_sched_client_alloc(void);
+extern void psb_sched_client_unref(struct psb_sched_client **client);
+extern int psb_scheduler_admit(struct drm_psb_private *dev_priv,
+			       struct psb_sched_client *client, int priority,
+			       unsigned num);
+extern void psb_scheduler_unreserve(struct drm_psb_private *dev_priv,
+				    struct psb_sched_client *client,
+				    unsigned num);
+extern void psb_task_cache_takedown(void);
 extern int psb_cmdbuf_ta(struct drm_file *priv,
 			 struct drm_psb_cmdbuf_arg *arg,
 			 struct drm_buffer_object *cmd_buffer,
@@ -153,10 +337,12 @@ extern int psb_cmdbuf_ta(struct drm_file *priv,
 			 struct drm_buffer_object *oom_buffer,
 			 struct psb_scene *scene,
 			 struct psb_feedback_info *feedback,
+			 struct psb_validate_ctx *ctx,
 			 struct drm_fence_arg *fence_arg);
 extern int psb_cmdbuf_raster(struct drm_file *priv,
 			     struct drm_psb_cmdbuf_arg *arg,
 			     struct drm_buffer_object *cmd_buffer,
+			     struct psb_validate_ctx *ctx,
 			     struct drm_fence_arg *fence_arg);
 extern void psb_scheduler_handler(struct drm_psb_private *dev_priv,
 				  uint32_t status);
@@ -164,6 +350,7 @@ extern void psb_scheduler_pause(struct drm_psb_private *dev_priv);
 extern void psb_scheduler_restart(struct drm_psb_private *dev_priv);
 extern int psb_scheduler_idle(struct drm_psb_private *dev_priv);
 extern int psb_scheduler_finished(struct drm_psb_private *dev_priv);
+extern int psb_scheduler_ta_mem_unused(struct drm_psb_private *dev_priv);
 
 extern void psb_scheduler_lockup(struct drm_psb_private *dev_priv,
 				 int *lockup, int *idle);
@@ -173,5 +360,18 @@ extern int psb_forced_user_interrupt(struct drm_psb_private *dev_priv);
 extern void psb_scheduler_remove_scene_refs(struct psb_scene *scene);
 extern void psb_scheduler_ta_mem_check(struct drm_psb_private *dev_priv);
 extern int psb_extend_raster_timeout(struct drm_psb_private *dev_priv);
+extern void psb_scheduler_fence_queued(struct drm_psb_private *dev_priv,
+				       uint32_t sequence);
+
+extern void psb_trace_event(struct psb_scheduler *scheduler, uint32_t type,
+			    struct psb_task *task, uint32_t arg);
+extern void psb_trace_takedown(struct psb_scheduler *scheduler);
+
+static inline void psb_trace(struct psb_scheduler *scheduler, uint32_t type,
+			     struct psb_task *task, uint32_t arg)
+{
+	if (unlikely(scheduler->trace.enabled))
+		psb_trace_event(scheduler, type, task, arg);
+}
 
 #endif
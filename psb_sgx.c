@@ -30,6 +30,8 @@
 #include "psb_detear.h"
 
 #include "psb_msvdx.h"
+#include <linux/sort.h>
+#include <linux/delay.h>
 
 int psb_submit_video_cmdbuf(struct drm_device *dev,
 			    struct drm_buffer_object *cmd_buffer,
@@ -47,6 +49,7 @@ struct psb_dstbuf_cache {
 	unsigned int dst_page_offset;
 	struct drm_bo_kmap_obj dst_kmap;
 	int dst_is_iomem;
+	unsigned int kmaps;
 };
 
 struct psb_buflist_item {
@@ -112,67 +115,346 @@ void psb_init_disallowed(void)
 	}
 }
 
-static int psb_memcpy_check(uint32_t * dst, const uint32_t * src, uint32_t size)
+static inline int psb_reg_forbidden(uint32_t reg)
 {
-	size >>= 3;
-	while (size--) {
-		if (unlikely((*src >= 0x1000) || psb_disallowed(*src))) {
+	return (reg >= PSB_MAX_REG) || psb_disallowed(reg);
+}
+
+/*
+ * Check the register offsets of a (register, value) pair stream against
+ * the disallowed bitmap. Four pairs are checked per iteration: the
+ * range check is done on the OR of the offsets, and the bitmap lookups
+ * are combined so that there is a single branch for the common case
+ * where all four are allowed.
+ */
+
+static int psb_check_regs_bitmap(const uint32_t *regs, uint32_t pairs)
+{
+	const uint32_t *start = regs;
+	uint32_t n;
+
+	for (n = pairs >> 2; n; --n, regs += 8) {
+		if (likely(((regs[0] | regs[2] | regs[4] | regs[6]) <
+			    PSB_MAX_REG) &&
+			   !(psb_disallowed(regs[0]) |
+			     psb_disallowed(regs[2]) |
+			     psb_disallowed(regs[4]) |
+			     psb_disallowed(regs[6]))))
+			continue;
+		break;
+	}
+
+	for (n = (pairs - ((regs - start) >> 1)); n; --n, regs += 2) {
+		if (unlikely(psb_reg_forbidden(regs[0]))) {
 			DRM_ERROR("Forbidden SGX register access: "
-				  "0x%04x.\n", *src);
+				  "0x%04x.\n", regs[0]);
 			return -EPERM;
 		}
-		*dst++ = *src++;
-		*dst++ = *src++;
 	}
 	return 0;
 }
 
-static int psb_2d_wait_available(struct drm_psb_private *dev_priv,
-				 unsigned size)
+/*
+ * Check a register stream, on the kernel copy so that user-space can't
+ * change it after it has been checked.
+ *
+ * Clients send much the same streams with every task, starting with a
+ * fixed prologue, so the offsets of recently checked streams are kept
+ * in dev_priv->reg_cache. A stream is only checked against the bitmap
+ * from the first pair where its offsets differ from the cached stream,
+ * which is looked up by its first offset and its length. Values don't
+ * affect the check and aren't compared. The cache only ever holds
+ * offsets that passed the check, so a wrong entry only costs a full
+ * check. It is protected by the TA engine lock, under which all
+ * register streams are copied.
+ */
+
+static int psb_check_regs(struct psb_reg_cache *cache,
+			  const uint32_t *regs, uint32_t pairs)
 {
-	uint32_t avail = PSB_RSGX32(PSB_CR_2D_SOCIF);
-	int ret = 0;
+	struct psb_reg_cache_entry *entry;
+	uint32_t cached;
+	uint32_t i;
+	int ret;
 
-      retry:
-	if (avail < size) {
-#if 0
-		/* We'd ideally
-		 * like to have an IRQ-driven event here.
-		 */
+	if (pairs == 0)
+		return 0;
+
+	entry = &cache->entries[((regs[0] >> 2) ^ pairs) &
+				(PSB_REG_CACHE_SLOTS - 1)];
+	cached = min(pairs, entry->num_regs);
+
+	for (i = 0; i + 4 <= cached; i += 4) {
+		if ((regs[2 * i] ^ entry->regs[i]) |
+		    (regs[2 * i + 2] ^ entry->regs[i + 1]) |
+		    (regs[2 * i + 4] ^ entry->regs[i + 2]) |
+		    (regs[2 * i + 6] ^ entry->regs[i + 3]))
+			break;
+	}
+	while (i < cached && regs[2 * i] == entry->regs[i])
+		++i;
+
+	if (i == pairs)
+		return 0;
+
+	ret = psb_check_regs_bitmap(regs + 2 * i, pairs - i);
+	if (ret)
+		return ret;
+
+	cached = min_t(uint32_t, pairs, PSB_REG_CACHE_REGS);
+	for (; i < cached; ++i)
+		entry->regs[i] = regs[2 * i];
+	entry->num_regs = cached;
+
+	return 0;
+}
+
+/*
+ * Kernel 2D command ring.
+ *
+ * Submitters copy their commands into the ring under the 2D lock and
+ * return as soon as they fit. The ring is drained into the slave port
+ * as FIFO space frees up, by the submitter itself, from the 2D complete
+ * interrupt, which is kept enabled while the ring holds commands, and
+ * from the watchdog timer as a fallback for missed events.
+ *
+ * The tail is only moved by the 2D lock holder. The head is only moved
+ * with ring->lock held, since we may drain from several contexts.
+ * PSB_2D_RING_RESERVE dwords are kept free for psb_check_2d_idle(),
+ * which needs to queue a fence from atomic context.
+ */
+
+int psb_2d_ring_init(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+
+	spin_lock_init(&ring->lock);
+	ring->head = 0;
+	ring->tail = 0;
+	ring->irq_on = 0;
+	ring->buf = drm_alloc(PSB_2D_RING_SIZE * sizeof(uint32_t),
+			      DRM_MEM_DRIVER);
+
+	return (ring->buf) ? 0 : -ENOMEM;
+}
+
+void psb_2d_ring_takedown(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+
+	if (ring->irq_on) {
+		psb_2D_irq_off(dev_priv);
+		ring->irq_on = 0;
+	}
+	if (ring->buf) {
+		drm_free(ring->buf, PSB_2D_RING_SIZE * sizeof(uint32_t),
+			 DRM_MEM_DRIVER);
+		ring->buf = NULL;
+	}
+}
+
+/*
+ * Free dwords in the ring, including the reserve.
+ */
+
+uint32_t psb_2d_ring_space(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+
+	smp_mb();
+	return (ring->head - ring->tail - 1) & PSB_2D_RING_MASK;
+}
+
+int psb_2d_ring_empty(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+
+	smp_mb();
+	return (ring->head == ring->tail);
+}
+
+/*
+ * Queue commands. The caller must hold the 2D lock and must have
+ * made sure there is room for them.
+ */
+
+void psb_2d_ring_write(struct drm_psb_private *dev_priv,
+		       const uint32_t *cmds, unsigned count)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+	uint32_t tail = ring->tail;
+	unsigned first;
+
+	first = PSB_2D_RING_SIZE - tail;
+	if (first > count)
+		first = count;
+
+	memcpy(ring->buf + tail, cmds, first * sizeof(uint32_t));
+	if (count > first)
+		memcpy(ring->buf, cmds + first,
+		       (count - first) * sizeof(uint32_t));
+
+	smp_wmb();
+	ring->tail = (tail + count) & PSB_2D_RING_MASK;
+}
+
+/*
+ * Move as much of the ring as the slave port has room for.
+ * May be called from any context.
+ */
+
+void psb_2d_ring_drain(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+	unsigned long irq_flags;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t avail;
+	uint32_t count;
+	uint32_t i;
+	int freed = 0;
+
+	spin_lock_irqsave(&ring->lock, irq_flags);
+	head = ring->head;
+	tail = ring->tail;
+	smp_rmb();
+
+	while (head != tail) {
+		avail = PSB_RSGX32(PSB_CR_2D_SOCIF) &
+		    _PSB_C2_SOCIF_FREESPACE_MASK;
+		if (avail == 0)
+			break;
+
+		count = (tail > head) ? tail - head : PSB_2D_RING_SIZE - head;
+		if (count > avail)
+			count = avail;
+		if (count > PSB_2D_BURST)
+			count = PSB_2D_BURST;
+
+		for (i = 0; i < count; ++i)
+			PSB_WSGX32(ring->buf[head + i],
+				   PSB_SGX_2D_SLAVE_PORT + (i << 2));
+		(void)PSB_RSGX32(PSB_SGX_2D_SLAVE_PORT + ((i - 1) << 2));
+
+		head = (head + count) & PSB_2D_RING_MASK;
+		freed = 1;
+	}
+
+	smp_mb();
+	ring->head = head;
 
+	if (head != tail && !ring->irq_on) {
 		psb_2D_irq_on(dev_priv);
-		DRM_WAIT_ON(ret, dev_priv->event_2d_queue, DRM_HZ,
-			    ((avail = PSB_RSGX32(PSB_CR_2D_SOCIF)) >= size));
+		ring->irq_on = 1;
+	} else if (head == tail && ring->irq_on) {
 		psb_2D_irq_off(dev_priv);
-		if (ret == 0)
-			return 0;
-		if (ret == -EINTR) {
-			ret = 0;
-			goto retry;
+		ring->irq_on = 0;
+	}
+	spin_unlock_irqrestore(&ring->lock, irq_flags);
+
+	if (freed)
+		DRM_WAKEUP(&dev_priv->event_2d_queue);
+}
+
+/*
+ * Throw away the queued commands after a 2D engine reset, so that they
+ * are not fed to the freshly reset slave port. The fences of the
+ * discarded commands are left to the caller.
+ */
+
+void psb_2d_ring_reset(struct drm_psb_private *dev_priv)
+{
+	struct psb_2d_ring *ring = &dev_priv->ring_2d;
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&ring->lock, irq_flags);
+	ring->head = ring->tail;
+	smp_mb();
+	if (ring->irq_on) {
+		psb_2D_irq_off(dev_priv);
+		ring->irq_on = 0;
+	}
+	spin_unlock_irqrestore(&ring->lock, irq_flags);
+
+	DRM_WAKEUP(&dev_priv->event_2d_queue);
+}
+
+/*
+ * Wait for room in the 2D ring. Called with the 2D lock held.
+ *
+ * Short waits are handled by spinning for at most PSB_2D_SPIN_USECS.
+ * After that we sleep on event_2d_queue, which is woken whenever the
+ * ring is drained. The sleep is cut into single-jiffy slices, each
+ * of which drains the ring itself, so that a missed event only costs
+ * a tick. Callers that cannot sleep pass can_sleep == 0 and keep
+ * busy-polling.
+ */
+
+static int psb_2d_wait_available(struct drm_psb_private *dev_priv,
+				 unsigned size, int can_sleep)
+{
+	unsigned long end;
+	unsigned long start;
+	unsigned spin;
+
+	size += PSB_2D_RING_RESERVE;
+	if (likely(psb_2d_ring_space(dev_priv) >= size))
+		return 0;
+
+	for (spin = 0; spin < PSB_2D_SPIN_USECS; ++spin) {
+		psb_2d_ring_drain(dev_priv);
+		if (psb_2d_ring_space(dev_priv) >= size)
+			break;
+		udelay(1);
+	}
+
+	dev_priv->twod_spin_waits++;
+	dev_priv->twod_spin_usecs += spin;
+
+	if (spin < PSB_2D_SPIN_USECS)
+		return 0;
+
+	if (!can_sleep) {
+		for (;;) {
+			psb_2d_ring_drain(dev_priv);
+			if (psb_2d_ring_space(dev_priv) >= size)
+				return 0;
+			cpu_relax();
 		}
-#else
-		avail = PSB_RSGX32(PSB_CR_2D_SOCIF);
-		goto retry;
-#endif
 	}
-	return ret;
+
+	dev_priv->twod_sleep_waits++;
+	start = jiffies;
+	end = start + PSB_2D_TIMEOUT;
+
+	while (psb_2d_ring_space(dev_priv) < size) {
+		if (time_after_eq(jiffies, end))
+			break;
+		(void)wait_event_timeout(dev_priv->event_2d_queue,
+					 psb_2d_ring_space(dev_priv) >= size,
+					 1);
+		psb_2d_ring_drain(dev_priv);
+	}
+
+	dev_priv->twod_sleep_usecs += jiffies_to_usecs(jiffies - start);
+
+	if (psb_2d_ring_space(dev_priv) < size) {
+		dev_priv->twod_timeouts++;
+		DRM_ERROR("Timed out waiting for 2D ring space.\n");
+		return -EBUSY;
+	}
+
+	return 0;
 }
 
 int psb_2d_submit(struct drm_psb_private *dev_priv, uint32_t * cmdbuf,
-		  unsigned size)
+		  unsigned size, int can_sleep)
 {
-	int ret = 0;
-	int i;
+	int ret;
 	unsigned submit_size;
 
 	while (size > 0) {
-		submit_size = (size < 0x60) ? size : 0x60;
-		size -= submit_size;
-		ret = psb_2d_wait_available(dev_priv, submit_size);
-		if (ret)
-			return ret;
-
-		submit_size <<= 2;
+		submit_size = (size < PSB_2D_BURST) ? size : PSB_2D_BURST;
 
 #ifdef PSB_DETEAR
 		/* delayed 2D blit tasks are not executed right now,
@@ -183,15 +465,25 @@ int psb_2d_submit(struct drm_psb_private *dev_priv, uint32_t * cmdbuf,
 			   delayed 2D blit tasks */
 			dev_priv->blit_2d = 0; 
 			memcpy(psb_blit_info.cmdbuf, cmdbuf, 10*4);
-		} else
-#endif	/* PSB_DETEAR */
-		{
-			for (i = 0; i < submit_size; i += 4) {
-				PSB_WSGX32(*cmdbuf++, PSB_SGX_2D_SLAVE_PORT + i);
-			}
-			(void)PSB_RSGX32(PSB_SGX_2D_SLAVE_PORT + i - 4);
+			cmdbuf += submit_size;
+			size -= submit_size;
+			continue;
 		}
+#endif	/* PSB_DETEAR */
+
+		ret = psb_2d_wait_available(dev_priv, submit_size, can_sleep);
+		if (ret)
+			return ret;
+
+		psb_2d_ring_write(dev_priv, cmdbuf, submit_size);
+		cmdbuf += submit_size;
+		size -= submit_size;
 	}
+
+	psb_2d_ring_drain(dev_priv);
+	if (!psb_2d_ring_empty(dev_priv))
+		psb_schedule_watchdog(dev_priv);
+
 	return 0;
 }
 
@@ -221,7 +513,7 @@ int psb_blit_sequence(struct drm_psb_private *dev_priv, uint32_t sequence)
 	*bufp++ = PSB_2D_FLUSH_BH;
 
 	psb_2d_lock(dev_priv);
-	ret = psb_2d_submit(dev_priv, buffer, bufp - buffer);
+	ret = psb_2d_submit(dev_priv, buffer, bufp - buffer, 1);
 	psb_2d_unlock(dev_priv);
 
 	if (!ret)
@@ -287,7 +579,7 @@ int psb_emit_2d_copy_blit(struct drm_device *dev,
 		*bufp++ = ((PAGE_SIZE >> 2) << PSB_2D_DST_XSIZE_SHIFT) |
 		    (cur_pages << PSB_2D_DST_YSIZE_SHIFT);
 
-		ret = psb_2d_submit(dev_priv, buf, bufp - buf);
+		ret = psb_2d_submit(dev_priv, buf, bufp - buf, 1);
 		if (ret)
 			goto out;
 		pg_add = (cur_pages << PAGE_SHIFT) * ((direction) ? -1 : 1);
@@ -321,10 +613,19 @@ int psb_idle_2d(struct drm_device *dev)
 	if (dev_priv->engine_lockup_2d)
 		return -EBUSY;
 
-	if ((PSB_RSGX32(PSB_CR_2D_SOCIF) == _PSB_C2_SOCIF_EMPTY) &&
+	if (psb_2d_ring_empty(dev_priv) &&
+	    (PSB_RSGX32(PSB_CR_2D_SOCIF) == _PSB_C2_SOCIF_EMPTY) &&
 	    ((PSB_RSGX32(PSB_CR_2D_BLIT_STATUS) & _PSB_C2B_STATUS_BUSY) == 0))
 		goto out;
 
+	do {
+		psb_2d_ring_drain(dev_priv);
+		busy = !psb_2d_ring_empty(dev_priv);
+	} while (busy && !time_after_eq(jiffies, _end));
+
+	if (busy)
+		goto out;
+
 	do {
 		busy = (PSB_RSGX32(PSB_CR_2D_SOCIF) != _PSB_C2_SOCIF_EMPTY);
 	} while (busy && !time_after_eq(jiffies, _end));
@@ -371,12 +672,15 @@ static void psb_dereference_buffers_locked(struct psb_buflist_item *buffers,
 
 }
 
+/*
+ * Returns 1 if the presumed offset hint had to be cleared in *arg,
+ * in which case the caller must write it back to user-space.
+ */
+
 static int psb_check_presumed(struct drm_bo_op_arg *arg,
-			      struct drm_buffer_object *bo,
-			      uint32_t __user * data, int *presumed_ok)
+			      struct drm_buffer_object *bo, int *presumed_ok)
 {
 	struct drm_bo_op_req *req = &arg->d.req;
-	uint32_t hint_offset;
 	uint32_t hint = req->bo_req.hint;
 
 	*presumed_ok = 0;
@@ -402,23 +706,149 @@ static int psb_check_presumed(struct drm_bo_op_arg *arg,
 	 * Needless to say, this is a bit ugly.
 	 */
 
-	hint_offset = (uint32_t *) & req->bo_req.hint - (uint32_t *) arg;
-	hint &= ~DRM_BO_HINT_PRESUMED_OFFSET;
-	return __put_user(hint, data + hint_offset);
+	req->bo_req.hint = hint & ~DRM_BO_HINT_PRESUMED_OFFSET;
+	return 1;
+}
+
+/*
+ * Whether a buffer is already held unfenced by this submission, as
+ * happens when it is listed twice or is also the feedback buffer.
+ * The list is only walked for buffers that are unfenced at all.
+ */
+
+static int psb_validate_claimed(struct psb_validate_ctx *ctx,
+				struct drm_buffer_object *bo)
+{
+	struct drm_device *dev = bo->dev;
+	struct drm_buffer_object *entry;
+	int claimed = 0;
+
+	mutex_lock(&bo->mutex);
+	if (bo->priv_flags & _DRM_BO_FLAG_UNFENCED) {
+		mutex_lock(&dev->struct_mutex);
+		list_for_each_entry(entry, &ctx->unfenced, lru) {
+			if (entry == bo) {
+				claimed = 1;
+				break;
+			}
+		}
+		mutex_unlock(&dev->struct_mutex);
+	}
+	mutex_unlock(&bo->mutex);
+
+	return claimed;
+}
+
+/*
+ * Validating a buffer that another submission holds unfenced waits
+ * until that submission is fenced. If we already hold unfenced buffers
+ * ourselves, that submission may be waiting for one of ours, so back
+ * off with -EAGAIN and let user-space restart the ioctl instead.
+ * A buffer we hold unfenced ourselves is already validated for this
+ * submission and is skipped, or it would back off on every restart.
+ *
+ * The check and the claim of the buffer for this submission are done
+ * under bo->mutex together with the validation, by
+ * drm_bo_do_validate_list().
+ *
+ * A busy buffer that other clients can reference may be waiting for
+ * their queued tasks, so the submission then keeps its place in the
+ * scheduler's order, see psb_sched_pick().
+ */
+
+static void psb_validate_order(struct drm_file *file_priv,
+			       struct psb_validate_ctx *ctx,
+			       struct drm_buffer_object *bo)
+{
+	if (ctx->sched_ordered ||
+	    (bo->base.owner == file_priv &&
+	     atomic_read(&bo->base.refcount) <= 1))
+		return;
+
+	mutex_lock(&bo->mutex);
+	if (bo->fence && !drm_fence_object_signaled(bo->fence, bo->fence_type))
+		ctx->sched_ordered = 1;
+	mutex_unlock(&bo->mutex);
+}
+
+static int psb_validate_claim(struct drm_file *file_priv,
+			      struct psb_validate_ctx *ctx,
+			      struct drm_buffer_object *bo,
+			      uint64_t flags, uint64_t mask, uint32_t hint,
+			      unsigned fence_class)
+{
+	if (!list_empty(&ctx->unfenced) && psb_validate_claimed(ctx, bo))
+		return 0;
+
+	psb_validate_order(file_priv, ctx, bo);
+
+	return drm_bo_do_validate_list(bo, flags, mask, hint, fence_class,
+				       hint & DRM_BO_HINT_DONT_BLOCK,
+				       !list_empty(&ctx->unfenced),
+				       &ctx->unfenced, NULL);
+}
+
+static int psb_validate_one(struct drm_file *file_priv,
+			    unsigned fence_class,
+			    struct drm_bo_op_arg *arg,
+			    struct psb_buflist_item *item,
+			    struct psb_validate_ctx *ctx)
+{
+	struct drm_device *dev = file_priv->head->dev;
+	struct drm_bo_op_req *req = &arg->d.req;
+	struct drm_buffer_object *bo;
+	uint64_t mask = req->bo_req.mask;
+	int ret;
+
+	if (req->op != drm_bo_validate) {
+		DRM_ERROR("Buffer object operation wasn't \"validate\".\n");
+		return -EINVAL;
+	}
+
+	item->ret = 0;
+
+	mutex_lock(&dev->struct_mutex);
+	bo = drm_lookup_buffer_object(file_priv, req->bo_req.handle, 1);
+	mutex_unlock(&dev->struct_mutex);
+	if (!bo)
+		return -EINVAL;
+
+	/*
+	 * Only allow creator to change shared buffer mask.
+	 */
+
+	if (bo->base.owner != file_priv)
+		mask &= ~(DRM_BO_FLAG_NO_EVICT | DRM_BO_FLAG_NO_MOVE);
+
+	ret = psb_validate_claim(file_priv, ctx, bo, req->bo_req.flags, mask,
+				 req->bo_req.hint, fence_class);
+	if (ret)
+		goto out_err;
+
+	item->bo = bo;
+
+	PSB_DEBUG_GENERAL("Validated buffer at 0x%08lx\n", item->bo->offset);
+	return 0;
+      out_err:
+	drm_bo_usage_deref_unlocked(&bo);
+	return ret;
 }
 
 static int psb_validate_buffer_list(struct drm_file *file_priv,
 				    unsigned fence_class,
 				    unsigned long data,
+				    struct psb_validate_ctx *ctx,
 				    struct psb_buflist_item *buffers,
 				    unsigned *num_buffers)
 {
 	struct drm_bo_op_arg arg;
-	struct drm_bo_op_req *req = &arg.d.req;
+	uint32_t hint_offset;
 	int ret = 0;
 	unsigned buf_count = 0;
 	struct psb_buflist_item *item = buffers;
 
+	hint_offset = (uint32_t *) & arg.d.req.bo_req.hint - (uint32_t *) & arg;
+
 	do {
 		if (buf_count >= *num_buffers) {
 			DRM_ERROR("Buffer count exceeded %d\n.", *num_buffers);
@@ -436,39 +866,22 @@ static int psb_validate_buffer_list(struct drm_file *file_priv,
 			goto out_err;
 		}
 
-		ret = 0;
-		if (req->op != drm_bo_validate) {
-			DRM_ERROR
-			    ("Buffer object operation wasn't \"validate\".\n");
-			ret = -EINVAL;
-			goto out_err;
-		}
-
-		item->ret = 0;
 		item->data = (void *)__user data;
-		ret = drm_bo_handle_validate(file_priv,
-					     req->bo_req.handle,
-					     fence_class,
-					     req->bo_req.flags,
-					     req->bo_req.mask,
-					     req->bo_req.hint,
-					     0, NULL, &item->bo);
+		ret = psb_validate_one(file_priv, fence_class, &arg, item,
+				       ctx);
 		if (ret)
 			goto out_err;
 
-		PSB_DEBUG_GENERAL("Validated buffer at 0x%08lx\n",
-				  buffers[buf_count].bo->offset);
-
 		buf_count++;
 
-
-		ret = psb_check_presumed(&arg, item->bo,
+		if (psb_check_presumed(&arg, item->bo,
+				       &item->presumed_offset_correct)) {
+			ret = __put_user(arg.d.req.bo_req.hint,
 					 (uint32_t __user *)
-					 (unsigned long) data,
-					 &item->presumed_offset_correct);
-
-		if (ret)
-			goto out_err;
+					 (unsigned long)data + hint_offset);
+			if (ret)
+				goto out_err;
+		}
 
 		data = arg.next;
 	} while (data);
@@ -483,47 +896,252 @@ static int psb_validate_buffer_list(struct drm_file *file_priv,
 	return ret;
 }
 
-int
-psb_reg_submit(struct drm_psb_private *dev_priv, uint32_t * regs,
-	       unsigned int cmds)
+/*
+ * Array-mode validate list. The entries are copied in and, if any
+ * presumed offset hint had to be cleared, written back in chunks of
+ * PSB_VALIDATE_CHUNK rather than one user-space access per entry.
+ */
+
+static int psb_validate_buffer_array(struct drm_file *file_priv,
+				     unsigned fence_class,
+				     unsigned long data,
+				     struct psb_validate_ctx *ctx,
+				     struct psb_buflist_item *buffers,
+				     unsigned *num_buffers)
 {
-	int i;
+	struct drm_bo_op_arg *args = ctx->validate_args;
+	struct drm_psb_validate_array list;
+	struct drm_bo_op_arg __user *user_args;
+	struct psb_buflist_item *item = buffers;
+	unsigned buf_count = 0;
+	unsigned chunk_start;
+	unsigned chunk;
+	unsigned i;
+	int dirty;
+	int ret = 0;
 
-	/*
-	 * cmds is 32-bit words.
-	 */
+	if (copy_from_user(&list, (void __user *)data, sizeof(list))) {
+		*num_buffers = 0;
+		return -EFAULT;
+	}
 
-	cmds >>= 1;
-	for (i = 0; i < cmds; ++i) {
-		PSB_WSGX32(regs[1], regs[0]);
-		regs += 2;
+	if (list.num_buffers > *num_buffers) {
+		DRM_ERROR("Buffer count exceeded %d\n.", *num_buffers);
+		*num_buffers = 0;
+		return -EINVAL;
 	}
-	wmb();
-	return 0;
-}
 
-/*
- * Security: Block user-space writing to MMU mapping registers.
- * This is important for security and brings Poulsbo DRM
- * up to par with the other DRM drivers. Using this,
- * user-space should not be able to map arbitrary memory
- * pages to graphics memory, but all user-space processes
- * basically have access to all buffer objects mapped to
- * graphics memory.
- */
+	user_args = (struct drm_bo_op_arg __user *)
+	    (unsigned long)list.buffers;
 
-int
-psb_submit_copy_cmdbuf(struct drm_device *dev,
-		       struct drm_buffer_object *cmd_buffer,
-		       unsigned long cmd_offset,
-		       unsigned long cmd_size,
-		       int engine, uint32_t * copy_buffer)
+	while (buf_count < list.num_buffers) {
+		chunk_start = buf_count;
+		chunk = list.num_buffers - buf_count;
+		if (chunk > PSB_VALIDATE_CHUNK)
+			chunk = PSB_VALIDATE_CHUNK;
+
+		item = buffers + chunk_start;
+		if (copy_from_user(args, user_args + chunk_start,
+				   chunk * sizeof(*args))) {
+			DRM_ERROR("Error copying validate array.\n");
+			ret = -EFAULT;
+			goto out_err;
+		}
+
+		dirty = 0;
+		for (i = 0; i < chunk; ++i) {
+			item = buffers + buf_count;
+			item->bo = NULL;
+			item->data = (void __user *)(user_args + buf_count);
+			ret = psb_validate_one(file_priv, fence_class,
+					       &args[i], item, ctx);
+			if (ret)
+				break;
+
+			buf_count++;
+			dirty |= psb_check_presumed(&args[i], item->bo,
+						    &item->presumed_offset_correct);
+		}
+
+		if (dirty && copy_to_user(user_args + chunk_start, args,
+					  (buf_count - chunk_start) *
+					  sizeof(*args)))
+			ret = -EFAULT;
+
+		if (ret)
+			goto out_err;
+	}
+
+	*num_buffers = buf_count;
+
+	return 0;
+      out_err:
+
+	*num_buffers = buf_count;
+	item->ret = (ret != -EAGAIN) ? ret : 0;
+	return ret;
+}
+
+/*
+ * Buffer set validation. The set already holds the buffer references,
+ * so there is no handle lookup and nothing to copy from user-space.
+ * Every buffer still goes through drm_bo_do_validate, since that is
+ * what puts it on the unfenced list for this submission, but buffers
+ * whose placement is unchanged take its cheap path.
+ *
+ * A buffer is presumed to be correctly relocated if it is still at the
+ * offset user-space passed for this submission.
+ */
+
+static int psb_validate_buffer_set(struct drm_file *file_priv,
+				   unsigned fence_class,
+				   struct psb_bufset *set,
+				   uint64_t __user *user_offsets,
+				   struct psb_validate_ctx *ctx,
+				   struct psb_buflist_item *buffers,
+				   unsigned *num_buffers)
+{
+	struct psb_bufset_entry *entry = set->entries;
+	struct psb_buflist_item *item = buffers;
+	struct drm_buffer_object *bo;
+	unsigned buf_count;
+	uint64_t presumed;
+	int ret = 0;
+
+	for (buf_count = 0; buf_count < set->num_entries; ++buf_count) {
+		item = buffers + buf_count;
+		bo = entry->bo;
+		item->bo = NULL;
+		item->data = NULL;
+		item->ret = 0;
+
+		presumed = ~0ULL;
+		if (user_offsets &&
+		    copy_from_user(&presumed, user_offsets + buf_count,
+				   sizeof(presumed))) {
+			ret = -EFAULT;
+			goto out_err;
+		}
+
+		ret = psb_validate_claim(file_priv, ctx, bo, entry->flags,
+					 entry->mask, entry->hint, fence_class);
+		if (ret)
+			goto out_err;
+
+		atomic_inc(&bo->usage);
+		item->bo = bo;
+
+		item->presumed_offset_correct =
+		    (bo->mem.mem_type == DRM_BO_MEM_LOCAL ||
+		     bo->offset == presumed);
+
+		++entry;
+	}
+
+	*num_buffers = buf_count;
+	return 0;
+
+      out_err:
+	*num_buffers = buf_count;
+	item->ret = (ret != -EAGAIN) ? ret : 0;
+	return ret;
+}
+
+#define PSB_VALIDATE_LIST  0
+#define PSB_VALIDATE_ARRAY 1
+#define PSB_VALIDATE_SET   2
+
+/*
+ * For PSB_VALIDATE_SET, data points to a struct drm_psb_bufset_submit.
+ * The set is looked up and returned referenced in *set, and the offset
+ * array of the submission is kept in the context. The set is released
+ * by psb_validate_copyback().
+ */
+
+static int psb_validate_buffers(struct drm_file *file_priv,
+				unsigned fence_class,
+				unsigned long data, int mode,
+				struct psb_validate_ctx *ctx,
+				unsigned *num_buffers,
+				struct psb_bufset **set)
+{
+	struct psb_buflist_item *buffers = ctx->buffers;
+	struct drm_psb_bufset_submit submit;
+	int ret;
+
+	*set = NULL;
+	ctx->set_offsets = NULL;
+
+	switch (mode) {
+	case PSB_VALIDATE_SET:
+		*num_buffers = 0;
+		if (copy_from_user(&submit, (void __user *)data,
+				   sizeof(submit)))
+			return -EFAULT;
+		*set = psb_bufset_lookup(file_priv, submit.handle);
+		if (!*set)
+			return -EINVAL;
+		ctx->set_offsets = (uint64_t __user *)
+		    (unsigned long)submit.offsets;
+		ret = psb_validate_buffer_set(file_priv, fence_class, *set,
+					      ctx->set_offsets, ctx, buffers,
+					      num_buffers);
+		break;
+	case PSB_VALIDATE_ARRAY:
+		ret = psb_validate_buffer_array(file_priv, fence_class, data,
+						ctx, buffers, num_buffers);
+		break;
+	default:
+		ret = psb_validate_buffer_list(file_priv, fence_class, data,
+					       ctx, buffers, num_buffers);
+		break;
+	}
+
+	return ret;
+}
+
+int
+psb_reg_submit(struct drm_psb_private *dev_priv, uint32_t * regs,
+	       unsigned int cmds)
+{
+	int i;
+
+	/*
+	 * cmds is 32-bit words.
+	 */
+
+	cmds >>= 1;
+	for (i = 0; i < cmds; ++i) {
+		PSB_WSGX32(regs[1], regs[0]);
+		regs += 2;
+	}
+	wmb();
+	return 0;
+}
+
+/*
+ * Security: Block user-space writing to MMU mapping registers.
+ * This is important for security and brings Poulsbo DRM
+ * up to par with the other DRM drivers. Using this,
+ * user-space should not be able to map arbitrary memory
+ * pages to graphics memory, but all user-space processes
+ * basically have access to all buffer objects mapped to
+ * graphics memory.
+ */
+
+int
+psb_submit_copy_cmdbuf(struct drm_device *dev,
+		       struct drm_buffer_object *cmd_buffer,
+		       unsigned long cmd_offset,
+		       unsigned long cmd_size,
+		       int engine, uint32_t * copy_buffer)
 {
 	unsigned long cmd_end = cmd_offset + (cmd_size << 2);
 	struct drm_psb_private *dev_priv = dev->dev_private;
 	unsigned long cmd_page_offset = cmd_offset - (cmd_offset & PAGE_MASK);
 	unsigned long cmd_next;
 	struct drm_bo_kmap_obj cmd_kmap;
+	uint32_t *copy_start = copy_buffer;
 	uint32_t *cmd_page;
 	unsigned cmds;
 	int is_iomem;
@@ -550,15 +1168,14 @@ psb_submit_copy_cmdbuf(struct drm_device *dev,
 		case PSB_ENGINE_2D:
 			ret =
 			    psb_2d_submit(dev_priv, cmd_page + cmd_page_offset,
-					  cmds);
+					  cmds, 1);
 			break;
 		case PSB_ENGINE_RASTERIZER:
 		case PSB_ENGINE_TA:
 		case PSB_ENGINE_HPRAST:
 			PSB_DEBUG_GENERAL("Reg copy.\n");
-			ret = psb_memcpy_check(copy_buffer,
-					       cmd_page + cmd_page_offset,
-					       cmds * sizeof(uint32_t));
+			memcpy(copy_buffer, cmd_page + cmd_page_offset,
+			       cmds * sizeof(uint32_t));
 			copy_buffer += cmds;
 			break;
 		default:
@@ -571,6 +1188,9 @@ psb_submit_copy_cmdbuf(struct drm_device *dev,
 
 	if (engine == PSB_ENGINE_2D)
 		psb_2d_unlock(dev_priv);
+	else if (!ret)
+		ret = psb_check_regs(&dev_priv->reg_cache, copy_start,
+				     cmd_size >> 1);
 
 	return ret;
 }
@@ -624,6 +1244,7 @@ static int psb_update_dstbuf_cache(struct psb_dstbuf_cache *dst_cache,
 						      &dst_cache->dst_is_iomem);
 		dst_cache->dst_offset = dst_offset & PAGE_MASK;
 		dst_cache->dst_page_offset = dst_cache->dst_offset >> 2;
+		dst_cache->kmaps++;
 	}
 	return 0;
 }
@@ -713,6 +1334,18 @@ static int psb_apply_reloc(struct drm_psb_private *dev_priv,
 	case PSB_RELOC_OP_USE_OFFSET:
 	case PSB_RELOC_OP_USE_REG:
 
+		/*
+		 * USE base registers are only fenced by TA-class
+		 * submissions, which hold the engine lock while
+		 * relocating. Other engines relocate concurrently
+		 * and must not touch the register manager.
+		 */
+
+		if (unlikely(fence_class != PSB_ENGINE_TA)) {
+			DRM_ERROR("USE relocation for non-TA engine.\n");
+			return -EINVAL;
+		}
+
 		/*
 		 * Security:
 		 * Only allow VERTEX or PIXEL data masters, as
@@ -797,18 +1430,217 @@ static int psb_ok_to_map_reloc(struct drm_psb_private *dev_priv,
 	return ret;
 }
 
+/*
+ * Relocation sort keys. The destination buffer goes in the top bits,
+ * the destination page in the middle and the relocation's position in
+ * the user stream in the low 32 bits, so sorting the keys groups
+ * relocations by destination page while keeping the user's order within
+ * a page. That matters for USE_OFFSET relocations that read back the
+ * value written by a previous relocation to the same dword.
+ */
+
+#define PSB_RELOC_KEY_DST_SHIFT  54
+#define PSB_RELOC_KEY_PAGE_SHIFT 32
+#define PSB_RELOC_KEY_PAGE_MASK  ((1ULL << (PSB_RELOC_KEY_DST_SHIFT - \
+					    PSB_RELOC_KEY_PAGE_SHIFT)) - 1)
+#define PSB_RELOC_KEY(_dst, _page, _index)				\
+	(((uint64_t) (_dst) << PSB_RELOC_KEY_DST_SHIFT) |		\
+	 (((uint64_t) (_page) & PSB_RELOC_KEY_PAGE_MASK) <<		\
+	  PSB_RELOC_KEY_PAGE_SHIFT) | (uint64_t) (_index))
+
+static int psb_reloc_key_cmp(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a;
+	uint64_t kb = *(const uint64_t *)b;
+
+	return (ka < kb) ? -1 : (ka > kb);
+}
+
+/*
+ * Build the sort keys for a relocation stream and sort them if that
+ * reduces the number of destination page kmaps. Relocations against
+ * buffers whose presumed offset is correct are dropped, since
+ * psb_apply_reloc would skip them anyway. Out-of-range buffer indices
+ * are kept, so that psb_apply_reloc still gets to reject them.
+ *
+ * Returns the number of keys, or -1 if the stream should be applied
+ * in user order.
+ */
+
+static int psb_sort_relocs(struct drm_psb_private *dev_priv,
+			   uint64_t *keys, unsigned int max_keys,
+			   const struct drm_psb_reloc *reloc,
+			   unsigned int num_relocs,
+			   struct psb_buflist_item *buffers,
+			   unsigned int num_buffers)
+{
+	uint64_t group;
+	uint64_t last_group = ~0ULL;
+	unsigned int dst;
+	unsigned int num_keys = 0;
+	unsigned int kmaps = 0;
+	unsigned int sorted_kmaps = 0;
+	int sorted = 1;
+	int i;
+
+	if (num_relocs > max_keys)
+		return -1;
+
+	for (i = 0; i < num_relocs; ++i, ++reloc) {
+		if (reloc->buffer < num_buffers &&
+		    buffers[reloc->buffer].presumed_offset_correct)
+			continue;
+
+		dst = min_t(unsigned int, reloc->dst_buffer,
+			    PSB_NUM_VALIDATE_BUFFERS - 1);
+		keys[num_keys] = PSB_RELOC_KEY(dst,
+					       reloc->where >>
+					       (PAGE_SHIFT - 2), i);
+		group = keys[num_keys] >> PSB_RELOC_KEY_PAGE_SHIFT;
+
+		if (group != last_group) {
+			if (num_keys > 0 && group < last_group)
+				sorted = 0;
+			last_group = group;
+			kmaps++;
+		}
+		num_keys++;
+	}
+
+	if (sorted)
+		return num_keys;
+
+	sort(keys, num_keys, sizeof(*keys), psb_reloc_key_cmp, NULL);
+
+	last_group = ~0ULL;
+	for (i = 0; i < num_keys; ++i) {
+		group = keys[i] >> PSB_RELOC_KEY_PAGE_SHIFT;
+		if (group != last_group) {
+			last_group = group;
+			sorted_kmaps++;
+		}
+	}
+
+	atomic_inc(&dev_priv->reloc_sorted);
+	atomic_add(kmaps - sorted_kmaps, &dev_priv->reloc_kmaps_saved);
+
+	return num_keys;
+}
+
+static int psb_apply_reloc_list(struct drm_psb_private *dev_priv,
+				uint32_t fence_class,
+				const struct drm_psb_reloc *reloc,
+				unsigned int num_relocs,
+				uint64_t *keys, unsigned int max_keys,
+				struct psb_buflist_item *buffers,
+				unsigned int num_buffers,
+				struct psb_dstbuf_cache *dst_cache,
+				int no_wait, int interruptible)
+{
+	int num_keys;
+	int count;
+	int ret = 0;
+
+	num_keys = psb_sort_relocs(dev_priv, keys, max_keys, reloc,
+				   num_relocs, buffers, num_buffers);
+
+	if (num_keys >= 0) {
+		for (count = 0; count < num_keys; ++count) {
+			ret = psb_apply_reloc(dev_priv, fence_class,
+					      reloc + (uint32_t) keys[count],
+					      buffers, num_buffers,
+					      dst_cache, no_wait,
+					      interruptible);
+			if (ret)
+				break;
+		}
+	} else {
+		for (count = 0; count < num_relocs; ++count) {
+			ret = psb_apply_reloc(dev_priv, fence_class,
+					      reloc, buffers,
+					      num_buffers, dst_cache,
+					      no_wait, interruptible);
+			if (ret)
+				break;
+			reloc++;
+		}
+	}
+
+	atomic_add(count, &dev_priv->reloc_count);
+	return ret;
+}
+
+/*
+ * Relocations read from user memory. They are copied in chunks of
+ * PSB_RELOC_CHUNK into a buffer private to this submission, so unlike
+ * the buffer object path there is no global mapping budget to wait for.
+ * Each chunk is sorted on its own; the destination page stays mapped
+ * across chunk boundaries.
+ */
+
+static int psb_fixup_user_relocs(struct drm_psb_private *dev_priv,
+				 uint32_t fence_class,
+				 unsigned int num_relocs,
+				 const struct drm_psb_reloc __user *user_relocs,
+				 struct psb_buflist_item *buffers,
+				 unsigned int num_buffers,
+				 int no_wait, int interruptible)
+{
+	struct psb_dstbuf_cache dst_cache;
+	struct drm_psb_reloc *relocs;
+	uint64_t *keys;
+	unsigned int chunk;
+	size_t size;
+	int ret = 0;
+
+	size = PSB_RELOC_CHUNK * (sizeof(*relocs) + sizeof(*keys));
+	relocs = drm_alloc(size, DRM_MEM_DRIVER);
+	if (!relocs)
+		return -ENOMEM;
+	keys = (uint64_t *) (relocs + PSB_RELOC_CHUNK);
+
+	memset(&dst_cache, 0, sizeof(dst_cache));
+
+	while (num_relocs) {
+		chunk = min_t(unsigned int, num_relocs, PSB_RELOC_CHUNK);
+
+		if (copy_from_user(relocs, user_relocs,
+				   chunk * sizeof(*relocs))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = psb_apply_reloc_list(dev_priv, fence_class, relocs,
+					   chunk, keys, PSB_RELOC_CHUNK,
+					   buffers, num_buffers, &dst_cache,
+					   no_wait, interruptible);
+		if (ret)
+			break;
+
+		user_relocs += chunk;
+		num_relocs -= chunk;
+	}
+
+	atomic_add(dst_cache.kmaps, &dev_priv->reloc_kmaps);
+	psb_clear_dstbuf_cache(&dst_cache);
+	drm_free(relocs, size, DRM_MEM_DRIVER);
+	return ret;
+}
+
 static int psb_fixup_relocs(struct drm_file *file_priv,
 			    uint32_t fence_class,
 			    unsigned int num_relocs,
 			    unsigned int reloc_offset,
 			    uint32_t reloc_handle,
-			    struct psb_buflist_item *buffers,
+			    int user_relocs,
+			    struct psb_validate_ctx *ctx,
 			    unsigned int num_buffers,
 			    int no_wait, int interruptible)
 {
 	struct drm_device *dev = file_priv->head->dev;
 	struct drm_psb_private *dev_priv =
 	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_buflist_item *buffers = ctx->buffers;
 	struct drm_buffer_object *reloc_buffer = NULL;
 	unsigned int reloc_num_pages;
 	unsigned int reloc_first_page;
@@ -817,7 +1649,6 @@ static int psb_fixup_relocs(struct drm_file *file_priv,
 	struct drm_psb_reloc *reloc;
 	struct drm_bo_kmap_obj reloc_kmap;
 	int reloc_is_iomem;
-	int count;
 	int ret = 0;
 	int registered = 0;
 	int short_circuit = 1;
@@ -836,6 +1667,15 @@ static int psb_fixup_relocs(struct drm_file *file_priv,
 	if (short_circuit)
 		return 0;
 
+	if (user_relocs)
+		return psb_fixup_user_relocs(dev_priv, fence_class, num_relocs,
+					     (const struct drm_psb_reloc __user *)
+					     (unsigned long)
+					     (((uint64_t) reloc_offset << 32) |
+					      reloc_handle),
+					     buffers, num_buffers,
+					     no_wait, interruptible);
+
 	memset(&dst_cache, 0, sizeof(dst_cache));
 	memset(&reloc_kmap, 0, sizeof(reloc_kmap));
 
@@ -888,17 +1728,12 @@ static int psb_fixup_relocs(struct drm_file *file_priv,
 	    ((unsigned long)drm_bmo_virtual(&reloc_kmap, &reloc_is_iomem) +
 	     reloc_offset);
 
-	for (count = 0; count < num_relocs; ++count) {
-		ret = psb_apply_reloc(dev_priv, fence_class,
-				      reloc, buffers,
-				      num_buffers, &dst_cache,
-				      no_wait, interruptible);
-		if (ret)
-			goto out1;
-		reloc++;
-	}
+	ret = psb_apply_reloc_list(dev_priv, fence_class, reloc, num_relocs,
+				   ctx->reloc_keys, PSB_RELOC_SORT_MAX,
+				   buffers, num_buffers, &dst_cache,
+				   no_wait, interruptible);
 
-      out1:
+	atomic_add(dst_cache.kmaps, &dev_priv->reloc_kmaps);
 	drm_bo_kunmap(&reloc_kmap);
       out:
 	if (registered) {
@@ -917,6 +1752,7 @@ static int psb_fixup_relocs(struct drm_file *file_priv,
 static int psb_cmdbuf_2d(struct drm_file *priv,
 		struct drm_psb_cmdbuf_arg *arg,
 		struct drm_buffer_object *cmd_buffer,
+		struct psb_validate_ctx *ctx,
 		struct drm_fence_arg *fence_arg)
 {
 	struct drm_device *dev = priv->head->dev;
@@ -951,7 +1787,7 @@ static int psb_cmdbuf_2d(struct drm_file *priv,
 	}
 #endif	/* PSB_DETEAR */
 
-	psb_fence_or_sync(priv, PSB_ENGINE_2D, arg, fence_arg, NULL);
+	psb_fence_or_sync(priv, PSB_ENGINE_2D, ctx, arg, fence_arg, NULL);
 
 	mutex_lock(&cmd_buffer->mutex);
 	if (cmd_buffer->fence != NULL)
@@ -1020,8 +1856,63 @@ static void psb_idle_engine(struct drm_device *dev, int engine)
 	}
 }
 
+/*
+ * Fence a non-final entry of a batched submission. The validated buffers
+ * stay on the unfenced list until the last entry of the batch, so only a
+ * stand-alone fence is created, and only if user-space asked for one.
+ */
+
+static void psb_fence_deferred(struct drm_file *priv,
+			       int engine,
+			       struct drm_psb_cmdbuf_arg *arg,
+			       struct drm_fence_arg *fence_arg,
+			       struct drm_fence_object **fence_p)
+{
+	struct drm_device *dev = priv->head->dev;
+	struct drm_fence_object *fence = NULL;
+	uint32_t fence_flags = arg->fence_flags & ~PSB_FENCE_FLAG_DEFERRED;
+	uint32_t fence_type = DRM_FENCE_TYPE_EXE;
+	int ret;
+
+	if (fence_flags & DRM_FENCE_FLAG_NO_USER)
+		goto out;
+
+	if (engine == PSB_ENGINE_TA)
+		fence_type |= _PSB_FENCE_TYPE_TA_DONE |
+		    _PSB_FENCE_TYPE_RASTER_DONE;
+
+	ret = drm_fence_object_create(dev, engine, fence_type,
+				      fence_flags | DRM_FENCE_FLAG_EMIT,
+				      &fence);
+	if (ret) {
+		psb_idle_engine(dev, engine);
+		fence_arg->handle = ~0;
+		fence_arg->error = ret;
+		fence = NULL;
+		goto out;
+	}
+
+	ret = drm_fence_add_user_object(priv, fence,
+					fence_flags & DRM_FENCE_FLAG_SHAREABLE);
+	if (ret) {
+		(void)drm_fence_object_wait(fence, 0, 1, fence->type);
+		drm_fence_usage_deref_unlocked(&fence);
+		fence_arg->handle = ~0;
+		fence_arg->error = ret;
+		goto out;
+	}
+
+	drm_fence_fill_arg(fence, fence_arg);
+      out:
+	if (fence_p)
+		*fence_p = fence;
+	else if (fence)
+		drm_fence_usage_deref_unlocked(&fence);
+}
+
 void psb_fence_or_sync(struct drm_file *priv,
 		       int engine,
+		       struct psb_validate_ctx *ctx,
 		       struct drm_psb_cmdbuf_arg *arg,
 		       struct drm_fence_arg *fence_arg,
 		       struct drm_fence_object **fence_p)
@@ -1030,7 +1921,12 @@ void psb_fence_or_sync(struct drm_file *priv,
 	int ret;
 	struct drm_fence_object *fence;
 
-	ret = drm_fence_buffer_objects(dev, NULL, arg->fence_flags,
+	if (arg->fence_flags & PSB_FENCE_FLAG_DEFERRED) {
+		psb_fence_deferred(priv, engine, arg, fence_arg, fence_p);
+		return;
+	}
+
+	ret = drm_fence_buffer_objects(dev, &ctx->unfenced, arg->fence_flags,
 				       NULL, &fence);
 
 	if (ret) {
@@ -1053,7 +1949,7 @@ void psb_fence_or_sync(struct drm_file *priv,
 			fence_arg->error = ret;
 		}
 
-		drm_putback_buffer_objects(dev);
+		drm_putback_buffer_list(dev, &ctx->unfenced);
 		if (fence_p)
 			*fence_p = NULL;
 		return;
@@ -1088,67 +1984,139 @@ void psb_fence_or_sync(struct drm_file *priv,
 		drm_fence_usage_deref_unlocked(&fence);
 }
 
+/*
+ * Write the validate replies back. Entries that are contiguous in
+ * user-space, as with an array-mode list, are written with a single
+ * copy_to_user() per PSB_VALIDATE_CHUNK entries. The next member is
+ * rewritten to point to the following entry, so a linked list stays
+ * usable if user-space needs to resubmit it.
+ */
+
 int psb_handle_copyback(struct drm_device *dev,
 			struct psb_buflist_item *buffers,
-			unsigned int num_buffers, int ret, void *data)
+			unsigned int num_buffers, int ret,
+			struct drm_bo_op_arg *args)
 {
-	struct drm_psb_private *dev_priv =
-	    (struct drm_psb_private *)dev->dev_private;
-	struct drm_bo_op_arg arg;
+	struct drm_bo_op_arg *arg;
 	struct psb_buflist_item *item = buffers;
+	struct psb_buflist_item *first;
 	struct drm_buffer_object *bo;
 	int err = ret;
+	int count;
 	int i;
 
-	/*
-	 * Clear the unfenced use base register lists and buffer lists.
-	 */
-
-	if (ret) {
-		drm_regs_fence(&dev_priv->use_manager, NULL);
-		drm_putback_buffer_objects(dev);
-	}
-
 	if (ret != -EAGAIN) {
-		for (i = 0; i < num_buffers; ++i) {
-			arg.handled = 1;
-			arg.d.rep.ret = item->ret;
-			bo = item->bo;
-			mutex_lock(&bo->mutex);
-			drm_bo_fill_rep_arg(bo, &arg.d.rep.bo_info);
-			mutex_unlock(&bo->mutex);
-			if (copy_to_user(item->data, &arg, sizeof(arg)))
+		i = 0;
+		while (i < num_buffers) {
+			first = item;
+			count = 0;
+			do {
+				arg = &args[count++];
+				arg->next = (i + 1 < num_buffers) ?
+				    (unsigned long)item[1].data : 0;
+				arg->handled = 1;
+				arg->d.rep.ret = item->ret;
+				bo = item->bo;
+				mutex_lock(&bo->mutex);
+				drm_bo_fill_rep_arg(bo, &arg->d.rep.bo_info);
+				mutex_unlock(&bo->mutex);
+				++item;
+				++i;
+			} while (i < num_buffers && count < PSB_VALIDATE_CHUNK &&
+				 item->data == (void __user *)
+				 ((struct drm_bo_op_arg __user *)item[-1].data +
+				  1));
+
+			if (copy_to_user(first->data, args,
+					 count * sizeof(*args)))
 				err = -EFAULT;
-			++item;
 		}
 	}
 
 	return err;
 }
 
-static int psb_cmdbuf_video(struct drm_file *priv,
-			    struct drm_psb_cmdbuf_arg *arg,
-			    unsigned int num_buffers,
-			    struct drm_buffer_object *cmd_buffer,
-			    struct drm_fence_arg *fence_arg)
+/*
+ * Buffer set counterpart of psb_handle_copyback. After a successful
+ * submission, the current offsets are written back to the offset array
+ * passed with the submission, if any.
+ */
+
+static int psb_bufset_copyback(struct drm_device *dev,
+			       uint64_t __user *user_offsets,
+			       struct psb_buflist_item *buffers,
+			       unsigned int num_buffers, int ret)
 {
-	struct drm_device *dev = priv->head->dev;
-	struct drm_fence_object *fence;
-	int ret;
+	uint64_t offset;
+	int i;
 
-	/*
-	 * Check this. Doesn't seem right. Have fencing done AFTER command
-	 * submission and make sure drm_psb_idle idles the MSVDX completely.
-	 */
+	if (ret || !user_offsets)
+		return ret;
 
-	psb_fence_or_sync(priv, PSB_ENGINE_VIDEO, arg, fence_arg, &fence);
-	ret = psb_submit_video_cmdbuf(dev, cmd_buffer, arg->cmdbuf_offset,
-				      arg->cmdbuf_size, fence);
+	for (i = 0; i < num_buffers; ++i) {
+		if (buffers[i].presumed_offset_correct)
+			continue;
 
-	if (ret)
-		return ret;
+		offset = buffers[i].bo->offset;
+		if (copy_to_user(user_offsets + i, &offset, sizeof(offset)))
+			ret = -EFAULT;
+	}
 
-	drm_fence_usage_deref_unlocked(&fence);
+	return ret;
+}
+
+/*
+ * Put back the submission's unfenced buffers on error, and write the
+ * validate replies back. The use base registers are put back by the
+ * TA submission path, which owns them.
+ */
+
+static int psb_validate_copyback(struct drm_file *file_priv,
+				 struct psb_bufset *set,
+				 struct psb_validate_ctx *ctx,
+				 unsigned int num_buffers, int ret)
+{
+	struct drm_device *dev = file_priv->head->dev;
+
+	if (ret)
+		drm_putback_buffer_list(dev, &ctx->unfenced);
+
+	if (set) {
+		ret = psb_bufset_copyback(dev, ctx->set_offsets, ctx->buffers,
+					  num_buffers, ret);
+		psb_bufset_unref(&set);
+		return ret;
+	}
+
+	return psb_handle_copyback(dev, ctx->buffers, num_buffers, ret,
+				   ctx->validate_args);
+}
+
+static int psb_cmdbuf_video(struct drm_file *priv,
+			    struct drm_psb_cmdbuf_arg *arg,
+			    unsigned int num_buffers,
+			    struct drm_buffer_object *cmd_buffer,
+			    struct psb_validate_ctx *ctx,
+			    struct drm_fence_arg *fence_arg)
+{
+	struct drm_device *dev = priv->head->dev;
+	struct drm_fence_object *fence;
+	int ret;
+
+	/*
+	 * Check this. Doesn't seem right. Have fencing done AFTER command
+	 * submission and make sure drm_psb_idle idles the MSVDX completely.
+	 */
+
+	psb_fence_or_sync(priv, PSB_ENGINE_VIDEO, ctx, arg, fence_arg,
+			  &fence);
+	ret = psb_submit_video_cmdbuf(dev, cmd_buffer, arg->cmdbuf_offset,
+				      arg->cmdbuf_size, fence);
+
+	if (ret)
+		return ret;
+
+	drm_fence_usage_deref_unlocked(&fence);
 	mutex_lock(&cmd_buffer->mutex);
 	if (cmd_buffer->fence != NULL)
 		drm_fence_usage_deref_unlocked(&cmd_buffer->fence);
@@ -1161,8 +2129,11 @@ int psb_feedback_buf(struct drm_file *file_priv,
 		     uint32_t handle,
 		     uint32_t offset,
 		     uint32_t feedback_breakpoints,
-		     uint32_t feedback_size, struct psb_feedback_info *feedback)
+		     uint32_t feedback_size,
+		     struct psb_validate_ctx *ctx,
+		     struct psb_feedback_info *feedback)
 {
+	struct drm_device *dev = file_priv->head->dev;
 	struct drm_buffer_object *bo;
 	struct page *page;
 	uint32_t page_no;
@@ -1191,19 +2162,23 @@ int psb_feedback_buf(struct drm_file *file_priv,
 		return -EINVAL;
 	}
 
-	ret = drm_bo_handle_validate(file_priv,
-				     handle,
-				     PSB_ENGINE_TA,
-				     DRM_BO_FLAG_MEM_LOCAL |
-				     DRM_BO_FLAG_CACHED |
-				     DRM_BO_FLAG_WRITE |
-				     PSB_BO_FLAG_FEEDBACK,
-				     DRM_BO_MASK_MEM |
-				     DRM_BO_FLAG_CACHED |
-				     DRM_BO_FLAG_WRITE |
-				     PSB_BO_FLAG_FEEDBACK, 0, 0, NULL, &bo);
+	mutex_lock(&dev->struct_mutex);
+	bo = drm_lookup_buffer_object(file_priv, handle, 1);
+	mutex_unlock(&dev->struct_mutex);
+	if (!bo)
+		return -EINVAL;
+
+	ret = psb_validate_claim(file_priv, ctx, bo,
+				 DRM_BO_FLAG_MEM_LOCAL |
+				 DRM_BO_FLAG_CACHED |
+				 DRM_BO_FLAG_WRITE |
+				 PSB_BO_FLAG_FEEDBACK,
+				 DRM_BO_MASK_MEM |
+				 DRM_BO_FLAG_CACHED |
+				 DRM_BO_FLAG_WRITE |
+				 PSB_BO_FLAG_FEEDBACK, 0, PSB_ENGINE_TA);
 	if (ret)
-		return ret;
+		goto out_unref;
 
 	page_no = offset >> PAGE_SHIFT;
 	if (page_no >= bo->num_pages) {
@@ -1234,89 +2209,48 @@ int psb_feedback_buf(struct drm_file *file_priv,
 	return ret;
 }
 
-int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
-		     struct drm_file *file_priv)
+/*
+ * Look up the command buffers of a single submission and hand it to
+ * its engine. The buffer list has already been validated and relocated.
+ */
+
+static int psb_cmdbuf_dispatch(struct drm_device *dev,
+			       struct drm_file *file_priv,
+			       struct drm_psb_cmdbuf_arg *arg,
+			       struct psb_validate_ctx *ctx,
+			       unsigned num_buffers,
+			       struct drm_fence_arg *fence_arg)
 {
-	drm_psb_cmdbuf_arg_t *arg = data;
-	int ret = 0;
-	unsigned num_buffers;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
 	struct drm_buffer_object *cmd_buffer = NULL;
 	struct drm_buffer_object *ta_buffer = NULL;
 	struct drm_buffer_object *oom_buffer = NULL;
-	struct drm_fence_arg fence_arg;
 	struct drm_psb_scene user_scene;
 	struct psb_scene_pool *pool = NULL;
 	struct psb_scene *scene = NULL;
-	struct drm_psb_private *dev_priv =
-	    (struct drm_psb_private *)file_priv->head->dev->dev_private;
-	int engine;
 	struct psb_feedback_info feedback;
-
-	if (!dev_priv)
-		return -EINVAL;
-
-	ret = drm_bo_read_lock(&dev->bm.bm_lock, 1);
-	if (ret)
-		return ret;
-
-	num_buffers = PSB_NUM_VALIDATE_BUFFERS;
-
-	ret = mutex_lock_interruptible(&dev_priv->cmdbuf_mutex);
-	if (ret) {
-		drm_bo_read_unlock(&dev->bm.bm_lock);
-		return -EAGAIN;
-	}
-	if (unlikely(dev_priv->buffers == NULL)) {
-		dev_priv->buffers = vmalloc(PSB_NUM_VALIDATE_BUFFERS *
-					    sizeof(*dev_priv->buffers));
-		if (dev_priv->buffers == NULL) {
-			drm_bo_read_unlock(&dev->bm.bm_lock);
-			return -ENOMEM;
-		}
-	}
-
-
-	engine = (arg->engine == PSB_ENGINE_RASTERIZER) ?
-	    PSB_ENGINE_TA : arg->engine;
-
-	ret =
-	    psb_validate_buffer_list(file_priv, engine,
-				     (unsigned long)arg->buffer_list,
-				     dev_priv->buffers, &num_buffers);
-	if (ret)
-		goto out_err0;
-
-	ret = psb_fixup_relocs(file_priv, engine, arg->num_relocs,
-			       arg->reloc_offset, arg->reloc_handle,
-			       dev_priv->buffers, num_buffers, 0, 1);
-	if (ret)
-		goto out_err0;
+	int ret;
 
 	mutex_lock(&dev->struct_mutex);
 	cmd_buffer = drm_lookup_buffer_object(file_priv, arg->cmdbuf_handle, 1);
 	mutex_unlock(&dev->struct_mutex);
-	if (!cmd_buffer) {
-		ret = -EINVAL;
-		goto out_err0;
-	}
+	if (!cmd_buffer)
+		return -EINVAL;
 
 	switch (arg->engine) {
 	case PSB_ENGINE_2D:
-		ret = psb_cmdbuf_2d(file_priv, arg, cmd_buffer, &fence_arg);
-		if (ret)
-			goto out_err0;
+		ret = psb_cmdbuf_2d(file_priv, arg, cmd_buffer, ctx,
+				    fence_arg);
 		break;
 	case PSB_ENGINE_VIDEO:
 		ret =
 		    psb_cmdbuf_video(file_priv, arg, num_buffers, cmd_buffer,
-				     &fence_arg);
-		if (ret)
-			goto out_err0;
+				     ctx, fence_arg);
 		break;
 	case PSB_ENGINE_RASTERIZER:
-		ret = psb_cmdbuf_raster(file_priv, arg, cmd_buffer, &fence_arg);
-		if (ret)
-			goto out_err0;
+		ret = psb_cmdbuf_raster(file_priv, arg, cmd_buffer, ctx,
+					fence_arg);
 		break;
 	case PSB_ENGINE_TA:
 		if (arg->ta_handle == arg->cmdbuf_handle) {
@@ -1332,7 +2266,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 			mutex_unlock(&dev->struct_mutex);
 			if (!ta_buffer) {
 				ret = -EINVAL;
-				goto out_err0;
+				goto out;
 			}
 		}
 		if (arg->oom_size != 0) {
@@ -1350,7 +2284,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 				mutex_unlock(&dev->struct_mutex);
 				if (!oom_buffer) {
 					ret = -EINVAL;
-					goto out_err0;
+					goto out;
 				}
 			}
 		}
@@ -1359,7 +2293,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 				     ((unsigned long)arg->scene_arg),
 				     sizeof(user_scene));
 		if (ret)
-			goto out_err0;
+			goto out;
 
 		if (!user_scene.handle_valid) {
 			pool = psb_scene_pool_alloc(file_priv, 0,
@@ -1367,7 +2301,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 						    user_scene.w, user_scene.h);
 			if (!pool) {
 				ret = -ENOMEM;
-				goto out_err0;
+				goto out;
 			}
 
 			user_scene.handle = psb_scene_pool_handle(pool);
@@ -1377,7 +2311,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 					   &user_scene, sizeof(user_scene));
 
 			if (ret)
-				goto out_err0;
+				goto out;
 		} else {
 			mutex_lock(&dev->struct_mutex);
 			pool = psb_scene_pool_lookup_devlocked(file_priv,
@@ -1386,7 +2320,7 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 			mutex_unlock(&dev->struct_mutex);
 			if (!pool) {
 				ret = -EINVAL;
-				goto out_err0;
+				goto out;
 			}
 		}
 
@@ -1395,11 +2329,12 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 					      user_scene.w,
 					      user_scene.h,
 					      arg->ta_flags &
-					      PSB_TA_FLAG_LASTPASS, &scene);
+					      PSB_TA_FLAG_LASTPASS, ctx, &scene);
 		mutex_unlock(&dev_priv->reset_mutex);
 
 		if (ret)
-			goto out_err0;
+			goto out;
+
 
 		memset(&feedback, 0, sizeof(feedback));
 		if (arg->feedback_ops) {
@@ -1408,31 +2343,23 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 					       arg->feedback_handle,
 					       arg->feedback_offset,
 					       arg->feedback_breakpoints,
-					       arg->feedback_size, &feedback);
+					       arg->feedback_size, ctx,
+					       &feedback);
 			if (ret)
-				goto out_err0;
+				goto out;
 		}
 		ret = psb_cmdbuf_ta(file_priv, arg, cmd_buffer, ta_buffer,
-				    oom_buffer, scene, &feedback, &fence_arg);
-		if (ret)
-			goto out_err0;
+				    oom_buffer, scene, &feedback, ctx,
+				    fence_arg);
 		break;
 	default:
 		DRM_ERROR("Unimplemented command submission mechanism (%x).\n",
 			  arg->engine);
 		ret = -EINVAL;
-		goto out_err0;
-	}
-
-	if (!(arg->fence_flags & DRM_FENCE_FLAG_NO_USER)) {
-		ret = copy_to_user((void __user *)
-				   ((unsigned long)arg->fence_arg),
-				   &fence_arg, sizeof(fence_arg));
+		break;
 	}
 
-      out_err0:
-	ret =
-	    psb_handle_copyback(dev, dev_priv->buffers, num_buffers, ret, data);
+      out:
 	mutex_lock(&dev->struct_mutex);
 	if (scene)
 		psb_scene_unref_devlocked(&scene);
@@ -1444,11 +2371,513 @@ int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
 		drm_bo_usage_deref_locked(&ta_buffer);
 	if (oom_buffer)
 		drm_bo_usage_deref_locked(&oom_buffer);
+	mutex_unlock(&dev->struct_mutex);
+
+	return ret;
+}
+
+/*
+ * Submission contexts. Contexts are only allocated when the pool is
+ * empty, which after warm-up only happens if more submissions than ever
+ * before are in flight at the same time.
+ */
+
+static void psb_validate_ctx_free(struct psb_validate_ctx *ctx)
+{
+	if (ctx->buffers)
+		vfree(ctx->buffers);
+	if (ctx->validate_args)
+		drm_free(ctx->validate_args, PSB_VALIDATE_CHUNK *
+			 sizeof(*ctx->validate_args), DRM_MEM_DRIVER);
+	if (ctx->reloc_keys)
+		vfree(ctx->reloc_keys);
+	drm_free(ctx, sizeof(*ctx), DRM_MEM_DRIVER);
+}
+
+static struct psb_validate_ctx *psb_validate_ctx_alloc(void)
+{
+	struct psb_validate_ctx *ctx;
+
+	ctx = drm_calloc(1, sizeof(*ctx), DRM_MEM_DRIVER);
+	if (!ctx)
+		return NULL;
+
+	INIT_LIST_HEAD(&ctx->unfenced);
+	ctx->buffers = vmalloc(PSB_NUM_VALIDATE_BUFFERS *
+			       sizeof(*ctx->buffers));
+	ctx->validate_args = drm_alloc(PSB_VALIDATE_CHUNK *
+				       sizeof(*ctx->validate_args),
+				       DRM_MEM_DRIVER);
+	ctx->reloc_keys = vmalloc(PSB_RELOC_SORT_MAX *
+				  sizeof(*ctx->reloc_keys));
+
+	if (!ctx->buffers || !ctx->validate_args || !ctx->reloc_keys) {
+		psb_validate_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static struct psb_validate_ctx *psb_validate_ctx_get(struct drm_psb_private
+						     *dev_priv)
+{
+	struct psb_validate_ctx *ctx = NULL;
+
+	spin_lock(&dev_priv->validate_ctx_lock);
+	if (!list_empty(&dev_priv->validate_ctx_pool)) {
+		ctx = list_entry(dev_priv->validate_ctx_pool.next,
+				 struct psb_validate_ctx, head);
+		list_del_init(&ctx->head);
+	}
+	spin_unlock(&dev_priv->validate_ctx_lock);
+
+	if (unlikely(ctx == NULL))
+		ctx = psb_validate_ctx_alloc();
+
+	return ctx;
+}
+
+static void psb_validate_ctx_put(struct drm_psb_private *dev_priv,
+				 struct psb_validate_ctx *ctx)
+{
+	BUG_ON(!list_empty(&ctx->unfenced));
+
+	spin_lock(&dev_priv->validate_ctx_lock);
+	list_add(&ctx->head, &dev_priv->validate_ctx_pool);
+	spin_unlock(&dev_priv->validate_ctx_lock);
+}
+
+void psb_validate_ctx_takedown(struct drm_psb_private *dev_priv)
+{
+	struct psb_validate_ctx *ctx, *next;
+	LIST_HEAD(pool);
+
+	spin_lock(&dev_priv->validate_ctx_lock);
+	list_splice_init(&dev_priv->validate_ctx_pool, &pool);
+	spin_unlock(&dev_priv->validate_ctx_lock);
+
+	list_for_each_entry_safe(ctx, next, &pool, head) {
+		list_del(&ctx->head);
+		psb_validate_ctx_free(ctx);
+	}
+}
+
+/*
+ * Take the bo read lock and a submission context. Validation and
+ * relocation only touch the context, so submissions run them
+ * concurrently and serialize in psb_engine_lock().
+ */
+
+static int psb_cmdbuf_lock(struct drm_device *dev,
+			   struct psb_validate_ctx **ctx)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	int ret;
+
+	ret = drm_bo_read_lock(&dev->bm.bm_lock, 1);
+	if (ret)
+		return ret;
+
+	*ctx = psb_validate_ctx_get(dev_priv);
+	if (!*ctx) {
+		drm_bo_read_unlock(&dev->bm.bm_lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void psb_cmdbuf_unlock(struct drm_device *dev,
+			      struct psb_validate_ctx *ctx,
+			      unsigned num_buffers)
+{
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
 
-	psb_dereference_buffers_locked(dev_priv->buffers, num_buffers);
+	mutex_lock(&dev->struct_mutex);
+	psb_dereference_buffers_locked(ctx->buffers, num_buffers);
 	mutex_unlock(&dev->struct_mutex);
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
+	psb_validate_ctx_put(dev_priv, ctx);
 
 	drm_bo_read_unlock(&dev->bm.bm_lock);
+}
+
+/*
+ * Serializes the hand-off of validated submissions to an engine class.
+ * 2D, video and TA submissions each have their own lock, so a TA
+ * submission waiting for a scene clear or an XHW round-trip doesn't
+ * hold up video decode or 2D blits. Rasterizer submissions share the
+ * TA lock; they go through the same scheduler queues and TA
+ * relocations share the USE base registers with them.
+ *
+ * Lock ordering:
+ *
+ * bm_lock (read) -> cmdbuf_mutex[class] -> reset_mutex / msvdx_mutex ->
+ * bo->mutex -> struct_mutex.
+ *
+ * Engine locks never nest within each other, and are never taken with
+ * a bo->mutex held. Validation runs before the engine lock is taken,
+ * so a bo can be validated and unfenced by one engine class while
+ * another class holds its lock; see psb_validate_claim(). A file's
+ * bufset_mutex is only held to look up a buffer set, which is then
+ * used by reference, so it doesn't nest with any of the above.
+ */
+
+static int psb_engine_lock(struct drm_psb_private *dev_priv,
+			   unsigned engine)
+{
+	if (mutex_lock_interruptible(&dev_priv->cmdbuf_mutex
+				     [psb_engine_class(engine)]))
+		return -EAGAIN;
+	return 0;
+}
+
+static void psb_engine_unlock(struct drm_psb_private *dev_priv,
+			      unsigned engine)
+{
+	mutex_unlock(&dev_priv->cmdbuf_mutex[psb_engine_class(engine)]);
+}
+
+/*
+ * Priority submissions get a larger share of the TA and rasterizer, so
+ * they are only honoured for the master, normally the X server, and
+ * for processes allowed to raise their CPU priority. Others have the
+ * flag silently ignored.
+ */
+
+static int psb_may_prioritize(struct drm_file *file_priv)
+{
+	return file_priv->master || capable(CAP_SYS_NICE);
+}
+
+int psb_cmdbuf_ioctl(struct drm_device *dev, void *data,
+		     struct drm_file *file_priv)
+{
+	drm_psb_cmdbuf_arg_t *arg = data;
+	int ret = 0;
+	unsigned num_buffers;
+	struct drm_fence_arg fence_arg;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)file_priv->head->dev->dev_private;
+	struct psb_validate_ctx *ctx;
+	struct psb_bufset *set;
+	struct psb_sched_client *client = psb_fpriv(file_priv)->sched_client;
+	unsigned engine;
+	int priority = 0;
+	int reserved = 0;
+	int mode;
+
+	if (!dev_priv)
+		return -EINVAL;
+
+	if (arg->engine >= PSB_NUM_ENGINES) {
+		DRM_ERROR("Invalid command submission engine %u.\n",
+			  arg->engine);
+		return -EINVAL;
+	}
+
+	arg->fence_flags &= ~PSB_FENCE_FLAG_DEFERRED;
+
+	engine = (arg->engine == PSB_ENGINE_RASTERIZER) ?
+	    PSB_ENGINE_TA : arg->engine;
+
+	if (engine == PSB_ENGINE_TA) {
+		priority = (arg->ta_flags & PSB_CMDBUF_FLAG_PRIORITY) &&
+		    psb_may_prioritize(file_priv);
+		reserved = psb_scheduler_admit(dev_priv, client, priority, 1);
+		if (reserved < 0)
+			return reserved;
+	}
+
+	ret = psb_cmdbuf_lock(dev, &ctx);
+	if (ret) {
+		psb_scheduler_unreserve(dev_priv, client, reserved);
+		return ret;
+	}
+
+	ctx->sched_reserved = reserved;
+	ctx->sched_priority = priority;
+	ctx->sched_ordered = 0;
+	num_buffers = PSB_NUM_VALIDATE_BUFFERS;
+
+	if (arg->ta_flags & PSB_CMDBUF_FLAG_BUFFER_SET)
+		mode = PSB_VALIDATE_SET;
+	else if (arg->ta_flags & PSB_CMDBUF_FLAG_VALIDATE_ARRAY)
+		mode = PSB_VALIDATE_ARRAY;
+	else
+		mode = PSB_VALIDATE_LIST;
+
+	ret =
+	    psb_validate_buffers(file_priv, engine,
+				 (unsigned long)arg->buffer_list, mode,
+				 ctx, &num_buffers, &set);
+	if (ret)
+		goto out_err0;
+
+	/*
+	 * TA relocations may grab USE base registers, which sit on the
+	 * device-wide register manager's unfenced list until the TA
+	 * submission is fenced. Those are relocated with the engine lock
+	 * held, all others before taking it.
+	 */
+
+	if (engine != PSB_ENGINE_TA) {
+		ret = psb_fixup_relocs(file_priv, engine, arg->num_relocs,
+				       arg->reloc_offset, arg->reloc_handle,
+				       arg->ta_flags &
+				       PSB_CMDBUF_FLAG_USER_RELOCS,
+				       ctx, num_buffers, 0, 1);
+		if (ret)
+			goto out_err0;
+	}
+
+	ret = psb_engine_lock(dev_priv, engine);
+	if (ret)
+		goto out_err0;
+
+	if (engine == PSB_ENGINE_TA)
+		ret = psb_fixup_relocs(file_priv, engine, arg->num_relocs,
+				       arg->reloc_offset, arg->reloc_handle,
+				       arg->ta_flags &
+				       PSB_CMDBUF_FLAG_USER_RELOCS,
+				       ctx, num_buffers, 0, 1);
+	if (!ret)
+		ret = psb_cmdbuf_dispatch(dev, file_priv, arg, ctx,
+					  num_buffers, &fence_arg);
+	if (ret && engine == PSB_ENGINE_TA)
+		drm_regs_fence(&dev_priv->use_manager, NULL);
+
+	psb_engine_unlock(dev_priv, engine);
+
+	if (ret)
+		goto out_err0;
+
+	if (!(arg->fence_flags & DRM_FENCE_FLAG_NO_USER)) {
+		ret = copy_to_user((void __user *)
+				   ((unsigned long)arg->fence_arg),
+				   &fence_arg, sizeof(fence_arg));
+	}
+
+      out_err0:
+	psb_scheduler_unreserve(dev_priv, client, ctx->sched_reserved);
+	ret = psb_validate_copyback(file_priv, set, ctx, num_buffers, ret);
+	psb_cmdbuf_unlock(dev, ctx, num_buffers);
+	return ret;
+}
+
+/*
+ * A batch stopped early after some of its entries were handed to the
+ * hardware. Those entries' buffers are still unfenced, so fence them
+ * with a fence covering everything submitted so far.
+ */
+
+static void psb_fence_batch_tail(struct drm_file *file_priv,
+				 int engine,
+				 struct psb_validate_ctx *ctx,
+				 uint32_t fence_flags,
+				 struct drm_fence_arg *fence_arg)
+{
+	struct drm_device *dev = file_priv->head->dev;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct drm_psb_cmdbuf_arg tail;
+	struct drm_fence_object *fence;
+
+	memset(&tail, 0, sizeof(tail));
+	tail.fence_flags = fence_flags;
+	psb_fence_or_sync(file_priv, engine, ctx, &tail, fence_arg, &fence);
+	if (engine == PSB_ENGINE_TA) {
+		drm_regs_fence(&dev_priv->use_manager, fence);
+		if (fence)
+			psb_scheduler_fence_queued(dev_priv, fence->sequence);
+	}
+	if (fence)
+		drm_fence_usage_deref_unlocked(&fence);
+}
+
+int psb_cmdbuf_batch_ioctl(struct drm_device *dev, void *data,
+			   struct drm_file *file_priv)
+{
+	struct drm_psb_cmdbuf_batch_arg *batch = data;
+	struct drm_psb_cmdbuf_arg __user *user_arg =
+	    (struct drm_psb_cmdbuf_arg __user *)(unsigned long)batch->cmdbufs;
+	struct drm_psb_cmdbuf_arg arg;
+	struct drm_fence_arg fence_arg;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)file_priv->head->dev->dev_private;
+	int fence_each = (batch->flags & PSB_BATCH_FLAG_FENCE_EACH) != 0;
+	uint32_t batch_fence_flags;
+	struct psb_validate_ctx *ctx;
+	struct psb_bufset *set;
+	struct psb_sched_client *client = psb_fpriv(file_priv)->sched_client;
+	unsigned num_buffers;
+	unsigned num_cmdbufs;
+	unsigned i;
+	int priority = 0;
+	int reserved = 0;
+	int last;
+	int mode;
+	int ret = 0;
+
+	if (!dev_priv)
+		return -EINVAL;
+
+	batch->num_submitted = 0;
+	batch->ret = 0;
+
+	if (batch->num_cmdbufs == 0)
+		return 0;
+
+	if (batch->num_cmdbufs > PSB_MAX_BATCH_CMDBUFS) {
+		DRM_ERROR("Too many command buffers in batch %u.\n",
+			  batch->num_cmdbufs);
+		return -EINVAL;
+	}
+
+	if (batch->engine != PSB_ENGINE_2D && batch->engine != PSB_ENGINE_TA) {
+		DRM_ERROR("Batched submission not supported for engine %u.\n",
+			  batch->engine);
+		return -EINVAL;
+	}
+
+	batch_fence_flags = batch->fence_flags & ~PSB_FENCE_FLAG_DEFERRED;
+	num_cmdbufs = batch->num_cmdbufs;
+
+	/*
+	 * Each TA or rasterizer entry queues one task. If the client's
+	 * share doesn't cover the whole batch, only submit the entries
+	 * it does cover.
+	 */
+
+	if (batch->engine == PSB_ENGINE_TA) {
+		priority = (batch->flags & PSB_BATCH_FLAG_PRIORITY) &&
+		    psb_may_prioritize(file_priv);
+		reserved = psb_scheduler_admit(dev_priv, client, priority,
+					       num_cmdbufs);
+		if (reserved < 0)
+			return reserved;
+		num_cmdbufs = reserved;
+	}
+
+	ret = psb_cmdbuf_lock(dev, &ctx);
+	if (ret) {
+		psb_scheduler_unreserve(dev_priv, client, reserved);
+		return ret;
+	}
+
+	ctx->sched_reserved = reserved;
+	ctx->sched_priority = priority;
+	ctx->sched_ordered = 0;
+	num_buffers = PSB_NUM_VALIDATE_BUFFERS;
+
+	if (batch->flags & PSB_BATCH_FLAG_BUFFER_SET)
+		mode = PSB_VALIDATE_SET;
+	else if (batch->flags & PSB_BATCH_FLAG_VALIDATE_ARRAY)
+		mode = PSB_VALIDATE_ARRAY;
+	else
+		mode = PSB_VALIDATE_LIST;
+
+	ret = psb_validate_buffers(file_priv, batch->engine,
+				   (unsigned long)batch->buffer_list, mode,
+				   ctx, &num_buffers, &set);
+	if (ret)
+		goto out_err0;
+
+	if (batch->engine != PSB_ENGINE_TA) {
+		ret = psb_fixup_relocs(file_priv, batch->engine,
+				       batch->num_relocs,
+				       batch->reloc_offset,
+				       batch->reloc_handle,
+				       batch->flags &
+				       PSB_BATCH_FLAG_USER_RELOCS,
+				       ctx, num_buffers, 0, 1);
+		if (ret)
+			goto out_err0;
+	}
+
+	ret = psb_engine_lock(dev_priv, batch->engine);
+	if (ret)
+		goto out_err0;
+
+	if (batch->engine == PSB_ENGINE_TA) {
+		ret = psb_fixup_relocs(file_priv, batch->engine,
+				       batch->num_relocs,
+				       batch->reloc_offset,
+				       batch->reloc_handle,
+				       batch->flags &
+				       PSB_BATCH_FLAG_USER_RELOCS,
+				       ctx, num_buffers, 0, 1);
+		if (ret)
+			goto out_err1;
+	}
+
+	for (i = 0; i < num_cmdbufs; ++i) {
+		if (copy_from_user(&arg, user_arg + i, sizeof(arg))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (((arg.engine == PSB_ENGINE_RASTERIZER) ?
+		     PSB_ENGINE_TA : arg.engine) != batch->engine) {
+			DRM_ERROR("Batch entry %u has the wrong engine %u.\n",
+				  i, arg.engine);
+			ret = -EINVAL;
+			break;
+		}
+
+		last = (i == num_cmdbufs - 1);
+		if (!fence_each) {
+			arg.fence_flags = (last) ? batch_fence_flags :
+			    DRM_FENCE_FLAG_NO_USER;
+			arg.fence_arg = batch->fence_arg;
+		}
+		arg.fence_flags &= ~PSB_FENCE_FLAG_DEFERRED;
+		if (!last)
+			arg.fence_flags |= PSB_FENCE_FLAG_DEFERRED;
+
+		ret = psb_cmdbuf_dispatch(dev, file_priv, &arg, ctx,
+					  num_buffers, &fence_arg);
+		if (ret)
+			break;
+
+		batch->num_submitted++;
+
+		if (!(arg.fence_flags & DRM_FENCE_FLAG_NO_USER) &&
+		    copy_to_user((void __user *)((unsigned long)arg.fence_arg),
+				 &fence_arg, sizeof(fence_arg))) {
+			ret = -EFAULT;
+			if (!last)
+				break;
+		}
+	}
+
+	if (ret && batch->num_submitted != 0) {
+		if (batch->num_submitted != num_cmdbufs) {
+			psb_fence_batch_tail(file_priv, batch->engine, ctx,
+					     (fence_each) ?
+					     DRM_FENCE_FLAG_NO_USER :
+					     batch_fence_flags, &fence_arg);
+			if (!fence_each && !(batch_fence_flags &
+					     DRM_FENCE_FLAG_NO_USER))
+				(void)copy_to_user((void __user *)
+						   ((unsigned long)
+						    batch->fence_arg),
+						   &fence_arg,
+						   sizeof(fence_arg));
+		}
+		batch->ret = ret;
+		ret = 0;
+	} else if (!ret && num_cmdbufs != batch->num_cmdbufs)
+		batch->ret = -EAGAIN;
+
+      out_err1:
+	if (ret && batch->engine == PSB_ENGINE_TA)
+		drm_regs_fence(&dev_priv->use_manager, NULL);
+	psb_engine_unlock(dev_priv, batch->engine);
+      out_err0:
+	psb_scheduler_unreserve(dev_priv, client, ctx->sched_reserved);
+	ret = psb_validate_copyback(file_priv, set, ctx, num_buffers, ret);
+	psb_cmdbuf_unlock(dev, ctx, num_buffers);
 	return ret;
 }
@@ -0,0 +1,353 @@
+/**************************************************************************
+ * Copyright (c) 2007, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ **************************************************************************/
+/*
+ * Scheduler event trace, read through "/proc/dri/%minor%/psb_trace"
+ * and summarized in "/proc/dri/%minor%/psb_trace_stats".
+ *
+ * Writers claim a slot by incrementing the ring head, so events may be
+ * recorded from interrupt context without a lock. A slot's id is
+ * invalidated while it is being written, and readers drop a record
+ * whose id changed while it was copied, seqlock style.
+ */
+
+#include "drmP.h"
+#include "psb_drv.h"
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <asm/div64.h>
+
+struct psb_trace_reader {
+	struct psb_scheduler *scheduler;
+	uint32_t next;
+};
+
+static const char *psb_trace_event_names[PSB_TRACE_NUM_EVENTS] = {
+	[PSB_TRACE_QUEUE] = "queue",
+	[PSB_TRACE_TA_FIRE] = "ta fire",
+	[PSB_TRACE_TA_DONE] = "ta done",
+	[PSB_TRACE_TA_OOM] = "ta oom",
+	[PSB_TRACE_RASTER_FIRE] = "raster fire",
+	[PSB_TRACE_RASTER_DONE] = "raster done",
+	[PSB_TRACE_USER_IRQ] = "user irq",
+	[PSB_TRACE_FREE] = "free",
+};
+
+static const char *psb_trace_stage_names[PSB_TRACE_NUM_EVENTS] = {
+	[PSB_TRACE_QUEUE] = "queued",
+	[PSB_TRACE_TA_FIRE] = "ta",
+	[PSB_TRACE_TA_DONE] = "raster wait",
+	[PSB_TRACE_TA_OOM] = "ta oom",
+	[PSB_TRACE_RASTER_FIRE] = "raster",
+	[PSB_TRACE_RASTER_DONE] = "reclaim",
+};
+
+void psb_trace_event(struct psb_scheduler *scheduler, uint32_t type,
+		     struct psb_task *task, uint32_t arg)
+{
+	struct psb_trace *trace = &scheduler->trace;
+	struct drm_psb_trace_event *ev;
+	uint64_t now = ktime_to_ns(ktime_get());
+	uint64_t delta;
+	uint32_t id;
+	int bucket;
+
+	id = atomic_inc_return(&trace->head) - 1;
+	ev = &trace->ring[id & PSB_TRACE_MASK];
+	atomic_inc(&trace->count[type]);
+
+	ev->id = ~id;
+	smp_wmb();
+	ev->time_ns = now;
+	ev->sequence = (task) ? task->sequence : 0;
+	ev->arg = arg;
+	ev->type = type;
+	ev->engine = (task) ? task->engine : 0;
+	smp_wmb();
+	ev->id = id;
+
+	if (!task)
+		return;
+
+	/*
+	 * Tasks are queued under the submit lock.
+	 */
+
+	if (type == PSB_TRACE_QUEUE &&
+	    atomic_read(&scheduler->queued) > trace->max_queued)
+		trace->max_queued = atomic_read(&scheduler->queued);
+
+	/*
+	 * Tasks that started their current stage before tracing
+	 * was enabled aren't accounted.
+	 */
+
+	if (task->trace_time >= trace->start_ns) {
+		delta = now - task->trace_time;
+		do_div(delta, 1000);
+		bucket = (delta >> 32) ? PSB_TRACE_BUCKETS :
+		    fls((uint32_t) delta);
+		if (bucket >= PSB_TRACE_BUCKETS)
+			bucket = PSB_TRACE_BUCKETS - 1;
+		atomic_inc(&trace->hist[task->trace_stage][bucket]);
+	}
+
+	task->trace_time = now;
+	task->trace_stage = type;
+}
+
+static int psb_trace_enable(struct psb_scheduler *scheduler, int enable)
+{
+	struct psb_trace *trace = &scheduler->trace;
+	int i, j;
+
+	mutex_lock(&trace->mutex);
+	if (!enable) {
+		trace->enabled = 0;
+		goto out;
+	}
+
+	if (trace->enabled)
+		goto out;
+
+	if (!trace->ring) {
+		trace->ring = vmalloc(PSB_TRACE_SIZE * sizeof(*trace->ring));
+		if (!trace->ring) {
+			mutex_unlock(&trace->mutex);
+			return -ENOMEM;
+		}
+		for (i = 0; i < PSB_TRACE_SIZE; ++i)
+			trace->ring[i].id = ~0;
+	}
+
+	for (i = 0; i < PSB_TRACE_NUM_EVENTS; ++i) {
+		for (j = 0; j < PSB_TRACE_BUCKETS; ++j)
+			atomic_set(&trace->hist[i][j], 0);
+		atomic_set(&trace->count[i], 0);
+	}
+	trace->max_queued = 0;
+
+	trace->start_ns = ktime_to_ns(ktime_get());
+	smp_wmb();
+	trace->enabled = 1;
+      out:
+	mutex_unlock(&trace->mutex);
+	return 0;
+}
+
+/*
+ * Called at scheduler takedown, when no more events can be recorded.
+ */
+
+void psb_trace_takedown(struct psb_scheduler *scheduler)
+{
+	struct psb_trace *trace = &scheduler->trace;
+
+	trace->enabled = 0;
+	if (trace->ring) {
+		vfree(trace->ring);
+		trace->ring = NULL;
+	}
+}
+
+static int psb_trace_open(struct inode *inode, struct file *filp)
+{
+	struct drm_device *dev = (struct drm_device *)PDE(inode)->data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_trace_reader *reader;
+	uint32_t head;
+
+	reader = drm_calloc(1, sizeof(*reader), DRM_MEM_DRIVER);
+	if (!reader)
+		return -ENOMEM;
+
+	/*
+	 * Start at the oldest record still in the ring.
+	 */
+
+	reader->scheduler = &dev_priv->scheduler;
+	head = atomic_read(&reader->scheduler->trace.head);
+	reader->next = (head > PSB_TRACE_SIZE) ? head - PSB_TRACE_SIZE : 0;
+	filp->private_data = reader;
+
+	return nonseekable_open(inode, filp);
+}
+
+static int psb_trace_release(struct inode *inode, struct file *filp)
+{
+	drm_free(filp->private_data, sizeof(struct psb_trace_reader),
+		 DRM_MEM_DRIVER);
+	return 0;
+}
+
+/*
+ * Copy out whole records up to the current ring head. A reader that
+ * has fallen more than a ring length behind skips ahead, leaving a gap
+ * in the record ids.
+ */
+
+static ssize_t psb_trace_read(struct file *filp, char __user * buf,
+			      size_t count, loff_t * ppos)
+{
+	struct psb_trace_reader *reader = filp->private_data;
+	struct psb_trace *trace = &reader->scheduler->trace;
+	struct drm_psb_trace_event *slot;
+	struct drm_psb_trace_event ev;
+	size_t copied = 0;
+	uint32_t head;
+
+	if (!trace->ring)
+		return 0;
+
+	while (count - copied >= sizeof(ev)) {
+		head = atomic_read(&trace->head);
+		if ((int32_t) (head - reader->next) > PSB_TRACE_SIZE)
+			reader->next = head - PSB_TRACE_SIZE;
+		if (reader->next == head)
+			break;
+
+		slot = &trace->ring[reader->next & PSB_TRACE_MASK];
+		if (slot->id != reader->next) {
+			if ((int32_t) (atomic_read(&trace->head) -
+				       reader->next) > PSB_TRACE_SIZE)
+				continue;
+			break;
+		}
+		smp_rmb();
+		ev = *slot;
+		smp_rmb();
+		if (slot->id != reader->next)
+			continue;
+
+		if (copy_to_user(buf + copied, &ev, sizeof(ev)))
+			return (copied) ? copied : -EFAULT;
+
+		copied += sizeof(ev);
+		reader->next++;
+	}
+
+	return copied;
+}
+
+static ssize_t psb_trace_write(struct file *filp, const char __user * buf,
+			       size_t count, loff_t * ppos)
+{
+	struct psb_trace_reader *reader = filp->private_data;
+	char c;
+	int ret;
+
+	if (count == 0)
+		return 0;
+	if (get_user(c, buf))
+		return -EFAULT;
+
+	switch (c) {
+	case '0':
+		ret = psb_trace_enable(reader->scheduler, 0);
+		break;
+	case '1':
+		ret = psb_trace_enable(reader->scheduler, 1);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return (ret) ? ret : count;
+}
+
+const struct file_operations psb_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = psb_trace_open,
+	.release = psb_trace_release,
+	.read = psb_trace_read,
+	.write = psb_trace_write,
+	.llseek = no_llseek,
+};
+
+/*
+ * Called when "/proc/dri/.../psb_trace_stats" is read. Event rates are
+ * per second since tracing was last enabled. Bucket n counts stages
+ * that took from 2^(n-1) up to 2^n - 1 microseconds, the last bucket
+ * anything longer.
+ */
+
+int psb_trace_info(char *buf, char **start, off_t offset,
+		   int request, int *eof, void *data)
+{
+	struct drm_device *dev = (struct drm_device *)data;
+	struct drm_psb_private *dev_priv =
+	    (struct drm_psb_private *)dev->dev_private;
+	struct psb_trace *trace = &dev_priv->scheduler.trace;
+	uint64_t elapsed_ms = 0;
+	uint64_t rate;
+	uint32_t count;
+	int len = 0;
+	int i, j;
+
+	if (offset > DRM_PROC_LIMIT) {
+		*eof = 1;
+		return 0;
+	}
+
+	*start = &buf[offset];
+	*eof = 0;
+
+	DRM_PROC_PRINT("tracing:                 %s\n",
+		       (trace->enabled) ? "on" : "off");
+	DRM_PROC_PRINT("events recorded:         %u\n",
+		       (uint32_t) atomic_read(&trace->head));
+
+	if (trace->start_ns) {
+		elapsed_ms = ktime_to_ns(ktime_get()) - trace->start_ns;
+		do_div(elapsed_ms, 1000000);
+	}
+	DRM_PROC_PRINT("elapsed (ms):            %llu\n",
+		       (unsigned long long)elapsed_ms);
+	DRM_PROC_PRINT("max queued tasks:        %d\n", trace->max_queued);
+
+	DRM_PROC_PRINT("\nevent            count     per second\n");
+	for (i = 0; i < PSB_TRACE_NUM_EVENTS; ++i) {
+		count = atomic_read(&trace->count[i]);
+		rate = (uint64_t) count * 1000;
+		if (elapsed_ms)
+			do_div(rate, (uint32_t) elapsed_ms);
+		else
+			rate = 0;
+		DRM_PROC_PRINT("%-16s %-9u %llu\n", psb_trace_event_names[i],
+			       count, (unsigned long long)rate);
+	}
+
+	for (i = 0; i < PSB_TRACE_NUM_EVENTS; ++i) {
+		if (!psb_trace_stage_names[i])
+			continue;
+		DRM_PROC_PRINT("\n%s (log2 us):\n", psb_trace_stage_names[i]);
+		for (j = 0; j < PSB_TRACE_BUCKETS; ++j)
+			DRM_PROC_PRINT("%s%u", (j) ? " " : "",
+				       atomic_read(&trace->hist[i][j]));
+		DRM_PROC_PRINT("\n");
+	}
+
+	if (len > request + offset)
+		return request;
+	*eof = 1;
+	return len - offset;
+}
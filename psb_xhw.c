@@ -25,43 +25,213 @@
 
 #include "drmP.h"
 #include "psb_drv.h"
+#include <linux/ktime.h>
+#include <asm/div64.h>
+
+/*
+ * Mark a buffer done. Called with the xhw_lock held. If the scheduler
+ * is holding on to completed tasks until their buffers are done, let
+ * it reclaim them.
+ */
+
+static inline void psb_xhw_buf_done(struct drm_psb_private *dev_priv,
+				    struct psb_xhw_buf *buf)
+{
+	if (buf->complete)
+		buf->complete(dev_priv, buf);
+	atomic_set(&buf->done, 1);
+	if (unlikely(!list_empty(&dev_priv->scheduler.task_reclaim_queue)))
+		schedule_delayed_work(&dev_priv->scheduler.wq, 0);
+}
+
+/*
+ * A reply arrived. Account the round trip and mark the buffer done.
+ * Called with the xhw_lock held.
+ */
+
+static void psb_xhw_buf_reply(struct drm_psb_private *dev_priv,
+			      struct psb_xhw_buf *buf)
+{
+	uint64_t delta = ktime_to_ns(ktime_get()) - buf->issue_ns;
+	int bucket;
+
+	do_div(delta, 1000);
+	bucket = (delta >> 32) ? PSB_XHW_HIST_BUCKETS : fls((uint32_t) delta);
+	if (bucket >= PSB_XHW_HIST_BUCKETS)
+		bucket = PSB_XHW_HIST_BUCKETS - 1;
+	atomic_inc(&dev_priv->xhw_hist[bucket]);
+
+	psb_xhw_buf_done(dev_priv, buf);
+}
+
+/*
+ * Move queued requests into the request ring while there is room.
+ * Called with the xhw_lock held. Buffers that don't want a reply are
+ * done once they are in the ring.
+ */
+
+static void psb_xhw_ring_fill(struct drm_psb_private *dev_priv)
+{
+	struct drm_psb_xhw_ring *ring = dev_priv->xhw_ring;
+	uint32_t head = dev_priv->xhw_ring_head;
+	struct psb_xhw_buf *buf;
+	uint32_t index;
+
+	while (dev_priv->xhw_on && !list_empty(&dev_priv->xhw_in) &&
+	       head - dev_priv->xhw_ring_reaped <= dev_priv->xhw_ring_mask) {
+		buf = list_entry(dev_priv->xhw_in.next, struct psb_xhw_buf,
+				 head);
+		list_del_init(&buf->head);
+
+		index = head++ & dev_priv->xhw_ring_mask;
+		memcpy(&ring->slot[index], &buf->arg, sizeof(buf->arg));
+		if (buf->arg.op == PSB_XHW_TERMINATE)
+			dev_priv->xhw_on = 0;
+
+		if (buf->copy_back)
+			dev_priv->xhw_ring_bufs[index] = buf;
+		else
+			psb_xhw_buf_done(dev_priv, buf);
+	}
+
+	if (!dev_priv->xhw_on)
+		wake_up(&dev_priv->xhw_caller_queue);
+
+	if (head == dev_priv->xhw_ring_head)
+		return;
+
+	smp_wmb();
+	ring->head = dev_priv->xhw_ring_head = head;
+	wake_up_interruptible(&dev_priv->xhw_queue);
+}
+
+/*
+ * Consume the next reply in the request ring. Called with the xhw_lock
+ * held. Returns 1 if more replies are waiting.
+ */
+
+static int psb_xhw_ring_handler(struct drm_psb_private *dev_priv)
+{
+	struct drm_psb_xhw_ring *ring = dev_priv->xhw_ring;
+	uint32_t reaped = dev_priv->xhw_ring_reaped;
+	uint32_t done = ring->done;
+	struct psb_xhw_buf *buf;
+	uint32_t index;
+
+	dev_priv->comm[PSB_COMM_USER_IRQ] = 0;
+	if (done == reaped)
+		return 0;
+
+	if (unlikely(done - reaped > dev_priv->xhw_ring_head - reaped)) {
+		DRM_ERROR("Invalid Xpsb request ring position.\n");
+		return -EINVAL;
+	}
+
+	smp_rmb();
+	index = reaped++ & dev_priv->xhw_ring_mask;
+	buf = dev_priv->xhw_ring_bufs[index];
+	dev_priv->xhw_ring_bufs[index] = NULL;
+	dev_priv->xhw_ring_reaped = reaped;
+
+	if (buf) {
+		memcpy(&buf->arg, &ring->slot[index], sizeof(buf->arg));
+		dev_priv->comm[PSB_COMM_USER_IRQ] = buf->arg.irq_op;
+		psb_xhw_buf_reply(dev_priv, buf);
+		wake_up(&dev_priv->xhw_caller_queue);
+	}
+
+	psb_xhw_ring_fill(dev_priv);
+	return (done != reaped) ? 1 : 0;
+}
 
 void
 psb_xhw_clean_buf(struct drm_psb_private *dev_priv, struct psb_xhw_buf *buf)
 {
 	unsigned long irq_flags;
+	int i;
 
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
 	list_del_init(&buf->head);
 	if (dev_priv->xhw_cur_buf == buf)
 		dev_priv->xhw_cur_buf = NULL;
-	atomic_set(&buf->done, 1);
+	if (dev_priv->xhw_ring) {
+		for (i = 0; i <= dev_priv->xhw_ring_mask; ++i)
+			if (dev_priv->xhw_ring_bufs[i] == buf)
+				dev_priv->xhw_ring_bufs[i] = NULL;
+	}
+	psb_xhw_buf_done(dev_priv, buf);
 	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 }
 
-static inline int psb_xhw_add(struct drm_psb_private *dev_priv,
-			      struct psb_xhw_buf *buf)
+/*
+ * Queue a request for the X server. If complete is non-NULL, it is
+ * called when the request is done, and the caller doesn't wait.
+ */
+
+static int psb_xhw_queue(struct drm_psb_private *dev_priv,
+			 struct psb_xhw_buf *buf,
+			 void (*complete) (struct drm_psb_private *,
+					   struct psb_xhw_buf *))
 {
 	unsigned long irq_flags;
 
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
-	atomic_set(&buf->done, 0);
 	if (unlikely(!dev_priv->xhw_submit_ok)) {
 		spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 		DRM_ERROR("No Xpsb 3D extension available.\n");
 		return -EINVAL;
 	}
+	buf->complete = complete;
+	buf->issue_ns = ktime_to_ns(ktime_get());
+	atomic_set(&buf->done, 0);
 	if (!list_empty(&buf->head)) {
 		DRM_ERROR("Recursive list adding.\n");
 		goto out;
 	}
 	list_add_tail(&buf->head, &dev_priv->xhw_in);
-	wake_up_interruptible(&dev_priv->xhw_queue);
+	if (dev_priv->xhw_ring)
+		psb_xhw_ring_fill(dev_priv);
+	else
+		wake_up_interruptible(&dev_priv->xhw_queue);
       out:
 	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 	return 0;
 }
 
+static inline int psb_xhw_add(struct drm_psb_private *dev_priv,
+			      struct psb_xhw_buf *buf)
+{
+	return psb_xhw_queue(dev_priv, buf, NULL);
+}
+
+/*
+ * Sleep until the X server has answered a request, and account the
+ * time spent.
+ */
+
+int psb_xhw_wait(struct drm_psb_private *dev_priv,
+		 struct psb_xhw_buf *buf, unsigned long timeout)
+{
+	uint64_t start = ktime_to_ns(ktime_get());
+	unsigned long irq_flags;
+	int ret = 0;
+
+	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
+				 atomic_read(&buf->done), timeout);
+
+	if (!atomic_read(&buf->done)) {
+		psb_xhw_clean_buf(dev_priv, buf);
+		ret = -EBUSY;
+	}
+
+	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+	dev_priv->xhw_sync_calls++;
+	dev_priv->xhw_sync_ns += ktime_to_ns(ktime_get()) - start;
+	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+
+	return ret;
+}
+
 int psb_xhw_hotplug(struct drm_psb_private *dev_priv, struct psb_xhw_buf *buf)
 {
 	struct drm_psb_xhw_arg *xa = &buf->arg;
@@ -98,13 +268,9 @@ int psb_xhw_scene_info(struct drm_psb_private *dev_priv,
 	if (ret)
 		return ret;
 
-	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
-				 atomic_read(&buf->done), DRM_HZ);
-
-	if (!atomic_read(&buf->done)) {
-		psb_xhw_clean_buf(dev_priv, buf);
-		return -EBUSY;
-	}
+	ret = psb_xhw_wait(dev_priv, buf, DRM_HZ);
+	if (ret)
+		return ret;
 
 	if (!xa->ret) {
 		memcpy(hw_cookie, xa->cookie, sizeof(xa->cookie));
@@ -189,13 +355,9 @@ int psb_xhw_reset_dpm(struct drm_psb_private *dev_priv, struct psb_xhw_buf *buf)
 	if (ret)
 		return ret;
 
-	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
-				 atomic_read(&buf->done), 3 * DRM_HZ);
-
-	if (!atomic_read(&buf->done)) {
-		psb_xhw_clean_buf(dev_priv, buf);
-		return -EBUSY;
-	}
+	ret = psb_xhw_wait(dev_priv, buf, 3 * DRM_HZ);
+	if (ret)
+		return ret;
 
 	return xa->ret;
 }
@@ -217,13 +379,9 @@ int psb_xhw_check_lockup(struct drm_psb_private *dev_priv,
 	if (ret)
 		return ret;
 
-	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
-				 atomic_read(&buf->done), DRM_HZ * 3);
-
-	if (!atomic_read(&buf->done)) {
-		psb_xhw_clean_buf(dev_priv, buf);
-		return -EBUSY;
-	}
+	ret = psb_xhw_wait(dev_priv, buf, DRM_HZ * 3);
+	if (ret)
+		return ret;
 
 	if (!xa->ret)
 		*value = xa->arg.cl.value;
@@ -243,12 +401,15 @@ static int psb_xhw_terminate(struct drm_psb_private *dev_priv,
 
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
 	dev_priv->xhw_submit_ok = 0;
+	buf->complete = NULL;
 	atomic_set(&buf->done, 0);
 	if (!list_empty(&buf->head)) {
 		DRM_ERROR("Recursive list adding.\n");
 		goto out;
 	}
 	list_add_tail(&buf->head, &dev_priv->xhw_in);
+	if (dev_priv->xhw_ring)
+		psb_xhw_ring_fill(dev_priv);
       out:
 	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 	wake_up_interruptible(&dev_priv->xhw_queue);
@@ -282,13 +443,9 @@ int psb_xhw_ta_mem_info(struct drm_psb_private *dev_priv,
 	if (ret)
 		return ret;
 
-	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
-				 atomic_read(&buf->done), DRM_HZ);
-
-	if (!atomic_read(&buf->done)) {
-		psb_xhw_clean_buf(dev_priv, buf);
-		return -EBUSY;
-	}
+	ret = psb_xhw_wait(dev_priv, buf, DRM_HZ);
+	if (ret)
+		return ret;
 
 	if (!xa->ret)
 		memcpy(hw_cookie, xa->cookie, sizeof(xa->cookie));
@@ -297,14 +454,12 @@ int psb_xhw_ta_mem_info(struct drm_psb_private *dev_priv,
 	return xa->ret;
 }
 
-int psb_xhw_ta_mem_load(struct drm_psb_private *dev_priv,
-			struct psb_xhw_buf *buf,
-			uint32_t flags,
-			uint32_t param_offset,
-			uint32_t pt_offset, uint32_t * hw_cookie)
+static void psb_xhw_ta_mem_load_arg(struct psb_xhw_buf *buf,
+				    uint32_t flags,
+				    uint32_t param_offset,
+				    uint32_t pt_offset, uint32_t * hw_cookie)
 {
 	struct drm_psb_xhw_arg *xa = &buf->arg;
-	int ret;
 
 	buf->copy_back = 1;
 	xa->op = PSB_XHW_TA_MEM_LOAD;
@@ -314,18 +469,46 @@ int psb_xhw_ta_mem_load(struct drm_psb_private *dev_priv,
 	xa->arg.bl.param_offset = param_offset;
 	xa->arg.bl.pt_offset = pt_offset;
 	memcpy(xa->cookie, hw_cookie, sizeof(xa->cookie));
+}
+
+/*
+ * Queue a TA memory load without waiting for the reply. The X server
+ * handles requests in order, so the load takes effect before any
+ * later scene fire. The reply is delivered to complete.
+ */
+
+int psb_xhw_ta_mem_load_async(struct drm_psb_private *dev_priv,
+			      struct psb_xhw_buf *buf,
+			      uint32_t flags,
+			      uint32_t param_offset,
+			      uint32_t pt_offset, uint32_t * hw_cookie,
+			      void (*complete) (struct drm_psb_private *,
+						struct psb_xhw_buf *))
+{
+	psb_xhw_ta_mem_load_arg(buf, flags, param_offset, pt_offset,
+				hw_cookie);
+	return psb_xhw_queue(dev_priv, buf, complete);
+}
+
+int psb_xhw_ta_mem_load(struct drm_psb_private *dev_priv,
+			struct psb_xhw_buf *buf,
+			uint32_t flags,
+			uint32_t param_offset,
+			uint32_t pt_offset, uint32_t * hw_cookie)
+{
+	struct drm_psb_xhw_arg *xa = &buf->arg;
+	int ret;
+
+	psb_xhw_ta_mem_load_arg(buf, flags, param_offset, pt_offset,
+				hw_cookie);
 
 	ret = psb_xhw_add(dev_priv, buf);
 	if (ret)
 		return ret;
 
-	(void)wait_event_timeout(dev_priv->xhw_caller_queue,
-				 atomic_read(&buf->done), 3 * DRM_HZ);
-
-	if (!atomic_read(&buf->done)) {
-		psb_xhw_clean_buf(dev_priv, buf);
-		return -EBUSY;
-	}
+	ret = psb_xhw_wait(dev_priv, buf, 3 * DRM_HZ);
+	if (ret)
+		return ret;
 
 	if (!xa->ret)
 		memcpy(hw_cookie, xa->cookie, sizeof(xa->cookie));
@@ -413,6 +596,39 @@ int psb_xhw_init(struct drm_device *dev)
 	return 0;
 }
 
+/*
+ * Lay out a request ring in the X server communications buffer.
+ */
+
+static int psb_xhw_ring_init(struct drm_psb_private *dev_priv,
+			     unsigned long size)
+{
+	struct drm_psb_xhw_ring *ring =
+	    (struct drm_psb_xhw_ring *)dev_priv->xhw;
+	unsigned long slots;
+
+	if (size < sizeof(*ring) + sizeof(ring->slot[0])) {
+		DRM_ERROR("X server request ring is too small.\n");
+		return -EINVAL;
+	}
+
+	slots = (size - sizeof(*ring)) / sizeof(ring->slot[0]);
+	if (slots > PSB_XHW_RING_MAX_SLOTS)
+		slots = PSB_XHW_RING_MAX_SLOTS;
+	slots = 1UL << (fls(slots) - 1);
+
+	ring->head = 0;
+	ring->done = 0;
+	ring->num_slots = slots;
+	dev_priv->xhw_ring_mask = slots - 1;
+	dev_priv->xhw_ring_head = 0;
+	dev_priv->xhw_ring_reaped = 0;
+	memset(dev_priv->xhw_ring_bufs, 0, sizeof(dev_priv->xhw_ring_bufs));
+	dev_priv->xhw_ring = ring;
+
+	return 0;
+}
+
 static int psb_xhw_init_init(struct drm_device *dev,
 			     struct drm_file *file_priv,
 			     struct drm_psb_xhw_init_arg *arg)
@@ -448,6 +664,13 @@ static int psb_xhw_init_init(struct drm_device *dev,
 			ret = -EINVAL;
 			goto out_err1;
 		}
+		if (arg->operation == PSB_XHW_INIT_RING) {
+			ret = psb_xhw_ring_init(dev_priv,
+						dev_priv->xhw_bo->num_pages <<
+						PAGE_SHIFT);
+			if (ret)
+				goto out_err1;
+		}
 		dev_priv->xhw_file = file_priv;
 
 		spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
@@ -474,6 +697,7 @@ static void psb_xhw_queue_empty(struct drm_psb_private *dev_priv)
 {
 	struct psb_xhw_buf *cur_buf, *next;
 	unsigned long irq_flags;
+	int i;
 
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
 	dev_priv->xhw_submit_ok = 0;
@@ -483,7 +707,19 @@ static void psb_xhw_queue_empty(struct drm_psb_private *dev_priv)
 		if (cur_buf->copy_back) {
 			cur_buf->arg.ret = -EINVAL;
 		}
-		atomic_set(&cur_buf->done, 1);
+		psb_xhw_buf_done(dev_priv, cur_buf);
+	}
+
+	if (dev_priv->xhw_ring) {
+		for (i = 0; i <= dev_priv->xhw_ring_mask; ++i) {
+			cur_buf = dev_priv->xhw_ring_bufs[i];
+			if (!cur_buf)
+				continue;
+			dev_priv->xhw_ring_bufs[i] = NULL;
+			cur_buf->arg.ret = -EINVAL;
+			psb_xhw_buf_done(dev_priv, cur_buf);
+		}
+		dev_priv->xhw_ring = NULL;
 	}
 	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
 	wake_up(&dev_priv->xhw_caller_queue);
@@ -492,6 +728,7 @@ static void psb_xhw_queue_empty(struct drm_psb_private *dev_priv)
 void psb_xhw_init_takedown(struct drm_psb_private *dev_priv,
 			   struct drm_file *file_priv, int closing)
 {
+	struct drm_device *dev = dev_priv->scheduler.dev;
 
 	if (dev_priv->xhw_file == file_priv &&
 	    atomic_add_unless(&dev_priv->xhw_client, -1, 0)) {
@@ -510,6 +747,14 @@ void psb_xhw_init_takedown(struct drm_psb_private *dev_priv,
 		drm_bo_kunmap(&dev_priv->xhw_kmap);
 		drm_bo_usage_deref_unlocked(&dev_priv->xhw_bo);
 		dev_priv->xhw_file = NULL;
+
+		/*
+		 * Cached scene cookies belong to this X server.
+		 */
+
+		mutex_lock(&dev->struct_mutex);
+		psb_scene_cache_flush_devlocked(dev);
+		mutex_unlock(&dev->struct_mutex);
 	}
 }
 
@@ -522,6 +767,7 @@ int psb_xhw_init_ioctl(struct drm_device *dev, void *data,
 
 	switch (arg->operation) {
 	case PSB_XHW_INIT:
+	case PSB_XHW_INIT_RING:
 		return psb_xhw_init_init(dev, file_priv, arg);
 	case PSB_XHW_TAKEDOWN:
 		psb_xhw_init_takedown(dev_priv, file_priv, 0);
@@ -540,11 +786,18 @@ static int psb_xhw_in_empty(struct drm_psb_private *dev_priv)
 	return empty;
 }
 
+/*
+ * Hand the reply to the last request over to the scheduler through
+ * the comm page. With a request ring, returns 1 if more replies are
+ * waiting.
+ */
+
 int psb_xhw_handler(struct drm_psb_private *dev_priv)
 {
 	unsigned long irq_flags;
 	struct drm_psb_xhw_arg *xa;
 	struct psb_xhw_buf *buf;
+	int ret;
 
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
 
@@ -553,12 +806,18 @@ int psb_xhw_handler(struct drm_psb_private *dev_priv)
 		return -EINVAL;
 	}
 
+	if (dev_priv->xhw_ring) {
+		ret = psb_xhw_ring_handler(dev_priv);
+		spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+		return ret;
+	}
+
 	buf = dev_priv->xhw_cur_buf;
 	if (buf && buf->copy_back) {
 		xa = &buf->arg;
 		memcpy(xa, dev_priv->xhw, sizeof(*xa));
 		dev_priv->comm[PSB_COMM_USER_IRQ] = xa->irq_op;
-		atomic_set(&buf->done, 1);
+		psb_xhw_buf_reply(dev_priv, buf);
 		wake_up(&dev_priv->xhw_caller_queue);
 	} else
 		dev_priv->comm[PSB_COMM_USER_IRQ] = 0;
@@ -568,6 +827,23 @@ int psb_xhw_handler(struct drm_psb_private *dev_priv)
 	return 0;
 }
 
+/*
+ * Whether the X server has ring requests to handle, or should return
+ * because the ring is gone.
+ */
+
+static int psb_xhw_ring_pending(struct drm_psb_private *dev_priv)
+{
+	int pending;
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
+	pending = (!dev_priv->xhw_ring ||
+		   dev_priv->xhw_ring_head != dev_priv->xhw_ring->done);
+	spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
+	return pending;
+}
+
 int psb_xhw_ioctl(struct drm_device *dev, void *data,
 		  struct drm_file *file_priv)
 {
@@ -590,6 +866,14 @@ int psb_xhw_ioctl(struct drm_device *dev, void *data,
 		return -EINVAL;
 	}
 
+	if (dev_priv->xhw_ring) {
+		ret = wait_event_interruptible_timeout(dev_priv->xhw_queue,
+						       psb_xhw_ring_pending
+						       (dev_priv), DRM_HZ);
+		mutex_unlock(&dev_priv->xhw_mutex);
+		return (ret == -ERESTARTSYS || ret == 0) ? -EAGAIN : 0;
+	}
+
 	spin_lock_irqsave(&dev_priv->xhw_lock, irq_flags);
 	while (list_empty(&dev_priv->xhw_in)) {
 		spin_unlock_irqrestore(&dev_priv->xhw_lock, irq_flags);
@@ -613,7 +897,7 @@ int psb_xhw_ioctl(struct drm_device *dev, void *data,
 	if (unlikely(buf->copy_back))
 		dev_priv->xhw_cur_buf = buf;
 	else {
-		atomic_set(&buf->done, 1);
+		psb_xhw_buf_done(dev_priv, buf);
 		dev_priv->xhw_cur_buf = NULL;
 	}
 
@@ -0,0 +1,3 @@
+/*
+ * Empty; everything is declared by psbsim_kernel.h.
+ */
@@ -0,0 +1,1017 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Host-side replay of TA / rasterizer submission streams through the
+ * scheduler, scene and fence code, against the scripted X server in
+ * psbsim_xhw.c. Time is simulated, so results are reproducible.
+ *
+ * A stream file has one submission per line:
+ *
+ *   <client> <think us> scene|raster <ta us> <raster us> [flags]
+ *
+ * where flags is a comma separated list of "first" (not the last TA
+ * pass of the scene), "prio" (priority submission) and "wait" (wait
+ * for the task to complete before the next submission). Lines starting
+ * with '#' are ignored. Without a stream file, a synthetic one is
+ * generated from the command line options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "psbsim.h"
+
+/*
+ * One more command buffer than a client may have queued, so that it is
+ * throttled by admission control rather than by buffer reuse.
+ */
+
+#define PSBSIM_CMD_BOS       (PSB_SCHED_CLIENT_MAX + 1)
+#define PSBSIM_SAMPLE_NS     100000ULL
+#define PSBSIM_SLICE_NS      10000000ULL
+#define PSBSIM_STALL_NS      60000000000ULL
+
+#define PSBSIM_SUBMIT_RASTER (1 << 0)
+#define PSBSIM_SUBMIT_FIRST  (1 << 1)
+#define PSBSIM_SUBMIT_PRIO   (1 << 2)
+#define PSBSIM_SUBMIT_WAIT   (1 << 3)
+
+struct psbsim_submit {
+	uint64_t think_ns;
+	uint32_t ta_us;
+	uint32_t raster_us;
+	uint32_t flags;
+};
+
+struct psbsim_client {
+	int id;
+	struct drm_file *file;
+	struct psb_scene_pool *pool;
+	struct drm_buffer_object *cmd_bo[PSBSIM_CMD_BOS];
+	uint32_t cmd_handle[PSBSIM_CMD_BOS];
+	unsigned next_bo;
+	struct psb_validate_ctx ctx;
+	struct psbsim_submit *submits;
+	unsigned num_submits;
+	unsigned max_submits;
+	unsigned errors;
+};
+
+/*
+ * Per-task timestamps, indexed by TA fence sequence. Submission times
+ * are filled in by the clients, the rest from the scheduler trace.
+ */
+
+struct psbsim_record {
+	int submitted;
+	int client;
+	uint32_t flags;
+	uint64_t submit_ns;
+	uint64_t admit_ns;
+	uint64_t t[PSB_TRACE_NUM_EVENTS];
+};
+
+struct psbsim_depth {
+	const char *name;
+	uint64_t sum;
+	uint32_t max;
+};
+
+enum {
+	PSBSIM_DEPTH_TA,
+	PSBSIM_DEPTH_RASTER,
+	PSBSIM_DEPTH_HP_RASTER,
+	PSBSIM_DEPTH_QUEUED,
+	PSBSIM_NUM_DEPTHS
+};
+
+static struct drm_device *psbsim_dev;
+static struct psbsim_client *psbsim_clients;
+static int psbsim_num_clients;
+static struct psbsim_record *psbsim_records;
+static uint32_t psbsim_num_records;
+static struct file psbsim_trace_file;
+static struct psbsim_event psbsim_sample_event;
+static uint64_t psbsim_samples;
+static uint64_t psbsim_last_event_ns;
+static uint64_t psbsim_start_ns;
+static uint64_t psbsim_end_ns;
+static uint32_t psbsim_w = 800;
+static uint32_t psbsim_h = 480;
+static uint32_t psbsim_num_scenes = 2;
+
+static struct psbsim_depth psbsim_depths[PSBSIM_NUM_DEPTHS] = {
+	[PSBSIM_DEPTH_TA] = {"ta_queue"},
+	[PSBSIM_DEPTH_RASTER] = {"raster_queue"},
+	[PSBSIM_DEPTH_HP_RASTER] = {"hp_raster_queue"},
+	[PSBSIM_DEPTH_QUEUED] = {"queued"},
+};
+
+static struct psbsim_record *psbsim_record(uint32_t sequence)
+{
+	uint32_t num;
+
+	if (sequence >= psbsim_num_records) {
+		num = (psbsim_num_records) ? psbsim_num_records : 1024;
+		while (num <= sequence)
+			num <<= 1;
+		psbsim_records = realloc(psbsim_records,
+					 num * sizeof(*psbsim_records));
+		BUG_ON(!psbsim_records);
+		memset(&psbsim_records[psbsim_num_records], 0,
+		       (num - psbsim_num_records) * sizeof(*psbsim_records));
+		psbsim_num_records = num;
+	}
+
+	return &psbsim_records[sequence];
+}
+
+/*
+ * Stream input.
+ */
+
+static struct psbsim_client *psbsim_client(int id)
+{
+	int num = psbsim_num_clients;
+
+	if (id >= num) {
+		psbsim_clients = realloc(psbsim_clients,
+					 (id + 1) * sizeof(*psbsim_clients));
+		BUG_ON(!psbsim_clients);
+		memset(&psbsim_clients[num], 0,
+		       (id + 1 - num) * sizeof(*psbsim_clients));
+		psbsim_num_clients = id + 1;
+		for (; num <= id; ++num)
+			psbsim_clients[num].id = num;
+	}
+
+	return &psbsim_clients[id];
+}
+
+static void psbsim_add_submit(int id, const struct psbsim_submit *submit)
+{
+	struct psbsim_client *client = psbsim_client(id);
+
+	if (client->num_submits == client->max_submits) {
+		client->max_submits = (client->max_submits) ?
+		    client->max_submits << 1 : 64;
+		client->submits = realloc(client->submits,
+					  client->max_submits *
+					  sizeof(*client->submits));
+		BUG_ON(!client->submits);
+	}
+	client->submits[client->num_submits++] = *submit;
+}
+
+static int psbsim_parse_stream(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	char line[256];
+	char kind[16];
+	char flags[64];
+	struct psbsim_submit submit;
+	unsigned long long think_us;
+	int lineno = 0;
+	int id;
+	int n;
+	char *tok;
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		++lineno;
+		if (line[strspn(line, " \t")] == '#' ||
+		    line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		memset(&submit, 0, sizeof(submit));
+		flags[0] = '\0';
+		n = sscanf(line, "%d %llu %15s %u %u %63s", &id, &think_us,
+			   kind, &submit.ta_us, &submit.raster_us, flags);
+		if (n < 5 || id < 0 ||
+		    (strcmp(kind, "scene") && strcmp(kind, "raster"))) {
+			fprintf(stderr, "%s:%d: parse error.\n", name, lineno);
+			fclose(f);
+			return -1;
+		}
+
+		submit.think_ns = think_us * 1000ULL;
+		if (!strcmp(kind, "raster"))
+			submit.flags |= PSBSIM_SUBMIT_RASTER;
+
+		for (tok = strtok(flags, ","); tok; tok = strtok(NULL, ",")) {
+			if (!strcmp(tok, "first"))
+				submit.flags |= PSBSIM_SUBMIT_FIRST;
+			else if (!strcmp(tok, "prio"))
+				submit.flags |= PSBSIM_SUBMIT_PRIO;
+			else if (!strcmp(tok, "wait"))
+				submit.flags |= PSBSIM_SUBMIT_WAIT;
+			else if (strcmp(tok, "-")) {
+				fprintf(stderr, "%s:%d: unknown flag \"%s\".\n",
+					name, lineno, tok);
+				fclose(f);
+				return -1;
+			}
+		}
+
+		psbsim_add_submit(id, &submit);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static uint32_t psbsim_jitter(unsigned *seed, uint32_t value, int percent)
+{
+	int range = (int)value * percent / 100;
+
+	if (range == 0)
+		return value;
+	return value - range + rand_r(seed) % (2 * range + 1);
+}
+
+static void psbsim_synthetic_stream(int clients, int frames,
+				    uint32_t think_us, uint32_t ta_us,
+				    uint32_t raster_us, int prio_clients,
+				    int jitter, unsigned seed)
+{
+	struct psbsim_submit submit;
+	int i, j;
+
+	for (i = 0; i < clients; ++i) {
+		for (j = 0; j < frames; ++j) {
+			memset(&submit, 0, sizeof(submit));
+			submit.think_ns = (uint64_t)
+			    psbsim_jitter(&seed, think_us, jitter) * 1000;
+			submit.ta_us = psbsim_jitter(&seed, ta_us, jitter);
+			submit.raster_us = psbsim_jitter(&seed, raster_us,
+							 jitter);
+			if (!submit.ta_us)
+				submit.ta_us = 1;
+			if (!submit.raster_us)
+				submit.raster_us = 1;
+			if (i < prio_clients)
+				submit.flags |= PSBSIM_SUBMIT_PRIO;
+			psbsim_add_submit(i, &submit);
+		}
+	}
+}
+
+/*
+ * Interactive clients draw a small frame once per period and wait for
+ * it, like a compositor, so their latency shows how far the clients
+ * flooding the scheduler get ahead of them.
+ */
+
+static void psbsim_interactive_stream(int first, int clients, int frames,
+				      uint32_t period_us, uint32_t ta_us,
+				      uint32_t raster_us, int prio,
+				      int jitter, unsigned seed)
+{
+	struct psbsim_submit submit;
+	int i, j;
+
+	for (i = first; i < first + clients; ++i) {
+		for (j = 0; j < frames; ++j) {
+			memset(&submit, 0, sizeof(submit));
+			submit.think_ns = (uint64_t)
+			    psbsim_jitter(&seed, period_us, jitter) * 1000;
+			submit.ta_us = psbsim_jitter(&seed, ta_us, jitter);
+			submit.raster_us = psbsim_jitter(&seed, raster_us,
+							 jitter);
+			if (!submit.ta_us)
+				submit.ta_us = 1;
+			if (!submit.raster_us)
+				submit.raster_us = 1;
+			submit.flags = PSBSIM_SUBMIT_WAIT;
+			if (prio)
+				submit.flags |= PSBSIM_SUBMIT_PRIO;
+			psbsim_add_submit(i, &submit);
+		}
+	}
+}
+
+/*
+ * Clients. A submission follows the DRM_PSB_CMDBUF path of
+ * psb_cmdbuf_ioctl() and psb_cmdbuf_dispatch(), with the command
+ * buffer as the only validated buffer and no relocations.
+ */
+
+static int psbsim_submit(struct psbsim_client *client,
+			 const struct psbsim_submit *submit)
+{
+	struct drm_device *dev = psbsim_dev;
+	struct drm_psb_private *dev_priv = dev->dev_private;
+	struct psb_sched_client *sched_client =
+	    psb_fpriv(client->file)->sched_client;
+	struct psb_validate_ctx *ctx = &client->ctx;
+	unsigned idx = client->next_bo++ % PSBSIM_CMD_BOS;
+	struct drm_buffer_object *cmd_bo = client->cmd_bo[idx];
+	struct psb_scene *scene = NULL;
+	struct psb_feedback_info feedback;
+	struct drm_psb_cmdbuf_arg arg;
+	struct drm_fence_arg fence_arg;
+	struct drm_bo_kmap_obj kmobj;
+	struct psbsim_record *rec;
+	uint64_t submit_ns;
+	uint64_t admit_ns;
+	uint32_t sequence;
+	uint32_t *cmds;
+	int is_iomem;
+	int reserved;
+	int ret;
+
+	/*
+	 * Like user space, don't overwrite a command buffer that is
+	 * still in use. This is what throttles a client that doesn't
+	 * wait for its own rendering.
+	 */
+
+	ret = drm_bo_wait(cmd_bo, 0, 1, 0);
+	if (ret)
+		return ret;
+
+	ret = drm_bo_kmap(cmd_bo, 0, 1, &kmobj);
+	if (ret)
+		return ret;
+	cmds = drm_bmo_virtual(&kmobj, &is_iomem);
+	cmds[0] = PSBSIM_CR_TA_RUNTIME;
+	cmds[1] = submit->ta_us;
+	cmds[2] = PSBSIM_CR_RASTER_RUNTIME;
+	cmds[3] = submit->raster_us;
+	drm_bo_kunmap(&kmobj);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.engine = (submit->flags & PSBSIM_SUBMIT_RASTER) ?
+	    PSB_ENGINE_RASTERIZER : PSB_ENGINE_TA;
+	arg.cmdbuf_handle = client->cmd_handle[idx];
+	arg.cmdbuf_offset = 2 * sizeof(uint32_t);
+	arg.cmdbuf_size = 2;
+	arg.ta_handle = client->cmd_handle[idx];
+	arg.ta_offset = 0;
+	arg.ta_size = 2;
+	arg.fence_flags = DRM_FENCE_FLAG_NO_USER;
+	if (!(submit->flags & PSBSIM_SUBMIT_FIRST))
+		arg.ta_flags |= PSB_TA_FLAG_LASTPASS;
+	if (submit->flags & PSBSIM_SUBMIT_PRIO)
+		arg.ta_flags |= PSB_CMDBUF_FLAG_PRIORITY;
+
+	submit_ns = psbsim_now_ns;
+	reserved = psb_scheduler_admit(dev_priv, sched_client,
+				       arg.ta_flags & PSB_CMDBUF_FLAG_PRIORITY,
+				       1);
+	if (reserved < 0)
+		return reserved;
+	admit_ns = psbsim_now_ns;
+
+	INIT_LIST_HEAD(&ctx->head);
+	INIT_LIST_HEAD(&ctx->unfenced);
+	ctx->sched_reserved = reserved;
+	ctx->sched_priority = (arg.ta_flags & PSB_CMDBUF_FLAG_PRIORITY) != 0;
+	ctx->sched_ordered = 0;
+
+	ret = drm_bo_do_validate_list(cmd_bo, 0, 0, 0, PSB_ENGINE_TA, 0, 0,
+				      &ctx->unfenced, NULL);
+	if (ret)
+		goto out_unreserve;
+
+	mutex_lock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
+	if (arg.engine == PSB_ENGINE_RASTERIZER) {
+		ret = psb_cmdbuf_raster(client->file, &arg, cmd_bo, ctx,
+					&fence_arg);
+	} else {
+		mutex_lock(&dev_priv->reset_mutex);
+		ret = psb_validate_scene_pool(client->pool, 0, 0, 0,
+					      psbsim_w, psbsim_h,
+					      arg.ta_flags &
+					      PSB_TA_FLAG_LASTPASS, ctx,
+					      &scene);
+		mutex_unlock(&dev_priv->reset_mutex);
+
+		if (!ret) {
+			memset(&feedback, 0, sizeof(feedback));
+			ret = psb_cmdbuf_ta(client->file, &arg, cmd_bo, cmd_bo,
+					    NULL, scene, &feedback, ctx,
+					    &fence_arg);
+		}
+	}
+	sequence = dev_priv->sequence[PSB_ENGINE_TA];
+	mutex_unlock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
+
+	if (!ret) {
+		rec = psbsim_record(sequence);
+		rec->submitted = 1;
+		rec->client = client->id;
+		rec->flags = submit->flags;
+		rec->submit_ns = submit_ns;
+		rec->admit_ns = admit_ns;
+	}
+
+      out_unreserve:
+	psb_scheduler_unreserve(dev_priv, sched_client, ctx->sched_reserved);
+	drm_putback_buffer_list(dev, &ctx->unfenced);
+
+	if (scene) {
+		mutex_lock(&dev->struct_mutex);
+		psb_scene_unref_devlocked(&scene);
+		mutex_unlock(&dev->struct_mutex);
+	}
+
+	psbsim_yield();
+
+	if (!ret && (submit->flags & PSBSIM_SUBMIT_WAIT))
+		ret = drm_bo_wait(cmd_bo, 0, 1, 0);
+
+	return ret;
+}
+
+static void psbsim_client_thread(void *arg)
+{
+	struct psbsim_client *client = (struct psbsim_client *)arg;
+	unsigned i;
+
+	for (i = 0; i < client->num_submits; ++i) {
+		if (client->submits[i].think_ns)
+			psbsim_sleep_ns(client->submits[i].think_ns);
+		if (psbsim_submit(client, &client->submits[i]))
+			client->errors++;
+	}
+
+	for (i = 0; i < PSBSIM_CMD_BOS; ++i)
+		(void)drm_bo_wait(client->cmd_bo[i], 0, 1, 0);
+}
+
+static void psbsim_client_start(struct psbsim_client *client)
+{
+	char name[16];
+	int i;
+
+	client->file = psbsim_file_open(psbsim_dev);
+	client->pool = psb_scene_pool_alloc(client->file, 0, psbsim_num_scenes,
+					    psbsim_w, psbsim_h);
+	BUG_ON(!client->pool);
+	for (i = 0; i < PSBSIM_CMD_BOS; ++i) {
+		client->cmd_bo[i] = psbsim_bo_create(client->file, 1,
+						     &client->cmd_handle[i]);
+		BUG_ON(!client->cmd_bo[i]);
+	}
+
+	snprintf(name, sizeof(name), "client%d", client->id);
+	(void)psbsim_thread_create(name, psbsim_client_thread, client, 0);
+}
+
+/*
+ * Sampling of the scheduler queues, and draining of the trace ring
+ * before it wraps.
+ */
+
+static uint32_t psbsim_list_len(struct list_head *head)
+{
+	struct list_head *list;
+	uint32_t len = 0;
+
+	list_for_each(list, head)
+	    ++len;
+	return len;
+}
+
+static void psbsim_depth(int idx, uint32_t depth)
+{
+	psbsim_depths[idx].sum += depth;
+	if (depth > psbsim_depths[idx].max)
+		psbsim_depths[idx].max = depth;
+}
+
+static void psbsim_drain_trace(void)
+{
+	struct drm_psb_trace_event ev[64];
+	struct psbsim_record *rec;
+	ssize_t len;
+	loff_t pos = 0;
+	int i;
+
+	do {
+		len = psb_trace_fops.read(&psbsim_trace_file, (char *)ev,
+					  sizeof(ev), &pos);
+		for (i = 0; i < len / (ssize_t) sizeof(ev[0]); ++i) {
+			psbsim_last_event_ns = ev[i].time_ns;
+			if (ev[i].type >= PSB_TRACE_NUM_EVENTS ||
+			    ev[i].sequence == 0)
+				continue;
+			rec = psbsim_record(ev[i].sequence);
+
+			/*
+			 * Keep the first fire and the last completion of a
+			 * stage, so that OOM restarts count towards it.
+			 */
+
+			switch (ev[i].type) {
+			case PSB_TRACE_QUEUE:
+			case PSB_TRACE_TA_FIRE:
+			case PSB_TRACE_RASTER_FIRE:
+				if (rec->t[ev[i].type])
+					break;
+			default:
+				rec->t[ev[i].type] = ev[i].time_ns;
+			}
+		}
+	} while (len == sizeof(ev));
+}
+
+static void psbsim_sample(struct psbsim_event *event)
+{
+	struct drm_psb_private *dev_priv = psbsim_dev->dev_private;
+	struct psb_scheduler *scheduler = &dev_priv->scheduler;
+
+	psbsim_depth(PSBSIM_DEPTH_TA, psbsim_list_len(&scheduler->ta_queue));
+	psbsim_depth(PSBSIM_DEPTH_RASTER,
+		     psbsim_list_len(&scheduler->raster_queue));
+	psbsim_depth(PSBSIM_DEPTH_HP_RASTER,
+		     psbsim_list_len(&scheduler->hp_raster_queue));
+	psbsim_depth(PSBSIM_DEPTH_QUEUED, atomic_read(&scheduler->queued));
+	psbsim_samples++;
+
+	psbsim_drain_trace();
+	psbsim_event_add(event, psbsim_now_ns + PSBSIM_SAMPLE_NS);
+}
+
+/*
+ * Report.
+ */
+
+/*
+ * Percentile of a sorted array, in microseconds.
+ */
+
+#define PSBSIM_PCT(_v, _n, _pct) \
+	((_v)[((uint64_t) (_n) - 1) * (_pct) / 100] / 1000.)
+
+static int psbsim_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static void psbsim_print_latency(const char *name, uint64_t *v, uint32_t n)
+{
+	if (n == 0) {
+		printf("%-18s %8s\n", name, "-");
+		return;
+	}
+
+	qsort(v, n, sizeof(*v), psbsim_cmp_u64);
+	printf("%-18s %8u %10.1f %10.1f %10.1f\n", name, n,
+	       PSBSIM_PCT(v, n, 50), PSBSIM_PCT(v, n, 99), PSBSIM_PCT(v, n, 100));
+}
+
+/*
+ * Per-client completion latency from submission, including the wait
+ * for admission, and the admission wait alone.
+ */
+
+static void psbsim_report_clients(uint64_t elapsed)
+{
+	uint64_t *total = calloc(psbsim_num_records + 1, sizeof(*total));
+	uint64_t *admit = calloc(psbsim_num_records + 1, sizeof(*admit));
+	struct psbsim_client *client;
+	struct psbsim_record *rec;
+	uint32_t seq;
+	uint32_t n;
+	int i;
+
+	BUG_ON(!total || !admit);
+
+	printf("\nclient (us)    %6s %8s %10s %10s %10s %10s %10s\n",
+	       "tasks", "tasks/s", "p50", "p99", "max", "admit p99",
+	       "admit max");
+	for (i = 0; i < psbsim_num_clients; ++i) {
+		client = &psbsim_clients[i];
+		n = 0;
+		for (seq = 1; seq < psbsim_num_records; ++seq) {
+			rec = &psbsim_records[seq];
+			if (!rec->submitted || rec->client != i ||
+			    !rec->t[PSB_TRACE_RASTER_DONE])
+				continue;
+			total[n] = rec->t[PSB_TRACE_RASTER_DONE] -
+			    rec->submit_ns;
+			admit[n] = rec->admit_ns - rec->submit_ns;
+			++n;
+		}
+
+		printf("%-3d %-10s %6u %8.1f", i,
+		       (!client->num_submits) ? "" :
+		       (client->submits[0].flags & PSBSIM_SUBMIT_PRIO) ?
+		       "prio" :
+		       (client->submits[0].flags & PSBSIM_SUBMIT_WAIT) ?
+		       "wait" : "", n, (elapsed) ? n * 1e9 / elapsed : 0.);
+		if (n == 0) {
+			printf("\n");
+			continue;
+		}
+
+		qsort(total, n, sizeof(*total), psbsim_cmp_u64);
+		qsort(admit, n, sizeof(*admit), psbsim_cmp_u64);
+		printf(" %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       PSBSIM_PCT(total, n, 50), PSBSIM_PCT(total, n, 99),
+		       PSBSIM_PCT(total, n, 100), PSBSIM_PCT(admit, n, 99),
+		       PSBSIM_PCT(admit, n, 100));
+	}
+
+	free(total);
+	free(admit);
+}
+
+enum {
+	PSBSIM_STAGE_ADMIT,
+	PSBSIM_STAGE_QUEUED,
+	PSBSIM_STAGE_TA,
+	PSBSIM_STAGE_RASTER_WAIT,
+	PSBSIM_STAGE_RASTER,
+	PSBSIM_STAGE_TOTAL,
+	PSBSIM_NUM_STAGES
+};
+
+static const char *psbsim_stage_names[PSBSIM_NUM_STAGES] = {
+	[PSBSIM_STAGE_ADMIT] = "admission",
+	[PSBSIM_STAGE_QUEUED] = "queue -> fire",
+	[PSBSIM_STAGE_TA] = "ta",
+	[PSBSIM_STAGE_RASTER_WAIT] = "ta -> raster",
+	[PSBSIM_STAGE_RASTER] = "raster",
+	[PSBSIM_STAGE_TOTAL] = "submit -> done",
+};
+
+static void psbsim_stage(uint64_t **v, uint32_t *n, int stage,
+			 uint64_t start, uint64_t end)
+{
+	if (!end || end < start)
+		return;
+	v[stage][n[stage]++] = end - start;
+}
+
+static void psbsim_report(int verbose)
+{
+	uint64_t *v[PSBSIM_NUM_STAGES];
+	uint32_t n[PSBSIM_NUM_STAGES];
+	struct psbsim_record *rec;
+	uint64_t elapsed = psbsim_end_ns - psbsim_start_ns;
+	uint32_t completed = 0;
+	uint32_t seq;
+	unsigned errors = 0;
+	char *buf;
+	char *start;
+	int eof;
+	int len;
+	int i;
+
+	for (i = 0; i < PSBSIM_NUM_STAGES; ++i) {
+		v[i] = calloc(psbsim_num_records + 1, sizeof(*v[i]));
+		BUG_ON(!v[i]);
+		n[i] = 0;
+	}
+
+	for (seq = 1; seq < psbsim_num_records; ++seq) {
+		rec = &psbsim_records[seq];
+		if (!rec->submitted)
+			continue;
+		if (rec->t[PSB_TRACE_RASTER_DONE])
+			++completed;
+
+		psbsim_stage(v, n, PSBSIM_STAGE_ADMIT, rec->submit_ns,
+			     rec->admit_ns);
+		psbsim_stage(v, n, PSBSIM_STAGE_TOTAL, rec->submit_ns,
+			     rec->t[PSB_TRACE_RASTER_DONE]);
+		psbsim_stage(v, n, PSBSIM_STAGE_RASTER,
+			     rec->t[PSB_TRACE_RASTER_FIRE],
+			     rec->t[PSB_TRACE_RASTER_DONE]);
+		if (rec->flags & PSBSIM_SUBMIT_RASTER) {
+			psbsim_stage(v, n, PSBSIM_STAGE_QUEUED,
+				     rec->t[PSB_TRACE_QUEUE],
+				     rec->t[PSB_TRACE_RASTER_FIRE]);
+			continue;
+		}
+		psbsim_stage(v, n, PSBSIM_STAGE_QUEUED,
+			     rec->t[PSB_TRACE_QUEUE],
+			     rec->t[PSB_TRACE_TA_FIRE]);
+		psbsim_stage(v, n, PSBSIM_STAGE_TA,
+			     rec->t[PSB_TRACE_TA_FIRE],
+			     rec->t[PSB_TRACE_TA_DONE]);
+		psbsim_stage(v, n, PSBSIM_STAGE_RASTER_WAIT,
+			     rec->t[PSB_TRACE_TA_DONE],
+			     rec->t[PSB_TRACE_RASTER_FIRE]);
+	}
+
+	for (i = 0; i < psbsim_num_clients; ++i)
+		errors += psbsim_clients[i].errors;
+
+	printf("simulated time:    %.3f ms\n", elapsed / 1e6);
+	printf("tasks completed:   %u\n", completed);
+	printf("tasks/s:           %.1f\n",
+	       (elapsed) ? completed * 1e9 / elapsed : 0.);
+	printf("submit errors:     %u\n", errors);
+	printf("xhw requests:      %lu\n", psbsim_xhw_requests);
+	printf("interrupts:        %lu\n", psbsim_xhw_irqs);
+
+	printf("\nqueue depth        %8s %10s\n", "mean", "max");
+	for (i = 0; i < PSBSIM_NUM_DEPTHS; ++i)
+		printf("%-18s %8.2f %10u\n", psbsim_depths[i].name,
+		       (psbsim_samples) ?
+		       (double)psbsim_depths[i].sum / psbsim_samples : 0.,
+		       psbsim_depths[i].max);
+
+	printf("\nlatency (us)       %8s %10s %10s %10s\n", "tasks", "p50",
+	       "p99", "max");
+	for (i = 0; i < PSBSIM_NUM_STAGES; ++i)
+		psbsim_print_latency(psbsim_stage_names[i], v[i], n[i]);
+
+	for (i = 0; i < PSBSIM_NUM_STAGES; ++i)
+		free(v[i]);
+
+	psbsim_report_clients(elapsed);
+
+	if (!verbose)
+		return;
+
+	buf = calloc(1, PAGE_SIZE);
+	BUG_ON(!buf);
+	len = psb_trace_info(buf, &start, 0, PAGE_SIZE, &eof, psbsim_dev);
+	printf("\npsb_trace_stats:\n%.*s", len, start);
+	free(buf);
+}
+
+static void psbsim_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [stream file]\n"
+		"  -c clients     synthetic clients (1)\n"
+		"  -n frames      synthetic frames per client (100)\n"
+		"  -k think_us    synthetic think time between frames (0)\n"
+		"  -t ta_us       synthetic TA run time (2000)\n"
+		"  -r raster_us   synthetic rasterizer run time (4000)\n"
+		"  -p clients     synthetic clients submitting with priority (0)\n"
+		"  -i clients     synthetic interactive clients (0)\n"
+		"  -I frames      synthetic frames per interactive client (100)\n"
+		"  -f period_us   interactive frame period (16667)\n"
+		"  -a ta_us       interactive TA run time (300)\n"
+		"  -b raster_us   interactive rasterizer run time (800)\n"
+		"  -P             interactive clients submit with priority\n"
+		"  -j percent     synthetic run time jitter (0)\n"
+		"  -s seed        synthetic stream seed (1)\n"
+		"  -x reply_us    X server reply time (50)\n"
+		"  -d dealloc_us  parameter memory deallocation time (100)\n"
+		"  -g WxH         scene size (800x480)\n"
+		"  -m scenes      scene buffers per client (2)\n"
+		"  -S             don't overlap TA and rasterizer\n"
+		"  -D mask        drm_psb_debug mask (0)\n"
+		"  -F fences      run the fence handler benchmark instead, with\n"
+		"                 this many fences outstanding\n"
+		"  -R rounds      fence handler and register check benchmark\n"
+		"                 rounds (100000)\n"
+		"  -V rounds      run the validate benchmark instead, with this\n"
+		"                 many submissions per list\n"
+		"  -C file        run the register check benchmark instead, on\n"
+		"                 the register streams in this file\n"
+		"  -T submits     run the concurrent TA, 2D and video stress test\n"
+		"                 instead, with -c clients per engine making this\n"
+		"                 many submissions each\n"
+		"  -v             print the trace statistics\n"
+		"  -q             suppress kernel messages\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct psbsim_xhw_timing timing = {
+		.reply_ns = 50000,
+		.ta_ns = 2000000,
+		.raster_ns = 4000000,
+		.dealloc_ns = 100000,
+	};
+	uint32_t think_us = 0;
+	uint32_t ta_us = 2000;
+	uint32_t raster_us = 4000;
+	int clients = 1;
+	int frames = 100;
+	int prio_clients = 0;
+	int interactive = 0;
+	int interactive_frames = 100;
+	uint32_t period_us = 16667;
+	uint32_t interactive_ta_us = 300;
+	uint32_t interactive_raster_us = 800;
+	int interactive_prio = 0;
+	int jitter = 0;
+	unsigned seed = 1;
+	unsigned fences = 0;
+	unsigned rounds = 100000;
+	unsigned validate_rounds = 0;
+	const char *regs_file = NULL;
+	unsigned stress_submits = 0;
+	int verbose = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "c:n:k:t:r:p:i:I:f:a:b:Pj:s:x:d:g:m:D:F:R:V:C:T:Svqh")) != -1) {
+		switch (opt) {
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'k':
+			think_us = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			ta_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			raster_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			prio_clients = atoi(optarg);
+			break;
+		case 'i':
+			interactive = atoi(optarg);
+			break;
+		case 'I':
+			interactive_frames = atoi(optarg);
+			break;
+		case 'f':
+			period_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			interactive_ta_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			interactive_raster_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			interactive_prio = 1;
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			timing.reply_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'd':
+			timing.dealloc_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%ux%u", &psbsim_w, &psbsim_h) != 2) {
+				psbsim_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			psbsim_num_scenes = strtoul(optarg, NULL, 0);
+			if (psbsim_num_scenes < 1 ||
+			    psbsim_num_scenes > PSB_MAX_NUM_SCENES) {
+				psbsim_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'D':
+			drm_psb_debug = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			fences = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'V':
+			validate_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			regs_file = optarg;
+			break;
+		case 'T':
+			stress_submits = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			drm_psb_pipeline = 0;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'q':
+			psbsim_quiet = 1;
+			break;
+		default:
+			psbsim_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (fences) {
+		psbsim_kernel_init();
+		psbsim_dev = psbsim_device_init((4 * 1024 * 1024) >> PAGE_SHIFT);
+		return (psbsim_fence_bench(psbsim_dev, fences, rounds)) ? 1 : 0;
+	}
+
+	if (validate_rounds) {
+		psbsim_kernel_init();
+		psbsim_dev = psbsim_device_init((4 * 1024 * 1024) >> PAGE_SHIFT);
+		return (psbsim_validate_bench(psbsim_dev, validate_rounds)) ?
+		    1 : 0;
+	}
+
+	if (regs_file) {
+		psbsim_kernel_init();
+		psbsim_dev = psbsim_device_init((4 * 1024 * 1024) >> PAGE_SHIFT);
+		return (psbsim_regs_bench(psbsim_dev, regs_file, rounds)) ?
+		    1 : 0;
+	}
+
+	if (stress_submits) {
+		struct psbsim_stress_params params = {
+			.clients = (clients > 0) ? clients : 1,
+			.submissions = stress_submits,
+			.think_ns = (uint64_t)think_us * 1000,
+			.ta_us = ta_us,
+			.raster_us = raster_us,
+			.blit_ns = 100000,
+			.decode_ns = 5000000,
+			.w = psbsim_w,
+			.h = psbsim_h,
+			.num_scenes = psbsim_num_scenes,
+		};
+
+		psbsim_kernel_init();
+		psbsim_dev = psbsim_device_init((4 * 1024 * 1024) >> PAGE_SHIFT);
+		return (psbsim_stress(psbsim_dev, &params, &timing)) ? 1 : 0;
+	}
+
+	if (optind < argc) {
+		if (psbsim_parse_stream(argv[optind]))
+			return 1;
+	} else {
+		psbsim_synthetic_stream(clients, frames, think_us, ta_us,
+					raster_us, prio_clients, jitter, seed);
+		psbsim_interactive_stream(clients, interactive,
+					  interactive_frames, period_us,
+					  interactive_ta_us,
+					  interactive_raster_us,
+					  interactive_prio, jitter, seed + 1);
+	}
+
+	if (psbsim_num_clients == 0) {
+		fprintf(stderr, "No submissions.\n");
+		return 1;
+	}
+
+	psbsim_kernel_init();
+	psbsim_dev = psbsim_device_init((4 * 1024 * 1024) >> PAGE_SHIFT);
+	psbsim_xhw_start(psbsim_dev, &timing);
+
+	BUG_ON(psb_trace_fops.open(psbsim_proc_inode(psbsim_dev),
+				   &psbsim_trace_file));
+	BUG_ON(psb_trace_fops.write(&psbsim_trace_file, "1", 1, NULL) != 1);
+
+	for (i = 0; i < psbsim_num_clients; ++i)
+		psbsim_client_start(&psbsim_clients[i]);
+
+	psbsim_start_ns = psbsim_last_event_ns = psbsim_now_ns;
+	psbsim_event_init(&psbsim_sample_event, psbsim_sample);
+	psbsim_event_add(&psbsim_sample_event, psbsim_now_ns);
+
+	while (psbsim_threads_alive()) {
+		if (!psbsim_run(psbsim_now_ns + PSBSIM_SLICE_NS) ||
+		    psbsim_now_ns - psbsim_last_event_ns > PSBSIM_STALL_NS) {
+			fprintf(stderr, "Clients stalled.\n");
+			return 1;
+		}
+	}
+
+	psbsim_event_del(&psbsim_sample_event);
+	psbsim_drain_trace();
+	psbsim_end_ns = psbsim_last_event_ns;
+	psbsim_xhw_stop();
+
+	psbsim_report(verbose);
+	return 0;
+}
@@ -0,0 +1,128 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+
+#ifndef _PSBSIM_H_
+#define _PSBSIM_H_
+
+#include "psb_drv.h"
+#include "psb_schedule.h"
+#include "psb_scene.h"
+
+/*
+ * psbsim_kernel.c
+ */
+
+extern int psbsim_quiet;
+
+extern uint64_t psbsim_host_ns(void);
+extern struct task_struct *psbsim_thread_create(const char *name,
+						void (*fn) (void *),
+						void *arg, int daemon);
+extern int psbsim_threads_alive(void);
+extern void psbsim_sleep_ns(uint64_t ns);
+extern void psbsim_yield(void);
+extern void psbsim_event_init(struct psbsim_event *ev,
+			      void (*func) (struct psbsim_event *));
+extern void psbsim_event_add(struct psbsim_event *ev, uint64_t time);
+extern int psbsim_event_del(struct psbsim_event *ev);
+extern void psbsim_timer_add_ns(struct timer_list *timer, uint64_t time);
+extern void psbsim_irq_enter(void);
+extern void psbsim_irq_exit(void);
+extern struct inode *psbsim_proc_inode(void *data);
+extern int psbsim_run(uint64_t until_ns);
+extern void psbsim_kernel_init(void);
+
+/*
+ * psbsim_drm.c
+ */
+
+extern struct drm_device *psbsim_device_init(unsigned long scene_cache_pages);
+extern struct drm_file *psbsim_file_open(struct drm_device *dev);
+extern struct drm_buffer_object *psbsim_bo_create(struct drm_file *priv,
+						  unsigned long num_pages,
+						  uint32_t *handle);
+
+/*
+ * psbsim_fence.c
+ */
+
+extern int psbsim_fence_bench(struct drm_device *dev, unsigned num_fences,
+			      unsigned rounds);
+
+/*
+ * psbsim_regs.c
+ */
+
+extern int psbsim_regs_bench(struct drm_device *dev, const char *name,
+			     unsigned rounds);
+
+/*
+ * psbsim_stress.c
+ */
+
+struct psbsim_stress_params {
+	unsigned clients;
+	unsigned submissions;
+	uint64_t think_ns;
+	uint32_t ta_us;
+	uint32_t raster_us;
+	uint64_t blit_ns;
+	uint64_t decode_ns;
+	uint32_t w;
+	uint32_t h;
+	uint32_t num_scenes;
+};
+
+struct psbsim_xhw_timing;
+
+extern int psbsim_stress(struct drm_device *dev,
+			 const struct psbsim_stress_params *params,
+			 const struct psbsim_xhw_timing *timing);
+
+/*
+ * psbsim_validate.c
+ */
+
+extern int psbsim_validate_bench(struct drm_device *dev, unsigned rounds);
+
+/*
+ * psbsim_xhw.c
+ *
+ * Engine run times in microseconds are passed to the hardware model as
+ * register writes in the TA and rasterizer command streams, to
+ * registers that user-space may write and that nothing else uses.
+ */
+
+#define PSBSIM_CR_TA_RUNTIME     0x0B20
+#define PSBSIM_CR_RASTER_RUNTIME 0x0B24
+
+struct psbsim_xhw_timing {
+	uint64_t reply_ns;
+	uint64_t ta_ns;
+	uint64_t raster_ns;
+	uint64_t dealloc_ns;
+};
+
+extern void psbsim_xhw_start(struct drm_device *dev,
+			     const struct psbsim_xhw_timing *timing);
+extern void psbsim_xhw_stop(void);
+extern unsigned long psbsim_xhw_requests;
+extern unsigned long psbsim_xhw_irqs;
+
+#endif
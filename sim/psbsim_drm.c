@@ -0,0 +1,555 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Buffer objects, user objects and the parts of the driver outside of
+ * the scheduler, scene, fence, xhw and command submission code,
+ * reduced to what those need.
+ *
+ * Buffer objects have no placement. Their pages are only allocated
+ * when they are mapped, so that parameter memory sizes cost nothing.
+ * Validation puts a buffer on the caller's unfenced list with the
+ * fence type psb_fence_types() would give it, and fencing works as in
+ * drm_bo.c.
+ */
+
+#include "psbsim.h"
+
+int drm_psb_debug = 0;
+int drm_psb_pipeline = 1;
+
+#define PSBSIM_USER_OBJECT_ORDER 10
+
+static struct list_head psbsim_user_objects[1 << PSBSIM_USER_OBJECT_ORDER];
+static uint32_t psbsim_next_handle = 1;
+
+/*
+ * User objects. Files don't share objects in the simulator, so there
+ * are no reference objects. Handles are hashed, as by the DRM core,
+ * so that looking up a buffer costs the same however many exist.
+ */
+
+static struct list_head *psbsim_user_object_bucket(uint32_t key)
+{
+	struct list_head *bucket =
+	    &psbsim_user_objects[key & ((1 << PSBSIM_USER_OBJECT_ORDER) - 1)];
+
+	if (!bucket->next)
+		INIT_LIST_HEAD(bucket);
+	return bucket;
+}
+
+int drm_add_user_object(struct drm_file *priv, struct drm_user_object *item,
+			int shareable)
+{
+	item->hash.key = psbsim_next_handle++;
+	item->owner = priv;
+	item->shareable = shareable;
+	atomic_set(&item->refcount, 1);
+	list_add_tail(&item->list, psbsim_user_object_bucket(item->hash.key));
+	return 0;
+}
+
+struct drm_user_object *drm_lookup_user_object(struct drm_file *priv,
+					       uint32_t key)
+{
+	struct drm_user_object *item;
+
+	list_for_each_entry(item, psbsim_user_object_bucket(key), list) {
+		if (item->hash.key == key)
+			return item;
+	}
+	return NULL;
+}
+
+struct drm_ref_object *drm_lookup_ref_object(struct drm_file *priv,
+					     struct drm_user_object
+					     *referenced_object,
+					     enum drm_ref_type ref_action)
+{
+	return NULL;
+}
+
+void drm_remove_ref_object(struct drm_file *priv, struct drm_ref_object *item)
+{
+	BUG();
+}
+
+int drm_user_object_ref(struct drm_file *priv, uint32_t user_token,
+			enum drm_object_type type,
+			struct drm_user_object **object)
+{
+	return -EINVAL;
+}
+
+int drm_user_object_unref(struct drm_file *priv, uint32_t user_token,
+			  enum drm_object_type type)
+{
+	return -EINVAL;
+}
+
+static void psbsim_remove_user_object(struct drm_user_object *item)
+{
+	if (!list_empty(&item->list))
+		list_del_init(&item->list);
+}
+
+/*
+ * Buffer objects.
+ */
+
+struct psbsim_bo {
+	struct drm_buffer_object bo;
+	void *pages;
+};
+
+int drm_buffer_object_create(struct drm_device *dev, unsigned long size,
+			     enum drm_bo_type type, uint64_t mask,
+			     uint32_t hint, uint32_t page_alignment,
+			     unsigned long buffer_start,
+			     struct drm_buffer_object **buf_obj)
+{
+	struct psbsim_bo *sbo = calloc(1, sizeof(*sbo));
+	struct drm_buffer_object *bo;
+
+	if (!sbo)
+		return -ENOMEM;
+
+	bo = &sbo->bo;
+	bo->dev = dev;
+	bo->type = type;
+	atomic_set(&bo->usage, 1);
+	mutex_init(&bo->mutex);
+	init_waitqueue_head(&bo->event_queue);
+	INIT_LIST_HEAD(&bo->lru);
+	INIT_LIST_HEAD(&bo->ddestroy);
+	INIT_LIST_HEAD(&bo->base.list);
+	bo->num_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	bo->mem.num_pages = bo->num_pages;
+	bo->mem.size = bo->num_pages << PAGE_SHIFT;
+	bo->mem.mask = mask;
+	bo->mem.flags = mask;
+
+	/*
+	 * Distinct offsets, so that parameter memory reloads are noticed.
+	 */
+
+	bo->offset = (unsigned long)bo;
+	atomic_inc(&dev->bm.count);
+
+	*buf_obj = bo;
+	return 0;
+}
+
+struct drm_buffer_object *psbsim_bo_create(struct drm_file *priv,
+					   unsigned long num_pages,
+					   uint32_t *handle)
+{
+	struct drm_buffer_object *bo;
+
+	if (drm_buffer_object_create(priv->head->dev,
+				     num_pages << PAGE_SHIFT,
+				     drm_bo_type_dc, 0, 0, 0, 0, &bo))
+		return NULL;
+
+	(void)drm_add_user_object(priv, &bo->base, 0);
+	bo->base.type = drm_buffer_type;
+	*handle = bo->base.hash.key;
+	return bo;
+}
+
+static void psbsim_bo_destroy(struct drm_buffer_object *bo)
+{
+	struct psbsim_bo *sbo = container_of(bo, struct psbsim_bo, bo);
+
+	BUG_ON(!list_empty(&bo->lru));
+	if (bo->fence)
+		drm_fence_usage_deref_unlocked(&bo->fence);
+	psbsim_remove_user_object(&bo->base);
+	atomic_dec(&bo->dev->bm.count);
+	free(sbo->pages);
+	free(sbo);
+}
+
+void drm_bo_usage_deref_locked(struct drm_buffer_object **bo)
+{
+	struct drm_buffer_object *tmp_bo = *bo;
+
+	*bo = NULL;
+	if (atomic_dec_and_test(&tmp_bo->usage))
+		psbsim_bo_destroy(tmp_bo);
+}
+
+void drm_bo_usage_deref_unlocked(struct drm_buffer_object **bo)
+{
+	drm_bo_usage_deref_locked(bo);
+}
+
+struct drm_buffer_object *drm_lookup_buffer_object(struct drm_file *file_priv,
+						   uint32_t handle,
+						   int check_owner)
+{
+	struct drm_user_object *uo = drm_lookup_user_object(file_priv, handle);
+	struct drm_buffer_object *bo;
+
+	if (!uo || uo->type != drm_buffer_type)
+		return NULL;
+	if (check_owner && uo->owner != file_priv)
+		return NULL;
+
+	bo = drm_user_object_entry(uo, struct drm_buffer_object, base);
+	atomic_inc(&bo->usage);
+	return bo;
+}
+
+int drm_bo_wait(struct drm_buffer_object *bo, int lazy, int ignore_signals,
+		int no_wait)
+{
+	int ret;
+
+	if (!bo->fence)
+		return 0;
+
+	if (drm_fence_object_signaled(bo->fence, bo->fence_type)) {
+		drm_fence_usage_deref_unlocked(&bo->fence);
+		return 0;
+	}
+	if (no_wait)
+		return -EBUSY;
+
+	ret = drm_fence_object_wait(bo->fence, lazy, ignore_signals,
+				    bo->fence_type);
+	if (ret)
+		return ret;
+
+	if (bo->fence)
+		drm_fence_usage_deref_unlocked(&bo->fence);
+	return 0;
+}
+
+int drm_bo_kmap(struct drm_buffer_object *bo, unsigned long start_page,
+		unsigned long num_pages, struct drm_bo_kmap_obj *map)
+{
+	struct psbsim_bo *sbo = container_of(bo, struct psbsim_bo, bo);
+
+	if (start_page + num_pages > bo->num_pages)
+		return -EINVAL;
+
+	if (!sbo->pages) {
+		sbo->pages = calloc(bo->num_pages, PAGE_SIZE);
+		if (!sbo->pages)
+			return -ENOMEM;
+	}
+
+	map->bo_kmap_type = bo_map_vmap;
+	map->page = NULL;
+	map->virtual = (char *)sbo->pages + (start_page << PAGE_SHIFT);
+	return 0;
+}
+
+void drm_bo_kunmap(struct drm_bo_kmap_obj *map)
+{
+	map->virtual = NULL;
+}
+
+struct page *drm_ttm_get_page(struct drm_ttm *ttm, int index)
+{
+	BUG();
+}
+
+/*
+ * As psb_fence_types().
+ */
+
+static uint32_t psbsim_fence_type(struct drm_buffer_object *bo,
+				  uint32_t fence_class)
+{
+	uint32_t type;
+
+	if (fence_class != PSB_ENGINE_TA)
+		return DRM_FENCE_TYPE_EXE;
+
+	type = DRM_FENCE_TYPE_EXE |
+	    _PSB_FENCE_TYPE_TA_DONE | _PSB_FENCE_TYPE_RASTER_DONE;
+	if (bo->mem.mask & PSB_BO_FLAG_TA)
+		type &= ~_PSB_FENCE_TYPE_RASTER_DONE;
+	if (bo->mem.mask & PSB_BO_FLAG_SCENE)
+		type |= _PSB_FENCE_TYPE_SCENE_DONE;
+	if (bo->mem.mask & PSB_BO_FLAG_FEEDBACK)
+		type |= _PSB_FENCE_TYPE_FEEDBACK;
+	return type;
+}
+
+int drm_bo_do_validate_list(struct drm_buffer_object *bo,
+			    uint64_t flags, uint64_t mask,
+			    uint32_t hint, uint32_t fence_class,
+			    int no_wait, int backoff,
+			    struct list_head *unfenced,
+			    struct drm_bo_info_rep *rep)
+{
+	if (bo->priv_flags & _DRM_BO_FLAG_UNFENCED) {
+		if (bo->new_fence_class != fence_class)
+			return -EINVAL;
+		return 0;
+	}
+
+	bo->mem.mask = (bo->mem.mask & ~mask) | (flags & mask);
+	bo->new_fence_class = fence_class;
+	bo->new_fence_type = psbsim_fence_type(bo, fence_class);
+	bo->priv_flags |= _DRM_BO_FLAG_UNFENCED;
+	atomic_inc(&bo->usage);
+	list_add_tail(&bo->lru, unfenced);
+	return 0;
+}
+
+/*
+ * As in drm_bo.c, less the buffer locking.
+ */
+
+int drm_fence_buffer_objects(struct drm_device *dev,
+			     struct list_head *list,
+			     uint32_t fence_flags,
+			     struct drm_fence_object *fence,
+			     struct drm_fence_object **used_fence)
+{
+	struct drm_buffer_object *entry, *next;
+	uint32_t fence_type = 0;
+	uint32_t fence_class = ~0;
+	int ret;
+
+	list_for_each_entry(entry, list, lru) {
+		fence_type |= entry->new_fence_type;
+		if (fence_class == ~0)
+			fence_class = entry->new_fence_class;
+		else if (entry->new_fence_class != fence_class) {
+			*used_fence = NULL;
+			return -EINVAL;
+		}
+	}
+
+	if (fence_class == ~0) {
+		*used_fence = NULL;
+		return -EINVAL;
+	}
+
+	ret = drm_fence_object_create(dev, fence_class, fence_type,
+				      fence_flags | DRM_FENCE_FLAG_EMIT,
+				      &fence);
+	if (ret) {
+		*used_fence = NULL;
+		return ret;
+	}
+
+	list_for_each_entry_safe(entry, next, list, lru) {
+		list_del_init(&entry->lru);
+		if (entry->fence)
+			drm_fence_usage_deref_unlocked(&entry->fence);
+		entry->fence = drm_fence_reference_locked(fence);
+		entry->fence_class = entry->new_fence_class;
+		entry->fence_type = entry->new_fence_type;
+		entry->priv_flags &= ~_DRM_BO_FLAG_UNFENCED;
+		wake_up_all(&entry->event_queue);
+		drm_bo_usage_deref_unlocked(&entry);
+	}
+
+	*used_fence = fence;
+	return 0;
+}
+
+void drm_putback_buffer_list(struct drm_device *dev, struct list_head *list)
+{
+	struct drm_buffer_object *entry, *next;
+
+	list_for_each_entry_safe(entry, next, list, lru) {
+		list_del_init(&entry->lru);
+		entry->priv_flags &= ~_DRM_BO_FLAG_UNFENCED;
+		drm_bo_usage_deref_unlocked(&entry);
+	}
+}
+
+/*
+ * As in drm_bo.c, only reporting unfenced buffers as busy.
+ */
+
+void drm_bo_fill_rep_arg(struct drm_buffer_object *bo,
+			 struct drm_bo_info_rep *rep)
+{
+	if (!rep)
+		return;
+
+	rep->handle = bo->base.hash.key;
+	rep->flags = bo->mem.flags;
+	rep->size = bo->num_pages * PAGE_SIZE;
+	rep->offset = bo->offset;
+	rep->arg_handle = 0;
+	rep->mask = bo->mem.mask;
+	rep->buffer_start = bo->buffer_start;
+	rep->fence_flags = bo->fence_type;
+	rep->rep_flags = 0;
+	rep->page_alignment = bo->mem.page_alignment;
+
+	if (bo->priv_flags & _DRM_BO_FLAG_UNFENCED)
+		rep->rep_flags |= DRM_BO_REP_BUSY;
+}
+
+/*
+ * As in drm_bo_move.c.
+ */
+
+int drm_bo_same_page(unsigned long offset, unsigned long offset2)
+{
+	return (offset & PAGE_MASK) == (offset2 & PAGE_MASK);
+}
+
+unsigned long drm_bo_offset_end(unsigned long offset, unsigned long end)
+{
+	offset = (offset + PAGE_SIZE) & PAGE_MASK;
+	return (end < offset) ? end : offset;
+}
+
+/*
+ * The rest of the driver. There are no relocations against USE base
+ * registers and no engine lockups. The MSVDX is in psbsim_stress.c.
+ */
+
+int psb_grab_use_base(struct drm_psb_private *dev_priv,
+		      unsigned long base,
+		      unsigned long size,
+		      unsigned int data_master,
+		      uint32_t fence_class,
+		      uint32_t fence_type,
+		      int no_wait,
+		      int interruptible, int *r_reg, uint32_t *r_offset)
+{
+	return -EINVAL;
+}
+
+void drm_regs_fence(struct drm_reg_manager *regs,
+		    struct drm_fence_object *fence)
+{
+}
+
+void psb_schedule_watchdog(struct drm_psb_private *dev_priv)
+{
+}
+
+void psb_reset(struct drm_psb_private *dev_priv, int reset_2d)
+{
+}
+
+void psb_2D_irq_off(struct drm_psb_private *dev_priv)
+{
+}
+
+void psb_2D_irq_on(struct drm_psb_private *dev_priv)
+{
+}
+
+/*
+ * Device setup, following psb_driver_load() and psb_do_init().
+ */
+
+extern struct drm_fence_driver psb_fence_driver;
+
+static struct drm_driver psbsim_driver = {
+	.fence_driver = &psb_fence_driver,
+};
+
+static struct drm_head psbsim_head;
+
+struct drm_device *psbsim_device_init(unsigned long scene_cache_pages)
+{
+	struct drm_device *dev = calloc(1, sizeof(*dev));
+	struct drm_psb_private *dev_priv = calloc(1, sizeof(*dev_priv));
+	int i;
+
+	BUG_ON(!dev || !dev_priv);
+
+	mutex_init(&dev->struct_mutex);
+	dev->driver = &psbsim_driver;
+	INIT_LIST_HEAD(&dev->bm.unfenced);
+	drm_bo_init_lock(&dev->bm.bm_lock);
+	atomic_set(&dev->bm.count, 0);
+	psbsim_head.dev = dev;
+
+	mutex_init(&dev_priv->temp_mem);
+	for (i = 0; i < PSB_NUM_ENGINES; ++i)
+		mutex_init(&dev_priv->cmdbuf_mutex[i]);
+	spin_lock_init(&dev_priv->validate_ctx_lock);
+	INIT_LIST_HEAD(&dev_priv->validate_ctx_pool);
+	psb_scene_cache_init(&dev_priv->scene_cache, scene_cache_pages);
+	mutex_init(&dev_priv->reset_mutex);
+
+	INIT_LIST_HEAD(&dev_priv->ta_mem_load_buf.head);
+	atomic_set(&dev_priv->ta_mem_load_buf.done, 1);
+
+	atomic_set(&dev_priv->lock_2d, 0);
+	atomic_set(&dev_priv->ta_wait_2d, 0);
+	atomic_set(&dev_priv->ta_wait_2d_irq, 0);
+	atomic_set(&dev_priv->waiters_2d, 0);
+	DRM_INIT_WAITQUEUE(&dev_priv->queue_2d);
+	DRM_INIT_WAITQUEUE(&dev_priv->event_2d_queue);
+	BUG_ON(psb_2d_ring_init(dev_priv));
+	psb_init_disallowed();
+
+	dev->dev_private = (void *)dev_priv;
+	BUG_ON(psb_task_cache_init());
+	psb_scheduler_init(dev, &dev_priv->scheduler);
+
+	dev_priv->sgx_reg = calloc(1, PSB_SGX_SIZE);
+	dev_priv->comm = calloc(1, PAGE_SIZE);
+	BUG_ON(!dev_priv->sgx_reg || !dev_priv->comm);
+
+	/*
+	 * The 2D engine is always idle.
+	 */
+
+	PSB_WSGX32(_PSB_C2_SOCIF_EMPTY, PSB_CR_2D_SOCIF);
+
+	dev_priv->ta_mem_pages = (32 * 1024 * 1024) >> PAGE_SHIFT;
+	dev_priv->ta_mem_min_pages = dev_priv->ta_mem_pages;
+	dev_priv->ta_mem_max_pages = (128 * 1024 * 1024) >> PAGE_SHIFT;
+	dev_priv->sequence_lock = SPIN_LOCK_UNLOCKED;
+
+	BUG_ON(psb_xhw_init(dev));
+	drm_fence_manager_init(dev);
+
+	return dev;
+}
+
+struct drm_file *psbsim_file_open(struct drm_device *dev)
+{
+	struct drm_file *priv = calloc(1, sizeof(*priv));
+	struct psb_fpriv *fpriv = calloc(1, sizeof(*fpriv));
+
+	BUG_ON(!priv || !fpriv);
+
+	priv->head = &psbsim_head;
+	INIT_LIST_HEAD(&priv->pending_events);
+	INIT_LIST_HEAD(&priv->event_list);
+	init_waitqueue_head(&priv->event_wait);
+	priv->event_space = 4096;
+
+	mutex_init(&fpriv->bufset_mutex);
+	INIT_LIST_HEAD(&fpriv->bufsets);
+	fpriv->sched_client = psb_sched_client_alloc();
+	BUG_ON(!fpriv->sched_client);
+	priv->driver_priv = fpriv;
+
+	return priv;
+}
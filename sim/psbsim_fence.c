@@ -0,0 +1,119 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Cost of drm_fence_handler() with a deep queue of outstanding fences,
+ * in host CPU time.
+ *
+ * The TA fence class is kept at a fixed number of outstanding fences.
+ * Each round emits a new fence, reports TA done for the fence halfway
+ * down the queue, and rasterizer done for the oldest one, which then
+ * leaves the ring. Half of the queue is thus partially signaled at any
+ * time, as with a TA running ahead of the rasterizer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "psbsim.h"
+
+#define PSBSIM_FENCE_TYPE (DRM_FENCE_TYPE_EXE | _PSB_FENCE_TYPE_TA_DONE | \
+			   _PSB_FENCE_TYPE_RASTER_DONE)
+
+static uint64_t psbsim_fence_signal(struct drm_device *dev,
+				    uint32_t sequence, uint32_t type)
+{
+	struct drm_fence_manager *fm = &dev->fm;
+	unsigned long irq_flags;
+	uint64_t start;
+
+	write_lock_irqsave(&fm->lock, irq_flags);
+	start = psbsim_host_ns();
+	drm_fence_handler(dev, PSB_ENGINE_TA, sequence, type, 0);
+	start = psbsim_host_ns() - start;
+	write_unlock_irqrestore(&fm->lock, irq_flags);
+
+	return start;
+}
+
+static struct drm_fence_object *psbsim_fence_emit(struct drm_device *dev)
+{
+	struct drm_fence_object *fence;
+
+	(void)psb_fence_advance_sequence(dev, PSB_ENGINE_TA);
+	BUG_ON(drm_fence_object_create(dev, PSB_ENGINE_TA, PSBSIM_FENCE_TYPE,
+				       DRM_FENCE_FLAG_EMIT, &fence));
+	return fence;
+}
+
+int psbsim_fence_bench(struct drm_device *dev, unsigned num_fences,
+		       unsigned rounds)
+{
+	struct drm_fence_object **ring;
+	struct drm_fence_object *fence;
+	uint64_t handler_ns = 0;
+	uint64_t start;
+	uint32_t mask = 1;
+	unsigned head = 0;
+	unsigned i;
+	int ret = 0;
+
+	while (mask < num_fences + 1)
+		mask <<= 1;
+	ring = calloc(mask--, sizeof(*ring));
+	BUG_ON(!ring);
+
+	for (i = 0; i < num_fences; ++i)
+		ring[i & mask] = psbsim_fence_emit(dev);
+
+	start = psbsim_host_ns();
+	for (i = 0; i < rounds; ++i) {
+		ring[(head + num_fences) & mask] = psbsim_fence_emit(dev);
+
+		fence = ring[(head + num_fences / 2) & mask];
+		handler_ns += psbsim_fence_signal(dev, fence->sequence,
+						  DRM_FENCE_TYPE_EXE |
+						  _PSB_FENCE_TYPE_TA_DONE);
+
+		fence = ring[head & mask];
+		handler_ns += psbsim_fence_signal(dev, fence->sequence,
+						  _PSB_FENCE_TYPE_RASTER_DONE);
+
+		if (fence->signaled_types != PSBSIM_FENCE_TYPE ||
+		    !list_empty(&fence->ring)) {
+			fprintf(stderr, "Fence %u not retired.\n",
+				fence->sequence);
+			ret = -1;
+		}
+		drm_fence_usage_deref_unlocked(&ring[head++ & mask]);
+	}
+	start = psbsim_host_ns() - start;
+
+	printf("outstanding fences: %u\n", num_fences);
+	printf("rounds:             %u\n", rounds);
+	printf("handler calls:      %u\n", 2 * rounds);
+	printf("ns per handler:     %.1f\n",
+	       (rounds) ? (double)handler_ns / (2 * rounds) : 0.);
+	printf("ns per round:       %.1f\n",
+	       (rounds) ? (double)start / rounds : 0.);
+
+	for (i = 0; i < num_fences; ++i)
+		drm_fence_usage_deref_unlocked(&ring[head++ & mask]);
+	free(ring);
+
+	return ret;
+}
@@ -0,0 +1,766 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Discrete event kernel for psbsim.
+ *
+ * Time only advances when nothing can run at the current time. Process
+ * context runs in cooperative threads built on ucontext, which switch
+ * only when they sleep. The event loop runs, in order of preference,
+ * pending tasklets, runnable threads, and the earliest timed event.
+ * Timed events stand in for both timers and device interrupts.
+ *
+ * A thread that yields without sleeping, as a polling wait does, is
+ * parked until the next timed event has run, so that polling can't
+ * stop the clock.
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include <ucontext.h>
+#include "psbsim.h"
+
+#define PSBSIM_STACK_SIZE (512 * 1024)
+
+struct task_struct {
+	ucontext_t ctx;
+	void *stack;
+	const char *name;
+	void (*fn) (void *);
+	void *arg;
+	int state;
+	int queued;
+	int exited;
+	int daemon;
+	struct list_head run_head;
+	struct timer_list timeout;
+};
+
+struct inode {
+	struct proc_dir_entry de;
+};
+
+/*
+ * Like the monotonic clock, start well after zero, so that zero
+ * timestamps and jiffies are never current.
+ */
+
+uint64_t psbsim_now_ns = 1000000000ULL;
+unsigned int drm_debug;
+unsigned int psbsim_errors;
+int psbsim_quiet;
+
+static ucontext_t psbsim_main_ctx;
+static struct task_struct *psbsim_cur;
+static int psbsim_irq;
+static int psbsim_live_threads;
+static LIST_HEAD(psbsim_runqueue);
+static LIST_HEAD(psbsim_yielded);
+static LIST_HEAD(psbsim_tasklets);
+
+static struct psbsim_event **psbsim_heap;
+static int psbsim_heap_size;
+static int psbsim_heap_alloc;
+static uint64_t psbsim_event_seq;
+
+static LIST_HEAD(psbsim_work_list);
+static wait_queue_head_t psbsim_work_wait;
+static wait_queue_head_t psbsim_work_idle;
+static int psbsim_work_busy;
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (psbsim_quiet)
+		return 0;
+
+	fprintf(stderr, "[%12.6f] ", (double)psbsim_now_ns / 1e9);
+	va_start(ap, fmt);
+	ret = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void psbsim_bug(const char *file, int line)
+{
+	fprintf(stderr, "[%12.6f] BUG at %s:%d\n",
+		(double)psbsim_now_ns / 1e9, file, line);
+	abort();
+}
+
+/*
+ * Host time, for the benchmarks.
+ */
+
+uint64_t psbsim_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The driver only sorts with the default swap, which qsort() does
+ * itself.
+ */
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp) (const void *, const void *),
+	  void (*swap) (void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+/*
+ * Timed events, kept in a binary heap ordered by time, and by the order
+ * they were added for equal times.
+ */
+
+static int psbsim_event_before(struct psbsim_event *a, struct psbsim_event *b)
+{
+	if (a->time != b->time)
+		return a->time < b->time;
+	return a->seq < b->seq;
+}
+
+static void psbsim_heap_set(int i, struct psbsim_event *ev)
+{
+	psbsim_heap[i] = ev;
+	ev->index = i;
+}
+
+static void psbsim_heap_up(int i)
+{
+	struct psbsim_event *ev = psbsim_heap[i];
+
+	while (i > 0 && psbsim_event_before(ev, psbsim_heap[(i - 1) / 2])) {
+		psbsim_heap_set(i, psbsim_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	psbsim_heap_set(i, ev);
+}
+
+static void psbsim_heap_down(int i)
+{
+	struct psbsim_event *ev = psbsim_heap[i];
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= psbsim_heap_size)
+			break;
+		if (child + 1 < psbsim_heap_size &&
+		    psbsim_event_before(psbsim_heap[child + 1],
+					psbsim_heap[child]))
+			child++;
+		if (!psbsim_event_before(psbsim_heap[child], ev))
+			break;
+		psbsim_heap_set(i, psbsim_heap[child]);
+		i = child;
+	}
+	psbsim_heap_set(i, ev);
+}
+
+void psbsim_event_init(struct psbsim_event *ev,
+		       void (*func) (struct psbsim_event *))
+{
+	ev->index = -1;
+	ev->func = func;
+}
+
+int psbsim_event_del(struct psbsim_event *ev)
+{
+	int i = ev->index;
+	struct psbsim_event *last;
+
+	if (i < 0)
+		return 0;
+
+	ev->index = -1;
+	last = psbsim_heap[--psbsim_heap_size];
+	if (last != ev) {
+		psbsim_heap_set(i, last);
+		psbsim_heap_up(i);
+		psbsim_heap_down(last->index);
+	}
+	return 1;
+}
+
+void psbsim_event_add(struct psbsim_event *ev, uint64_t time)
+{
+	(void)psbsim_event_del(ev);
+
+	if (psbsim_heap_size == psbsim_heap_alloc) {
+		psbsim_heap_alloc = (psbsim_heap_alloc) ?
+		    psbsim_heap_alloc * 2 : 256;
+		psbsim_heap = realloc(psbsim_heap, psbsim_heap_alloc *
+				      sizeof(*psbsim_heap));
+		BUG_ON(!psbsim_heap);
+	}
+
+	ev->time = (time < psbsim_now_ns) ? psbsim_now_ns : time;
+	ev->seq = psbsim_event_seq++;
+	psbsim_heap_set(psbsim_heap_size++, ev);
+	psbsim_heap_up(ev->index);
+}
+
+/*
+ * Threads.
+ */
+
+struct task_struct *psbsim_current(void)
+{
+	return psbsim_cur;
+}
+
+int psbsim_in_irq(void)
+{
+	return psbsim_irq;
+}
+
+static void psbsim_wake(struct task_struct *t)
+{
+	if (t->state == TASK_RUNNING)
+		return;
+
+	t->state = TASK_RUNNING;
+	if (!t->queued) {
+		t->queued = 1;
+		list_add_tail(&t->run_head, &psbsim_runqueue);
+	}
+}
+
+static void psbsim_timeout_fn(unsigned long data)
+{
+	psbsim_wake((struct task_struct *)data);
+}
+
+static void psbsim_thread_start(void)
+{
+	struct task_struct *t = psbsim_cur;
+
+	t->fn(t->arg);
+	t->exited = 1;
+	if (!t->daemon)
+		psbsim_live_threads--;
+	swapcontext(&t->ctx, &psbsim_main_ctx);
+	BUG();
+}
+
+struct task_struct *psbsim_thread_create(const char *name,
+					 void (*fn) (void *), void *arg,
+					 int daemon)
+{
+	struct task_struct *t = calloc(1, sizeof(*t));
+
+	BUG_ON(!t);
+	t->stack = malloc(PSBSIM_STACK_SIZE);
+	BUG_ON(!t->stack);
+	t->name = name;
+	t->fn = fn;
+	t->arg = arg;
+	t->daemon = daemon;
+	t->state = TASK_RUNNING;
+	init_timer(&t->timeout);
+	t->timeout.function = psbsim_timeout_fn;
+	t->timeout.data = (unsigned long)t;
+
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = t->stack;
+	t->ctx.uc_stack.ss_size = PSBSIM_STACK_SIZE;
+	t->ctx.uc_link = NULL;
+	makecontext(&t->ctx, psbsim_thread_start, 0);
+
+	if (!daemon)
+		psbsim_live_threads++;
+	t->queued = 1;
+	list_add_tail(&t->run_head, &psbsim_runqueue);
+	return t;
+}
+
+int psbsim_threads_alive(void)
+{
+	return psbsim_live_threads;
+}
+
+void set_current_state(int state)
+{
+	BUG_ON(!psbsim_cur);
+	psbsim_cur->state = state;
+}
+
+void schedule(void)
+{
+	struct task_struct *t = psbsim_cur;
+
+	if (!t) {
+		printk("Sleeping outside of process context.\n");
+		BUG();
+	}
+
+	if (t->state == TASK_RUNNING && !t->queued) {
+		t->queued = 1;
+		list_add_tail(&t->run_head, &psbsim_yielded);
+	}
+	swapcontext(&t->ctx, &psbsim_main_ctx);
+}
+
+long schedule_timeout(long timeout)
+{
+	struct task_struct *t = psbsim_cur;
+	unsigned long expire;
+	long left;
+
+	if (timeout == MAX_SCHEDULE_TIMEOUT) {
+		schedule();
+		return timeout;
+	}
+
+	expire = jiffies + timeout;
+	mod_timer(&t->timeout, expire);
+	schedule();
+	del_timer(&t->timeout);
+
+	left = (long)(expire - jiffies);
+	return (left < 0) ? 0 : left;
+}
+
+void psbsim_sleep_ns(uint64_t ns)
+{
+	struct task_struct *t = psbsim_cur;
+
+	BUG_ON(!t);
+	psbsim_timer_add_ns(&t->timeout, psbsim_now_ns + ns);
+	t->state = TASK_UNINTERRUPTIBLE;
+	while (timer_pending(&t->timeout)) {
+		schedule();
+		t->state = TASK_UNINTERRUPTIBLE;
+	}
+	t->state = TASK_RUNNING;
+}
+
+/*
+ * Let the other runnable threads go first, like a return to user space
+ * after waking them up.
+ */
+
+void psbsim_yield(void)
+{
+	struct task_struct *t = psbsim_cur;
+
+	BUG_ON(!t);
+	if (list_empty(&psbsim_runqueue))
+		return;
+
+	t->queued = 1;
+	list_add_tail(&t->run_head, &psbsim_runqueue);
+	swapcontext(&t->ctx, &psbsim_main_ctx);
+}
+
+void msleep(unsigned int msecs)
+{
+	psbsim_sleep_ns((uint64_t) msecs * 1000000);
+}
+
+void udelay(unsigned long usecs)
+{
+	/*
+	 * Busy waits take no simulated time.
+	 */
+}
+
+/*
+ * Wait queues.
+ */
+
+void init_waitqueue_head(wait_queue_head_t *q)
+{
+	INIT_LIST_HEAD(&q->task_list);
+}
+
+void init_waitqueue_entry(wait_queue_t *wait, struct task_struct *t)
+{
+	wait->task = t;
+	INIT_LIST_HEAD(&wait->task_list);
+}
+
+void add_wait_queue(wait_queue_head_t *q, wait_queue_t *wait)
+{
+	list_add_tail(&wait->task_list, &q->task_list);
+}
+
+void remove_wait_queue(wait_queue_head_t *q, wait_queue_t *wait)
+{
+	list_del_init(&wait->task_list);
+}
+
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait, int state)
+{
+	if (list_empty(&wait->task_list))
+		list_add_tail(&wait->task_list, &q->task_list);
+	set_current_state(state);
+}
+
+void finish_wait(wait_queue_head_t *q, wait_queue_t *wait)
+{
+	set_current_state(TASK_RUNNING);
+	if (!list_empty(&wait->task_list))
+		list_del_init(&wait->task_list);
+}
+
+void __wake_up(wait_queue_head_t *q)
+{
+	wait_queue_t *wait;
+
+	list_for_each_entry(wait, &q->task_list, task_list)
+	    psbsim_wake(wait->task);
+}
+
+/*
+ * Mutexes. The event loop may take an uncontended mutex.
+ */
+
+void mutex_init(struct mutex *m)
+{
+	m->owner = NULL;
+	init_waitqueue_head(&m->wait);
+}
+
+void mutex_lock(struct mutex *m)
+{
+	DEFINE_WAIT(wait);
+
+	if (m->owner) {
+		BUG_ON(!psbsim_cur || m->owner == psbsim_cur);
+		for (;;) {
+			prepare_to_wait(&m->wait, &wait, TASK_UNINTERRUPTIBLE);
+			if (!m->owner)
+				break;
+			schedule();
+		}
+		finish_wait(&m->wait, &wait);
+	}
+	m->owner = (psbsim_cur) ? psbsim_cur : (struct task_struct *)&m->owner;
+}
+
+int mutex_trylock(struct mutex *m)
+{
+	if (m->owner)
+		return 0;
+	mutex_lock(m);
+	return 1;
+}
+
+void mutex_unlock(struct mutex *m)
+{
+	BUG_ON(!m->owner);
+	m->owner = NULL;
+	__wake_up(&m->wait);
+}
+
+/*
+ * Timers.
+ */
+
+static void psbsim_timer_fire(struct psbsim_event *ev)
+{
+	struct timer_list *timer = container_of(ev, struct timer_list, ev);
+
+	if (timer->function)
+		timer->function(timer->data);
+}
+
+void init_timer(struct timer_list *timer)
+{
+	psbsim_event_init(&timer->ev, psbsim_timer_fire);
+	timer->function = NULL;
+	timer->data = 0;
+}
+
+void psbsim_timer_add_ns(struct timer_list *timer, uint64_t time)
+{
+	timer->ev.func = psbsim_timer_fire;
+	psbsim_event_add(&timer->ev, time);
+}
+
+void add_timer(struct timer_list *timer)
+{
+	psbsim_timer_add_ns(timer, (uint64_t) timer->expires *
+			    (1000000000ULL / HZ));
+}
+
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	int pending = timer_pending(timer);
+
+	timer->expires = expires;
+	add_timer(timer);
+	return pending;
+}
+
+int del_timer(struct timer_list *timer)
+{
+	return psbsim_event_del(&timer->ev);
+}
+
+/*
+ * Tasklets run from the event loop, ahead of threads.
+ */
+
+void tasklet_init(struct tasklet_struct *t,
+		  void (*func) (unsigned long), unsigned long data)
+{
+	INIT_LIST_HEAD(&t->head);
+	t->scheduled = 0;
+	t->func = func;
+	t->data = data;
+}
+
+void tasklet_schedule(struct tasklet_struct *t)
+{
+	if (t->scheduled)
+		return;
+	t->scheduled = 1;
+	list_add_tail(&t->head, &psbsim_tasklets);
+}
+
+void tasklet_kill(struct tasklet_struct *t)
+{
+	if (t->scheduled) {
+		list_del_init(&t->head);
+		t->scheduled = 0;
+	}
+}
+
+/*
+ * The shared workqueue, served by a single worker thread.
+ */
+
+void psbsim_init_work(struct work_struct *work, work_func_t func)
+{
+	INIT_LIST_HEAD(&work->entry);
+	work->func = func;
+	work->pending = 0;
+}
+
+static void psbsim_delayed_work_timer(unsigned long data)
+{
+	struct work_struct *work = (struct work_struct *)data;
+
+	list_add_tail(&work->entry, &psbsim_work_list);
+	__wake_up(&psbsim_work_wait);
+}
+
+void psbsim_init_delayed_work(struct delayed_work *dwork, work_func_t func)
+{
+	psbsim_init_work(&dwork->work, func);
+	init_timer(&dwork->timer);
+	dwork->timer.function = psbsim_delayed_work_timer;
+	dwork->timer.data = (unsigned long)&dwork->work;
+}
+
+int schedule_work(struct work_struct *work)
+{
+	if (work->pending)
+		return 0;
+	work->pending = 1;
+	list_add_tail(&work->entry, &psbsim_work_list);
+	__wake_up(&psbsim_work_wait);
+	return 1;
+}
+
+int schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+	if (!delay)
+		return schedule_work(&dwork->work);
+	if (dwork->work.pending)
+		return 0;
+	dwork->work.pending = 1;
+	mod_timer(&dwork->timer, jiffies + delay);
+	return 1;
+}
+
+int cancel_delayed_work(struct delayed_work *dwork)
+{
+	if (!del_timer(&dwork->timer))
+		return 0;
+	dwork->work.pending = 0;
+	return 1;
+}
+
+static void psbsim_worker(void *arg)
+{
+	struct work_struct *work;
+
+	for (;;) {
+		wait_event(psbsim_work_wait, !list_empty(&psbsim_work_list));
+		work = list_entry(psbsim_work_list.next, struct work_struct,
+				  entry);
+		list_del_init(&work->entry);
+		work->pending = 0;
+		psbsim_work_busy = 1;
+		work->func(work);
+		psbsim_work_busy = 0;
+		__wake_up(&psbsim_work_idle);
+	}
+}
+
+void flush_scheduled_work(void)
+{
+	wait_event(psbsim_work_idle,
+		   list_empty(&psbsim_work_list) && !psbsim_work_busy);
+}
+
+/*
+ * Memory and files.
+ */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void *ctor, ...)
+{
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache)
+		cache->size = size;
+	return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+void *kmap_atomic(struct page *page, int type)
+{
+	BUG();
+}
+
+void kunmap_atomic(void *v, int type)
+{
+	BUG();
+}
+
+struct proc_dir_entry *PDE(const struct inode *inode)
+{
+	return (struct proc_dir_entry *)&inode->de;
+}
+
+struct inode *psbsim_proc_inode(void *data)
+{
+	struct inode *inode = calloc(1, sizeof(*inode));
+
+	BUG_ON(!inode);
+	inode->de.data = data;
+	return inode;
+}
+
+/*
+ * The event loop.
+ */
+
+static void psbsim_switch_to(struct task_struct *t)
+{
+	psbsim_cur = t;
+	swapcontext(&psbsim_main_ctx, &t->ctx);
+	psbsim_cur = NULL;
+
+	if (t->exited) {
+		free(t->stack);
+		free(t);
+	}
+}
+
+void psbsim_irq_enter(void)
+{
+	psbsim_irq++;
+}
+
+void psbsim_irq_exit(void)
+{
+	psbsim_irq--;
+}
+
+/*
+ * Run until nothing is left to do, or until the clock would pass the
+ * given time, in which case it is advanced to that time. Returns 0 if
+ * there is nothing left to do.
+ */
+
+int psbsim_run(uint64_t until_ns)
+{
+	struct tasklet_struct *tasklet;
+	struct task_struct *t;
+	struct psbsim_event *ev;
+
+	for (;;) {
+		if (!list_empty(&psbsim_tasklets)) {
+			tasklet = list_entry(psbsim_tasklets.next,
+					     struct tasklet_struct, head);
+			list_del_init(&tasklet->head);
+			tasklet->scheduled = 0;
+			tasklet->func(tasklet->data);
+			continue;
+		}
+
+		if (!list_empty(&psbsim_runqueue)) {
+			t = list_entry(psbsim_runqueue.next,
+				       struct task_struct, run_head);
+			list_del_init(&t->run_head);
+			t->queued = 0;
+			psbsim_switch_to(t);
+			continue;
+		}
+
+		if (psbsim_heap_size == 0 && list_empty(&psbsim_yielded))
+			return 0;
+
+		if (psbsim_heap_size == 0 ||
+		    psbsim_heap[0]->time > until_ns) {
+			if (list_empty(&psbsim_yielded)) {
+				if (until_ns > psbsim_now_ns)
+					psbsim_now_ns = until_ns;
+				return 1;
+			}
+
+			/*
+			 * Only pollers left. Let a jiffy pass.
+			 */
+
+			psbsim_now_ns += 1000000000ULL / HZ;
+		} else {
+			ev = psbsim_heap[0];
+			(void)psbsim_event_del(ev);
+			if (ev->time > psbsim_now_ns)
+				psbsim_now_ns = ev->time;
+			ev->func(ev);
+		}
+
+		list_splice_init(&psbsim_yielded, &psbsim_runqueue);
+	}
+}
+
+void psbsim_kernel_init(void)
+{
+	init_waitqueue_head(&psbsim_work_wait);
+	init_waitqueue_head(&psbsim_work_idle);
+	(void)psbsim_thread_create("events", psbsim_worker, NULL, 1);
+}
@@ -0,0 +1,807 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Kernel and DRM core environment for building the scheduler, scene,
+ * fence, xhw and command submission code on the host. This header is
+ * force-included ahead of every driver source, and stands in for
+ * drmP.h and intel_drv.h, whose include guards it sets.
+ *
+ * Execution is single threaded and driven by psbsim_kernel.c. Process
+ * context code runs in cooperative threads that only switch when they
+ * sleep, so spinlocks need no locking. Interrupts, tasklets and timers
+ * run from the event loop, between threads.
+ */
+
+#ifndef _PSBSIM_KERNEL_H_
+#define _PSBSIM_KERNEL_H_
+
+#define _DRM_P_H_
+#define __INTEL_DRV_H__
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define __KERNEL__
+#define __user
+#define __iomem
+#define __init
+#define __exit
+#define __FUNCTION__ __func__
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(2, 6, 24)
+
+#define FIX_TG_16
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint64_t dma_addr_t;
+typedef unsigned int gfp_t;
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define HZ 1000
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+#define THIS_MODULE NULL
+#define EXPORT_SYMBOL(_sym) extern int psbsim_export_dummy
+
+#define likely(_x) __builtin_expect(!!(_x), 1)
+#define unlikely(_x) __builtin_expect(!!(_x), 0)
+#define barrier() __asm__ __volatile__("" : : : "memory")
+#define mb() __sync_synchronize()
+#define rmb() barrier()
+#define wmb() barrier()
+#define smp_mb() mb()
+#define smp_rmb() rmb()
+#define smp_wmb() wmb()
+#define cpu_relax() barrier()
+#define might_sleep() do { } while (0)
+
+#define ARRAY_SIZE(_a) (sizeof(_a) / sizeof((_a)[0]))
+#define container_of(_ptr, _type, _member) \
+	((_type *)((char *)(_ptr) - offsetof(_type, _member)))
+
+#define min(_x, _y) ({ typeof(_x) __x = (_x); typeof(_y) __y = (_y); \
+			(void)(&__x == &__y); __x < __y ? __x : __y; })
+#define max(_x, _y) ({ typeof(_x) __x = (_x); typeof(_y) __y = (_y); \
+			(void)(&__x == &__y); __x > __y ? __x : __y; })
+#define min_t(_t, _x, _y) ({ _t __x = (_x); _t __y = (_y); \
+			     __x < __y ? __x : __y; })
+#define max_t(_t, _x, _y) ({ _t __x = (_x); _t __y = (_y); \
+			     __x > __y ? __x : __y; })
+
+static inline int fls(int x)
+{
+	return (x) ? 32 - __builtin_clz((unsigned int)x) : 0;
+}
+
+static inline unsigned long __ffs(unsigned long x)
+{
+	return __builtin_ctzl(x);
+}
+
+/*
+ * As on x86, the bit operations take any pointer, and work on 32-bit
+ * words, so they are safe on int members.
+ */
+
+static inline void set_bit(int nr, volatile void *addr)
+{
+	((volatile uint32_t *)addr)[nr >> 5] |= 1U << (nr & 31);
+}
+
+static inline void clear_bit(int nr, volatile void *addr)
+{
+	((volatile uint32_t *)addr)[nr >> 5] &= ~(1U << (nr & 31));
+}
+
+static inline int test_bit(int nr, const volatile void *addr)
+{
+	return (((const volatile uint32_t *)addr)[nr >> 5] >> (nr & 31)) & 1;
+}
+
+extern void sort(void *base, size_t num, size_t size,
+		 int (*cmp) (const void *, const void *),
+		 void (*swap) (void *, void *, int));
+
+#define do_div(_n, _base) ({				\
+	uint32_t __base = (_base);			\
+	uint32_t __rem = (uint32_t)((_n) % __base);	\
+	(_n) /= __base;					\
+	__rem;						\
+})
+
+/*
+ * Diagnostics.
+ */
+
+#define KERN_EMERG ""
+#define KERN_ALERT ""
+#define KERN_CRIT ""
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_NOTICE ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+
+extern int printk(const char *fmt, ...)
+    __attribute__ ((format(printf, 1, 2)));
+extern void psbsim_bug(const char *file, int line) __attribute__ ((noreturn));
+
+#define BUG() psbsim_bug(__FILE__, __LINE__)
+#define BUG_ON(_cond) do { if (unlikely(_cond)) BUG(); } while (0)
+#define WARN_ON(_cond) ({ int __c = !!(_cond); \
+	if (unlikely(__c)) printk("WARNING at %s:%d\n", __FILE__, __LINE__); \
+	__c; })
+
+extern unsigned int drm_debug;
+extern unsigned int psbsim_errors;
+
+#define DRM_NAME "drm"
+#define DRM_ERROR(fmt, arg...)						\
+	do {								\
+		psbsim_errors++;					\
+		printk("[" DRM_NAME ":%s] *ERROR* " fmt, __func__, ##arg); \
+	} while (0)
+#define DRM_INFO(fmt, arg...) printk("[" DRM_NAME "] " fmt, ##arg)
+#define DRM_DEBUG_CODE 2
+#define DRM_DEBUG(fmt, arg...)						\
+	do {								\
+		if (drm_debug)						\
+			printk("[" DRM_NAME ":%s] " fmt, __func__, ##arg); \
+	} while (0)
+
+#define DRM_PROC_LIMIT (PAGE_SIZE - 80)
+#define DRM_PROC_PRINT(fmt, arg...)					\
+   len += sprintf(&buf[len], fmt , ##arg);				\
+   if (len > DRM_PROC_LIMIT) { *eof = 1; return len - offset; }
+
+/*
+ * Lists.
+ */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(_name) { &(_name), &(_name) }
+#define LIST_HEAD(_name) struct list_head _name = LIST_HEAD_INIT(_name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new,
+			      struct list_head *prev, struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new,
+				 struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next)
+{
+	next->prev = prev;
+	prev->next = next;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	entry->next = (void *)0x00100100;
+	entry->prev = (void *)0x00200200;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+	__list_del(list->prev, list->next);
+	list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head *list,
+				  struct list_head *head)
+{
+	__list_del(list->prev, list->next);
+	list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_splice_init(struct list_head *list,
+				    struct list_head *head)
+{
+	if (!list_empty(list)) {
+		struct list_head *first = list->next;
+		struct list_head *last = list->prev;
+		struct list_head *at = head->next;
+
+		first->prev = head;
+		head->next = first;
+		last->next = at;
+		at->prev = last;
+		INIT_LIST_HEAD(list);
+	}
+}
+
+#define list_entry(_ptr, _type, _member) container_of(_ptr, _type, _member)
+#define list_first_entry(_ptr, _type, _member) \
+	list_entry((_ptr)->next, _type, _member)
+#define list_for_each(_pos, _head) \
+	for (_pos = (_head)->next; _pos != (_head); _pos = _pos->next)
+#define list_for_each_prev(_pos, _head) \
+	for (_pos = (_head)->prev; _pos != (_head); _pos = _pos->prev)
+#define list_for_each_safe(_pos, _n, _head) \
+	for (_pos = (_head)->next, _n = _pos->next; _pos != (_head); \
+	     _pos = _n, _n = _pos->next)
+#define list_for_each_entry(_pos, _head, _member)			\
+	for (_pos = list_entry((_head)->next, typeof(*_pos), _member);	\
+	     &_pos->_member != (_head);					\
+	     _pos = list_entry(_pos->_member.next, typeof(*_pos), _member))
+#define list_for_each_entry_reverse(_pos, _head, _member)		\
+	for (_pos = list_entry((_head)->prev, typeof(*_pos), _member);	\
+	     &_pos->_member != (_head);					\
+	     _pos = list_entry(_pos->_member.prev, typeof(*_pos), _member))
+#define list_for_each_entry_safe_reverse(_pos, _n, _head, _member)	\
+	for (_pos = list_entry((_head)->prev, typeof(*_pos), _member),	\
+	     _n = list_entry(_pos->_member.prev, typeof(*_pos), _member); \
+	     &_pos->_member != (_head);					\
+	     _pos = _n, _n = list_entry(_n->_member.prev, typeof(*_n), _member))
+#define list_for_each_entry_safe(_pos, _n, _head, _member)		\
+	for (_pos = list_entry((_head)->next, typeof(*_pos), _member),	\
+	     _n = list_entry(_pos->_member.next, typeof(*_pos), _member); \
+	     &_pos->_member != (_head);					\
+	     _pos = _n, _n = list_entry(_n->_member.next, typeof(*_n), _member))
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+/*
+ * Atomics. Threads only switch when they sleep, so plain arithmetic
+ * is atomic.
+ */
+
+typedef struct {
+	volatile int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(_i) { (_i) }
+#define atomic_read(_v) ((_v)->counter)
+#define atomic_set(_v, _i) (((_v)->counter) = (_i))
+
+static inline void atomic_add(int i, atomic_t *v) { v->counter += i; }
+static inline void atomic_sub(int i, atomic_t *v) { v->counter -= i; }
+static inline void atomic_inc(atomic_t *v) { v->counter++; }
+static inline void atomic_dec(atomic_t *v) { v->counter--; }
+static inline int atomic_add_return(int i, atomic_t *v)
+{
+	return v->counter += i;
+}
+static inline int atomic_sub_return(int i, atomic_t *v)
+{
+	return v->counter -= i;
+}
+#define atomic_inc_return(_v) atomic_add_return(1, _v)
+#define atomic_dec_return(_v) atomic_sub_return(1, _v)
+#define atomic_dec_and_test(_v) (atomic_sub_return(1, _v) == 0)
+#define atomic_inc_and_test(_v) (atomic_add_return(1, _v) == 0)
+static inline int atomic_xchg(atomic_t *v, int new)
+{
+	int old = v->counter;
+
+	v->counter = new;
+	return old;
+}
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	int cur = v->counter;
+
+	if (cur == old)
+		v->counter = new;
+	return cur;
+}
+static inline int atomic_add_unless(atomic_t *v, int a, int u)
+{
+	if (v->counter == u)
+		return 0;
+	v->counter += a;
+	return 1;
+}
+
+/*
+ * Spinlocks and interrupt masking.
+ */
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+typedef struct {
+	int locked;
+} rwlock_t;
+
+#define SPIN_LOCK_UNLOCKED ((spinlock_t) { 0 })
+#define RW_LOCK_UNLOCKED ((rwlock_t) { 0 })
+#define spin_lock_init(_l) ((_l)->locked = 0)
+#define rwlock_init(_l) ((_l)->locked = 0)
+#define spin_lock(_l) ((void)(_l))
+#define spin_unlock(_l) ((void)(_l))
+#define spin_lock_irq(_l) ((void)(_l))
+#define spin_unlock_irq(_l) ((void)(_l))
+#define spin_lock_bh(_l) ((void)(_l))
+#define spin_unlock_bh(_l) ((void)(_l))
+#define spin_lock_irqsave(_l, _f) ((void)(_l), (_f) = 0)
+#define spin_unlock_irqrestore(_l, _f) ((void)(_l), (void)(_f))
+#define read_lock(_l) ((void)(_l))
+#define read_unlock(_l) ((void)(_l))
+#define write_lock(_l) ((void)(_l))
+#define write_unlock(_l) ((void)(_l))
+#define read_lock_irqsave(_l, _f) ((void)(_l), (_f) = 0)
+#define read_unlock_irqrestore(_l, _f) ((void)(_l), (void)(_f))
+#define write_lock_irqsave(_l, _f) ((void)(_l), (_f) = 0)
+#define write_unlock_irqrestore(_l, _f) ((void)(_l), (void)(_f))
+#define local_irq_save(_f) ((_f) = 0)
+#define local_irq_restore(_f) ((void)(_f))
+#define in_irq() psbsim_in_irq()
+#define in_interrupt() psbsim_in_irq()
+
+/*
+ * Threads and sleeping. See psbsim_kernel.c.
+ */
+
+#define TASK_RUNNING 0
+#define TASK_INTERRUPTIBLE 1
+#define TASK_UNINTERRUPTIBLE 2
+
+struct task_struct;
+
+struct __wait_queue_head {
+	struct list_head task_list;
+};
+typedef struct __wait_queue_head wait_queue_head_t;
+
+struct __wait_queue {
+	struct task_struct *task;
+	struct list_head task_list;
+};
+typedef struct __wait_queue wait_queue_t;
+
+#define DEFINE_WAIT(_name)						\
+	wait_queue_t _name = { .task = current,				\
+			       .task_list = LIST_HEAD_INIT((_name).task_list) }
+#define DECLARE_WAITQUEUE(_name, _task)					\
+	wait_queue_t _name = { .task = _task,				\
+			       .task_list = LIST_HEAD_INIT((_name).task_list) }
+
+extern struct task_struct *psbsim_current(void);
+extern int psbsim_in_irq(void);
+#define current psbsim_current()
+
+extern void init_waitqueue_head(wait_queue_head_t *q);
+extern void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait,
+			    int state);
+extern void finish_wait(wait_queue_head_t *q, wait_queue_t *wait);
+extern void init_waitqueue_entry(wait_queue_t *wait, struct task_struct *t);
+extern void add_wait_queue(wait_queue_head_t *q, wait_queue_t *wait);
+extern void remove_wait_queue(wait_queue_head_t *q, wait_queue_t *wait);
+extern void __wake_up(wait_queue_head_t *q);
+extern void set_current_state(int state);
+#define __set_current_state(_state) set_current_state(_state)
+extern void schedule(void);
+extern long schedule_timeout(long timeout);
+extern void msleep(unsigned int msecs);
+extern void udelay(unsigned long usecs);
+#define DRM_UDELAY(_d) udelay(_d)
+#define cond_resched() do { } while (0)
+#define signal_pending(_t) 0
+#define wake_up(_q) __wake_up(_q)
+#define wake_up_all(_q) __wake_up(_q)
+#define wake_up_interruptible(_q) __wake_up(_q)
+#define wake_up_interruptible_all(_q) __wake_up(_q)
+
+#define __psbsim_wait_event(_wq, _cond, _state, _timeout)		\
+({									\
+	long __timeout = (_timeout);					\
+	DEFINE_WAIT(__wait);						\
+									\
+	for (;;) {							\
+		prepare_to_wait(&(_wq), &__wait, _state);		\
+		if (_cond)						\
+			break;						\
+		__timeout = schedule_timeout(__timeout);		\
+		if (!__timeout) {					\
+			if (_cond)					\
+				__timeout = 1;				\
+			break;						\
+		}							\
+	}								\
+	finish_wait(&(_wq), &__wait);					\
+	__timeout;							\
+})
+
+#define MAX_SCHEDULE_TIMEOUT 0x7fffffffL
+#define wait_event(_wq, _cond) \
+	((void)__psbsim_wait_event(_wq, _cond, TASK_UNINTERRUPTIBLE, \
+				   MAX_SCHEDULE_TIMEOUT))
+#define wait_event_interruptible(_wq, _cond) \
+	(__psbsim_wait_event(_wq, _cond, TASK_INTERRUPTIBLE, \
+			     MAX_SCHEDULE_TIMEOUT), 0)
+#define wait_event_timeout(_wq, _cond, _timeout) \
+	__psbsim_wait_event(_wq, _cond, TASK_UNINTERRUPTIBLE, _timeout)
+#define wait_event_interruptible_timeout(_wq, _cond, _timeout) \
+	__psbsim_wait_event(_wq, _cond, TASK_INTERRUPTIBLE, _timeout)
+
+#define DRM_WAIT_ON(_ret, _queue, _timeout, _condition)		\
+do {									\
+	(_ret) = wait_event_timeout(_queue, _condition, _timeout) ?	\
+	    0 : -EBUSY;							\
+} while (0)
+#define DRM_WAKEUP(_queue) wake_up_interruptible(_queue)
+#define DRM_INIT_WAITQUEUE(_queue) init_waitqueue_head(_queue)
+
+struct mutex {
+	struct task_struct *owner;
+	wait_queue_head_t wait;
+};
+
+extern void mutex_init(struct mutex *m);
+extern void mutex_lock(struct mutex *m);
+extern int mutex_trylock(struct mutex *m);
+extern void mutex_unlock(struct mutex *m);
+#define mutex_lock_interruptible(_m) (mutex_lock(_m), 0)
+#define mutex_is_locked(_m) ((_m)->owner != NULL)
+
+struct rw_semaphore {
+	int count;
+};
+
+#define ERESTARTSYS 512
+
+/*
+ * Time. The clock is simulated; jiffies and ktime follow it.
+ */
+
+extern uint64_t psbsim_now_ns;
+
+#define jiffies ((unsigned long)(psbsim_now_ns / (1000000000ULL / HZ)))
+#define time_after(_a, _b) ((long)(_b) - (long)(_a) < 0)
+#define time_before(_a, _b) time_after(_b, _a)
+#define time_after_eq(_a, _b) ((long)(_a) - (long)(_b) >= 0)
+#define time_before_eq(_a, _b) time_after_eq(_b, _a)
+#define msecs_to_jiffies(_m) ((unsigned long)(_m) * HZ / 1000)
+#define usecs_to_jiffies(_u) (((unsigned long)(_u) * HZ + 999999) / 1000000)
+#define jiffies_to_msecs(_j) ((unsigned int)((_j) * 1000 / HZ))
+#define jiffies_to_usecs(_j) ((unsigned int)((_j) * (1000000 / HZ)))
+#define DRM_HZ HZ
+
+typedef union {
+	s64 tv64;
+} ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+	ktime_t t = { .tv64 = (s64) psbsim_now_ns };
+	return t;
+}
+
+#define ktime_to_ns(_k) ((_k).tv64)
+#define ktime_sub(_a, _b) ({ ktime_t __t = { (_a).tv64 - (_b).tv64 }; __t; })
+
+static inline void do_gettimeofday(struct timeval *tv)
+{
+	tv->tv_sec = psbsim_now_ns / 1000000000ULL;
+	tv->tv_usec = (psbsim_now_ns % 1000000000ULL) / 1000;
+}
+
+struct timer_list;
+
+struct psbsim_event {
+	uint64_t time;
+	uint64_t seq;
+	int index;
+	void (*func) (struct psbsim_event *);
+};
+
+struct timer_list {
+	struct psbsim_event ev;
+	unsigned long expires;
+	void (*function) (unsigned long);
+	unsigned long data;
+};
+
+extern void init_timer(struct timer_list *timer);
+extern void add_timer(struct timer_list *timer);
+extern int mod_timer(struct timer_list *timer, unsigned long expires);
+extern int del_timer(struct timer_list *timer);
+#define del_timer_sync(_t) del_timer(_t)
+#define timer_pending(_t) ((_t)->ev.index >= 0)
+
+/*
+ * Deferred work.
+ */
+
+struct work_struct;
+typedef void (*work_func_t) (struct work_struct *);
+
+struct work_struct {
+	struct list_head entry;
+	work_func_t func;
+	int pending;
+};
+
+struct delayed_work {
+	struct work_struct work;
+	struct timer_list timer;
+};
+
+extern void psbsim_init_work(struct work_struct *work, work_func_t func);
+extern void psbsim_init_delayed_work(struct delayed_work *dwork,
+				     work_func_t func);
+extern int schedule_work(struct work_struct *work);
+extern int schedule_delayed_work(struct delayed_work *dwork,
+				 unsigned long delay);
+extern int cancel_delayed_work(struct delayed_work *dwork);
+extern void flush_scheduled_work(void);
+#define INIT_WORK(_w, _f) psbsim_init_work(_w, _f)
+#define INIT_DELAYED_WORK(_w, _f) psbsim_init_delayed_work(_w, _f)
+
+struct tasklet_struct {
+	struct list_head head;
+	int scheduled;
+	void (*func) (unsigned long);
+	unsigned long data;
+};
+
+extern void tasklet_init(struct tasklet_struct *t,
+			 void (*func) (unsigned long), unsigned long data);
+extern void tasklet_schedule(struct tasklet_struct *t);
+extern void tasklet_kill(struct tasklet_struct *t);
+
+typedef int irqreturn_t;
+#define IRQ_NONE 0
+#define IRQ_HANDLED 1
+#define DRM_IRQ_ARGS int irq, void *arg
+
+/*
+ * Memory.
+ */
+
+#define kmalloc(_size, _flags) malloc(_size)
+#define kzalloc(_size, _flags) calloc(1, _size)
+#define kcalloc(_n, _size, _flags) calloc(_n, _size)
+#define kfree(_p) free(_p)
+#define vmalloc(_size) malloc(_size)
+#define vfree(_p) free(_p)
+
+struct kmem_cache {
+	size_t size;
+};
+
+#define SLAB_HWCACHE_ALIGN 0
+extern struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+					    size_t align, unsigned long flags,
+					    void *ctor, ...);
+extern void kmem_cache_destroy(struct kmem_cache *cache);
+#define kmem_cache_alloc(_c, _flags) malloc((_c)->size)
+#define kmem_cache_zalloc(_c, _flags) calloc(1, (_c)->size)
+#define kmem_cache_free(_c, _p) free(_p)
+
+#define DRM_MEM_DRIVER 2
+#define DRM_MEM_MM 22
+#define DRM_MEM_HASHTAB 23
+#define DRM_MEM_OBJECTS 24
+#define DRM_MEM_FENCE 25
+#define DRM_MEM_TTM 26
+#define DRM_MEM_BUFOBJ 27
+
+#define drm_alloc(_size, _area) malloc(_size)
+#define drm_calloc(_n, _size, _area) calloc(_n, _size)
+#define drm_free(_p, _size, _area) free(_p)
+#define drm_ctl_alloc(_size, _area) malloc(_size)
+#define drm_ctl_calloc(_n, _size, _area) calloc(_n, _size)
+#define drm_ctl_free(_p, _size, _area) free(_p)
+
+#define copy_to_user(_to, _from, _n) (memcpy(_to, _from, _n), 0)
+#define copy_from_user(_to, _from, _n) (memcpy(_to, _from, _n), 0)
+#define get_user(_x, _p) ((_x) = *(_p), 0)
+#define put_user(_x, _p) (*(_p) = (_x), 0)
+#define __put_user(_x, _p) put_user(_x, _p)
+#define DRM_COPY_FROM_USER(_to, _from, _n) copy_from_user(_to, _from, _n)
+#define DRM_COPY_TO_USER(_to, _from, _n) copy_to_user(_to, _from, _n)
+
+static inline void iowrite32(uint32_t val, void *addr)
+{
+	*(volatile uint32_t *)addr = val;
+}
+
+static inline uint32_t ioread32(void *addr)
+{
+	return *(volatile uint32_t *)addr;
+}
+
+struct page;
+#define KM_USER0 0
+#define KM_IRQ0 1
+extern void *kmap_atomic(struct page *page, int type);
+extern void kunmap_atomic(void *v, int type);
+
+/*
+ * Files.
+ */
+
+struct inode;
+struct file {
+	void *private_data;
+};
+
+struct file_operations {
+	void *owner;
+	int (*open) (struct inode *, struct file *);
+	int (*release) (struct inode *, struct file *);
+	ssize_t (*read) (struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write) (struct file *, const char __user *, size_t,
+			  loff_t *);
+	loff_t (*llseek) (struct file *, loff_t, int);
+};
+
+struct proc_dir_entry {
+	void *data;
+};
+
+extern struct proc_dir_entry *PDE(const struct inode *inode);
+#define nonseekable_open(_i, _f) 0
+#define no_llseek NULL
+
+/*
+ * DRM core.
+ */
+
+#include "drm.h"
+#include "drm_hashtab.h"
+
+enum drm_ref_type {
+	_DRM_REF_USE = 0,
+	_DRM_REF_TYPE1,
+	_DRM_NO_REF_TYPES
+};
+
+struct drm_mm_node {
+	struct list_head fl_entry;
+	struct list_head ml_entry;
+	int free;
+	unsigned long start;
+	unsigned long size;
+	struct drm_mm *mm;
+	void *private;
+};
+
+struct drm_mm {
+	struct list_head fl_entry;
+	struct list_head ml_entry;
+};
+
+struct drm_map_list {
+	struct list_head head;
+	struct drm_hash_item hash;
+	struct drm_map *map;
+	uint64_t user_token;
+	struct drm_mm_node *file_offset_node;
+};
+
+#include "drm_objects.h"
+
+struct drm_head {
+	int minor;
+	struct drm_device *dev;
+};
+
+struct drm_file {
+	int master;
+	struct drm_head *head;
+	void *driver_priv;
+	struct list_head pending_events;
+	struct list_head event_list;
+	wait_queue_head_t event_wait;
+	int event_space;
+	int event_enabled;
+};
+
+struct drm_driver {
+	struct drm_fence_driver *fence_driver;
+};
+
+struct drm_device {
+	void *dev_private;
+	struct mutex struct_mutex;
+	struct drm_driver *driver;
+	struct drm_fence_manager fm;
+	struct drm_buffer_manager bm;
+};
+
+#define LOCK_TEST_WITH_RETURN(_dev, _file_priv) do { } while (0)
+
+/*
+ * Simulated clients are never privileged; the X server is the master.
+ */
+
+#define CAP_SYS_NICE 23
+#define capable(_cap) 0
+
+extern int drm_add_user_object(struct drm_file *priv,
+			       struct drm_user_object *item, int shareable);
+extern struct drm_user_object *drm_lookup_user_object(struct drm_file *priv,
+						      uint32_t key);
+extern int drm_user_object_ref(struct drm_file *priv, uint32_t user_token,
+			       enum drm_object_type type,
+			       struct drm_user_object **object);
+extern int drm_user_object_unref(struct drm_file *priv, uint32_t user_token,
+				 enum drm_object_type type);
+extern void drm_remove_ref_object(struct drm_file *priv,
+				  struct drm_ref_object *item);
+
+/*
+ * Display types only referenced through pointers.
+ */
+
+struct drm_crtc;
+struct drm_display_mode;
+
+#endif
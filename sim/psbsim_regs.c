@@ -0,0 +1,227 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Cost of copying and checking TA and rasterizer register streams, in
+ * host CPU time, with and without the cache of checked streams.
+ *
+ * A stream file has one stream per line, in submission order:
+ *
+ *   ta|raster <reg>=<value> ...
+ *
+ * with offsets and values in hex. Lines starting with '#' are ignored.
+ * Each stream is put in a command buffer of its own and copied with
+ * psb_submit_copy_cmdbuf() under the TA engine lock, as when a task is
+ * set up. Without the cache, all entries are invalidated before each
+ * stream, which is a few stores and is timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "psbsim.h"
+
+#define PSBSIM_REGS_MAX_STREAMS 1024
+#define PSBSIM_REGS_MAX_PAIRS   (PSB_MAX_TA_CMDS >> 1)
+
+struct psbsim_regs_stream {
+	int engine;
+	uint32_t pairs;
+	struct drm_buffer_object *bo;
+};
+
+struct psbsim_regs_bench {
+	struct drm_device *dev;
+	struct psbsim_regs_stream *streams;
+	unsigned num_streams;
+	unsigned long num_pairs;
+	unsigned rounds;
+	int ret;
+};
+
+static int psbsim_regs_parse(struct psbsim_regs_bench *bench,
+			     struct drm_file *file, const char *name)
+{
+	FILE *f = fopen(name, "r");
+	char line[1024];
+	uint32_t data[PSBSIM_REGS_MAX_PAIRS * 2];
+	struct psbsim_regs_stream *stream;
+	struct drm_bo_kmap_obj kmap;
+	uint32_t handle;
+	int is_iomem;
+	int lineno = 0;
+	char *tok;
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		++lineno;
+		if (line[strspn(line, " \t")] == '#' ||
+		    line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (bench->num_streams == PSBSIM_REGS_MAX_STREAMS) {
+			fprintf(stderr, "%s:%d: too many streams.\n", name,
+				lineno);
+			goto out_err;
+		}
+		stream = &bench->streams[bench->num_streams];
+
+		tok = strtok(line, " \t\r\n");
+		if (!strcmp(tok, "ta"))
+			stream->engine = PSB_ENGINE_TA;
+		else if (!strcmp(tok, "raster"))
+			stream->engine = PSB_ENGINE_RASTERIZER;
+		else
+			goto out_parse;
+
+		stream->pairs = 0;
+		while ((tok = strtok(NULL, " \t\r\n"))) {
+			if (stream->pairs == PSBSIM_REGS_MAX_PAIRS) {
+				fprintf(stderr, "%s:%d: stream too long.\n",
+					name, lineno);
+				goto out_err;
+			}
+			if (sscanf(tok, "%x=%x", &data[stream->pairs * 2],
+				   &data[stream->pairs * 2 + 1]) != 2)
+				goto out_parse;
+			++stream->pairs;
+		}
+
+		stream->bo = psbsim_bo_create(file, 1, &handle);
+		BUG_ON(!stream->bo);
+		BUG_ON(drm_bo_kmap(stream->bo, 0, 1, &kmap));
+		memcpy(drm_bmo_virtual(&kmap, &is_iomem), data,
+		       stream->pairs * 2 * sizeof(uint32_t));
+		drm_bo_kunmap(&kmap);
+
+		bench->num_pairs += stream->pairs;
+		++bench->num_streams;
+	}
+
+	fclose(f);
+	return 0;
+
+      out_parse:
+	fprintf(stderr, "%s:%d: parse error.\n", name, lineno);
+      out_err:
+	fclose(f);
+	return -1;
+}
+
+static uint64_t psbsim_regs_run(struct psbsim_regs_bench *bench, int cached)
+{
+	struct drm_psb_private *dev_priv = bench->dev->dev_private;
+	struct psbsim_regs_stream *stream;
+	uint32_t copy[PSB_MAX_TA_CMDS];
+	uint64_t elapsed = 0;
+	uint64_t start;
+	unsigned i, j, k;
+	int ret;
+
+	mutex_lock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
+	memset(&dev_priv->reg_cache, 0, sizeof(dev_priv->reg_cache));
+
+	/*
+	 * The first round warms up the cache and isn't timed.
+	 */
+
+	for (i = 0; i <= bench->rounds; ++i) {
+		start = psbsim_host_ns();
+		for (j = 0; j < bench->num_streams; ++j) {
+			stream = &bench->streams[j];
+			if (!cached) {
+				for (k = 0; k < PSB_REG_CACHE_SLOTS; ++k)
+					dev_priv->reg_cache.entries[k].
+					    num_regs = 0;
+			}
+			ret = psb_submit_copy_cmdbuf(bench->dev, stream->bo, 0,
+						     stream->pairs * 2,
+						     stream->engine, copy);
+			if (ret) {
+				fprintf(stderr, "Stream %u rejected: %d.\n",
+					j, ret);
+				bench->ret = -1;
+				goto out;
+			}
+		}
+		if (i > 0)
+			elapsed += psbsim_host_ns() - start;
+	}
+
+      out:
+	mutex_unlock(&dev_priv->cmdbuf_mutex[PSB_ENGINE_TA]);
+	return elapsed;
+}
+
+static void psbsim_regs_thread(void *data)
+{
+	struct psbsim_regs_bench *bench = (struct psbsim_regs_bench *)data;
+	double elapsed;
+	int cached;
+
+	printf("check regs (ns)  streams    pairs  per stream    per pair\n");
+	for (cached = 1; cached >= 0; --cached) {
+		elapsed = (double)psbsim_regs_run(bench, cached) /
+		    bench->rounds;
+		if (bench->ret)
+			return;
+		printf("%-14s %9u %8lu %11.1f %11.2f\n",
+		       (cached) ? "cached" : "uncached", bench->num_streams,
+		       bench->num_pairs, elapsed / bench->num_streams,
+		       elapsed / bench->num_pairs);
+	}
+}
+
+int psbsim_regs_bench(struct drm_device *dev, const char *name,
+		      unsigned rounds)
+{
+	struct psbsim_regs_bench bench;
+	struct drm_file *file = psbsim_file_open(dev);
+	unsigned i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.dev = dev;
+	bench.rounds = (rounds) ? rounds : 1;
+	bench.streams = calloc(PSBSIM_REGS_MAX_STREAMS,
+			       sizeof(*bench.streams));
+	BUG_ON(!bench.streams);
+
+	if (psbsim_regs_parse(&bench, file, name))
+		bench.ret = -1;
+	else if (bench.num_streams == 0) {
+		fprintf(stderr, "No streams.\n");
+		bench.ret = -1;
+	}
+
+	if (bench.ret == 0) {
+		(void)psbsim_thread_create("regs", psbsim_regs_thread,
+					   &bench, 0);
+		while (psbsim_threads_alive())
+			(void)psbsim_run(psbsim_now_ns + 1000000000ULL);
+	}
+
+	for (i = 0; i < bench.num_streams; ++i)
+		drm_bo_usage_deref_unlocked(&bench.streams[i].bo);
+	free(bench.streams);
+
+	return bench.ret;
+}
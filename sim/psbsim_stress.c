@@ -0,0 +1,414 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Concurrent submission to the TA, 2D and video engines.
+ *
+ * Each engine gets the same number of clients, which submit through
+ * psb_cmdbuf_ioctl() as fast as they are let, rendering to one of two
+ * buffers in turn and waiting for a buffer to be idle before reusing
+ * it. TA clients submit a scene per frame. The TA and rasterizer run
+ * behind the scripted X server of psbsim_xhw.c. The 2D engine and the
+ * MSVDX are modelled here:
+ *
+ * - The 2D ring drains into the register file as soon as it is written.
+ *   The blitter then executes one command buffer, ending with its fence
+ *   blit, per blit_ns, writing the fence sequence to the comm area and
+ *   raising its interrupt.
+ *
+ * - The MSVDX decodes the command buffers it is handed one at a time,
+ *   each taking decode_ns, and updates msvdx_current_sequence before
+ *   raising its interrupt.
+ *
+ * Submit latency is the simulated time spent in psb_cmdbuf_ioctl(), so
+ * it is the time a client is blocked, by locks held across sleeps, by
+ * TA admission control or by a full 2D ring.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "psbsim.h"
+
+#define PSBSIM_STRESS_SLOTS    2
+#define PSBSIM_STRESS_2D_CMDS  8
+#define PSBSIM_STRESS_STALL_NS 60000000000ULL
+#define PSBSIM_STRESS_MSVDX_Q  256
+
+#define PSBSIM_STRESS_FLAGS (DRM_BO_FLAG_READ | DRM_BO_FLAG_WRITE | \
+			     DRM_BO_FLAG_MEM_TT)
+
+enum {
+	PSBSIM_STRESS_TA,
+	PSBSIM_STRESS_2D,
+	PSBSIM_STRESS_VIDEO,
+	PSBSIM_STRESS_ENGINES
+};
+
+static const char *psbsim_stress_names[PSBSIM_STRESS_ENGINES] = {
+	[PSBSIM_STRESS_TA] = "ta",
+	[PSBSIM_STRESS_2D] = "2d",
+	[PSBSIM_STRESS_VIDEO] = "video",
+};
+
+static const uint32_t psbsim_stress_engines[PSBSIM_STRESS_ENGINES] = {
+	[PSBSIM_STRESS_TA] = PSB_ENGINE_TA,
+	[PSBSIM_STRESS_2D] = PSB_ENGINE_2D,
+	[PSBSIM_STRESS_VIDEO] = PSB_ENGINE_VIDEO,
+};
+
+struct psbsim_stress_client {
+	int engine;
+	struct drm_file *file;
+	struct drm_buffer_object *cmd_bo[PSBSIM_STRESS_SLOTS];
+	uint32_t cmd_handle[PSBSIM_STRESS_SLOTS];
+	struct drm_buffer_object *bo[PSBSIM_STRESS_SLOTS];
+	uint32_t handle[PSBSIM_STRESS_SLOTS];
+	struct drm_psb_scene scene;
+	uint64_t *latency;
+	uint64_t end_ns;
+	unsigned submits;
+	unsigned errors;
+};
+
+static struct drm_device *psbsim_stress_dev;
+static const struct psbsim_stress_params *psbsim_stress_params;
+static struct psbsim_stress_client *psbsim_stress_clients;
+static unsigned psbsim_stress_num_clients;
+static unsigned psbsim_stress_running;
+static uint64_t psbsim_stress_progress_ns;
+
+/*
+ * 2D engine.
+ */
+
+static struct psbsim_event psbsim_2d_event;
+
+static void psbsim_2d_blit(struct psbsim_event *ev)
+{
+	struct drm_psb_private *dev_priv = psbsim_stress_dev->dev_private;
+	volatile uint32_t *comm = &dev_priv->comm[PSB_ENGINE_2D << 4];
+
+	if (*comm != dev_priv->sequence[PSB_ENGINE_2D]) {
+		++*comm;
+		psbsim_irq_enter();
+		psb_fence_handler(psbsim_stress_dev, PSB_ENGINE_2D);
+		psbsim_irq_exit();
+	}
+
+	if (psbsim_stress_running)
+		psbsim_event_add(&psbsim_2d_event,
+				 psbsim_now_ns + psbsim_stress_params->blit_ns);
+}
+
+/*
+ * MSVDX.
+ */
+
+static struct psbsim_event psbsim_msvdx_event;
+static uint32_t psbsim_msvdx_queue[PSBSIM_STRESS_MSVDX_Q];
+static unsigned psbsim_msvdx_head;
+static unsigned psbsim_msvdx_tail;
+
+static void psbsim_msvdx_done(struct psbsim_event *ev)
+{
+	struct drm_psb_private *dev_priv = psbsim_stress_dev->dev_private;
+
+	dev_priv->msvdx_current_sequence =
+	    psbsim_msvdx_queue[psbsim_msvdx_head++ %
+			       PSBSIM_STRESS_MSVDX_Q];
+	psbsim_irq_enter();
+	psb_fence_handler(psbsim_stress_dev, PSB_ENGINE_VIDEO);
+	psbsim_irq_exit();
+
+	if (psbsim_msvdx_head != psbsim_msvdx_tail)
+		psbsim_event_add(&psbsim_msvdx_event, psbsim_now_ns +
+				 psbsim_stress_params->decode_ns);
+}
+
+int psb_submit_video_cmdbuf(struct drm_device *dev,
+			    struct drm_buffer_object *cmd_buffer,
+			    unsigned long cmd_offset, unsigned long cmd_size,
+			    struct drm_fence_object *fence)
+{
+	struct drm_psb_private *dev_priv = dev->dev_private;
+
+	if (!psbsim_stress_params)
+		return -EINVAL;
+
+	BUG_ON(psbsim_msvdx_tail - psbsim_msvdx_head ==
+	       PSBSIM_STRESS_MSVDX_Q);
+	psbsim_msvdx_queue[psbsim_msvdx_tail++ % PSBSIM_STRESS_MSVDX_Q] =
+	    (fence) ? fence->sequence : dev_priv->sequence[PSB_ENGINE_VIDEO];
+	if (psbsim_msvdx_tail - psbsim_msvdx_head == 1)
+		psbsim_event_add(&psbsim_msvdx_event, psbsim_now_ns +
+				 psbsim_stress_params->decode_ns);
+
+	return 0;
+}
+
+/*
+ * Clients.
+ */
+
+static void psbsim_stress_cmds(struct psbsim_stress_client *client,
+			       struct drm_psb_cmdbuf_arg *arg, unsigned slot)
+{
+	const struct psbsim_stress_params *params = psbsim_stress_params;
+	struct drm_bo_kmap_obj kmobj;
+	uint32_t *cmds;
+	int is_iomem;
+	int i;
+
+	BUG_ON(drm_bo_kmap(client->cmd_bo[slot], 0, 1, &kmobj));
+	cmds = drm_bmo_virtual(&kmobj, &is_iomem);
+
+	arg->cmdbuf_handle = client->cmd_handle[slot];
+	switch (client->engine) {
+	case PSBSIM_STRESS_TA:
+		cmds[0] = PSBSIM_CR_TA_RUNTIME;
+		cmds[1] = params->ta_us;
+		cmds[2] = PSBSIM_CR_RASTER_RUNTIME;
+		cmds[3] = params->raster_us;
+		arg->cmdbuf_offset = 2 * sizeof(uint32_t);
+		arg->cmdbuf_size = 2;
+		arg->ta_handle = client->cmd_handle[slot];
+		arg->ta_offset = 0;
+		arg->ta_size = 2;
+		arg->ta_flags = PSB_TA_FLAG_LASTPASS;
+		arg->scene_arg = (unsigned long)&client->scene;
+		break;
+	case PSBSIM_STRESS_2D:
+		for (i = 0; i < PSBSIM_STRESS_2D_CMDS; ++i)
+			cmds[i] = PSB_2D_FLUSH_BH;
+		arg->cmdbuf_size = PSBSIM_STRESS_2D_CMDS;
+		break;
+	default:
+		arg->cmdbuf_size = 16;
+		break;
+	}
+
+	drm_bo_kunmap(&kmobj);
+}
+
+static int psbsim_stress_submit(struct psbsim_stress_client *client,
+				unsigned slot)
+{
+	struct drm_psb_cmdbuf_arg arg;
+	struct drm_bo_op_arg op;
+	uint64_t start;
+	int ret;
+
+	/*
+	 * Don't render to a buffer that is still in use.
+	 */
+
+	ret = drm_bo_wait(client->bo[slot], 0, 1, 0);
+	if (ret)
+		return ret;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.engine = psbsim_stress_engines[client->engine];
+	arg.fence_flags = DRM_FENCE_FLAG_NO_USER;
+	psbsim_stress_cmds(client, &arg, slot);
+
+	memset(&op, 0, sizeof(op));
+	op.d.req.op = drm_bo_validate;
+	op.d.req.bo_req.handle = client->handle[slot];
+	op.d.req.bo_req.flags = PSBSIM_STRESS_FLAGS;
+	op.d.req.bo_req.mask = PSBSIM_STRESS_FLAGS;
+	arg.buffer_list = (unsigned long)&op;
+
+	start = psbsim_now_ns;
+	ret = psb_cmdbuf_ioctl(psbsim_stress_dev, &arg, client->file);
+	if (ret)
+		return ret;
+
+	client->latency[client->submits++] = psbsim_now_ns - start;
+	client->end_ns = psbsim_stress_progress_ns = psbsim_now_ns;
+
+	return 0;
+}
+
+static void psbsim_stress_thread(void *arg)
+{
+	struct psbsim_stress_client *client =
+	    (struct psbsim_stress_client *)arg;
+	const struct psbsim_stress_params *params = psbsim_stress_params;
+	unsigned i;
+
+	for (i = 0; i < params->submissions; ++i) {
+		if (params->think_ns)
+			psbsim_sleep_ns(params->think_ns);
+		if (psbsim_stress_submit(client, i % PSBSIM_STRESS_SLOTS))
+			client->errors++;
+		psbsim_yield();
+	}
+
+	for (i = 0; i < PSBSIM_STRESS_SLOTS; ++i)
+		(void)drm_bo_wait(client->bo[i], 0, 1, 0);
+
+	if (--psbsim_stress_running == 0)
+		psbsim_xhw_stop();
+}
+
+static void psbsim_stress_start(struct psbsim_stress_client *client,
+				int engine, int id)
+{
+	const struct psbsim_stress_params *params = psbsim_stress_params;
+	char name[16];
+	int i;
+
+	client->engine = engine;
+	client->file = psbsim_file_open(psbsim_stress_dev);
+	client->scene.w = params->w;
+	client->scene.h = params->h;
+	client->scene.num_buffers = params->num_scenes;
+	client->latency = calloc(params->submissions,
+				 sizeof(*client->latency));
+	BUG_ON(!client->latency);
+
+	for (i = 0; i < PSBSIM_STRESS_SLOTS; ++i) {
+		client->cmd_bo[i] = psbsim_bo_create(client->file, 1,
+						     &client->cmd_handle[i]);
+		client->bo[i] = psbsim_bo_create(client->file, 1,
+						 &client->handle[i]);
+		BUG_ON(!client->cmd_bo[i] || !client->bo[i]);
+	}
+
+	snprintf(name, sizeof(name), "%s%d", psbsim_stress_names[engine], id);
+	(void)psbsim_thread_create(name, psbsim_stress_thread, client, 0);
+}
+
+/*
+ * Percentile of a sorted array, in microseconds.
+ */
+
+#define PSBSIM_PCT(_v, _n, _pct) \
+	((_v)[((uint64_t) (_n) - 1) * (_pct) / 100] / 1000.)
+
+static int psbsim_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Submissions per second are over the time the engine's clients took
+ * to make all their submissions.
+ */
+
+static void psbsim_stress_report(uint64_t start)
+{
+	const struct psbsim_stress_params *params = psbsim_stress_params;
+	struct psbsim_stress_client *client;
+	uint64_t *v;
+	uint64_t elapsed;
+	unsigned errors;
+	unsigned n;
+	unsigned i;
+	int engine;
+
+	v = calloc(psbsim_stress_num_clients * params->submissions,
+		   sizeof(*v));
+	BUG_ON(!v);
+
+	printf("submit (us)    %8s %8s %10s %10s %10s %8s\n",
+	       "submits", "per s", "p50", "p99", "max", "errors");
+	for (engine = 0; engine < PSBSIM_STRESS_ENGINES; ++engine) {
+		n = 0;
+		errors = 0;
+		elapsed = 0;
+		for (i = 0; i < psbsim_stress_num_clients; ++i) {
+			client = &psbsim_stress_clients[i];
+			if (client->engine != engine)
+				continue;
+			memcpy(&v[n], client->latency,
+			       client->submits * sizeof(*v));
+			n += client->submits;
+			errors += client->errors;
+			if (client->end_ns - start > elapsed)
+				elapsed = client->end_ns - start;
+		}
+
+		printf("%-14s %8u %8.1f", psbsim_stress_names[engine], n,
+		       (elapsed) ? n * 1e9 / elapsed : 0.);
+		if (n == 0) {
+			printf(" %10s %10s %10s %8u\n", "-", "-", "-", errors);
+			continue;
+		}
+		qsort(v, n, sizeof(*v), psbsim_cmp_u64);
+		printf(" %10.1f %10.1f %10.1f %8u\n", PSBSIM_PCT(v, n, 50),
+		       PSBSIM_PCT(v, n, 99), PSBSIM_PCT(v, n, 100), errors);
+	}
+
+	free(v);
+}
+
+int psbsim_stress(struct drm_device *dev,
+		  const struct psbsim_stress_params *params,
+		  const struct psbsim_xhw_timing *timing)
+{
+	uint64_t start;
+	unsigned i;
+	int ret = 0;
+
+	psbsim_stress_dev = dev;
+	psbsim_stress_params = params;
+	psbsim_stress_num_clients = params->clients * PSBSIM_STRESS_ENGINES;
+	psbsim_stress_clients = calloc(psbsim_stress_num_clients,
+				       sizeof(*psbsim_stress_clients));
+	BUG_ON(!psbsim_stress_clients);
+
+	psbsim_xhw_start(dev, timing);
+	psbsim_event_init(&psbsim_2d_event, psbsim_2d_blit);
+	psbsim_event_init(&psbsim_msvdx_event, psbsim_msvdx_done);
+
+	/*
+	 * Interleave the engines, so that none gets a head start.
+	 */
+
+	psbsim_stress_running = psbsim_stress_num_clients;
+	for (i = 0; i < psbsim_stress_num_clients; ++i)
+		psbsim_stress_start(&psbsim_stress_clients[i],
+				    i % PSBSIM_STRESS_ENGINES,
+				    i / PSBSIM_STRESS_ENGINES);
+	psbsim_event_add(&psbsim_2d_event, psbsim_now_ns + params->blit_ns);
+
+	start = psbsim_stress_progress_ns = psbsim_now_ns;
+	while (psbsim_threads_alive()) {
+		(void)psbsim_run(psbsim_now_ns + 1000000000ULL);
+		if (psbsim_now_ns - psbsim_stress_progress_ns >
+		    PSBSIM_STRESS_STALL_NS) {
+			fprintf(stderr, "Clients stalled.\n");
+			return -1;
+		}
+	}
+
+	psbsim_stress_report(start);
+
+	for (i = 0; i < psbsim_stress_num_clients; ++i) {
+		if (psbsim_stress_clients[i].errors)
+			ret = -1;
+		free(psbsim_stress_clients[i].latency);
+	}
+	free(psbsim_stress_clients);
+
+	return ret;
+}
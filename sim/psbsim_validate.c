@@ -0,0 +1,258 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * Cost of validating the buffer list of a submission, in host CPU time,
+ * for the linked list, the array-mode list and a buffer set.
+ *
+ * Each submission goes through psb_cmdbuf_ioctl() as an empty 2D
+ * command buffer, so that besides validation it only costs a fence.
+ * The 2D fence is retired after each submission, as the 2D interrupt
+ * would. Presumed offsets are always correct, as with a client whose
+ * buffers stay put. Like user-space, the list is rebuilt before each
+ * submission, since the replies overwrite it; that is not timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "psbsim.h"
+
+#define PSBSIM_VALIDATE_FLAGS (DRM_BO_FLAG_READ | DRM_BO_FLAG_WRITE | \
+			       DRM_BO_FLAG_MEM_TT)
+
+#define PSBSIM_VALIDATE_LIST  0
+#define PSBSIM_VALIDATE_ARRAY 1
+#define PSBSIM_VALIDATE_SET   2
+#define PSBSIM_VALIDATE_MODES 3
+
+static const unsigned psbsim_validate_sizes[] = { 16, 128, 1024 };
+
+static const char *psbsim_validate_names[PSBSIM_VALIDATE_MODES] = {
+	[PSBSIM_VALIDATE_LIST] = "list",
+	[PSBSIM_VALIDATE_ARRAY] = "array",
+	[PSBSIM_VALIDATE_SET] = "set",
+};
+
+struct psbsim_validate_bench {
+	struct drm_device *dev;
+	struct drm_file *file;
+	struct drm_buffer_object *cmd_bo;
+	uint32_t cmd_handle;
+	struct drm_buffer_object **bos;
+	uint32_t *handles;
+	struct drm_bo_op_arg *args;
+	uint64_t *offsets;
+	unsigned rounds;
+	int ret;
+};
+
+static void psbsim_validate_fill(struct psbsim_validate_bench *bench,
+				 unsigned num_buffers, int linked)
+{
+	struct drm_bo_op_arg *arg;
+	unsigned i;
+
+	memset(bench->args, 0, num_buffers * sizeof(*bench->args));
+	for (i = 0; i < num_buffers; ++i) {
+		arg = &bench->args[i];
+		if (linked && i + 1 < num_buffers)
+			arg->next = (unsigned long)(arg + 1);
+		arg->d.req.op = drm_bo_validate;
+		arg->d.req.bo_req.handle = bench->handles[i];
+		arg->d.req.bo_req.flags = PSBSIM_VALIDATE_FLAGS;
+		arg->d.req.bo_req.mask = PSBSIM_VALIDATE_FLAGS;
+		arg->d.req.bo_req.hint = DRM_BO_HINT_PRESUMED_OFFSET;
+		arg->d.req.bo_req.presumed_offset = bench->bos[i]->offset;
+		bench->offsets[i] = bench->bos[i]->offset;
+	}
+}
+
+static uint32_t psbsim_validate_set_create(struct psbsim_validate_bench
+					   *bench, unsigned num_buffers)
+{
+	struct drm_psb_bufset_entry *entries;
+	struct drm_psb_bufset_arg arg;
+	unsigned i;
+
+	entries = calloc(num_buffers, sizeof(*entries));
+	BUG_ON(!entries);
+	for (i = 0; i < num_buffers; ++i) {
+		entries[i].handle = bench->handles[i];
+		entries[i].flags = PSBSIM_VALIDATE_FLAGS;
+		entries[i].mask = PSBSIM_VALIDATE_FLAGS;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	arg.entries = (unsigned long)entries;
+	arg.num_entries = num_buffers;
+	arg.op = PSB_BUFSET_CREATE;
+	BUG_ON(psb_bufset_ioctl(bench->dev, &arg, bench->file));
+	free(entries);
+
+	return arg.handle;
+}
+
+static void psbsim_validate_set_destroy(struct psbsim_validate_bench *bench,
+					uint32_t handle)
+{
+	struct drm_psb_bufset_arg arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.op = PSB_BUFSET_DESTROY;
+	arg.handle = handle;
+	BUG_ON(psb_bufset_ioctl(bench->dev, &arg, bench->file));
+}
+
+static void psbsim_validate_retire(struct drm_device *dev)
+{
+	struct drm_psb_private *dev_priv = dev->dev_private;
+	struct drm_fence_manager *fm = &dev->fm;
+	unsigned long irq_flags;
+	uint32_t sequence = dev_priv->sequence[PSB_ENGINE_2D];
+
+	dev_priv->comm[PSB_ENGINE_2D << 4] = sequence;
+	write_lock_irqsave(&fm->lock, irq_flags);
+	drm_fence_handler(dev, PSB_ENGINE_2D, sequence,
+			  DRM_FENCE_TYPE_EXE, 0);
+	write_unlock_irqrestore(&fm->lock, irq_flags);
+}
+
+static uint64_t psbsim_validate_run(struct psbsim_validate_bench *bench,
+				    unsigned num_buffers, int mode)
+{
+	struct drm_psb_validate_array array;
+	struct drm_psb_bufset_submit submit;
+	struct drm_psb_cmdbuf_arg arg;
+	uint64_t elapsed = 0;
+	uint64_t start;
+	unsigned i;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.engine = PSB_ENGINE_2D;
+	arg.cmdbuf_handle = bench->cmd_handle;
+	arg.fence_flags = DRM_FENCE_FLAG_NO_USER;
+
+	switch (mode) {
+	case PSBSIM_VALIDATE_ARRAY:
+		array.buffers = (unsigned long)bench->args;
+		array.num_buffers = num_buffers;
+		arg.buffer_list = (unsigned long)&array;
+		arg.ta_flags = PSB_CMDBUF_FLAG_VALIDATE_ARRAY;
+		break;
+	case PSBSIM_VALIDATE_SET:
+		memset(&submit, 0, sizeof(submit));
+		submit.handle = psbsim_validate_set_create(bench,
+							   num_buffers);
+		submit.offsets = (unsigned long)bench->offsets;
+		arg.buffer_list = (unsigned long)&submit;
+		arg.ta_flags = PSB_CMDBUF_FLAG_BUFFER_SET;
+		break;
+	default:
+		arg.buffer_list = (unsigned long)bench->args;
+		break;
+	}
+
+	/*
+	 * The first submission warms up the submission context and
+	 * isn't timed.
+	 */
+
+	for (i = 0; i <= bench->rounds; ++i) {
+		psbsim_validate_fill(bench, num_buffers,
+				     mode == PSBSIM_VALIDATE_LIST);
+
+		start = psbsim_host_ns();
+		ret = psb_cmdbuf_ioctl(bench->dev, &arg, bench->file);
+		if (i > 0)
+			elapsed += psbsim_host_ns() - start;
+
+		if (ret) {
+			fprintf(stderr, "Submission failed: %d.\n", ret);
+			bench->ret = -1;
+			break;
+		}
+		psbsim_validate_retire(bench->dev);
+	}
+
+	if (mode == PSBSIM_VALIDATE_SET)
+		psbsim_validate_set_destroy(bench, submit.handle);
+
+	return elapsed;
+}
+
+static void psbsim_validate_thread(void *data)
+{
+	struct psbsim_validate_bench *bench =
+	    (struct psbsim_validate_bench *)data;
+	double elapsed;
+	unsigned num_buffers;
+	unsigned i;
+	int mode;
+
+	printf("validate (ns)    buffers  per submit  per buffer\n");
+	for (i = 0; i < ARRAY_SIZE(psbsim_validate_sizes); ++i) {
+		num_buffers = psbsim_validate_sizes[i];
+		for (mode = 0; mode < PSBSIM_VALIDATE_MODES; ++mode) {
+			elapsed = (double)psbsim_validate_run(bench,
+							      num_buffers,
+							      mode) /
+			    bench->rounds;
+			printf("%-14s %9u %11.1f %11.1f\n",
+			       psbsim_validate_names[mode], num_buffers,
+			       elapsed, elapsed / num_buffers);
+		}
+	}
+}
+
+int psbsim_validate_bench(struct drm_device *dev, unsigned rounds)
+{
+	struct psbsim_validate_bench bench;
+	unsigned max_buffers = PSB_NUM_VALIDATE_BUFFERS;
+	unsigned i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.dev = dev;
+	bench.file = psbsim_file_open(dev);
+	bench.rounds = (rounds) ? rounds : 1;
+	bench.cmd_bo = psbsim_bo_create(bench.file, 1, &bench.cmd_handle);
+	bench.bos = calloc(max_buffers, sizeof(*bench.bos));
+	bench.handles = calloc(max_buffers, sizeof(*bench.handles));
+	bench.args = calloc(max_buffers, sizeof(*bench.args));
+	bench.offsets = calloc(max_buffers, sizeof(*bench.offsets));
+	BUG_ON(!bench.cmd_bo || !bench.bos || !bench.handles ||
+	       !bench.args || !bench.offsets);
+
+	for (i = 0; i < max_buffers; ++i) {
+		bench.bos[i] = psbsim_bo_create(bench.file, 1,
+						&bench.handles[i]);
+		BUG_ON(!bench.bos[i]);
+	}
+
+	(void)psbsim_thread_create("validate", psbsim_validate_thread,
+				   &bench, 0);
+	while (psbsim_threads_alive())
+		(void)psbsim_run(psbsim_now_ns + 1000000000ULL);
+
+	free(bench.bos);
+	free(bench.handles);
+	free(bench.args);
+	free(bench.offsets);
+
+	return bench.ret;
+}
@@ -0,0 +1,209 @@
+/**************************************************************************
+ * Copyright (c) 2009, Intel Corporation.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ **************************************************************************/
+/*
+ * A scripted stand-in for the Xpsb request handler, and a model of the
+ * TA and rasterizer engines behind it.
+ *
+ * The X server runs in its own thread. It sets up a request ring with
+ * DRM_PSB_XHW_INIT and then loops in DRM_PSB_XHW, handling the ring
+ * slots in order, each taking reply_ns. Fire requests start an engine,
+ * which raises its completion interrupt after the run time given in
+ * the command stream, or the default one.
+ */
+
+#include "psbsim.h"
+
+unsigned long psbsim_xhw_requests;
+unsigned long psbsim_xhw_irqs;
+
+struct psbsim_engine {
+	struct psbsim_event ev;
+	uint32_t status;
+	int busy;
+};
+
+static struct drm_device *psbsim_xhw_dev;
+static struct psbsim_xhw_timing psbsim_xhw_timing;
+static struct psbsim_engine psbsim_ta_engine;
+static struct psbsim_engine psbsim_raster_engine;
+static struct psbsim_engine psbsim_dealloc_engine;
+static struct psbsim_event psbsim_sw_event;
+static int psbsim_xhw_stopping;
+static uint32_t psbsim_xhw_cookie;
+
+static void psbsim_raise_irq(uint32_t status)
+{
+	struct drm_psb_private *dev_priv = psbsim_xhw_dev->dev_private;
+
+	psbsim_xhw_irqs++;
+	psbsim_irq_enter();
+	psb_scheduler_handler(dev_priv, status);
+	psbsim_irq_exit();
+}
+
+static void psbsim_sw_event_fire(struct psbsim_event *ev)
+{
+	psbsim_raise_irq(_PSB_CE_SW_EVENT);
+}
+
+static void psbsim_engine_done(struct psbsim_event *ev)
+{
+	struct psbsim_engine *engine =
+	    container_of(ev, struct psbsim_engine, ev);
+
+	engine->busy = 0;
+
+	/*
+	 * The parameter memory of a scene is freed after it is rendered.
+	 */
+
+	if (engine == &psbsim_raster_engine &&
+	    (engine->status & _PSB_CE_DPM_3D_MEM_FREE)) {
+		psbsim_dealloc_engine.busy = 1;
+		psbsim_dealloc_engine.status = _PSB_CE_DPM_3D_MEM_FREE;
+		psbsim_event_add(&psbsim_dealloc_engine.ev, psbsim_now_ns +
+				 psbsim_xhw_timing.dealloc_ns);
+		psbsim_raise_irq(_PSB_CE_PIXELBE_END_RENDER);
+		return;
+	}
+
+	psbsim_raise_irq(engine->status);
+}
+
+static void psbsim_engine_start(struct psbsim_engine *engine,
+				uint32_t status, uint32_t runtime_reg,
+				uint64_t default_ns)
+{
+	struct drm_psb_private *dev_priv = psbsim_xhw_dev->dev_private;
+	uint64_t runtime = PSB_RSGX32(runtime_reg);
+
+	if (engine->busy)
+		DRM_ERROR("Engine fired while busy.\n");
+
+	runtime = (runtime) ? runtime * 1000 : default_ns;
+	PSB_WSGX32(0, runtime_reg);
+
+	engine->busy = 1;
+	engine->status = status;
+	psbsim_event_add(&engine->ev, psbsim_now_ns + runtime);
+}
+
+static void psbsim_xhw_request(struct drm_psb_xhw_arg *xa)
+{
+	uint32_t pages;
+
+	psbsim_xhw_requests++;
+	psbsim_sleep_ns(psbsim_xhw_timing.reply_ns);
+	xa->ret = 0;
+
+	switch (xa->op) {
+	case PSB_XHW_SCENE_INFO:
+		pages = ((xa->arg.si.w + 31) / 32) * ((xa->arg.si.h + 31) / 32);
+		pages = (pages * 64 + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		xa->arg.si.size = (pages + 16) << PAGE_SHIFT;
+		xa->arg.si.clear_p_start = 0;
+		xa->arg.si.clear_num_pages = 4;
+		xa->cookie[0] = ++psbsim_xhw_cookie;
+		break;
+	case PSB_XHW_TA_MEM_INFO:
+		xa->arg.bi.size = xa->arg.bi.pages << PAGE_SHIFT;
+		xa->cookie[0] = ++psbsim_xhw_cookie;
+		break;
+	case PSB_XHW_SCENE_BIND_FIRE:
+		if (xa->arg.sb.engine == PSB_SCENE_ENGINE_TA)
+			psbsim_engine_start(&psbsim_ta_engine,
+					    _PSB_CE_TA_FINISHED,
+					    PSBSIM_CR_TA_RUNTIME,
+					    psbsim_xhw_timing.ta_ns);
+		else
+			psbsim_engine_start(&psbsim_raster_engine,
+					    _PSB_CE_PIXELBE_END_RENDER |
+					    _PSB_CE_DPM_3D_MEM_FREE,
+					    PSBSIM_CR_RASTER_RUNTIME,
+					    psbsim_xhw_timing.raster_ns);
+		break;
+	case PSB_XHW_FIRE_RASTER:
+		psbsim_engine_start(&psbsim_raster_engine,
+				    _PSB_CE_PIXELBE_END_RENDER,
+				    PSBSIM_CR_RASTER_RUNTIME,
+				    psbsim_xhw_timing.raster_ns);
+		break;
+	case PSB_XHW_CHECK_LOCKUP:
+		xa->arg.cl.value = 0;
+		break;
+	case PSB_XHW_TERMINATE:
+		psbsim_xhw_stopping = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+static void psbsim_xhw_thread(void *arg)
+{
+	struct drm_device *dev = psbsim_xhw_dev;
+	struct drm_file *file = (struct drm_file *)arg;
+	struct drm_psb_private *dev_priv = dev->dev_private;
+	struct drm_psb_xhw_ring *ring = dev_priv->xhw_ring;
+	uint32_t done;
+
+	while (!psbsim_xhw_stopping) {
+		if (psb_xhw_ioctl(dev, NULL, file) != 0)
+			continue;
+
+		for (done = ring->done; done != ring->head;) {
+			psbsim_xhw_request(&ring->slot[done &
+						       (ring->num_slots - 1)]);
+			ring->done = ++done;
+
+			/*
+			 * The driver reaps ring replies, and refills the
+			 * ring, from the software event interrupt.
+			 */
+
+			psbsim_event_add(&psbsim_sw_event, psbsim_now_ns);
+		}
+	}
+}
+
+void psbsim_xhw_start(struct drm_device *dev,
+		      const struct psbsim_xhw_timing *timing)
+{
+	struct drm_file *file = psbsim_file_open(dev);
+	struct drm_psb_xhw_init_arg arg;
+
+	psbsim_xhw_dev = dev;
+	psbsim_xhw_timing = *timing;
+	psbsim_event_init(&psbsim_ta_engine.ev, psbsim_engine_done);
+	psbsim_event_init(&psbsim_raster_engine.ev, psbsim_engine_done);
+	psbsim_event_init(&psbsim_dealloc_engine.ev, psbsim_engine_done);
+	psbsim_event_init(&psbsim_sw_event, psbsim_sw_event_fire);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.operation = PSB_XHW_INIT_RING;
+	BUG_ON(!psbsim_bo_create(file, 4, &arg.buffer_handle));
+	BUG_ON(psb_xhw_init_ioctl(dev, &arg, file));
+
+	(void)psbsim_thread_create("Xpsb", psbsim_xhw_thread, file, 1);
+}
+
+void psbsim_xhw_stop(void)
+{
+	psbsim_xhw_stopping = 1;
+}